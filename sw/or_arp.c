@@ -19,6 +19,9 @@
 #include "or_ip.h"
 #include "or_icmp.h"
 #include "or_rtable.h"
+#include "or_timer.h"
+#include "or_drop.h"
+#include "or_lockprof.h"
 #include "reg_defines.h"
 
 
@@ -288,6 +291,11 @@ int update_arp_cache(struct sr_instance* sr, struct in_addr* remote_ip, char* re
 
 	}
 
+	/* a refresh leaves the pending timer alone, it re-arms itself when it fires */
+	if (!is_static && !arp_entry->timer_id) {
+		arp_arm_expiry(rs, arp_entry);
+	}
+
 	/* update the hw arp cache copy */
 	trigger_arp_cache_modified(rs);
 
@@ -367,7 +375,7 @@ void lock_arp_cache_rd(router_state *rs) {
 	assert(rs);
 
 	/* get the arp cache lock */
-	if(pthread_rwlock_rdlock(rs->arp_cache_lock) != 0) {
+	if(lockprof_rdlock(rs->arp_cache_lock, LOCK_ARP_CACHE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting arp cache read lock");
 	}
 }
@@ -377,7 +385,7 @@ void lock_arp_cache_wr(router_state *rs) {
 	assert(rs);
 
 	/* get the arp cache lock */
-	if(pthread_rwlock_wrlock(rs->arp_cache_lock) != 0) {
+	if(lockprof_wrlock(rs->arp_cache_lock, LOCK_ARP_CACHE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting arp cache write lock");
 	}
 }
@@ -387,6 +395,7 @@ void unlock_arp_cache(router_state *rs) {
 	assert(rs);
 
 	/* release the arp cache lock */
+	lockprof_release(LOCK_ARP_CACHE);
 	if(pthread_rwlock_unlock(rs->arp_cache_lock) != 0) {
 		perror("Failure releasing arp cache lock");
 	}
@@ -477,7 +486,7 @@ void lock_arp_queue_rd(router_state *rs) {
 	//printf("LOCK ARP QUEUE-RD %u\n", pthread_self());
 	assert(rs);
 
-	if(pthread_rwlock_rdlock(rs->arp_queue_lock) != 0) {
+	if(lockprof_rdlock(rs->arp_queue_lock, LOCK_ARP_QUEUE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting arp queue read lock");
 	}
 }
@@ -487,7 +496,7 @@ void lock_arp_queue_wr(router_state *rs) {
 
 	assert(rs);
 
-	if(pthread_rwlock_wrlock(rs->arp_queue_lock) != 0) {
+	if(lockprof_wrlock(rs->arp_queue_lock, LOCK_ARP_QUEUE, LOCKPROF_SITE) != 0) {
 
 		perror("Failure getting arp queue write lock");
 	}
@@ -500,51 +509,61 @@ void unlock_arp_queue(router_state *rs) {
 
 	assert(rs);
 
+	lockprof_release(LOCK_ARP_QUEUE);
 	if(pthread_rwlock_unlock(rs->arp_queue_lock) != 0) {
 		perror("Failure releasing arp queue lock");
 	}
 }
 
 /*
- * HELPER function called from arp_thread
  * NOT THREAD SAFE
+ * Schedules the expiry of a dynamic entry for when its TTL runs out
  */
-void expire_arp_cache(struct sr_instance* sr) {
-	assert(sr);
+void arp_arm_expiry(router_state* rs, arp_cache_entry* entry) {
+	time_t now;
+	time(&now);
 
-	router_state *rs = (router_state *)sr->interface_subsystem;
-	node *arp_walker = 0;
-	arp_cache_entry *arp_entry = 0;
+	double remaining = difftime(entry->TTL + rs->arp_ttl + 1, now);
+	if (remaining < 0) {
+		remaining = 0;
+	}
+
+	entry->timer_id = timer_add(rs, (uint32_t)(remaining * 1000), 0, arp_expire_timer, entry->ip.s_addr);
+}
+
+/*
+ * Timer callback, key is the ip of the entry
+ */
+void arp_expire_timer(router_state* rs, uint32_t key, uint32_t id) {
+	struct in_addr ip;
 	time_t now;
-	double diff;
-	int timedout_entry = 0;
 
-	arp_walker = rs->arp_cache;
-	while(arp_walker) {
-		arp_entry = (arp_cache_entry *)arp_walker->data;
-		node *tmp = arp_walker;
-		arp_walker = arp_walker->next;
+	ip.s_addr = key;
 
-		/** if not static, check that is TTL is within reason **/
-		if (arp_entry->is_static != 1) {
-			time(&now);
-			diff = difftime(now, arp_entry->TTL);
+	lock_arp_cache_wr(rs);
+
+	/* the entry may be gone, or a later timer may have replaced this one */
+	arp_cache_entry* entry = in_arp_cache(rs, &ip);
+	if (entry && (entry->timer_id == id)) {
+		entry->timer_id = 0;
 
-			if (diff > rs->arp_ttl) {
-				node_remove(&rs->arp_cache, tmp);
-				timedout_entry = 1;
+		if (entry->is_static != 1) {
+			time(&now);
+			if (difftime(now, entry->TTL) > rs->arp_ttl) {
+				del_arp_cache(rs->sr, &ip);
+				trigger_arp_cache_modified(rs);
+			} else {
+				/* refreshed since we were armed */
+				arp_arm_expiry(rs, entry);
 			}
 		}
 	}
 
-	/* update the hw arp cache */
-	if(timedout_entry == 1) {
-		trigger_arp_cache_modified(rs);
-	}
+	unlock_arp_cache(rs);
 }
 
 /*
- * HELPER function called from arp_thread
+ * HELPER function called from arp_queue_timer
  */
 void process_arp_queue(struct sr_instance* sr) {
 	router_state* rs = get_router_state(sr);
@@ -605,6 +624,7 @@ void process_arp_queue(struct sr_instance* sr) {
 						}
 					}
 
+					drop_count(rs, DROP_ARP_TIMEOUT, aqe->out_iface_name);
 					free(aqpe->packet);
 					next_packet_node = cur_packet_node->next;
 					//free(cur_packet_node);   /* IS THIS CORRECT TO FREE IT ? */
@@ -756,30 +776,23 @@ void cli_ip_arp_help(router_state *rs, cli_request* req) {
 
 
 
-void* arp_thread(void *param) {
-	assert(param);
-	struct sr_instance *sr = (struct sr_instance *)param;
-	router_state *rs = get_router_state(sr);
-
-	while (1) {
-		lock_arp_cache_wr(rs);
-		expire_arp_cache(sr);
-		unlock_arp_cache(rs);
-
-		lock_arp_cache_rd(rs);
-		lock_arp_queue_wr(rs);
-		lock_if_list_rd(rs);
-		lock_rtable_rd(rs); /* because we may send an icmp packet back, requiring get next hop */
+/*
+ * Timer callback, retries outstanding arp requests once a second
+ */
+void arp_queue_timer(router_state* rs, uint32_t key, uint32_t id) {
+	struct sr_instance *sr = (struct sr_instance *)rs->sr;
 
-		process_arp_queue(sr);
+	lock_arp_cache_rd(rs);
+	lock_arp_queue_wr(rs);
+	lock_if_list_rd(rs);
+	lock_rtable_rd(rs); /* because we may send an icmp packet back, requiring get next hop */
 
-		unlock_rtable(rs);
-		unlock_if_list(rs);
-		unlock_arp_queue(rs);
-		unlock_arp_cache(rs);
+	process_arp_queue(sr);
 
-		sleep(1);
-	}
+	unlock_rtable(rs);
+	unlock_if_list(rs);
+	unlock_arp_queue(rs);
+	unlock_arp_cache(rs);
 }
 
 void cli_ip_arp_add_help(router_state *rs, cli_request *req) {
@@ -986,8 +999,20 @@ void cli_ip_arp_set_ttl(router_state *rs, cli_request *req) {
 		return;
 	}
 
+	lock_arp_cache_wr(rs);
 	rs->arp_ttl = timeout;
 
+	/* reschedule against the new ttl, the old timers no longer match and drop out */
+	node* cur = rs->arp_cache;
+	while (cur) {
+		arp_cache_entry* entry = (arp_cache_entry*)cur->data;
+		if (entry->is_static != 1) {
+			arp_arm_expiry(rs, entry);
+		}
+		cur = cur->next;
+	}
+	unlock_arp_cache(rs);
+
 	char *info = (char *)calloc(80, sizeof(char));
 	snprintf(info, 80, "Arp entry TTL has been set to: %d\n", rs->arp_ttl);
 	send_to_socket(req->sockfd, info, strlen(info));
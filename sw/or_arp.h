@@ -56,6 +56,8 @@ void cli_hw_num_pckts_fwd(router_state *rs, cli_request *req);
 
 
 
-void* arp_thread(void *param);
+void arp_arm_expiry(router_state* rs, arp_cache_entry* entry);
+void arp_expire_timer(router_state* rs, uint32_t key, uint32_t id);
+void arp_queue_timer(router_state* rs, uint32_t key, uint32_t id);
 
 #endif /*OR_ARP_H_*/
@@ -14,6 +14,7 @@
 #include "or_rstable.h"
 #include "or_data_types.h"
 #include "or_utils.h"
+#include "or_lockprof.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -243,10 +244,45 @@ int update_atable_entry(struct in_addr* destination, struct in_addr* mask, struc
 
 }
 
+/*
+ * Returns: the atable slot of an interface, -1 if it has none
+ */
+int atable_port_of(char* iface) {
+
+	if (!strcmp(iface, "eth0")) {
+		return 0;
+	} else if (!strcmp(iface, "eth1")) {
+		return 1;
+	} else if (!strcmp(iface, "eth2")) {
+		return 2;
+	} else if (!strcmp(iface, "eth3")) {
+		return 3;
+	}
+	
+	return -1;
+
+}
+
+static atable_entry* get_multipath_entry(node* multipath, struct in_addr* destination, struct in_addr* mask) {
+
+	while (multipath) {
+	
+		atable_entry* ae = (atable_entry*)multipath->data;
+		if ((ae->ip.s_addr == destination->s_addr) && (ae->mask.s_addr == mask->s_addr)) {
+			return ae;
+		}
+		multipath = multipath->next;
+		
+	}
+	
+	return NULL;
+
+}
+
 /* !! NOT THREAD SAFE !!
  * LOCK RS FOR WRITING BEFORE CALLING THE FUNCTION
  */
-int compute_atable(router_state* rs) {
+int compute_atable(router_state* rs, node* multipath) {
 
 	/* Logic:
 	 *   After each Dijkstra's computation, we need to update our atable 
@@ -254,6 +290,10 @@ int compute_atable(router_state* rs) {
 	 *	 already in atable. If so, then update its alpha values. If not, that
 	 *	 means it is a newly joined node and we should therefore include it into
 	 *	 atable and initialize it.
+	 *
+	 *   multipath holds the equal cost next hops per port SPF found (see
+	 *   compute_rtable). A new destination starts out split evenly across
+	 *   all of them, an existing one gets the ports it was missing at alpha 0.
 	 */
 
 	assert(rs);
@@ -267,6 +307,8 @@ int compute_atable(router_state* rs) {
 	double alpha[4];
 	
 	node* p = NULL;	// for atable linked list
+	atable_entry* mp = NULL;
+	int k;
 	
 	if (!n)
 		printf("THERE IS NO ENTRY IN RTABLE\n");
@@ -316,6 +358,12 @@ int compute_atable(router_state* rs) {
 					next_hop_ip[3] = re->gw;
 					alpha[3] = 1;
 				}
+				
+				mp = get_multipath_entry(multipath, &(re->ip), &(re->mask));
+				if (mp) {
+					memcpy(next_hop_ip, mp->next_hop_ip, sizeof(next_hop_ip));
+					memcpy(alpha, mp->alpha, sizeof(alpha));
+				}
 
 				add_atable_entry(&(re->ip), &(re->mask), next_hop_ip, alpha, rs);
 				
@@ -368,6 +416,13 @@ int compute_atable(router_state* rs) {
 					alpha[3] = 1 - alpha[0] - alpha[1] - alpha[2];
 				}
 				
+				mp = get_multipath_entry(multipath, &(re->ip), &(re->mask));
+				for (k = 0; mp && (k < 4); ++k) {
+					if (!next_hop_ip[k].s_addr) {
+						next_hop_ip[k] = mp->next_hop_ip[k];
+					}
+				}
+				
 				update_atable_entry(&(re->ip), &(re->mask), next_hop_ip, alpha, p);
 				
 			}
@@ -382,6 +437,99 @@ int compute_atable(router_state* rs) {
 	
 }
 
+/* !! NOT THREAD SAFE !!
+ * LOCK RS FOR WRITING BEFORE CALLING THE FUNCTION
+ */
+int atable_drop_next_hop(router_state* rs, int port, struct in_addr* next_hop) {
+
+	/* Logic:
+	 *   A neighbor went down. Zero the alpha of every entry reaching it on
+	 *   this port and hand its share to the next hops that are left, in
+	 *   proportion to what they had (evenly if they had nothing).
+	 *   Returns the number of entries changed.
+	 */
+
+	assert(rs);
+	assert(next_hop);
+	
+	if ((port < 0) || (port > 3)) {
+		return 0;
+	}
+	
+	node* n = rs->atable;
+	int changed = 0;
+	int k;
+	
+	while (n) {
+	
+		atable_entry* ae = (atable_entry*)n->data;
+		
+		if (ae->next_hop_ip[port].s_addr == next_hop->s_addr) {
+		
+			double rest = 0;
+			int live = 0;
+			
+			ae->next_hop_ip[port].s_addr = 0;
+			ae->alpha[port] = 0;
+			
+			for (k = 0; k < 4; ++k) {
+				if (ae->next_hop_ip[k].s_addr) {
+					rest += ae->alpha[k];
+					++live;
+				}
+			}
+			
+			for (k = 0; k < 4; ++k) {
+				if (!ae->next_hop_ip[k].s_addr) {
+					ae->alpha[k] = 0;
+				} else if (rest > 0) {
+					ae->alpha[k] = ae->alpha[k] / rest;
+				} else {
+					ae->alpha[k] = 1.0 / live;
+				}
+			}
+			
+			++changed;
+			
+		}
+		
+		n = n->next;
+		
+	}
+	
+	return changed;
+
+}
+
+/* !! NOT THREAD SAFE !!
+ * LOCK RS FOR READING BEFORE CALLING THE FUNCTION
+ * Returns: the port carrying the largest share to the destination, -1 if none
+ */
+int atable_best_port(struct in_addr* destination, struct in_addr* mask, struct in_addr* next_hop, router_state* rs) {
+
+	node* n = get_atable_entry(destination, mask, rs);
+	int best = -1;
+	int k;
+	
+	if (!n) {
+		return -1;
+	}
+	
+	atable_entry* ae = (atable_entry*)n->data;
+	for (k = 0; k < 4; ++k) {
+		if (ae->next_hop_ip[k].s_addr && ((best < 0) || (ae->alpha[k] > ae->alpha[best]))) {
+			best = k;
+		}
+	}
+	
+	if (best >= 0) {
+		*next_hop = ae->next_hop_ip[best];
+	}
+	
+	return best;
+
+}
+
 /* NOT THREAD SAFE
  * LOCK RS FOR WRITING BEFORE CALLING THE FUNCTION
  */
@@ -435,7 +583,7 @@ int sprint_atable(router_state *rs) {
 void lock_atable_rd(router_state *rs) {
 	assert(rs);
 
-	if(pthread_rwlock_rdlock(rs->atable_lock) != 0) {
+	if(lockprof_rdlock(rs->atable_lock, LOCK_ATABLE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting atable read lock");
 	}
 }
@@ -443,7 +591,7 @@ void lock_atable_rd(router_state *rs) {
 void lock_atable_wr(router_state *rs) {
 	assert(rs);
 
-	if(pthread_rwlock_wrlock(rs->atable_lock) != 0) {
+	if(lockprof_wrlock(rs->atable_lock, LOCK_ATABLE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting atable write lock");
 	}
 }
@@ -451,6 +599,7 @@ void lock_atable_wr(router_state *rs) {
 void unlock_atable(router_state *rs) {
 	assert(rs);
 
+	lockprof_release(LOCK_ATABLE);
 	if(pthread_rwlock_unlock(rs->atable_lock) != 0) {
 		perror("Failure unlocking atable lock");
 	}
@@ -18,7 +18,10 @@ int del_atable_entry(struct in_addr* destination, struct in_addr* mask, router_s
 int sprint_atable_entry(node* n, unsigned int index);
 int update_atable_entry(struct in_addr* destination, struct in_addr* mask, struct in_addr* next_hop_ip, double* alpha, node* n);
 
-int compute_atable(router_state* rs);
+int atable_port_of(char* iface);
+int compute_atable(router_state* rs, node* multipath);
+int atable_drop_next_hop(router_state* rs, int port, struct in_addr* next_hop);
+int atable_best_port(struct in_addr* destination, struct in_addr* mask, struct in_addr* next_hop, router_state* rs);
 int delete_atable(router_state* rs);
 int sprint_atable(router_state* rs);
 
@@ -10,6 +10,10 @@
 #include <string.h>
 #include <netdb.h>
 
+/* before lwip takes over read and write */
+#include "sr_base_internal.h"
+#include "sr_dumper.h"
+
 #ifdef _NOLWIP_
 	#include <netinet/in.h>
 	#include <unistd.h>
@@ -24,6 +28,7 @@
 #include "or_cli.h"
 #include "or_utils.h"
 #include "or_sping.h"
+#include "or_lockprof.h"
 #include "nf2/nf2util.h"
 
 #define MAX_COMMAND_SIZE 128
@@ -133,7 +138,7 @@ cli_command_handler cli_command_lpm(router_state* rs, char* command) {
 void lock_cli_commands_rd(void* subsys) {
 	router_state* rs = (router_state*)subsys;
 
-	if(pthread_rwlock_rdlock(rs->cli_commands_lock) != 0) {
+	if(lockprof_rdlock(rs->cli_commands_lock, LOCK_CLI_COMMANDS, LOCKPROF_SITE) != 0) {
 		perror("Failure getting cli commands read lock");
 	}
 }
@@ -141,6 +146,7 @@ void lock_cli_commands_rd(void* subsys) {
 void unlock_cli_commands(void* subsys) {
 	router_state* rs = (router_state*)subsys;
 
+	lockprof_release(LOCK_CLI_COMMANDS);
 	if(pthread_rwlock_unlock(rs->cli_commands_lock) != 0) {
 		perror("Failure unlocking cli commands lock");
 	}
@@ -216,10 +222,37 @@ void cli_help(router_state* rs, cli_request* req) {
 	usage = "\tshow vns [user server vhost lhost topology]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
-	usage = "\tshow ip [route interface arp]\n";
+	usage = "\tshow ip [route fib interface arp flow drops latency]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tip [route fib interface arp flow latency]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tip fib verify [samples]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tip flow [collector <ip> <port>|none] [sample N] [timeout <active> <inactive>] [rate N]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tip latency [on off reset], reset clears the histograms\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tshow locks [sites per lock]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tlocks profile [on off reset]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tshow nat table, entries and port pool usage\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
-	usage = "\tip [route interface arp]\n";
+	usage = "\tnat pool [tcp udp icmp] [low port] [high port]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tnat parity [on off]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tnat timeout [tcp-syn tcp-est tcp-fin udp icmp] [seconds]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
 	usage = "\tsping [dest]\n";
@@ -228,12 +261,18 @@ void cli_help(router_state* rs, cli_request* req) {
 
 	/* PWOSPF */
 
-	usage = "\tshow pwopsf [iface router info]\n";
+	usage = "\tshow pwopsf [iface router area info]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
 	usage = "\tset aid [area id]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
+	usage = "\tset iface area [iface] [area id]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tarea range [add del] [area id] [subnet] [mask]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
 	usage = "\tset hello interval [interval]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
@@ -243,6 +282,15 @@ void cli_help(router_state* rs, cli_request* req) {
 	usage = "\tset lsu interval [interval]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
+	usage = "\tset spf throttle [start ms] [hold ms] [max wait ms]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tset metric [rate load] [min change]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tset liveness [interval ms] [multiplier]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
 	usage = "\tsend hello\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
@@ -283,6 +331,21 @@ void cli_help(router_state* rs, cli_request* req) {
 	usage = "\thw packts fwd\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
+	usage = "\tsnapshot save\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tlog rotate [MB] [seconds] [files kept]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tlog filter [pcap expression|none]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tlog sample [N] [random]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tlog select [all|eth0 eth1 eth2 eth3] [rx|tx|both]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
 
 
 }
@@ -295,8 +358,23 @@ void cli_show_help(router_state *rs, cli_request* req) {
 	char *usage1 = "show vns [user server vhost lhost topology]\n";
 	send_to_socket(req->sockfd, usage1, strlen(usage1));
 
-	char *usage2 = "show ip [route interface arp]\n";
+	char *usage2 = "show ip [route fib interface arp flow drops latency]\n";
 	send_to_socket(req->sockfd, usage2, strlen(usage2));
+
+	char *usage3 = "show timers\n";
+	send_to_socket(req->sockfd, usage3, strlen(usage3));
+
+	char *usage4 = "show snapshot\n";
+	send_to_socket(req->sockfd, usage4, strlen(usage4));
+
+	char *usage5 = "show log\n";
+	send_to_socket(req->sockfd, usage5, strlen(usage5));
+
+	char *usage6 = "show locks [sites per lock]\n";
+	send_to_socket(req->sockfd, usage6, strlen(usage6));
+
+	char *usage7 = "show nat table\n";
+	send_to_socket(req->sockfd, usage7, strlen(usage7));
 }
 
 
@@ -408,3 +486,163 @@ void cli_nat_test(router_state *rs, cli_request *req) {
 }
 
 
+void cli_show_log(router_state *rs, cli_request *req) {
+	struct sr_instance* sr = (struct sr_instance*)rs->sr;
+	struct sr_dumper* d = sr->dumper;
+	struct sr_dump_filter* f;
+	char line[sizeof(d->fname) + SR_DUMP_FILTER_LEN];	/* room for either with the rest of its line */
+
+	if (!d) {
+		char *msg = "Packet logging is off, start with -l <file>\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	snprintf(line, sizeof(line), "File: %s  Snaplen: %d  Rotate: %llu MB / %u s, keep %u\n", d->fname, d->snaplen,
+		(unsigned long long)(d->rotate_bytes >> 20), d->rotate_secs, d->rotate_keep);
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	/* head and tail are read without a lock, the backlog is a close approximation */
+	snprintf(line, sizeof(line), "Captured: %llu  Dropped: %llu  Backlog: %u/%u\n",
+		(unsigned long long)(d->written + (uint32_t)(d->head - d->tail)), (unsigned long long)d->dropped,
+		(uint32_t)(d->head - d->tail), SR_DUMP_RING_SLOTS);
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	snprintf(line, sizeof(line), "Written: %llu packets %llu bytes in %llu writes  Rotations: %llu  Errors: %llu\n",
+		(unsigned long long)d->written, (unsigned long long)d->written_bytes, (unsigned long long)d->batches,
+		(unsigned long long)d->rotations, (unsigned long long)d->write_errors);
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	/* the lock keeps the filter from being replaced and freed under us */
+	pthread_mutex_lock(&(d->filter_lock));
+	f = d->filter;
+	snprintf(line, sizeof(line), "Filter: %s  Interfaces: 0x%08X  Directions: %s%s  Sample: 1 in %u%s\n",
+		(f->has_prog ? f->expr : "none"), f->ifaces, ((f->dirs & SR_DUMP_RX) ? "rx " : ""),
+		((f->dirs & SR_DUMP_TX) ? "tx" : ""), (f->sample ? f->sample : 1), (f->sample_random ? " (random)" : ""));
+	pthread_mutex_unlock(&(d->filter_lock));
+	send_to_socket(req->sockfd, line, strlen(line));
+}
+
+void cli_log_rotate(router_state *rs, cli_request *req) {
+	struct sr_instance* sr = (struct sr_instance*)rs->sr;
+	unsigned int mb = 0, secs = 0, keep = 0;
+	char *msg;
+
+	if (!sr->dumper) {
+		msg = "Packet logging is off\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	if (sscanf(req->command, "log rotate %u %u %u", &mb, &secs, &keep) < 2) {
+		msg = "usage: log rotate [MB] [seconds] [files kept], 0 turns each off\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	sr_dump_set_rotation(sr, ((uint64_t)mb) << 20, secs, keep);
+
+	msg = "Log rotation set\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_log_filter(router_state *rs, cli_request *req) {
+	struct sr_instance* sr = (struct sr_instance*)rs->sr;
+	char errbuf[PCAP_ERRBUF_SIZE];
+	char line[PCAP_ERRBUF_SIZE + 32];
+	char *expr = req->command + strlen("log filter");
+	char *msg;
+
+	if (!sr->dumper) {
+		msg = "Packet logging is off\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	while (*expr == ' ') {
+		++expr;
+	}
+	if (*expr == '\0') {
+		msg = "usage: log filter <pcap filter expression>|none\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+	if (strcmp(expr, "none") == 0) {
+		expr = "";
+	}
+
+	if (sr_dump_set_filter(sr, expr, errbuf) != 0) {
+		snprintf(line, sizeof(line), "Bad filter: %s\n", errbuf);
+		send_to_socket(req->sockfd, line, strlen(line));
+		return;
+	}
+
+	msg = "Log filter set\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_log_sample(router_state *rs, cli_request *req) {
+	struct sr_instance* sr = (struct sr_instance*)rs->sr;
+	unsigned int sample = 0;
+	char mode[16];
+	char *msg;
+
+	if (!sr->dumper) {
+		msg = "Packet logging is off\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	mode[0] = '\0';
+	if (sscanf(req->command, "log sample %u %15s", &sample, mode) < 1) {
+		msg = "usage: log sample N [random], 1 logs every packet\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	sr_dump_set_sampling(sr, sample, (strcmp(mode, "random") == 0));
+
+	msg = "Log sampling set\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_log_select(router_state *rs, cli_request *req) {
+	struct sr_instance* sr = (struct sr_instance*)rs->sr;
+	char buf[256];
+	char *tok, *save;
+	uint32_t ifaces = 0, dirs = 0;
+	char *msg;
+
+	if (!sr->dumper) {
+		msg = "Packet logging is off\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	strncpy(buf, req->command + strlen("log select"), 255);
+	buf[255] = '\0';
+
+	for (tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+		if (strcmp(tok, "all") == 0) {
+			ifaces = SR_DUMP_ALL_IFACES;
+		} else if (strcmp(tok, "rx") == 0) {
+			dirs |= SR_DUMP_RX;
+		} else if (strcmp(tok, "tx") == 0) {
+			dirs |= SR_DUMP_TX;
+		} else if (strcmp(tok, "both") == 0) {
+			dirs |= SR_DUMP_RX | SR_DUMP_TX;
+		} else if (strncmp(tok, "eth", 3) == 0) {
+			ifaces |= sr_dump_iface_bit(tok);
+		} else {
+			msg = "usage: log select [all|ethX ...] [rx|tx|both]\n";
+			send_to_socket(req->sockfd, msg, strlen(msg));
+			return;
+		}
+	}
+
+	/* whatever wasn't given stays as it is */
+	sr_dump_set_selection(sr, ifaces, dirs);
+
+	msg = "Log selection set\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
@@ -24,5 +24,11 @@ void cli_hw_help(router_state *rs, cli_request *req);
 
 void cli_nat_test(router_state *rs, cli_request *req);
 
+void cli_show_log(router_state *rs, cli_request *req);
+void cli_log_rotate(router_state *rs, cli_request *req);
+void cli_log_filter(router_state *rs, cli_request *req);
+void cli_log_sample(router_state *rs, cli_request *req);
+void cli_log_select(router_state *rs, cli_request *req);
+
 #endif /* OR_CLI_H_ */
 
@@ -122,14 +122,38 @@ typedef struct pwospf_hdr pwospf_hdr;
 #define PWOSPF_VERSION					0x2
 #define PWOSPF_TYPE_HELLO				0x1
 #define PWOSPF_TYPE_LINK_STATE_UPDATE	0x4
+#define PWOSPF_TYPE_LIVENESS			0x6	/* NGRP extension, fast neighbor liveness */
 
 #define PWOSPF_AREA_ID 0x0
+#define PWOSPF_BACKBONE_AREA 0x0
+#define PWOSPF_ADV_SUMMARY 0x80000000	/* top bit of ngrp_rx_rate, an ABR summarized this advertisement into the area */
+#define PWOSPF_ADV_RATE 0x7FFFFFFF		/* the rest of ngrp_rx_rate, the measured rate */
 #define PWOSPF_HELLO_TIP 0xe0000005
 
 #define PWOSPF_NEIGHBOR_TIMEOUT 5
 #define PWOSPF_LSUINT 1
+
+/* spf throttle defaults in ms: wait before the first run, hold between runs under churn, cap on the hold */
+#define PWOSPF_SPF_START 50
+#define PWOSPF_SPF_HOLD 200
+#define PWOSPF_SPF_MAX_WAIT 5000
+
+/* what we advertise as the cost (ngrp_tx_rate) of our links */
+#define PWOSPF_METRIC_RATE 0		/* measured tx rate */
+#define PWOSPF_METRIC_LOAD 1		/* damped utilization against the port speed, in levels */
+#define PWOSPF_LOAD_LEVELS 16		/* cost 1 when idle up to 16 when saturated */
+#define PWOSPF_LOAD_DAMPING 0.25	/* weight of each new sample in the utilization average */
+#define PWOSPF_LOAD_MIN_CHANGE 2	/* levels the cost must move by before we re-advertise */
+#define PWOSPF_LOAD_HOLD_DOWN 10	/* seconds a cost holds before it may move again */
+#define PWOSPF_DEFAULT_SPEED 1000	/* Mbit/s, for ports that report none */
+#define PWOSPF_RATE_MIN_CHANGE 10	/* percent a measured rate must move by before we re-advertise it */
 #define PWOSPF_HELLO_PADDING 0x0
 
+/* liveness defaults: a packet every 100 ms, a neighbor is down after missing 3 of them */
+#define PWOSPF_LIVENESS_INTERVAL 100
+#define PWOSPF_LIVENESS_MULTIPLIER 3
+#define PWOSPF_LIVENESS_IDLE 1000	/* ms between checks while liveness is off */
+
 struct pwospf_hello_hdr
 {
 	struct in_addr pwospf_mask;
@@ -139,6 +163,16 @@ struct pwospf_hello_hdr
 typedef struct pwospf_hello_hdr pwospf_hello_hdr;
 
 
+/* the sender's interval in ms and multiplier, the receiver declares it down after their product */
+struct pwospf_liveness_hdr
+{
+	uint16_t pwospf_interval;
+	uint8_t pwospf_mult;
+	uint8_t pwospf_pad;
+} __attribute__ ((packed));
+typedef struct pwospf_liveness_hdr pwospf_liveness_hdr;
+
+
 struct pwospf_lsu_hdr
 {
 	uint16_t pwospf_seq;
@@ -165,7 +199,9 @@ struct nat_tcp_hdr
 	uint16_t tcp_dport;
 	uint32_t tcp_seq;
 	uint32_t tcp_ack;
-	uint8_t unused1[4];
+	uint8_t tcp_off;
+	uint8_t tcp_flags;
+	uint16_t tcp_win;
 	uint16_t tcp_sum;
 	uint8_t unused2[2];
 } __attribute__ ((packed));
@@ -190,6 +226,122 @@ struct nat_icmp_hdr
 } __attribute__ ((packed));
 typedef struct nat_icmp_hdr nat_icmp_hdr;
 
+#define NAT_TCP_FIN 0x01
+#define NAT_TCP_SYN 0x02
+#define NAT_TCP_RST 0x04
+#define NAT_TCP_ACK 0x10
+
+/* tcp state of a nat entry, from the flags of translated packets */
+#define NAT_TCP_NONE 0
+#define NAT_TCP_SYN_SENT 1
+#define NAT_TCP_ESTABLISHED 2
+#define NAT_TCP_FIN_WAIT 3	/* both sides sent a FIN */
+#define NAT_TCP_CLOSED 4
+
+/* idle timeouts in seconds, indexes into router_state nat_timeouts */
+#define NAT_TIMEOUT_TCP_SYN 0
+#define NAT_TIMEOUT_TCP_EST 1
+#define NAT_TIMEOUT_TCP_FIN 2
+#define NAT_TIMEOUT_UDP 3
+#define NAT_TIMEOUT_ICMP 4
+#define NAT_NUM_TIMEOUTS 5
+
+#define NAT_DEFAULT_TCP_SYN_TIMEOUT 30
+#define NAT_DEFAULT_TCP_EST_TIMEOUT 240
+#define NAT_DEFAULT_TCP_FIN_TIMEOUT 10
+#define NAT_DEFAULT_UDP_TIMEOUT 30
+#define NAT_DEFAULT_ICMP_TIMEOUT 30
+#define NAT_EXPIRY_STEPS 4	/* idle checks per timeout, an entry outlives it by at most one step */
+
+/** WARM RESTART SNAPSHOT **/
+#define SNAPSHOT_MAGIC 0x4E475250	/* "NGRP" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_DEFAULT_PATH "router.snapshot"
+#define SNAPSHOT_PATH_LEN 256
+#define SNAPSHOT_INTERVAL 10000		/* ms between periodic writes */
+#define SNAPSHOT_MAX_AGE 300		/* seconds, an older snapshot is ignored entirely */
+#define SNAPSHOT_LSDB_MAX_AGE 60	/* seconds, past this the lsdb, routes and alphas are not restored */
+
+#define SNAPSHOT_ARP 0
+#define SNAPSHOT_NAT 1
+#define SNAPSHOT_NAT_POOL 2
+#define SNAPSHOT_ROUTER 3
+#define SNAPSHOT_LINK 4
+#define SNAPSHOT_ROUTE 5
+#define SNAPSHOT_ALPHA 6
+#define SNAPSHOT_NUM_SECTIONS 7
+
+/** FORWARDING WORKERS, see worker_register **/
+#define NUM_WORKERS 4			/* forwarding threads with a slot of per worker counters */
+#define WORKER_SHARED NUM_WORKERS	/* the slot any other thread adds to atomically */
+
+/** FLOW TELEMETRY **/
+#define FLOW_MAX_ENTRIES 8192		/* per worker, the cache never holds more */
+#define FLOW_HASH_BUCKETS 4096		/* per worker, power of two */
+#define FLOW_DEFAULT_ACTIVE_TIMEOUT 60	/* seconds */
+#define FLOW_DEFAULT_INACTIVE_TIMEOUT 15	/* seconds */
+#define FLOW_DEFAULT_EXPORT_RATE 1000	/* records per second */
+#define FLOW_SWEEP_INTERVAL 1000	/* ms */
+#define FLOW_TEMPLATE_INTERVAL 60	/* seconds, collectors lose udp templates */
+#define FLOW_EXPORT_MTU 1400
+
+/* flow_entry state, see flow_account */
+#define FLOW_ENTRY_FREE 0
+#define FLOW_ENTRY_LIVE 1	/* in the cache, either side may claim it */
+#define FLOW_ENTRY_BUSY 2	/* the owner is updating it */
+#define FLOW_ENTRY_DEAD 3	/* claimed by the sweep, the owner unlinks it */
+
+/** DROP ACCOUNTING, indexes into drop_worker count **/
+#define DROP_INVALID 0		/* is_packet_valid failed */
+#define DROP_IFACE_DOWN 1	/* arrived on an inactive interface */
+#define DROP_TTL_EXPIRED 2
+#define DROP_NO_ROUTE 3
+#define DROP_HAIRPIN 4		/* route points back out the arrival interface */
+#define DROP_ARP_TIMEOUT 5	/* next hop never answered, dropped from the arp queue */
+#define DROP_UNSUPPORTED 6	/* protocol or ethertype we don't handle */
+#define DROP_NAT_NO_PORT 7	/* no external port left to translate to */
+#define DROP_SEND_FAILED 8
+#define DROP_BAD_LSU 9		/* advertisement count runs past the end of the LSU */
+#define DROP_NUM_REASONS 10
+
+#define DROP_MAX_IFACES 8	/* by flow_ifindex, 0 is not tied to an interface */
+#define DROP_READER_CLI 0
+#define DROP_READER_WWW 1
+#define DROP_NUM_READERS 2
+
+/** PIPELINE STAGE LATENCY, indexes into latency_worker stage **/
+#define LAT_RX 0		/* process_packet up to handing the packet on */
+#define LAT_IP 1		/* all of process_ip_packet */
+#define LAT_VALIDATE 2
+#define LAT_LOCAL 3		/* is it for one of our interfaces */
+#define LAT_LPM 4
+#define LAT_NAT 5
+#define LAT_MULTIPATH 6		/* atable lookup and next hop pick */
+#define LAT_ARP 7		/* arp cache lookup in send_ip */
+#define LAT_TX 8		/* send_packet */
+#define LAT_NUM_STAGES 9
+
+#define LAT_SUB_BITS 4		/* 16 buckets per power of two, within 6.25% */
+#define LAT_NUM_BUCKETS 512	/* ns, the last one holds anything from 33 s up */
+
+/** LOCK PROFILER, one id per wrapped lock **/
+#define LOCK_ARP_CACHE 0
+#define LOCK_ARP_QUEUE 1
+#define LOCK_IF_LIST 2
+#define LOCK_RTABLE 3
+#define LOCK_ATABLE 4
+#define LOCK_RSTABLE 5
+#define LOCK_NAT_TABLE 6
+#define LOCK_NAT_SHARD 7	/* all shards count as one lock */
+#define LOCK_NAT_POOLS 8
+#define LOCK_PWOSPF_ROUTER_LIST 9
+#define LOCK_PWOSPF_LSU_QUEUE 10
+#define LOCK_CLI_COMMANDS 11
+#define LOCK_LOCAL_IP_FILTERS 12
+#define LOCK_NETFPGA_STATS 13
+#define LOCK_NUM 14
+#define LOCKPROF_NUM_BUCKETS 40	/* log2 ns */
+#define LOCKPROF_NUM_SITES 16	/* contending call sites kept per lock */
 
 
 /** LINKED LIST STRUCT **/
@@ -201,6 +353,53 @@ struct node {
 typedef struct node node;
 
 
+/* kept shortest path tree for incremental SPF, see or_dijkstra.c */
+typedef struct spf_tree spf_tree;
+
+/*
+ * Our LSU as last encoded, pwospf header onwards. Floods reuse it with a new sequence
+ * number until what we advertise changes, anything that changes that bumps
+ * router_state.pwospf_lsu_generation.
+ */
+struct pwospf_lsu_cache {
+	uint8_t* packet;
+	unsigned int len;
+	uint32_t generation;	/* of the contents it was encoded from */
+	uint32_t encodes;
+	uint32_t floods;
+};
+typedef struct pwospf_lsu_cache pwospf_lsu_cache;
+
+/* an address range an ABR advertises in place of the prefixes of its area that fall in it */
+struct pwospf_area_range {
+	struct in_addr subnet;
+	struct in_addr mask;
+};
+typedef struct pwospf_area_range pwospf_area_range;
+
+/*
+ * An area we have been attached to, our LSDB entries for it are the routers in the
+ * pwospf router list with its area id. Guarded by the pwospf_router_list_lock, never freed.
+ */
+struct pwospf_area {
+	uint32_t area_id;
+	struct pwospf_lsu_cache lsu_cache;	/* our LSU into this area */
+	spf_tree* spf;			/* only the dijkstra thread runs on it */
+	unsigned int spf_settled;	/* routers the last run settled */
+	uint16_t last_seq;		/* of our entry when we left, a new one carries on from it */
+	node* summaries;		/* pwospf_interface, the inter-area prefixes we advertise into it */
+	node* ranges;			/* pwospf_area_range, of this area's own prefixes */
+};
+typedef struct pwospf_area pwospf_area;
+
+/* (area id, router id) index over the nodes of the pwospf router list, see or_lsdb.c */
+struct pwospf_lsdb {
+	node** slots;
+	unsigned int mask;
+	unsigned int count;
+};
+typedef struct pwospf_lsdb pwospf_lsdb;
+
 /** ROUTER STATE STRUCT **/
 struct router_state {
 	void* sr;
@@ -212,10 +411,18 @@ struct router_state {
 	uint16_t pwospf_hello_interval;
 	uint32_t pwospf_lsu_interval;
 	uint32_t pwospf_lsu_broadcast;
+	uint32_t pwospf_metric;
+	uint32_t pwospf_load_min_change;
+	uint32_t pwospf_lsu_generation;	/* guarded by the pwospf_router_list_lock */
+	uint32_t pwospf_liveness_interval;	/* ms, 0 turns liveness off */
+	uint32_t pwospf_liveness_multiplier;
+	uint32_t pwospf_liveness_downs;
+	node* pwospf_areas;	/* pwospf_area, guarded by the pwospf_router_list_lock */
+	struct pwospf_lsdb pwospf_lsdb;	/* guarded by the pwospf_router_list_lock */
 	uint32_t dijkstra_dirty;
 	uint16_t is_netfpga;
 	uint32_t arp_ttl;
-	uint32_t nat_timeout;
+	uint32_t nat_timeouts[NAT_NUM_TIMEOUTS];
 
 	/* NETFPGA specific */
 	nf2device netfpga;
@@ -230,12 +437,18 @@ struct router_state {
 
 	node* rtable;
 	pthread_rwlock_t* rtable_lock;
+
+	/* aggregated copy of the rtable that is written to hardware, guarded by the rtable lock */
+	struct fib_node* fib_trie;
+	struct fib_next_hop* fib_next_hops;
+	node* fib;
+	uint32_t fib_gen;
+	uint32_t fib_overflow:1;
 	
 	node* atable;
 	pthread_rwlock_t* atable_lock;
 	
 	node* rstable;
-	pthread_t* rstable_thread;
 	pthread_mutex_t* rstable_mutex;
 	pthread_rwlock_t* rstable_lock;
 
@@ -261,20 +474,27 @@ struct router_state {
 	node* pwospf_lsu_queue;
 	pthread_mutex_t* pwospf_lsu_queue_lock;
 
-	node* nat_table;
-	pthread_t* nat_maintenance_thread;
+	struct nat_table* nat_table;
 	pthread_mutex_t* nat_table_mutex;
-	pthread_cond_t* nat_table_cond;
 
-	pthread_t* arp_thread;
-	pthread_t *pwospf_hello_thread;
-	pthread_t *pwospf_lsu_thread;
-	pthread_t *pwospf_lsu_timeout_thread;
+	/* periodic and per entry timers, run by a single executor */
+	struct timer_wheel* timers;
+	pthread_t* timer_thread;
 
 	pthread_t* pwospf_dijkstra_thread;
 	pthread_mutex_t* dijkstra_mutex;
 	pthread_cond_t* dijkstra_cond;
 
+	/* spf throttle, guarded by the dijkstra_mutex */
+	uint32_t spf_start_ms;
+	uint32_t spf_hold_ms;
+	uint32_t spf_max_wait_ms;
+	uint32_t spf_cur_hold_ms;
+	uint64_t spf_last_run_ms;
+	uint32_t spf_runs;
+	uint32_t spf_coalesced;
+	uint32_t spf_last_run_us;
+
 	pthread_t* pwospf_lsu_bcast_thread;
 	pthread_mutex_t* pwospf_lsu_bcast_mutex;
 	pthread_cond_t* pwospf_lsu_bcast_cond;
@@ -286,7 +506,6 @@ struct router_state {
 	pthread_cond_t* www_cond;
 
 	/* stats related */
-	pthread_t* stats_thread;
 	pthread_mutex_t* stats_mutex;
 	struct timeval stats_last_time;
 	uint32_t stats_last[8][4];
@@ -295,7 +514,24 @@ struct router_state {
 	pthread_mutex_t* local_ip_filter_list_mutex;
 	node* local_ip_filter_list;
 
-	pthread_mutex_t* log_dumper_mutex;
+	/* warm restart snapshot, guarded by the snapshot_mutex */
+	pthread_mutex_t* snapshot_mutex;
+	char snapshot_path[SNAPSHOT_PATH_LEN];
+	uint32_t snapshot_ready:1;	/* restore has run, writing before it would clobber the file */
+	time_t snapshot_last_write;
+	uint32_t snapshot_writes;
+	uint32_t snapshot_failures;
+	uint32_t snapshot_restored[SNAPSHOT_NUM_SECTIONS];
+	uint32_t snapshot_aged[SNAPSHOT_NUM_SECTIONS];	/* too old to restore */
+
+	/* flow telemetry cache and its ipfix exporter */
+	struct flow_cache* flow_cache;
+
+	/* why packets were dropped */
+	struct drop_stats* drop_stats;
+
+	/* where forwarding time goes */
+	struct latency_stats* latency_stats;
 };
 typedef struct router_state router_state;
 
@@ -307,9 +543,67 @@ struct rtable_entry {
   	char iface[32];
   	unsigned int is_static:1;
   	unsigned int is_active:1;
+  	unsigned int is_inter_area:1;
 };
 typedef struct rtable_entry rtable_entry;
 
+/** FIB AGGREGATION STRUCTS **/
+#define FIB_MAX_NEXT_HOPS 64
+#define FIB_NO_ROUTE -1
+
+struct fib_next_hop {
+	struct in_addr gw;
+	char iface[32];
+	unsigned int refs;
+};
+typedef struct fib_next_hop fib_next_hop;
+
+struct fib_node {
+	struct fib_node* child[2];
+	struct fib_node* parent;
+	int nh;					/* index into fib_next_hops of the route at this prefix */
+	int inherited;			/* next hop inherited from the closest covering route */
+	uint64_t set;			/* candidate next hops for the subtree (ORTC pass 2) */
+	uint32_t gen;
+	unsigned int has_hole:1;	/* some address below this node has no route */
+	unsigned int dirty:1;
+};
+typedef struct fib_node fib_node;
+
+/** TIMER WHEEL STRUCTS **/
+#define TIMER_L0_BITS 8
+#define TIMER_LN_BITS 6
+#define TIMER_L0_SIZE (1 << TIMER_L0_BITS)
+#define TIMER_LN_SIZE (1 << TIMER_LN_BITS)
+#define TIMER_LEVELS 3
+
+/* key is whatever the owner uses to find its entry, id lets it ignore stale timers */
+typedef void (*timer_fn)(struct router_state* rs, uint32_t key, uint32_t id);
+
+struct timer_entry {
+	struct timer_entry* next;
+	uint64_t expires;		/* ms on the monotonic clock */
+	uint32_t period;		/* ms, 0 for one shot */
+	timer_fn fn;
+	uint32_t key;
+	uint32_t id;
+};
+typedef struct timer_entry timer_entry;
+
+struct timer_wheel {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t now;			/* next tick to run */
+	uint64_t next_wakeup;	/* 0 if sleeping until signalled */
+	uint32_t next_id;
+	uint32_t count;
+	timer_entry* l0[TIMER_L0_SIZE];
+	timer_entry* ln[TIMER_LEVELS][TIMER_LN_SIZE];
+	uint64_t fired;
+	uint64_t wakeups;
+};
+typedef struct timer_wheel timer_wheel;
+
 /** ATABLE STRUCT **/
 struct atable_entry {
   	struct in_addr ip;
@@ -338,6 +632,7 @@ struct arp_cache_entry {
 	unsigned char arp_ha[ETH_ADDR_LEN];	/* target hardware address */
 	time_t TTL;							/* time expiration of entry */
 	int is_static;
+	uint32_t timer_id;					/* pending expiry timer, 0 if none */
 };
 typedef struct arp_cache_entry arp_cache_entry;
 
@@ -407,6 +702,7 @@ struct iface_entry {
     time_t last_sent_hello;
     node* nbr_routers;
     uint8_t is_wan;
+    uint32_t area_id;	/* pwospf area the interface is in */
 };
 typedef struct iface_entry iface_entry;
 
@@ -414,19 +710,28 @@ struct nbr_router {
 	uint32_t router_id;	/* net byte order */
 	struct in_addr ip;	/* net byte order */
 	time_t last_rcvd_hello;
+	uint32_t timer_id;	/* pending dead timer */
+	uint64_t last_rcvd_liveness;	/* ms, timer_now_ms() */
+	uint32_t liveness_detect;	/* ms without liveness before it is down, 0 until we hear one */
 };
 typedef struct nbr_router nbr_router;
 
 /*
  * Definitions for Dijkstra's Algorithm
  */
+#define PWOSPF_MAX_NEXT_HOPS 4	/* one per port, as many as an atable entry holds */
+
  struct pwospf_interface {
  	struct in_addr subnet;
  	struct in_addr mask;
  	uint32_t router_id;
  	uint32_t is_active:1;
+ 	uint32_t is_summary:1;	/* advertised by an ABR for another area, see PWOSPF_ADV_SUMMARY */
  	uint32_t rx_rate;
  	uint32_t tx_rate;
+ 	double load;			/* our links only, damped utilization 0..1 */
+ 	time_t load_changed;	/* our links only, when the advertised cost last moved */
+ 	time_t rate_changed;	/* our links only, when the advertised rates last moved */
  };
 
  typedef struct pwospf_interface pwospf_interface;
@@ -436,11 +741,15 @@ typedef struct nbr_router nbr_router;
  	uint32_t area_id;
 // 	uint16_t lsu_int;
  	uint16_t seq;
+	uint64_t digest;	/* of the advertisements in its last lsu, see lsdb_digest */
 	time_t last_update;
 	uint32_t distance;
 	unsigned int shortest_path_found:1;
 	node* interface_list;
 	struct pwospf_router* prev_router;
+	uint32_t next_rids[PWOSPF_MAX_NEXT_HOPS];	/* first hops of all equal cost paths to us */
+	uint8_t num_next_rids;
+	uint32_t timer_id;	/* pending age out timer */
  };
 
  typedef struct pwospf_router pwospf_router;
@@ -471,19 +780,329 @@ struct nat_ip_port_pair {
 typedef struct nat_ip_port_pair nat_ip_port_pair;
 
 
+/*
+ * Precomputed rewrite of a translated tcp, udp or icmp echo packet, the
+ * deltas are ones' complement adjustments applied to the existing checksums
+ */
+struct nat_rewrite {
+	uint32_t ip;		/* NETWORK BYTE ORDER */
+	uint16_t port;		/* NETWORK BYTE ORDER */
+	uint16_t ip_delta;
+	uint16_t l4_delta;
+	uint8_t ip_off;		/* from the start of the ip header */
+	uint8_t port_off;	/* from the start of the l4 header */
+	uint8_t sum_off;	/* from the start of the l4 header */
+	uint8_t sum_optional;	/* udp, a zero checksum is left alone */
+};
+
+typedef struct nat_rewrite nat_rewrite;
+
+#define NAT_SHARD_BITS 3
+#define NAT_NUM_SHARDS (1 << NAT_SHARD_BITS)
+#define NAT_HW_ROWS 16
+#define NAT_MAINTENANCE_INTERVAL 1000	/* ms, the hit averages decay per run as if a second passed */
+
 struct nat_entry {
 	nat_ip_port_pair nat_ext;
 	nat_ip_port_pair nat_int;
+	uint8_t proto;
 	uint32_t last_hits;
 	time_t last_hits_time;
-	uint32_t hits;
+	uint32_t hits;			/* hit_count when the average last stepped */
+	uint32_t hit_count;		/* under the shard lock, which translation holds anyway */
 	double avg_hits_per_second;
+	uint32_t rate_epoch;		/* shard epoch the average last stepped in */
+	uint32_t active_epoch;		/* on the shard's active list if this is its epoch */
+	uint32_t timer_id;		/* pending idle check, 0 for static entries */
 	uint8_t hw_row;
 	uint8_t is_static;
+	uint8_t shard;
+	uint8_t tcp_state;
+	uint8_t tcp_fin;		/* sides that sent a FIN, bit 1 << NAT_EXTERNAL or NAT_INTERNAL */
+	nat_rewrite rewrite[2];		/* indexed by the side a packet arrives on */
+
+	/* nat_shard linkage */
+	struct nat_entry* int_next;	/* internal hash chain, free list when unused */
+	struct nat_entry* ext_next;	/* external hash chain */
+	struct nat_entry* prev;		/* list of entries in use */
+	struct nat_entry* next;
+	struct nat_entry* active_next;	/* hit this epoch */
+	struct nat_entry** active_pprev;
 };
 
 typedef struct nat_entry nat_entry;
 
+#define NAT_TABLE_INITIAL_BUCKETS 128	/* per shard */
+#define NAT_SLAB_SIZE 256
+
+/** NAT EXTERNAL PORT ALLOCATOR **/
+#define NAT_PORT_WORDS (65536 / 64)
+#define NAT_DEFAULT_PORT_LO 1025
+#define NAT_DEFAULT_PORT_HI 65535
+#define NAT_POOL_TCP 0
+#define NAT_POOL_UDP 1
+#define NAT_POOL_ICMP 2
+#define NAT_NUM_POOLS 3
+
+struct nat_port_pool {
+	uint16_t lo;			/* HOST BYTE ORDER, inclusive */
+	uint16_t hi;
+	uint32_t cursor;		/* allocation resumes here */
+	uint32_t in_use;
+	uint32_t high_water;
+	uint32_t failures;
+	uint64_t used[NAT_PORT_WORDS];
+};
+typedef struct nat_port_pool nat_port_pool;
+
+/*
+ * Entries live in the shard picked by a hash of (int ip, int port, proto), are
+ * carved out of that shard's NAT_SLAB_SIZE slabs and indexed there by
+ * (int ip, int port, proto) and (ext port, proto).
+ */
+struct nat_shard {
+	pthread_mutex_t lock;
+	nat_entry** int_buckets;
+	nat_entry** ext_buckets;
+	uint32_t num_buckets;		/* power of two */
+	uint32_t num_entries;
+	nat_entry* entries;
+	nat_entry* free_entries;
+	node* slabs;
+
+	/* entries hit since maintenance last ran, the only ones it has to look at */
+	nat_entry* active;
+	uint32_t epoch;			/* seconds of maintenance, starts at 1 */
+};
+
+typedef struct nat_shard nat_shard;
+
+/*
+ * ext_owner maps an external port to the shard holding it so inbound packets
+ * lock only that shard, it is read without a lock and rechecked under it.
+ * Lock order: nat_table_mutex, shards in index order, pool_lock.
+ */
+struct nat_table {
+	nat_shard shards[NAT_NUM_SHARDS];
+	uint8_t ext_owner[NAT_NUM_POOLS][65536];	/* shard + 1, 0 if unowned */
+	pthread_mutex_t pool_lock;
+	nat_port_pool pools[NAT_NUM_POOLS];
+	uint8_t preserve_parity;
+
+	/* hw nat rows, guarded by nat_table_mutex */
+	nat_entry* hw_rows[NAT_HW_ROWS];	/* occupant of each row, NULL if free */
+	uint32_t hw_stale;			/* rows still holding a removed entry */
+};
+
+typedef struct nat_table nat_table;
+
+/** FLOW TELEMETRY CACHE **/
+struct flow_key {
+	uint32_t src;		/* NETWORK BYTE ORDER */
+	uint32_t dst;		/* NETWORK BYTE ORDER */
+	uint16_t sport;		/* NETWORK BYTE ORDER, icmp type and code go in dport */
+	uint16_t dport;		/* NETWORK BYTE ORDER */
+	uint8_t proto;
+	uint8_t in_if;		/* ifindex, see flow_ifindex */
+	uint8_t out_if;
+	uint8_t reserved;
+};
+typedef struct flow_key flow_key;
+
+struct flow_entry {
+	flow_key key;
+	uint32_t hash;
+	uint8_t tcp_flags;	/* or of every sampled packet */
+	uint64_t first;		/* ms, timer_now_ms() */
+	uint64_t last;
+	uint64_t packets;	/* sampled, not scaled */
+	uint64_t bytes;
+	volatile uint32_t state;	/* FLOW_ENTRY_*, changed by compare and swap */
+	struct flow_entry* next;	/* hash chain, free list when unused */
+	struct flow_entry* dead_next;	/* on the worker's dead list */
+};
+typedef struct flow_entry flow_entry;
+
+/*
+ * A worker is written by the forwarding thread owning its slot, the sweep only
+ * claims expired entries and hands them back on the dead list, see flow_account.
+ * The lock serializes the threads sharing the WORKER_SHARED worker, nobody else
+ * takes it. The counters are read by the cli without a lock.
+ */
+struct flow_worker {
+	pthread_mutex_t lock;
+	flow_entry* buckets[FLOW_HASH_BUCKETS];
+	flow_entry* entries;		/* FLOW_MAX_ENTRIES, allocated once */
+	flow_entry* free_entries;
+	flow_entry* volatile dead;	/* claimed by the sweep, not yet unlinked */
+	uint32_t clear_gen;		/* flow_cache clear_gen when last cleared */
+	uint32_t num_entries;
+	uint32_t sample_count;
+	uint64_t packets;		/* seen while enabled */
+	uint64_t created;
+	uint64_t overflows;		/* sampled packets of new flows with the cache full */
+};
+typedef struct flow_worker flow_worker;
+
+/*
+ * Packets read enabled, sample and clear_gen without a lock, everything else
+ * is only touched by the sweep and the cli under config_lock.
+ */
+struct flow_cache {
+	flow_worker workers[NUM_WORKERS + 1];	/* by worker_slot */
+	pthread_mutex_t config_lock;
+	volatile uint32_t enabled;	/* a collector is set */
+	volatile uint32_t clear_gen;	/* bumped when export goes off, owners clear their worker */
+	volatile uint32_t sample;	/* 1 in sample packets, 0 or 1 is all */
+	struct sockaddr_in collector;
+	int sockfd;
+	uint32_t active_timeout;	/* seconds */
+	uint32_t inactive_timeout;
+	uint32_t export_rate;		/* records per second */
+
+	/* exporter */
+	uint32_t sequence;		/* data records sent */
+	time_t last_template;
+	uint32_t next_worker;		/* sweep starts here so a busy worker can't starve the rest */
+	uint64_t exported;
+	uint64_t deferred;		/* expired but held back by the export rate */
+	uint64_t messages;
+	uint64_t send_errors;
+};
+typedef struct flow_cache flow_cache;
+
+/** DROP ACCOUNTING **/
+/* written only by the thread owning the slot, a line of its own so they don't share */
+struct drop_worker {
+	uint64_t count[DROP_MAX_IFACES][DROP_NUM_REASONS];
+} __attribute__ ((aligned (64)));
+typedef struct drop_worker drop_worker;
+
+/* what a reader saw last time, rates are the difference */
+struct drop_reader {
+	uint64_t last[DROP_MAX_IFACES][DROP_NUM_REASONS];
+	uint64_t last_ms;	/* timer_now_ms(), 0 before the first read */
+};
+typedef struct drop_reader drop_reader;
+
+struct drop_stats {
+	drop_worker workers[NUM_WORKERS + 1];	/* by worker_slot */
+	pthread_mutex_t reader_lock;
+	drop_reader readers[DROP_NUM_READERS];
+};
+typedef struct drop_stats drop_stats;
+
+/** PIPELINE STAGE LATENCY **/
+/* log linear buckets, see latency_bucket */
+struct latency_hist {
+	uint64_t count[LAT_NUM_BUCKETS];
+	uint64_t sum_ns;
+	uint64_t max_ns;
+};
+typedef struct latency_hist latency_hist;
+
+struct latency_worker {
+	latency_hist stage[LAT_NUM_STAGES];
+} __attribute__ ((aligned (64)));
+typedef struct latency_worker latency_worker;
+
+struct latency_stats {
+	latency_worker workers[NUM_WORKERS + 1];	/* by worker_slot */
+	volatile uint32_t enabled;
+};
+typedef struct latency_stats latency_stats;
+
+/** WARM RESTART SNAPSHOT FILE **/
+/*
+ * The file is this header followed by each section as an array of fixed size records, so
+ * it is read back by mapping it and indexing in place. Addresses keep the byte order they
+ * have in memory, the file is only meant to be read back by the router that wrote it.
+ */
+struct snapshot_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t router_id;
+	uint32_t reserved;
+	int64_t written;	/* time_t */
+	uint32_t offset[SNAPSHOT_NUM_SECTIONS];	/* from the start of the file */
+	uint32_t count[SNAPSHOT_NUM_SECTIONS];
+} __attribute__ ((packed)) ;
+typedef struct snapshot_hdr snapshot_hdr;
+
+struct snapshot_arp {
+	uint32_t ip;
+	uint8_t ha[ETH_ADDR_LEN];
+	uint8_t is_static;
+	uint8_t reserved;
+	int64_t refreshed;	/* arp_cache_entry.TTL */
+} __attribute__ ((packed)) ;
+typedef struct snapshot_arp snapshot_arp;
+
+struct snapshot_nat {
+	uint32_t ext_ip;
+	uint32_t int_ip;
+	uint16_t ext_port;
+	uint16_t int_port;
+	uint8_t proto;
+	uint8_t is_static;
+	uint8_t tcp_state;
+	uint8_t tcp_fin;
+	int64_t last_hits_time;
+} __attribute__ ((packed)) ;
+typedef struct snapshot_nat snapshot_nat;
+
+/* one per nat_table.pools, in order */
+struct snapshot_nat_pool {
+	uint16_t lo;
+	uint16_t hi;
+	uint32_t cursor;
+} __attribute__ ((packed)) ;
+typedef struct snapshot_nat_pool snapshot_nat_pool;
+
+/* its num_links links follow those of the routers before it in the link section */
+struct snapshot_router {
+	uint32_t router_id;
+	uint32_t area_id;
+	uint16_t seq;
+	uint16_t num_links;
+	uint32_t reserved;
+	uint64_t digest;
+	int64_t last_update;
+} __attribute__ ((packed)) ;
+typedef struct snapshot_router snapshot_router;
+
+struct snapshot_link {
+	uint32_t subnet;
+	uint32_t mask;
+	uint32_t router_id;
+	uint32_t rx_rate;
+	uint32_t tx_rate;
+	uint8_t is_active;
+	uint8_t is_summary;
+	uint16_t reserved;
+} __attribute__ ((packed)) ;
+typedef struct snapshot_link snapshot_link;
+
+/* dynamic routes only, the static ones come from the rtable file */
+struct snapshot_route {
+	uint32_t ip;
+	uint32_t gw;
+	uint32_t mask;
+	char iface[IF_LEN];
+	uint8_t is_active;
+	uint8_t is_inter_area;
+	uint16_t reserved;
+} __attribute__ ((packed)) ;
+typedef struct snapshot_route snapshot_route;
+
+struct snapshot_alpha {
+	uint32_t ip;
+	uint32_t mask;
+	uint32_t next_hop[4];
+	double alpha[4];
+} __attribute__ ((packed)) ;
+typedef struct snapshot_alpha snapshot_alpha;
+
 /* STRUCT CONTAINING INFO FOR THREAD SPAWED TO SATISFY A CLIENTS WWW REQUEST **/
 struct www_client_thread_info {
 	int sockfd;
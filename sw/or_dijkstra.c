@@ -12,6 +12,8 @@
 #include "or_rstable.h"
 #include "or_iface.h"
 #include "or_output.h"
+#include "or_timer.h"
+#include "or_lsdb.h"
 #include <assert.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
@@ -22,11 +24,7 @@
 #include <errno.h>
 
 
-pwospf_router* get_shortest(node* pwospf_router_list);
-void update_neighbor_distance(pwospf_router* w, node* pwospf_router_list);
 node* build_route_wrapper_list(uint32_t our_rid, node* pwospf_router_list);
-void add_route_wrappers(uint32_t our_rid, node** head, pwospf_router* r);
-node* get_route_wrapper(node* head, struct in_addr* subnet, struct in_addr* mask);
 iface_entry* get_iface_by_rid(uint32_t rid, node* if_list);
 iface_entry* get_iface_by_subnet_mask(struct in_addr* subnet, struct in_addr* mask, node* if_list);
 void print_wrapper_list(node* route_wrapper_list);
@@ -35,55 +33,87 @@ struct route_wrapper {
 	rtable_entry entry; /* entry being wrapped, lacking next hop ip */
 	uint32_t distance; /* distance from source in hops */
 	uint32_t next_rid; /* next router id from source */
+	uint32_t next_rids[PWOSPF_MAX_NEXT_HOPS]; /* every equal cost next router, next_rid first */
+	uint8_t num_next_rids;
 	uint8_t directly_connected:1; /* is this route directly connected to us? */
 };
 typedef struct route_wrapper route_wrapper;
 
+/*
+ * SPF runs on a dense copy of the router list built once per run: routers are numbered
+ * in list order, an open addressed hash maps router ids to those numbers, and each
+ * router's usable links sit in one adjacency array. The candidate set is a binary heap
+ * ordered by (distance, number), so a full run settles routers in exactly the order the
+ * old list scan picked them and ties still break the same way.
+ *
+ * The graph, distances and parents of the last run are kept in an spf_tree. The next run
+ * compares every router's links against the kept ones and only recomputes what the
+ * changes can reach (a simplified Dynamic SPT, Narvaez et al.):
+ *  - a router whose tree edge from its parent disappeared or got dearer loses its
+ *    distance, along with its whole subtree
+ *  - those routers are seeded from their cheapest link out of the intact part of the tree
+ *  - links that are new or got cheaper seed the router at their far end
+ *  - the heap then relaxes outward from the seeds only
+ *  - equal cost next hops are kept too, and only redone for routers whose distance or
+ *    links in changed and those after them on a shortest path, see spf_next_hops
+ * The kept tree never points at pwospf_router structs, those may be freed in between.
+ */
+struct spf_graph {
+	unsigned int num_routers;
+	pwospf_router** routers;	/* only valid during the run that built it */
+	uint32_t* rids;
+	int* rid_index;				/* router number by rid hash, -1 if empty */
+	unsigned int rid_index_mask;
+	unsigned int* adj_start;	/* links of router i are adj_start[i] .. adj_start[i+1] - 1 */
+	unsigned int* adj_to;
+	uint32_t* adj_cost;
+	unsigned int* rev_start;	/* links into router i are rev_start[i] .. rev_start[i+1] - 1 */
+	unsigned int* rev_from;
+	unsigned int* rev_link;		/* the same link's slot in adj_to */
+};
+typedef struct spf_graph spf_graph;
+
+struct spf_heap {
+	unsigned int size;
+	unsigned int* items;		/* router numbers */
+	int* pos;					/* slot of each router in items, -1 if not queued */
+	uint32_t* dist;
+};
+typedef struct spf_heap spf_heap;
+
+struct spf_tree {
+	unsigned int valid:1;
+	uint32_t source;
+	spf_graph g;
+	uint32_t* dist;
+	int* parent;				/* router number, -1 for the source and unreachable routers */
+	uint32_t* hops;				/* equal cost first hops, one bit per link out of the source */
+	unsigned int last_settled;	/* routers the last run took off the heap */
+};
+
 /*
  * NOT thread safe, lock the pwospf_router_list_lock for writes
  * on the router_state object before passing it in, also the if_list
- * lock for reads.
+ * lock for reads. dijkstra_thread passes private copies of both instead.
+ *
+ * If multipath is not NULL, it is set to a list of atable_entry, one for each route
+ * with equal cost next hops out of more than one port, carrying the next hop per port
+ * and an even split of the alphas, for compute_atable to seed new destinations with.
  *
  * Returns: a linked list representing the dynamic rtable
  *
  */
 
-node* compute_rtable(uint32_t our_router_id, node* pwospf_router_list, node* if_list) {
-	/* initialize all the entriest to their max distance, except us */
-	node* cur = pwospf_router_list;
-	pwospf_router* r = NULL;
-	pwospf_router* r_shortest = NULL;
+node* compute_rtable(spf_tree* tree, uint32_t our_router_id, node* pwospf_router_list, node* if_list, node** multipath) {
+	node* cur = NULL;
+	node* multipath_tail = NULL;
+	unsigned int k;
 
-	while (cur) {
-		r = (pwospf_router*)cur->data;
-		if (r->router_id == our_router_id) {
-			r->distance = 0;
-			r->shortest_path_found = 1;
-		} else if (r->router_id != 0) {
-			r->distance = 0xFFFFFFFF;
-			r->shortest_path_found = 0;
-		}
-
-		cur = cur->next;
+	if (multipath) {
+		*multipath = NULL;
 	}
 
-	/* Set our router as the shortest */
-	r_shortest = get_router_by_rid(our_router_id, pwospf_router_list);
-	//printf("or_dijkstra.c: r_shortest %u %u %d\n", r_shortest->distance, r_shortest->router_id, r_shortest->last_update);
-	
-	while (r_shortest) {
-		//printf("or_dijkstra.c: get_shortest: r_shortest %u %u\n", r_shortest->distance, r_shortest->router_id);
-		/* add this router to N' */
-		r_shortest->shortest_path_found = 1;
-
-		/* update the distances to our neighbors */
-		update_neighbor_distance(r_shortest, pwospf_router_list);
-
-		/* get the next router with the shortest distance */
-		r_shortest = get_shortest(pwospf_router_list);
-		
-		//printf("get_shortest\n");
-	}
+	compute_spf(tree, our_router_id, pwospf_router_list);
 
 	/* now have the shortest path to each router, build the temporary route table */
 	node* route_wrapper_list = build_route_wrapper_list(our_router_id, pwospf_router_list);
@@ -93,6 +123,7 @@ node* compute_rtable(uint32_t our_router_id, node* pwospf_router_list, node* if_
 	 * and need to lose the wrapping
 	 */
 	node* route_list = NULL;
+	node* route_tail = NULL;
 
 	cur = route_wrapper_list;
 	while (cur) {
@@ -126,6 +157,46 @@ node* compute_rtable(uint32_t our_router_id, node* pwospf_router_list, node* if_
 		new_entry->is_active = 1;
 		new_entry->is_static = 0;
 
+		if (multipath && !wrapper->directly_connected && (wrapper->num_next_rids > 1)) {
+			atable_entry* ae = (atable_entry*)calloc(1, sizeof(atable_entry));
+			unsigned int num_ports = 0;
+			ae->ip = new_entry->ip;
+			ae->mask = new_entry->mask;
+
+			for (k = 0; k < wrapper->num_next_rids; ++k) {
+				iface_entry* hop_iface = get_iface_by_rid(wrapper->next_rids[k], if_list);
+				int port = hop_iface ? atable_port_of(hop_iface->name) : -1;
+				if ((port < 0) || ae->next_hop_ip[port].s_addr) {
+					/* not one of ours, or another neighbor on a port we already use */
+					continue;
+				}
+
+				nbr_router* nbr = get_nbr_by_rid(hop_iface, wrapper->next_rids[k]);
+				if (nbr) {
+					ae->next_hop_ip[port].s_addr = nbr->ip.s_addr;
+					++num_ports;
+				}
+			}
+
+			if (num_ports > 1) {
+				for (k = 0; k < 4; ++k) {
+					ae->alpha[k] = ae->next_hop_ip[k].s_addr ? (1.0 / num_ports) : 0;
+				}
+
+				node* mp = node_create();
+				mp->data = ae;
+				if (!(*multipath)) {
+					*multipath = mp;
+				} else {
+					multipath_tail->next = mp;
+					mp->prev = multipath_tail;
+				}
+				multipath_tail = mp;
+			} else {
+				free(ae);
+			}
+		}
+
 		/* grab a new node, add it to the list */
 		node* temp = node_create();
 		temp->data = new_entry;
@@ -133,8 +204,10 @@ node* compute_rtable(uint32_t our_router_id, node* pwospf_router_list, node* if_
 		if (!route_list) {
 			route_list = temp;
 		} else {
-			node_push_back(route_list, temp);
+			route_tail->next = temp;
+			temp->prev = route_tail;
 		}
+		route_tail = temp;
 
 		cur = cur->next;
 	}
@@ -163,152 +236,953 @@ pwospf_router* get_router_by_rid(uint32_t rid, node* pwospf_router_list) {
 	return NULL;
 }
 
-pwospf_router* get_shortest(node* pwospf_router_list) {
-	pwospf_router* shortest_router = NULL;
-	uint32_t shortest_distance = 0xFFFFFFFF;
+static unsigned int spf_hash(uint32_t rid) {
+	return rid * 2654435761U;
+}
 
-	node* cur = pwospf_router_list;		
-	while (cur) {
+static int spf_index_of(spf_graph* g, uint32_t rid) {
+	unsigned int slot = spf_hash(rid) & g->rid_index_mask;
+	while (g->rid_index[slot] != -1) {
+		if (g->rids[g->rid_index[slot]] == rid) {
+			return g->rid_index[slot];
+		}
+		slot = (slot + 1) & g->rid_index_mask;
+	}
+
+	return -1;
+}
+
+/*
+ * Numbers the routers, indexes them by rid and lays out their active links,
+ * dropping links to routers we have no LSU for yet.
+ */
+static void spf_graph_build(spf_graph* g, node* pwospf_router_list) {
+	unsigned int n = 0;
+	unsigned int num_links = 0;
+	unsigned int i;
+	node* cur;
+
+	bzero(g, sizeof(spf_graph));
+	for (cur = pwospf_router_list; cur; cur = cur->next) {
 		pwospf_router* r = (pwospf_router*)cur->data;
-		if ((!r->shortest_path_found) && (r->distance < shortest_distance)) {
-			shortest_router = r;
-			shortest_distance = r->distance;
+		if (r->router_id != 0) {
+			++n;
+			num_links += node_length(r->interface_list);
 		}
-		//printf("or_dijkstra.c: shortest_router: %u, shortest_distance: %u, router: %d, r->distance: %d\n", shortest_router, shortest_distance, r, r->distance);
-		cur = cur->next;
 	}
 
-	return shortest_router;
+	g->num_routers = n;
+	g->routers = (pwospf_router**)malloc((n + 1) * sizeof(pwospf_router*));
+	g->rids = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+
+	unsigned int size = 4;
+	while (size < 2 * n) {
+		size <<= 1;
+	}
+	g->rid_index_mask = size - 1;
+	g->rid_index = (int*)malloc(size * sizeof(int));
+	memset(g->rid_index, 0xFF, size * sizeof(int));
+
+	n = 0;
+	for (cur = pwospf_router_list; cur; cur = cur->next) {
+		pwospf_router* r = (pwospf_router*)cur->data;
+		if (r->router_id == 0) {
+			continue;
+		}
+
+		unsigned int slot = spf_hash(r->router_id) & g->rid_index_mask;
+		while (g->rid_index[slot] != -1) {
+			slot = (slot + 1) & g->rid_index_mask;
+		}
+		g->rid_index[slot] = n;
+		g->rids[n] = r->router_id;
+		g->routers[n++] = r;
+	}
+
+	g->adj_start = (unsigned int*)malloc((n + 1) * sizeof(unsigned int));
+	g->adj_to = (unsigned int*)malloc((num_links + 1) * sizeof(unsigned int));
+	g->adj_cost = (uint32_t*)malloc((num_links + 1) * sizeof(uint32_t));
+
+	num_links = 0;
+	for (i = 0; i < n; ++i) {
+		g->adj_start[i] = num_links;
+		for (cur = g->routers[i]->interface_list; cur; cur = cur->next) {
+			pwospf_interface* iface = (pwospf_interface*)cur->data;
+			if ((iface->router_id == 0) || !iface->is_active) {
+				continue;
+			}
+
+			int v = spf_index_of(g, iface->router_id);
+			if (v >= 0) {
+				g->adj_to[num_links] = v;
+				g->adj_cost[num_links] = iface->tx_rate;
+				++num_links;
+			}
+		}
+	}
+	g->adj_start[n] = num_links;
+
+	/* the same links by the router they lead to, for next hops */
+	g->rev_start = (unsigned int*)calloc(n + 2, sizeof(unsigned int));
+	g->rev_from = (unsigned int*)malloc((num_links + 1) * sizeof(unsigned int));
+	g->rev_link = (unsigned int*)malloc((num_links + 1) * sizeof(unsigned int));
+	for (i = 0; i < num_links; ++i) {
+		g->rev_start[g->adj_to[i] + 1]++;
+	}
+	for (i = 0; i < n; ++i) {
+		g->rev_start[i + 1] += g->rev_start[i];
+	}
+	unsigned int* fill = (unsigned int*)malloc((n + 1) * sizeof(unsigned int));
+	memcpy(fill, g->rev_start, (n + 1) * sizeof(unsigned int));
+	for (i = 0; i < n; ++i) {
+		unsigned int k;
+		for (k = g->adj_start[i]; k < g->adj_start[i + 1]; ++k) {
+			unsigned int slot = fill[g->adj_to[k]]++;
+			g->rev_from[slot] = i;
+			g->rev_link[slot] = k;
+		}
+	}
+	free(fill);
+}
+
+static void spf_graph_free(spf_graph* g) {
+	free(g->routers);
+	free(g->rids);
+	free(g->rid_index);
+	free(g->adj_start);
+	free(g->adj_to);
+	free(g->adj_cost);
+	free(g->rev_start);
+	free(g->rev_from);
+	free(g->rev_link);
+	bzero(g, sizeof(spf_graph));
+}
+
+static int spf_heap_before(spf_heap* h, unsigned int a, unsigned int b) {
+	return (h->dist[a] < h->dist[b]) || ((h->dist[a] == h->dist[b]) && (a < b));
+}
+
+static void spf_heap_swap(spf_heap* h, unsigned int i, unsigned int j) {
+	unsigned int t = h->items[i];
+	h->items[i] = h->items[j];
+	h->items[j] = t;
+	h->pos[h->items[i]] = i;
+	h->pos[h->items[j]] = j;
+}
+
+static void spf_heap_up(spf_heap* h, unsigned int i) {
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+		if (!spf_heap_before(h, h->items[i], h->items[parent])) {
+			break;
+		}
+		spf_heap_swap(h, i, parent);
+		i = parent;
+	}
+}
+
+static void spf_heap_down(spf_heap* h, unsigned int i) {
+	while (1) {
+		unsigned int best = i;
+		unsigned int child = (2 * i) + 1;
+		if ((child < h->size) && spf_heap_before(h, h->items[child], h->items[best])) {
+			best = child;
+		}
+		if ((child + 1 < h->size) && spf_heap_before(h, h->items[child + 1], h->items[best])) {
+			best = child + 1;
+		}
+		if (best == i) {
+			break;
+		}
+		spf_heap_swap(h, i, best);
+		i = best;
+	}
+}
+
+/* queues v, or moves it up if its distance dropped while queued */
+static void spf_heap_push(spf_heap* h, unsigned int v) {
+	if (h->pos[v] == -1) {
+		h->items[h->size] = v;
+		h->pos[v] = h->size;
+		++(h->size);
+	}
+	spf_heap_up(h, h->pos[v]);
+}
+
+static unsigned int spf_heap_pop(spf_heap* h) {
+	unsigned int top = h->items[0];
+	h->pos[top] = -1;
+	--(h->size);
+	if (h->size > 0) {
+		h->items[0] = h->items[h->size];
+		h->pos[h->items[0]] = 0;
+		spf_heap_down(h, 0);
+	}
+
+	return top;
+}
+
+/* relaxes outward from whatever is queued, returns the number of routers settled */
+static unsigned int spf_relax(spf_graph* g, spf_heap* h, int* parent) {
+	unsigned int settled = 0;
+	unsigned int i;
+
+	while (h->size > 0) {
+		unsigned int w = spf_heap_pop(h);
+		++settled;
+
+		/* if the distance to v is shorter through w, update it */
+		for (i = g->adj_start[w]; i < g->adj_start[w + 1]; ++i) {
+			unsigned int v = g->adj_to[i];
+			if (h->dist[w] + g->adj_cost[i] < h->dist[v]) {
+				h->dist[v] = h->dist[w] + g->adj_cost[i];
+				parent[v] = w;
+				spf_heap_push(h, v);
+			}
+		}
+	}
+
+	return settled;
+}
+
+/* do router i of the new graph and router old_i of the kept one have the same links? */
+static int spf_links_equal(spf_graph* g, unsigned int i, spf_graph* old, unsigned int old_i) {
+	unsigned int len = g->adj_start[i + 1] - g->adj_start[i];
+	unsigned int k;
+
+	if (len != (old->adj_start[old_i + 1] - old->adj_start[old_i])) {
+		return 0;
+	}
+
+	for (k = 0; k < len; ++k) {
+		unsigned int a = g->adj_start[i] + k;
+		unsigned int b = old->adj_start[old_i] + k;
+		if ((g->adj_cost[a] != old->adj_cost[b]) || (g->rids[g->adj_to[a]] != old->rids[old->adj_to[b]])) {
+			return 0;
+		}
+	}
+
+	return 1;
 }
 
 /*
- * Helper function to update distances of routers attached to w's interfaces
+ * Carries the kept tree over to the new graph and invalidates and seeds what changed,
+ * leaving the heap ready for spf_relax. Fills in each router's number in the kept graph
+ * (-1 if new) and whether its links changed, spf_next_hops goes by them too.
  */
-void update_neighbor_distance(pwospf_router* w, node* pwospf_router_list) {
+static void spf_seed_changes(spf_tree* t, spf_graph* g, spf_heap* h, int* parent, int* old_index, uint8_t* changed) {
+	spf_graph* old = &(t->g);
+	unsigned int n = g->num_routers;
+	unsigned int i, k;
+
+	uint8_t* affected = (uint8_t*)calloc(n + 1, sizeof(uint8_t));
+	unsigned int* stack = (unsigned int*)malloc((n + 1) * sizeof(unsigned int));
+	unsigned int* child_start = (unsigned int*)calloc(n + 2, sizeof(unsigned int));
+	unsigned int* children = (unsigned int*)malloc((n + 1) * sizeof(unsigned int));
+	unsigned int top = 0;
+
+	/* carry distances and parents over by rid */
+	for (i = 0; i < n; ++i) {
+		int oi = spf_index_of(old, g->rids[i]);
+		old_index[i] = oi;
+		h->dist[i] = 0xFFFFFFFF;
+		parent[i] = -1;
+
+		if (oi < 0) {
+			changed[i] = 1;
+			continue;
+		}
 
-	node* cur = w->interface_list;
-	/* iterate through each interface of this router */
-	while (cur) {
-		pwospf_interface* i = (pwospf_interface*)cur->data;
-		if ((i->router_id != 0) && i->is_active) {
-			pwospf_router* v = get_router_by_rid(i->router_id, pwospf_router_list);			
+		h->dist[i] = t->dist[oi];
+		if (t->parent[oi] >= 0) {
+			parent[i] = spf_index_of(g, old->rids[t->parent[oi]]);
+			if (parent[i] < 0) {
+				/* our parent is gone */
+				stack[top++] = i;
+				affected[i] = 1;
+			}
+		}
+		changed[i] = !spf_links_equal(g, i, old, oi);
+	}
 
-			/* if the distance to v is shorter through w, update it */
-			/* ADDED: ensure V exists in our router list as well,
-			 * it is possible that someone is reporting a router that is
-			 * a neighbor that we have not received an LSU for yet */
-			if ((v) && (!v->shortest_path_found) && (w->distance + i->tx_rate < v->distance)) {
-				v->distance = w->distance + i->tx_rate;
-				v->prev_router = w;
+	/* a changed parent must still reach us at the same cost, else our subtree is stale */
+	for (i = 0; i < n; ++i) {
+		int p = parent[i];
+		if ((p < 0) || !changed[p] || affected[i]) {
+			continue;
+		}
+
+		uint32_t cost = t->dist[old_index[i]] - t->dist[old_index[p]];
+		int intact = 0;
+		for (k = g->adj_start[p]; k < g->adj_start[p + 1]; ++k) {
+			if ((g->adj_to[k] == i) && (g->adj_cost[k] == cost)) {
+				intact = 1;
+				break;
 			}
-			//printf("or_dijkstra.c: Router ID: %d, v->distance: %d, w->distance: %d, and tx_rate: %d, prev_router: %d\n", i->router_id, v->distance, w->distance, i->tx_rate, v->prev_router);
 		}
+		if (!intact) {
+			stack[top++] = i;
+			affected[i] = 1;
+		}
+	}
 
-		cur = cur->next;
+	/* invalidate the subtrees under those routers */
+	for (i = 0; i < n; ++i) {
+		if (parent[i] >= 0) {
+			child_start[parent[i] + 1]++;
+		}
+	}
+	for (i = 0; i < n; ++i) {
+		child_start[i + 1] += child_start[i];
+	}
+	for (i = 0; i < n; ++i) {
+		if (parent[i] >= 0) {
+			children[child_start[parent[i]]++] = i;
+		}
+	}
+	/* child_start[p] now points past p's children, they start at child_start[p - 1] */
+	while (top > 0) {
+		unsigned int v = stack[--top];
+		unsigned int first = (v == 0) ? 0 : child_start[v - 1];
+
+		for (k = first; k < child_start[v]; ++k) {
+			if (!affected[children[k]]) {
+				affected[children[k]] = 1;
+				stack[top++] = children[k];
+			}
+		}
 	}
+	for (i = 0; i < n; ++i) {
+		if (affected[i]) {
+			h->dist[i] = 0xFFFFFFFF;
+			parent[i] = -1;
+		}
+	}
+
+	/* seed the invalidated routers from the intact tree, and the far end of changed links */
+	for (i = 0; i < n; ++i) {
+		if (affected[i] || (h->dist[i] == 0xFFFFFFFF)) {
+			continue;
+		}
+
+		for (k = g->adj_start[i]; k < g->adj_start[i + 1]; ++k) {
+			unsigned int v = g->adj_to[k];
+			if ((changed[i] || affected[v]) && (h->dist[i] + g->adj_cost[k] < h->dist[v])) {
+				h->dist[v] = h->dist[i] + g->adj_cost[k];
+				parent[v] = i;
+				spf_heap_push(h, v);
+			}
+		}
+	}
+
+	free(affected);
+	free(stack);
+	free(child_start);
+	free(children);
 }
 
-node* build_route_wrapper_list(uint32_t our_rid, node* pwospf_router_list) {
-	node* head = NULL;
+struct spf_order {
+	uint32_t dist;
+	unsigned int v;
+};
 
-	/* iterate through the routers, adding their interfaces to the route list */
-	node* cur = pwospf_router_list;
-	while (cur) {
+static int spf_order_cmp(const void* a, const void* b) {
+	const struct spf_order* x = (const struct spf_order*)a;
+	const struct spf_order* y = (const struct spf_order*)b;
+	if (x->dist != y->dist) {
+		return (x->dist < y->dist) ? -1 : 1;
+	}
+	return (x->v < y->v) ? -1 : ((x->v > y->v) ? 1 : 0);
+}
+
+/* the first hops of v from those of the routers one shortest path link before it */
+static uint32_t spf_hops_of(spf_graph* g, int source, uint32_t* dist, uint32_t* hops, unsigned int v) {
+	unsigned int first = g->adj_start[source];
+	uint32_t bits = 0;
+	unsigned int k;
+
+	for (k = g->rev_start[v]; k < g->rev_start[v + 1]; ++k) {
+		unsigned int u = g->rev_from[k];
+		if ((dist[u] == 0xFFFFFFFF) || (dist[u] + g->adj_cost[g->rev_link[k]] != dist[v])) {
+			continue;
+		}
+		if (u == (unsigned int)source) {
+			if (g->rev_link[k] - first < 32) {
+				bits |= (1U << (g->rev_link[k] - first));
+			}
+		} else {
+			bits |= hops[u];
+		}
+	}
+
+	return bits;
+}
+
+/* marks v for spf_next_hops to redo, once */
+static void spf_hops_mark(uint8_t* affected, unsigned int* stack, unsigned int* top, int v) {
+	if ((v >= 0) && !affected[v]) {
+		affected[v] = 1;
+		stack[(*top)++] = v;
+	}
+}
+
+/*
+ * Collects the first hops of every equal cost path, not just the tree one. Each of the
+ * source's links is a bit, a router gets the bits of every neighbor that sits on one of
+ * its shortest paths. Only the first 32 links of the source can be told apart, more than
+ * that does not happen on a NetFPGA.
+ *
+ * With old_index from spf_seed_changes the kept bits are reused and only routers whose
+ * distance or links in changed, and everything downstream of them on a shortest path,
+ * are redone. A full run, or a change to the source's own links, redoes them all. Those
+ * are visited by distance so their neighbors are done first, zero cost links can break
+ * that so we go again until nothing changes. Returns the bits by router number.
+ */
+static uint32_t* spf_next_hops(spf_tree* t, spf_graph* g, int source, uint32_t* dist, int* old_index, uint8_t* changed) {
+	unsigned int n = g->num_routers;
+	unsigned int num_order = 0;
+	unsigned int top = 0;
+	unsigned int i, k, o;
+	int again;
+
+	uint32_t* hops = (uint32_t*)calloc(n + 1, sizeof(uint32_t));
+	for (i = 0; i < n; ++i) {
+		g->routers[i]->num_next_rids = 0;
+	}
+	if (source < 0) {
+		return hops;
+	}
+
+	uint8_t* affected = (uint8_t*)calloc(n + 1, sizeof(uint8_t));
+	unsigned int* stack = (unsigned int*)malloc((n + 1) * sizeof(unsigned int));
+	if (!old_index || changed[source]) {
+		memset(affected, 1, n);
+	} else {
+		spf_graph* old = &(t->g);
+
+		/* a new distance or new links change what the far ends can get from us */
+		for (i = 0; i < n; ++i) {
+			int oi = old_index[i];
+			if ((oi < 0) || (t->dist[oi] != dist[i])) {
+				spf_hops_mark(affected, stack, &top, i);
+			} else {
+				hops[i] = t->hops[oi];
+				if (!changed[i]) {
+					continue;
+				}
+			}
+
+			for (k = g->adj_start[i]; k < g->adj_start[i + 1]; ++k) {
+				spf_hops_mark(affected, stack, &top, g->adj_to[k]);
+			}
+			if (oi >= 0) {
+				for (k = old->adj_start[oi]; k < old->adj_start[oi + 1]; ++k) {
+					spf_hops_mark(affected, stack, &top, spf_index_of(g, old->rids[old->adj_to[k]]));
+				}
+			}
+		}
+
+		/* and so does a router that went away */
+		for (i = 0; i < old->num_routers; ++i) {
+			if (spf_index_of(g, old->rids[i]) < 0) {
+				for (k = old->adj_start[i]; k < old->adj_start[i + 1]; ++k) {
+					spf_hops_mark(affected, stack, &top, spf_index_of(g, old->rids[old->adj_to[k]]));
+				}
+			}
+		}
+
+		/* whatever sits after a marked router on a shortest path builds on its bits */
+		while (top > 0) {
+			unsigned int u = stack[--top];
+			if (dist[u] == 0xFFFFFFFF) {
+				continue;
+			}
+			for (k = g->adj_start[u]; k < g->adj_start[u + 1]; ++k) {
+				if (dist[u] + g->adj_cost[k] == dist[g->adj_to[k]]) {
+					spf_hops_mark(affected, stack, &top, g->adj_to[k]);
+				}
+			}
+		}
+	}
+
+	struct spf_order* order = (struct spf_order*)malloc((n + 1) * sizeof(struct spf_order));
+	for (i = 0; i < n; ++i) {
+		if (affected[i]) {
+			hops[i] = 0;
+			if ((dist[i] != 0xFFFFFFFF) && (i != (unsigned int)source)) {
+				order[num_order].dist = dist[i];
+				order[num_order++].v = i;
+			}
+		}
+	}
+	qsort(order, num_order, sizeof(struct spf_order), spf_order_cmp);
+
+	do {
+		again = 0;
+		for (o = 0; o < num_order; ++o) {
+			unsigned int v = order[o].v;
+			uint32_t bits = spf_hops_of(g, source, dist, hops, v);
+			if (bits != hops[v]) {
+				hops[v] = bits;
+				again = 1;
+			}
+		}
+	} while (again);
+
+	/* turn the bits back into neighbor router ids, parallel links to one neighbor count once */
+	unsigned int first = g->adj_start[source];
+	for (i = 0; i < n; ++i) {
+		pwospf_router* r = g->routers[i];
+		for (k = 0; (k < 32) && (hops[i] >> k); ++k) {
+			if (!(hops[i] & (1U << k))) {
+				continue;
+			}
+
+			uint32_t rid = g->rids[g->adj_to[first + k]];
+			for (o = 0; (o < r->num_next_rids) && (r->next_rids[o] != rid); ++o);
+			if ((o == r->num_next_rids) && (r->num_next_rids < PWOSPF_MAX_NEXT_HOPS)) {
+				r->next_rids[r->num_next_rids++] = rid;
+			}
+		}
+	}
+
+	free(affected);
+	free(stack);
+	free(order);
+
+	return hops;
+}
+
+spf_tree* spf_tree_create(void) {
+	return (spf_tree*)calloc(1, sizeof(spf_tree));
+}
+
+void spf_tree_destroy(spf_tree* t) {
+	if (!t) {
+		return;
+	}
+
+	spf_graph_free(&(t->g));
+	free(t->dist);
+	free(t->parent);
+	free(t->hops);
+	free(t);
+}
+
+/*
+ * NOT thread safe, lock the pwospf_router_list for writes
+ * Copies the distances of the last run in the area onto the live router list, for show commands
+ */
+void spf_tree_publish(spf_tree* t, node* pwospf_router_list, uint32_t area_id) {
+	node* cur;
+
+	if (!t->valid) {
+		return;
+	}
+
+	for (cur = pwospf_router_list; cur; cur = cur->next) {
 		pwospf_router* r = (pwospf_router*)cur->data;
-		add_route_wrappers(our_rid, &head, r);
-		cur = cur->next;
+		if (r->area_id != area_id) {
+			continue;
+		}
+		int i = spf_index_of(&(t->g), r->router_id);
+		if (i >= 0) {
+			r->distance = t->dist[i];
+			r->shortest_path_found = (t->dist[i] != 0xFFFFFFFF);
+		}
 	}
+}
 
-	return head;
+/* routers taken off the heap by the last run, all of them for a full run */
+unsigned int spf_tree_last_settled(spf_tree* t) {
+	return t->last_settled;
 }
 
-void add_route_wrappers(uint32_t our_rid, node** head, pwospf_router* r) {
+/*
+ * NOT thread safe, same locking as compute_rtable
+ *
+ * Fills in distance, shortest_path_found, prev_router and the equal cost next_rids on
+ * every router in the list, routers we cannot reach are left at distance 0xFFFFFFFF. With a tree, only the part
+ * the changes since the previous call can reach is recomputed and the tree is updated,
+ * without one this is a full run.
+ */
+void compute_spf(spf_tree* t, uint32_t our_router_id, node* pwospf_router_list) {
+	spf_graph g;
+	spf_heap h;
+	unsigned int i;
+	unsigned int settled = 0;
+
+	spf_graph_build(&g, pwospf_router_list);
+
+	unsigned int n = g.num_routers;
+	int* parent = (int*)malloc((n + 1) * sizeof(int));
+	h.dist = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+	h.items = (unsigned int*)malloc((n + 1) * sizeof(unsigned int));
+	h.pos = (int*)malloc((n + 1) * sizeof(int));
+	memset(h.pos, 0xFF, (n + 1) * sizeof(int));
+	h.size = 0;
+
+	int* old_index = NULL;
+	uint8_t* changed = NULL;
+	int source = spf_index_of(&g, our_router_id);
+	if (source >= 0) {
+		if (t && t->valid && (t->source == our_router_id)) {
+			old_index = (int*)malloc((n + 1) * sizeof(int));
+			changed = (uint8_t*)calloc(n + 1, sizeof(uint8_t));
+			spf_seed_changes(t, &g, &h, parent, old_index, changed);
+		} else {
+			/* initialize all the entries to their max distance, except us */
+			for (i = 0; i < n; ++i) {
+				h.dist[i] = 0xFFFFFFFF;
+				parent[i] = -1;
+			}
+			h.dist[source] = 0;
+			spf_heap_push(&h, source);
+		}
+		settled = spf_relax(&g, &h, parent);
+	} else {
+		for (i = 0; i < n; ++i) {
+			h.dist[i] = 0xFFFFFFFF;
+			parent[i] = -1;
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		pwospf_router* r = g.routers[i];
+		r->distance = h.dist[i];
+		r->shortest_path_found = (h.dist[i] != 0xFFFFFFFF);
+		r->prev_router = (parent[i] >= 0) ? g.routers[parent[i]] : NULL;
+	}
+	uint32_t* hops = spf_next_hops(t, &g, source, h.dist, old_index, changed);
+
+	free(h.items);
+	free(h.pos);
+	free(old_index);
+	free(changed);
+
+	if (t) {
+		/* keep this run as the base for the next one */
+		spf_graph_free(&(t->g));
+		free(t->dist);
+		free(t->parent);
+		free(t->hops);
+		t->g = g;
+		t->dist = h.dist;
+		t->parent = parent;
+		t->hops = hops;
+		t->source = our_router_id;
+		t->valid = (source >= 0);
+		t->last_settled = settled;
+	} else {
+		spf_graph_free(&g);
+		free(h.dist);
+		free(parent);
+		free(hops);
+	}
+}
+
+/*
+ * Route wrappers are found by subnet and mask through an open addressed hash,
+ * one slot per advertised interface is plenty.
+ */
+struct wrapper_index {
+	route_wrapper** slots;
+	unsigned int mask;
+	node* tail;
+};
+typedef struct wrapper_index wrapper_index;
+
+static route_wrapper** get_route_wrapper_slot(wrapper_index* index, struct in_addr* subnet, struct in_addr* mask) {
+	uint32_t ip = subnet->s_addr & mask->s_addr;
+	unsigned int slot = ((ip * 2654435761U) ^ mask->s_addr) & index->mask;
+
+	while (index->slots[slot]) {
+		route_wrapper* wrapper = index->slots[slot];
+		if ((wrapper->entry.ip.s_addr == ip) && (wrapper->entry.mask.s_addr == mask->s_addr)) {
+			break;
+		}
+		slot = (slot + 1) & index->mask;
+	}
+
+	return &(index->slots[slot]);
+}
+
+/* adds the equal cost next hops of r the wrapper does not have yet */
+static void add_route_next_hops(route_wrapper* wrapper, pwospf_router* r) {
+	unsigned int i, j;
+
+	for (i = 0; i < r->num_next_rids; ++i) {
+		for (j = 0; (j < wrapper->num_next_rids) && (wrapper->next_rids[j] != r->next_rids[i]); ++j);
+		if ((j == wrapper->num_next_rids) && (wrapper->num_next_rids < PWOSPF_MAX_NEXT_HOPS)) {
+			wrapper->next_rids[wrapper->num_next_rids++] = r->next_rids[i];
+		}
+	}
+}
+
+static void add_route_wrappers(uint32_t our_rid, node** head, wrapper_index* index, pwospf_router* r) {
 	node* cur = r->interface_list;
 	while (cur) {
 		pwospf_interface* i = (pwospf_interface*)cur->data;
 
 		/* check if we have an existing route matching this subnet and mask */
-		node* temp_node = get_route_wrapper(*head, &(i->subnet), &(i->mask));
-		if (temp_node) {
-			/* if our distance is longer, just continue to the next interface */
-			route_wrapper* wrapper = (route_wrapper*)temp_node->data;
-			if (r->distance >= wrapper->distance) {
-				cur = cur->next;
-				continue;
+		route_wrapper** slot = get_route_wrapper_slot(index, &(i->subnet), &(i->mask));
+		route_wrapper* wrapper = *slot;
+		if (wrapper) {
+			/* a route inside the area beats a summary of it from an ABR, however far */
+			if (i->is_summary != wrapper->entry.is_inter_area) {
+				if (i->is_summary) {
+					cur = cur->next;
+					continue;
+				}
 			} else {
-				/* replace the existing entries data with ours */
-				wrapper->distance = r->distance;
-				/* walk down until the next router is the source */
-				pwospf_router* cur_router = r;
-				if (!cur_router->prev_router) {
-					wrapper->next_rid = i->router_id;			
-				} else {
-					while (cur_router->prev_router->router_id != our_rid) {
-						cur_router = cur_router->prev_router;
-					}
-
-					wrapper->next_rid = cur_router->router_id;
-				}				
+				/* as close through this router too, its next hops are just as good */
+				if ((r->distance == wrapper->distance) && !wrapper->directly_connected) {
+					add_route_next_hops(wrapper, r);
+				}
 
-				/* set that this is directly connected to us */
-				if (our_rid == r->router_id) {
-					wrapper->directly_connected = 1;
+				/* if our distance is longer, just continue to the next interface */
+				if (r->distance >= wrapper->distance) {
+					cur = cur->next;
+					continue;
 				}
 			}
 		} else {
 			node* new_node = node_create();
 
 			/* no existing route wrapper, create a new one for this route */
-			route_wrapper* new_route = (route_wrapper*)calloc(1, sizeof(route_wrapper));
-			new_route->entry.ip.s_addr = i->subnet.s_addr & i->mask.s_addr;
-			new_route->entry.mask.s_addr = i->mask.s_addr;
-			new_route->distance = r->distance;
-
-			/* walk down until the next router is the source */
-			pwospf_router* cur_router = r;
-			if (!cur_router->prev_router) {
-				new_route->next_rid = i->router_id;
-			} else {
-				/* Use another way to determine the root of a minimum spanning tree */
-				while (cur_router->prev_router->router_id != our_rid) {
-					cur_router = cur_router->prev_router;
-				}
-				new_route->next_rid = cur_router->router_id;
-				//printf("or_dijkstra.c: wrapper->next_rid: %u current_router: %u prev_router %u \n", new_route->next_rid, cur_router->router_id, cur_router->prev_router->router_id);
-			}
-
-			/* set that this is directly connected to us */
-			if (our_rid == r->router_id) {
-				new_route->directly_connected = 1;
-			}
+			wrapper = (route_wrapper*)calloc(1, sizeof(route_wrapper));
+			wrapper->entry.ip.s_addr = i->subnet.s_addr & i->mask.s_addr;
+			wrapper->entry.mask.s_addr = i->mask.s_addr;
+			*slot = wrapper;
 
 			/* point the node's data at our route wrapper */
-			new_node->data = new_route;
+			new_node->data = wrapper;
 
 			if (!(*head)) {
 				(*head) = new_node;
 			} else {
-				node_push_back(*head, new_node);
+				index->tail->next = new_node;
+				new_node->prev = index->tail;
 			}
+			index->tail = new_node;
+		}
+
+		/* replace the existing entries data with ours */
+		wrapper->distance = r->distance;
+		wrapper->entry.is_inter_area = i->is_summary;
+
+		/* walk down until the next router is the source */
+		pwospf_router* cur_router = r;
+		if (!cur_router->prev_router) {
+			wrapper->next_rid = i->router_id;
+		} else {
+			/* Use another way to determine the root of a minimum spanning tree */
+			while (cur_router->prev_router->router_id != our_rid) {
+				cur_router = cur_router->prev_router;
+			}
+			wrapper->next_rid = cur_router->router_id;
+		}
+		wrapper->next_rids[0] = wrapper->next_rid;
+		wrapper->num_next_rids = 1;
+		add_route_next_hops(wrapper, r);
+
+		/* set that this is directly connected to us */
+		if (our_rid == r->router_id) {
+			wrapper->directly_connected = 1;
 		}
 
 		cur = cur->next;
 	}
 }
 
-node* get_route_wrapper(node* head, struct in_addr* subnet, struct in_addr* mask) {
-	/* walk the route wrapper list looking for an entry matching this subnet and mask */
-	node* cur = head;
+node* build_route_wrapper_list(uint32_t our_rid, node* pwospf_router_list) {
+	node* head = NULL;
+	wrapper_index index;
+	unsigned int num_ifaces = 0;
+	unsigned int size = 4;
+	node* cur;
+
+	for (cur = pwospf_router_list; cur; cur = cur->next) {
+		num_ifaces += node_length(((pwospf_router*)cur->data)->interface_list);
+	}
+	while (size < 2 * num_ifaces) {
+		size <<= 1;
+	}
+
+	index.slots = (route_wrapper**)calloc(size, sizeof(route_wrapper*));
+	index.mask = size - 1;
+	index.tail = NULL;
+
+	/* iterate through the routers, adding their interfaces to the route list */
+	for (cur = pwospf_router_list; cur; cur = cur->next) {
+		pwospf_router* r = (pwospf_router*)cur->data;
+		add_route_wrappers(our_rid, &head, &index, r);
+	}
+
+	free(index.slots);
+	return head;
+}
+
+static unsigned int route_hash(rtable_entry* re) {
+	return ((re->ip.s_addr & re->mask.s_addr) * 2654435761U) ^ re->mask.s_addr;
+}
+
+static int route_same_dest(rtable_entry* a, rtable_entry* b) {
+	return (a->ip.s_addr == b->ip.s_addr) && (a->mask.s_addr == b->mask.s_addr);
+}
+
+#define ROUTE_CHANGE_LEN 80
+
+static void sprint_route_change(char* buf, int* len, char op, rtable_entry* re) {
+	char ip_str[16];
+	char mask_str[16];
+	char gw_str[16];
+	inet_ntop(AF_INET, &(re->ip), ip_str, 16);
+	inet_ntop(AF_INET, &(re->mask), mask_str, 16);
+	inet_ntop(AF_INET, &(re->gw), gw_str, 16);
+
+	*len += snprintf(buf + *len, ROUTE_CHANGE_LEN, "%c %s %s %s %s\n", op, ip_str, mask_str, gw_str, re->iface);
+}
+
+static int route_added_cmp(const void* a, const void* b) {
+	rtable_entry* x = (rtable_entry*)(*(node**)a)->data;
+	rtable_entry* y = (rtable_entry*)(*(node**)b)->data;
+	if (rtable_entry_after(x, y)) {
+		return 1;
+	}
+	return rtable_entry_after(y, x) ? -1 : 0;
+}
+
+/*
+ * NOT thread safe, lock the rtable for writes
+ *
+ * Brings the dynamic entries of the rtable in line with new_routes (as returned by
+ * compute_rtable) in place: routes that are gone are deleted, routes whose next hop
+ * moved are modified and new ones are merged in at their place in the sorted rtable,
+ * so the sort in trigger_rtable_modified has nothing left to do. Static entries are
+ * not touched. A destination in new_routes more than once keeps its first route, and
+ * a dynamic destination in the rtable more than once keeps its first entry. Takes
+ * ownership of new_routes.
+ *
+ * The changes are written to *buf, one "+/~/- ip mask gw iface" line each, for the
+ * caller to print once the lock is dropped. Free *buf when done.
+ *
+ * Returns: the number of routes added, modified or deleted
+ */
+int apply_rtable_diff(router_state* rs, node* new_routes, char** buf, int* len) {
+	unsigned int size = 4;
+	unsigned int mask;
+	unsigned int slot;
+	unsigned int num_new = node_length(new_routes);
+	unsigned int num_added = 0;
+	int changes = 0;
+	node* cur;
+	node* next;
+
+	*len = 0;
+	*buf = (char*)calloc((node_length(rs->rtable) + num_new + 1) * ROUTE_CHANGE_LEN, sizeof(char));
+
+	while (size < 2 * num_new) {
+		size <<= 1;
+	}
+	mask = size - 1;
+	node** index = (node**)calloc(size, sizeof(node*));
+	uint8_t* taken = (uint8_t*)calloc(size, sizeof(uint8_t));	/* matched by a route we keep */
+
+	cur = new_routes;
 	while (cur) {
-		route_wrapper* wrapper = (route_wrapper*)cur->data;
-		if ((wrapper->entry.ip.s_addr == (subnet->s_addr & mask->s_addr)) && (wrapper->entry.mask.s_addr == mask->s_addr)) {
-			return cur;
+		next = cur->next;
+		slot = route_hash((rtable_entry*)cur->data) & mask;
+		while (index[slot] && !route_same_dest((rtable_entry*)index[slot]->data, (rtable_entry*)cur->data)) {
+			slot = (slot + 1) & mask;
 		}
+		if (index[slot]) {
+			node_remove(&new_routes, cur);
+		} else {
+			index[slot] = cur;
+		}
+		cur = next;
+	}
 
-		cur = cur->next;
+	/* walk the current dynamic routes, matching each against the new set */
+	cur = rs->rtable;
+	while (cur) {
+		next = cur->next;
+		rtable_entry* re = (rtable_entry*)cur->data;
+		if (re->is_static) {
+			cur = next;
+			continue;
+		}
+
+		slot = route_hash(re) & mask;
+		while (index[slot] && !route_same_dest((rtable_entry*)index[slot]->data, re)) {
+			slot = (slot + 1) & mask;
+		}
+		rtable_entry* match = index[slot] ? (rtable_entry*)index[slot]->data : NULL;
+
+		if (!match || taken[slot]) {
+			/* route is gone, or a duplicate of one we already kept */
+			sprint_route_change(*buf, len, '-', re);
+			node_remove(&(rs->rtable), cur);
+			++changes;
+		} else {
+			if ((match->gw.s_addr != re->gw.s_addr) || strncmp(match->iface, re->iface, IF_LEN) || (match->is_active != re->is_active) ||
+					(match->is_inter_area != re->is_inter_area)) {
+				re->gw.s_addr = match->gw.s_addr;
+				memcpy(re->iface, match->iface, IF_LEN);
+				re->is_active = match->is_active;
+				re->is_inter_area = match->is_inter_area;
+				sprint_route_change(*buf, len, '~', re);
+				++changes;
+			}
+			taken[slot] = 1;
+		}
+
+		cur = next;
 	}
 
-	return NULL;
+	/* whatever was not taken is new, collect it at the front of the index */
+	for (slot = 0; slot < size; ++slot) {
+		if (!index[slot]) {
+			continue;
+		}
+		if (taken[slot]) {
+			node_remove(&new_routes, index[slot]);
+		} else {
+			index[num_added++] = index[slot];
+		}
+	}
+	free(taken);
+
+	/* merge the new routes into the sorted rtable in one pass */
+	qsort(index, num_added, sizeof(node*), route_added_cmp);
+	node* prev = NULL;
+	cur = rs->rtable;
+	for (slot = 0; slot < num_added; ++slot) {
+		node* n = index[slot];
+		while (cur && !rtable_entry_after((rtable_entry*)cur->data, (rtable_entry*)n->data)) {
+			prev = cur;
+			cur = cur->next;
+		}
+
+		n->prev = prev;
+		n->next = cur;
+		if (prev) {
+			prev->next = n;
+		} else {
+			rs->rtable = n;
+		}
+		if (cur) {
+			cur->prev = n;
+		}
+		prev = n;
+
+		sprint_route_change(*buf, len, '+', (rtable_entry*)n->data);
+		++changes;
+	}
+
+	free(index);
+	return changes;
 }
 
 /*
@@ -369,93 +1243,326 @@ void print_wrapper_list(node* route_wrapper_list) {
 		inet_ntop(AF_INET, &(wrapper->entry.ip), subnet_str, 16);
 		inet_ntop(AF_INET, &(wrapper->entry.mask), mask_str, 16);
 
-		printf("%u %u %s %s\n", wrapper->distance, wrapper->next_rid, subnet_str, mask_str);
+		if (wrapper->num_next_rids > 1) {
+			printf("%u %u %s %s (%u equal cost next hops)\n", wrapper->distance, wrapper->next_rid, subnet_str, mask_str, wrapper->num_next_rids);
+		} else {
+			printf("%u %u %s %s\n", wrapper->distance, wrapper->next_rid, subnet_str, mask_str);
+		}
 
 		cur = cur->next;
 	}
 }
 
-void* dijkstra_thread(void* arg) {
-	router_state* rs = (router_state*)arg;
+/* copies each element of a list into a new list, data included, or only those keep takes */
+static node* copy_list(node* head, size_t size, int (*keep)(void*, uint32_t), uint32_t area_id) {
+	node* copy = NULL;
+	node* tail = NULL;
 
-	struct timespec wake_up_time;
-	struct timeval now;
-	int result = 0;
+	for (; head; head = head->next) {
+		if (keep && !keep(head->data, area_id)) {
+			continue;
+		}
 
-	pthread_mutex_lock(rs->dijkstra_mutex);
-	while (1) {
-		/* Determine the time when to wake up next */
-		gettimeofday(&now, NULL);
-		wake_up_time.tv_sec = now.tv_sec + 1;
-		wake_up_time.tv_nsec = now.tv_usec + 1000;
+		node* n = node_create();
+		n->data = malloc(size);
+		memcpy(n->data, head->data, size);
 
-		result = pthread_cond_timedwait(rs->dijkstra_cond, rs->dijkstra_mutex, &wake_up_time);
-		
-//		gettimeofday(&now, NULL);
-//		printf("or_dijkstra.c: result = %d at %d\n", result, now.tv_sec);
+		if (!copy) {
+			copy = n;
+		} else {
+			tail->next = n;
+			n->prev = tail;
+		}
+		tail = n;
+	}
+
+	return copy;
+}
+
+static void free_list(node* head) {
+	while (head) {
+		node_remove(&head, head);
+	}
+}
+
+static int router_in_area(void* data, uint32_t area_id) {
+	return ((pwospf_router*)data)->area_id == area_id;
+}
+
+static int iface_in_area(void* data, uint32_t area_id) {
+	return ((iface_entry*)data)->area_id == area_id;
+}
+
+/*
+ * NOT thread safe, lock the pwospf_router_list for writes
+ * Returns: a private copy of the LSDB of the area SPF can run on without any locks held
+ */
+static node* snapshot_pwospf_router_list(node* pwospf_router_list, uint32_t area_id) {
+	node* copy = copy_list(pwospf_router_list, sizeof(pwospf_router), router_in_area, area_id);
+	node* cur;
+
+	for (cur = copy; cur; cur = cur->next) {
+		pwospf_router* r = (pwospf_router*)cur->data;
+		r->interface_list = copy_list(r->interface_list, sizeof(pwospf_interface), NULL, 0);
+		r->prev_router = NULL;
+	}
+
+	return copy;
+}
+
+/*
+ * NOT thread safe, lock the if_list for reads
+ * Returns: a private copy of the interfaces in the area and their neighbors
+ */
+static node* snapshot_if_list(node* if_list, uint32_t area_id) {
+	node* copy = copy_list(if_list, sizeof(iface_entry), iface_in_area, area_id);
+	node* cur;
+
+	for (cur = copy; cur; cur = cur->next) {
+		iface_entry* iface = (iface_entry*)cur->data;
+		iface->nbr_routers = copy_list(iface->nbr_routers, sizeof(nbr_router), NULL, 0);
+	}
 
-		/* if we timed out, and the data is not dirty, go back to sleep */
-		if (result == ETIMEDOUT) {
-			if (!rs->dijkstra_dirty) {
+	return copy;
+}
+
+static void free_pwospf_router_snapshot(node* routers) {
+	node* cur;
+	for (cur = routers; cur; cur = cur->next) {
+		free_list(((pwospf_router*)cur->data)->interface_list);
+	}
+	free_list(routers);
+}
+
+static void free_if_list_snapshot(node* if_list) {
+	node* cur;
+	for (cur = if_list; cur; cur = cur->next) {
+		free_list(((iface_entry*)cur->data)->nbr_routers);
+	}
+	free_list(if_list);
+}
+
+static rtable_entry** get_area_route_slot(rtable_entry** slots, unsigned int mask, rtable_entry* re) {
+	unsigned int slot = route_hash(re) & mask;
+	while (slots[slot] && ((slots[slot]->ip.s_addr != re->ip.s_addr) || (slots[slot]->mask.s_addr != re->mask.s_addr))) {
+		slot = (slot + 1) & mask;
+	}
+	return &(slots[slot]);
+}
+
+/*
+ * Merges the routes SPF found in each area into one list. A route inside an area beats
+ * a summary, otherwise the first area with the prefix wins. An ABR ignores summaries
+ * outside the backbone, those were made from routes it has itself. Multipath entries
+ * only stay for the routes that made it. Takes ownership of all the lists.
+ */
+static node* merge_area_routes(uint32_t* area_ids, node** routes, node** multipaths, unsigned int num, node** multipath) {
+	unsigned int size = 4;
+	unsigned int total = 0;
+	unsigned int a;
+	node* merged = NULL;
+	node* merged_tail = NULL;
+	node* multipath_tail = NULL;
+	node* cur;
+
+	*multipath = NULL;
+	for (a = 0; a < num; ++a) {
+		total += node_length(routes[a]);
+	}
+	while (size < 2 * total) {
+		size <<= 1;
+	}
+	rtable_entry** slots = (rtable_entry**)calloc(size, sizeof(rtable_entry*));
+	unsigned int* owners = (unsigned int*)calloc(size, sizeof(unsigned int));
+
+	for (a = 0; a < num; ++a) {
+		for (cur = routes[a]; cur; cur = cur->next) {
+			rtable_entry* re = (rtable_entry*)cur->data;
+			if (re->is_inter_area && (num > 1) && (area_ids[a] != PWOSPF_BACKBONE_AREA)) {
 				continue;
 			}
-		}
-		rs->dijkstra_dirty = 0;
 
-		lock_if_list_rd(rs);
-		lock_rtable_wr(rs);
-		lock_mutex_pwospf_router_list(rs);
-
-		/* nuke all the non static entries */
-		//printf("---RTABLE BEFORE DIJKSTRA---\n");
-		//char* rtable_printout;
-		//int len;
-		//sprint_rtable(rs, &rtable_printout, &len);
-		//printf("%s\n", rtable_printout);
-		//free(rtable_printout);
+			rtable_entry** slot = get_area_route_slot(slots, size - 1, re);
+			if (!*slot || ((*slot)->is_inter_area && !re->is_inter_area)) {
+				*slot = re;
+				owners[slot - slots] = a;
+			}
+		}
+	}
 
-		node* cur = rs->rtable;
-		node* next = NULL;
+	for (a = 0; a < num; ++a) {
+		cur = routes[a];
 		while (cur) {
-			next = cur->next;
-			rtable_entry* entry = (rtable_entry*)cur->data;
-			if (!entry->is_static) {
-				node_remove(&(rs->rtable), cur);
+			node* next = cur->next;
+			if (*get_area_route_slot(slots, size - 1, (rtable_entry*)cur->data) == cur->data) {
+				cur->prev = merged_tail;
+				cur->next = NULL;
+				if (!merged) {
+					merged = cur;
+				} else {
+					merged_tail->next = cur;
+				}
+				merged_tail = cur;
+			} else {
+				free(cur->data);
+				free(cur);
 			}
+			cur = next;
+		}
 
+		cur = multipaths[a];
+		while (cur) {
+			node* next = cur->next;
+			rtable_entry key;
+			key.ip = ((atable_entry*)cur->data)->ip;
+			key.mask = ((atable_entry*)cur->data)->mask;
+			rtable_entry** slot = get_area_route_slot(slots, size - 1, &key);
+			if (*slot && (owners[slot - slots] == a)) {
+				cur->prev = multipath_tail;
+				cur->next = NULL;
+				if (!(*multipath)) {
+					*multipath = cur;
+				} else {
+					multipath_tail->next = cur;
+				}
+				multipath_tail = cur;
+			} else {
+				free(cur->data);
+				free(cur);
+			}
 			cur = next;
 		}
+	}
 
-		/* run dijkstra */
-		node* dijkstra_rtable = compute_rtable(rs->router_id, rs->pwospf_router_list, rs->if_list);
+	free(slots);
+	free(owners);
+	return merged;
+}
 
-		/* patch our list on to the end of the rtable */
-		if (!(rs->rtable)) {
-			rs->rtable = dijkstra_rtable;
+/*
+ * SPF never runs under the forwarding locks: the LSDB and the interfaces are copied
+ * under their own locks, the new dynamic routes are built from the copies with nothing
+ * held, and only merging the difference into the rtable (and the hardware write, if
+ * anything changed) happens under the rtable write lock. All printing is done after
+ * the locks are released.
+ *
+ * Runs are throttled like the spf-interval of commercial routers, so a burst of LSUs
+ * costs one run and one hardware write instead of one per LSU.
+ */
+void* dijkstra_thread(void* arg) {
+	router_state* rs = (router_state*)arg;
+
+	struct timespec until;
+	struct timespec run_start;
+	struct timespec run_end;
+	uint64_t now;
+	uint64_t run_at;
+
+	pthread_mutex_lock(rs->dijkstra_mutex);
+	while (1) {
+		while (!rs->dijkstra_dirty) {
+			pthread_cond_wait(rs->dijkstra_cond, rs->dijkstra_mutex);
+		}
+
+		/* pick when to run: the start delay after a quiet spell, otherwise a hold
+		 * after the last run that doubles under continued churn up to the max wait
+		 */
+		now = timer_now_ms();
+		run_at = now + rs->spf_start_ms;
+		if ((rs->spf_last_run_ms == 0) || ((now - rs->spf_last_run_ms) >= 2 * (uint64_t)rs->spf_cur_hold_ms)) {
+			rs->spf_cur_hold_ms = rs->spf_hold_ms;
 		} else {
-			cur = rs->rtable;
-			/* run to the end of the rtable */
-			while (cur->next) {
-				cur = cur->next;
+			if ((rs->spf_last_run_ms + rs->spf_cur_hold_ms) > run_at) {
+				run_at = rs->spf_last_run_ms + rs->spf_cur_hold_ms;
 			}
-			cur->next = dijkstra_rtable;
-			if (dijkstra_rtable) {
-				dijkstra_rtable->prev = cur;
+			rs->spf_cur_hold_ms *= 2;
+			if (rs->spf_cur_hold_ms > rs->spf_max_wait_ms) {
+				rs->spf_cur_hold_ms = rs->spf_max_wait_ms;
 			}
 		}
 
-		/* write new rtable out to hardware */
-		trigger_rtable_modified(rs);
-		char* rtable_printout;
+		/* anything triggered while we wait is folded into this run */
+		while (timer_now_ms() < run_at) {
+			until.tv_sec = run_at / 1000;
+			until.tv_nsec = (run_at % 1000) * 1000000;
+			pthread_cond_timedwait(rs->dijkstra_cond, rs->dijkstra_mutex, &until);
+		}
+		rs->dijkstra_dirty = 0;
+		pthread_mutex_unlock(rs->dijkstra_mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &run_start);
+
+		/* every area we are in gets its own run over its own part of the LSDB */
+		lock_mutex_pwospf_router_list(rs);
+		unsigned int num_areas = node_length(rs->pwospf_areas);
+		unsigned int a;
+		pwospf_area** areas = (pwospf_area**)calloc(num_areas + 1, sizeof(pwospf_area*));
+		uint32_t* area_ids = (uint32_t*)calloc(num_areas + 1, sizeof(uint32_t));
+		node** routers = (node**)calloc(num_areas + 1, sizeof(node*));
+		node** routes = (node**)calloc(num_areas + 1, sizeof(node*));
+		node** multipaths = (node**)calloc(num_areas + 1, sizeof(node*));
+		node* cur;
+
+		num_areas = 0;
+		for (cur = rs->pwospf_areas; cur; cur = cur->next) {
+			pwospf_area* area = (pwospf_area*)cur->data;
+			if (lsdb_lookup(rs, area->area_id, rs->router_id)) {
+				areas[num_areas] = area;
+				area_ids[num_areas] = area->area_id;
+				routers[num_areas] = snapshot_pwospf_router_list(rs->pwospf_router_list, area->area_id);
+				++num_areas;
+			}
+		}
+		unlock_mutex_pwospf_router_list(rs);
+
+		/* run dijkstra, only over what changed since the last run */
+		unsigned int settled = 0;
+		for (a = 0; a < num_areas; ++a) {
+			lock_if_list_rd(rs);
+			node* ifaces = snapshot_if_list(rs->if_list, area_ids[a]);
+			unlock_if_list(rs);
+
+			routes[a] = compute_rtable(areas[a]->spf, rs->router_id, routers[a], ifaces, &(multipaths[a]));
+			settled += spf_tree_last_settled(areas[a]->spf);
+			free_pwospf_router_snapshot(routers[a]);
+			free_if_list_snapshot(ifaces);
+		}
+
+		/* as an ABR, what each area learnt is summarized into the others */
+		pwospf_update_summaries(rs, area_ids, routes, num_areas);
+
+		lock_mutex_pwospf_router_list(rs);
+		for (a = 0; a < num_areas; ++a) {
+			spf_tree_publish(areas[a]->spf, rs->pwospf_router_list, area_ids[a]);
+			areas[a]->spf_settled = spf_tree_last_settled(areas[a]->spf);
+		}
+		unlock_mutex_pwospf_router_list(rs);
+
+		node* multipath;
+		node* dijkstra_rtable = merge_area_routes(area_ids, routes, multipaths, num_areas, &multipath);
+		free(areas);
+		free(area_ids);
+		free(routers);
+		free(routes);
+		free(multipaths);
+
+		/* publish only the differences, and write to hardware if there were any */
+		char* changes_printout;
 		int len;
-		printf("---RTABLE AFTER DIJKSTRA---\n");
-		sprint_rtable(rs, &rtable_printout, &len);
-		printf("%s\n", rtable_printout);
-		free(rtable_printout);
+		lock_rtable_wr(rs);
+		int changes = apply_rtable_diff(rs, dijkstra_rtable, &changes_printout, &len);
+		if (changes > 0) {
+			trigger_rtable_modified(rs);
+		}
+		unlock_rtable(rs);
+
+		printf("---RTABLE CHANGES AFTER DIJKSTRA (%u routers recomputed)---\n%s", settled, changes_printout);
+		free(changes_printout);
 
 		/* compute alpha here */
+		lock_rtable_rd(rs);
 		lock_atable_wr(rs);
-		compute_atable(rs);
+		compute_atable(rs, multipath);
 		
 //		struct in_addr destination, mask;
 //		struct timeval now;
@@ -545,14 +1652,23 @@ void* dijkstra_thread(void* arg) {
 		
 		add_atable_entry(&test_ip, &test_mask, test_alpha, rs);
 */
+		unlock_atable(rs);
+		unlock_rtable(rs);
+
+		while (multipath) {
+			node_remove(&multipath, multipath);
+		}
+
+		lock_atable_rd(rs);
 		sprint_atable(rs);
 		unlock_atable(rs);
 
-		/* unlock everything */
-		unlock_mutex_pwospf_router_list(rs);
-		unlock_rtable(rs);
-		unlock_if_list(rs);
+		clock_gettime(CLOCK_MONOTONIC, &run_end);
 
+		pthread_mutex_lock(rs->dijkstra_mutex);
+		rs->spf_runs++;
+		rs->spf_last_run_us = ((run_end.tv_sec - run_start.tv_sec) * 1000000) + ((run_end.tv_nsec - run_start.tv_nsec) / 1000);
+		rs->spf_last_run_ms = timer_now_ms();
 	}
 	pthread_mutex_unlock(rs->dijkstra_mutex);
 
@@ -560,7 +1676,12 @@ void* dijkstra_thread(void* arg) {
 }
 
 void dijkstra_trigger(router_state* rs) {
-	/* no lock on this object, worst case it takes an extra second to run */
+	pthread_mutex_lock(rs->dijkstra_mutex);
+	if (rs->dijkstra_dirty) {
+		/* a run is already pending, this change rides along with it */
+		rs->spf_coalesced++;
+	}
 	rs->dijkstra_dirty = 1;
 	pthread_cond_signal(rs->dijkstra_cond);
+	pthread_mutex_unlock(rs->dijkstra_mutex);
 }
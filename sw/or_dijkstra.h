@@ -9,7 +9,13 @@
 
 #include "or_data_types.h"
 
-node* compute_rtable(uint32_t our_router_id, node* pwospf_router_list, node* if_list);
+node* compute_rtable(spf_tree* tree, uint32_t our_router_id, node* pwospf_router_list, node* if_list, node** multipath);
+void compute_spf(spf_tree* tree, uint32_t our_router_id, node* pwospf_router_list);
+spf_tree* spf_tree_create(void);
+void spf_tree_destroy(spf_tree* tree);
+void spf_tree_publish(spf_tree* tree, node* pwospf_router_list, uint32_t area_id);
+unsigned int spf_tree_last_settled(spf_tree* tree);
+int apply_rtable_diff(router_state* rs, node* new_routes, char** buf, int* len);
 pwospf_router* get_router_by_rid(uint32_t rid, node* pwospf_router_list);
 void* dijkstra_thread(void* arg);
 void dijkstra_trigger(router_state* rs);
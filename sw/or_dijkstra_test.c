@@ -7,16 +7,33 @@
 #include "or_dijkstra.h"
 #include "or_utils.h"
 #include "or_output.h"
+#include "or_rtable.h"
+#include "or_fib.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
 
 
 void print_pwospf_router_list(node* head);
+int run_benchmark(unsigned int seed);
+int run_fib_test(unsigned int seed);
 
 int main(int argc, char** argv)
 {
+	if (argc < 2) {
+		printf("usage: %s <our rid> <topology file>\n       %s bench [seed]\n       %s fib [seed]\n", argv[0], argv[0], argv[0]);
+		exit(1);
+	}
+
+	if (strcmp(argv[1], "bench") == 0) {
+		return run_benchmark((argc > 2) ? atoi(argv[2]) : 1);
+	}
+	if (strcmp(argv[1], "fib") == 0) {
+		return run_fib_test((argc > 2) ? atoi(argv[2]) : 1);
+	}
+
 	int our_rid = atoi(argv[1]);
 
 	FILE* file = fopen(argv[2], "r");
@@ -138,7 +155,7 @@ int main(int argc, char** argv)
 
 	print_pwospf_router_list(router_list);
 
-	node* rtable = compute_rtable(our_rid, router_list, iface_list);
+	node* rtable = compute_rtable(NULL, our_rid, router_list, iface_list, NULL);
 
 	router_state rs;
 	rs.rtable = rtable;
@@ -174,3 +191,393 @@ void print_pwospf_router_list(node* head) {
 		cur_node_r = cur_node_r->next;
 	}
 }
+
+/*
+ * BENCHMARK
+ *
+ * Builds synthetic topologies (a ring with two random chords per router, random
+ * link costs), times compute_spf on each and checks its distances against the
+ * original linear scan implementation where that finishes in reasonable time.
+ * Then flaps single links and routers and times the incremental runs, checking
+ * the distances and equal cost next hops of each against a full one.
+ */
+
+static void add_link(pwospf_router* r, uint32_t nbr_rid, uint32_t link, uint32_t cost) {
+	pwospf_interface* iface = (pwospf_interface*)calloc(1, sizeof(pwospf_interface));
+	iface->subnet.s_addr = htonl(0x0A000000 | (link << 2));
+	iface->mask.s_addr = htonl(0xFFFFFFFC);
+	iface->router_id = nbr_rid;
+	iface->is_active = 1;
+	iface->tx_rate = cost;
+
+	node* n = node_create();
+	n->data = iface;
+	n->next = r->interface_list;
+	if (r->interface_list) {
+		r->interface_list->prev = n;
+	}
+	r->interface_list = n;
+}
+
+static node* build_topology(unsigned int num_routers, uint32_t max_cost, pwospf_router*** routers_out) {
+	pwospf_router** routers = (pwospf_router**)calloc(num_routers, sizeof(pwospf_router*));
+	node* head = NULL;
+	node* tail = NULL;
+	unsigned int i, j;
+	uint32_t link = 0;
+
+	for (i = 0; i < num_routers; ++i) {
+		routers[i] = (pwospf_router*)calloc(1, sizeof(pwospf_router));
+		routers[i]->router_id = i + 1;
+
+		node* n = node_create();
+		n->data = routers[i];
+		if (!head) {
+			head = n;
+		} else {
+			tail->next = n;
+			n->prev = tail;
+		}
+		tail = n;
+	}
+
+	for (i = 0; i < num_routers; ++i) {
+		for (j = 0; j < 3; ++j) {
+			unsigned int other = (j == 0) ? ((i + 1) % num_routers) : (rand() % num_routers);
+			if (other == i) {
+				continue;
+			}
+			uint32_t cost = 1 + (rand() % max_cost);
+			add_link(routers[i], routers[other]->router_id, link, cost);
+			add_link(routers[other], routers[i]->router_id, link, cost);
+			++link;
+		}
+	}
+
+	*routers_out = routers;
+	return head;
+}
+
+static void free_topology(node* head, pwospf_router** routers) {
+	while (head) {
+		node* next = head->next;
+		pwospf_router* r = (pwospf_router*)head->data;
+		while (r->interface_list) {
+			node_remove(&(r->interface_list), r->interface_list);
+		}
+		node_remove(&head, head);
+		head = next;
+	}
+	free(routers);
+}
+
+/* the list scan compute_rtable used before the heap, kept as the reference */
+static void reference_spf(uint32_t our_rid, node* pwospf_router_list) {
+	node* cur;
+	for (cur = pwospf_router_list; cur; cur = cur->next) {
+		pwospf_router* r = (pwospf_router*)cur->data;
+		r->prev_router = NULL;
+		r->distance = (r->router_id == our_rid) ? 0 : 0xFFFFFFFF;
+		r->shortest_path_found = 0;
+	}
+
+	pwospf_router* w = get_router_by_rid(our_rid, pwospf_router_list);
+	while (w) {
+		w->shortest_path_found = 1;
+
+		for (cur = w->interface_list; cur; cur = cur->next) {
+			pwospf_interface* i = (pwospf_interface*)cur->data;
+			if ((i->router_id != 0) && i->is_active) {
+				pwospf_router* v = get_router_by_rid(i->router_id, pwospf_router_list);
+				if ((v) && (!v->shortest_path_found) && (w->distance + i->tx_rate < v->distance)) {
+					v->distance = w->distance + i->tx_rate;
+					v->prev_router = w;
+				}
+			}
+		}
+
+		w = NULL;
+		uint32_t shortest = 0xFFFFFFFF;
+		for (cur = pwospf_router_list; cur; cur = cur->next) {
+			pwospf_router* r = (pwospf_router*)cur->data;
+			if ((!r->shortest_path_found) && (r->distance < shortest)) {
+				w = r;
+				shortest = r->distance;
+			}
+		}
+	}
+}
+
+static double elapsed_ms(struct timeval* start, struct timeval* end) {
+	return ((end->tv_sec - start->tv_sec) * 1000.0) + ((end->tv_usec - start->tv_usec) / 1000.0);
+}
+
+static void unlink_node(node** head, node* n) {
+	if (n->prev) {
+		n->prev->next = n->next;
+	} else {
+		*head = n->next;
+	}
+	if (n->next) {
+		n->next->prev = n->prev;
+	}
+	n->prev = NULL;
+	n->next = NULL;
+}
+
+/* does r have the same equal cost next hops, in any order, as were saved from the other run? */
+static int same_next_hops(pwospf_router* r, uint32_t* rids, uint8_t num) {
+	unsigned int a, b;
+
+	if (r->num_next_rids != num) {
+		return 0;
+	}
+	for (a = 0; a < num; ++a) {
+		for (b = 0; (b < num) && (r->next_rids[b] != rids[a]); ++b);
+		if (b == num) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* returns the number of incremental runs that disagreed with a full one, in distances or next hops */
+static int bench_incremental(node** head, pwospf_router** routers, unsigned int num_routers, uint32_t max_cost, unsigned int flaps,
+		double* ms, double* settled) {
+	spf_tree* tree = spf_tree_create();
+	uint32_t* got = (uint32_t*)malloc(num_routers * sizeof(uint32_t));
+	uint32_t* got_hops = (uint32_t*)malloc(num_routers * PWOSPF_MAX_NEXT_HOPS * sizeof(uint32_t));
+	uint8_t* got_num = (uint8_t*)malloc(num_routers * sizeof(uint8_t));
+	node* detached = NULL;
+	struct timeval start, end;
+	unsigned int k, i;
+	int failed = 0;
+	node* cur;
+
+	*ms = 0;
+	*settled = 0;
+	compute_spf(tree, routers[0]->router_id, *head);
+
+	for (k = 0; k < flaps; ++k) {
+		if (detached) {
+			/* bring the router back */
+			for (cur = *head; cur->next; cur = cur->next);
+			cur->next = detached;
+			detached->prev = cur;
+			detached = NULL;
+		} else if ((k % 10) == 9) {
+			/* lose a whole router */
+			pwospf_router* r = routers[1 + (rand() % (num_routers - 1))];
+			for (cur = *head; cur->data != r; cur = cur->next);
+			unlink_node(head, cur);
+			detached = cur;
+		} else {
+			/* flap or recost one link */
+			pwospf_router* r = routers[rand() % num_routers];
+			unsigned int which = rand() % node_length(r->interface_list);
+			for (cur = r->interface_list; which > 0; cur = cur->next, --which);
+			pwospf_interface* iface = (pwospf_interface*)cur->data;
+			if (rand() % 2) {
+				iface->is_active = !iface->is_active;
+			} else {
+				iface->tx_rate = 1 + (rand() % max_cost);
+			}
+		}
+
+		gettimeofday(&start, NULL);
+		compute_spf(tree, routers[0]->router_id, *head);
+		gettimeofday(&end, NULL);
+		*ms += elapsed_ms(&start, &end);
+		*settled += spf_tree_last_settled(tree);
+
+		for (cur = *head, i = 0; cur; cur = cur->next, ++i) {
+			pwospf_router* r = (pwospf_router*)cur->data;
+			got[i] = r->distance;
+			got_num[i] = r->num_next_rids;
+			memcpy(&(got_hops[i * PWOSPF_MAX_NEXT_HOPS]), r->next_rids, sizeof(r->next_rids));
+		}
+		compute_spf(NULL, routers[0]->router_id, *head);
+		for (cur = *head, i = 0; cur; cur = cur->next, ++i) {
+			pwospf_router* r = (pwospf_router*)cur->data;
+			if ((got[i] != r->distance) || !same_next_hops(r, &(got_hops[i * PWOSPF_MAX_NEXT_HOPS]), got_num[i])) {
+				++failed;
+				break;
+			}
+		}
+	}
+
+	if (detached) {
+		for (cur = *head; cur->next; cur = cur->next);
+		cur->next = detached;
+		detached->prev = cur;
+	}
+
+	*ms /= flaps;
+	*settled /= flaps;
+	free(got);
+	free(got_hops);
+	free(got_num);
+	spf_tree_destroy(tree);
+	return failed;
+}
+
+int run_benchmark(unsigned int seed) {
+	unsigned int sizes[] = { 100, 1000, 10000 };
+	unsigned int runs[] = { 200, 20, 5 };
+	unsigned int flaps = 100;
+	int failed = 0;
+	unsigned int s, k, i;
+
+	srand(seed);
+	printf("%8s  %6s  %12s  %12s  %12s  %10s  %s\n", "routers", "runs", "heap ms", "list ms", "flap ms", "settled", "check");
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		pwospf_router** routers;
+		node* head = build_topology(sizes[s], 100, &routers);
+		uint32_t* expected = (uint32_t*)malloc(sizes[s] * sizeof(uint32_t));
+		struct timeval start, end;
+		double heap_ms, list_ms = -1, flap_ms, flap_settled;
+		char* check = "skipped";
+
+		/* the list scan is O(V^2 E), only run it where it is bearable */
+		if (sizes[s] <= 1000) {
+			gettimeofday(&start, NULL);
+			for (k = 0; k < runs[s]; ++k) {
+				reference_spf(routers[0]->router_id, head);
+			}
+			gettimeofday(&end, NULL);
+			list_ms = elapsed_ms(&start, &end) / runs[s];
+
+			for (i = 0; i < sizes[s]; ++i) {
+				expected[i] = routers[i]->distance;
+			}
+		}
+
+		gettimeofday(&start, NULL);
+		for (k = 0; k < runs[s]; ++k) {
+			compute_spf(NULL, routers[0]->router_id, head);
+		}
+		gettimeofday(&end, NULL);
+		heap_ms = elapsed_ms(&start, &end) / runs[s];
+
+		if (sizes[s] <= 1000) {
+			check = "ok";
+			for (i = 0; i < sizes[s]; ++i) {
+				if (routers[i]->distance != expected[i]) {
+					check = "MISMATCH";
+					failed = 1;
+					break;
+				}
+			}
+		}
+
+		if (bench_incremental(&head, routers, sizes[s], 100, flaps, &flap_ms, &flap_settled) > 0) {
+			check = "INCREMENTAL MISMATCH";
+			failed = 1;
+		}
+
+		char list_str[16];
+		snprintf(list_str, 16, "%.3f", list_ms);
+		printf("%8u  %6u  %12.3f  %12s  %12.3f  %10.1f  %s\n", sizes[s], runs[s], heap_ms,
+			(list_ms < 0) ? "-" : list_str, flap_ms, flap_settled, check);
+
+		free(expected);
+		free_topology(head, routers);
+	}
+
+	/* with costs of 1 to 4 most routers have equal cost paths, so the next hops get checked for real */
+	{
+		pwospf_router** routers;
+		node* head = build_topology(1000, 4, &routers);
+		double flap_ms, flap_settled;
+		char* check = "ok";
+
+		if (bench_incremental(&head, routers, 1000, 4, flaps, &flap_ms, &flap_settled) > 0) {
+			check = "INCREMENTAL MISMATCH";
+			failed = 1;
+		}
+		printf("%8u  %6s  %12s  %12s  %12.3f  %10.1f  %s (costs 1-4)\n", 1000, "-", "-", "-", flap_ms, flap_settled, check);
+		free_topology(head, routers);
+	}
+
+	return failed;
+}
+
+static node* nth_route(node* rtable, int i) {
+	while (i-- > 0) {
+		rtable = rtable->next;
+	}
+	return rtable;
+}
+
+/*
+ * Random route adds, deletes and flaps, through the same calls the CLI and pwospf use.
+ * After each step the aggregated fib has to forward like the rtable, must not be longer
+ * than the active routes it was built from, and an update with nothing changed must keep it.
+ */
+int run_fib_test(unsigned int seed) {
+	router_state rs;
+	char* ifaces[] = { "eth0", "eth1", "eth2", "eth3" };
+	unsigned int steps = 2000;
+	unsigned int step;
+	int failed = 0;
+
+	bzero(&rs, sizeof(router_state));
+	srand(seed);
+
+	for (step = 0; (step < steps) && !failed; ++step) {
+		int op = rand() % 8;
+		int num_routes = node_length(rs.rtable);
+
+		if ((op < 4) || (num_routes == 0)) {
+			struct in_addr dest, gw, mask;
+			int len = (step == steps / 2) ? 0 : 8 + rand() % 17;
+
+			/* few distinct prefixes in 10/8 so they nest and aggregate */
+			mask.s_addr = htonl(len ? (0xFFFFFFFF << (32 - len)) : 0);
+			dest.s_addr = htonl(0x0A000000 | ((rand() & 0xFF) << 16) | ((rand() & 0x3) << 8)) & mask.s_addr;
+			gw.s_addr = htonl(0xC0A80001 + rand() % 3);
+			add_route(&rs, &dest, &gw, &mask, ifaces[rand() % 4]);
+		} else if (op < 6) {
+			rtable_entry* re = (rtable_entry*)nth_route(rs.rtable, rand() % num_routes)->data;
+			struct in_addr dest = re->ip, mask = re->mask;
+			del_route(&rs, &dest, &mask);
+		} else {
+			rtable_entry* re = (rtable_entry*)nth_route(rs.rtable, rand() % num_routes)->data;
+			re->is_active ^= 1;
+			trigger_rtable_modified(&rs);
+		}
+
+		if (rs.fib_overflow) {
+			continue;
+		}
+
+		int active = 0;
+		node* cur;
+		for (cur = rs.rtable; cur; cur = cur->next) {
+			active += ((rtable_entry*)cur->data)->is_active;
+		}
+
+		int mismatches = fib_verify(&rs, 1000);
+		node* before = rs.fib;
+		trigger_rtable_modified(&rs);
+
+		if (mismatches) {
+			printf("step %u: %d addresses forwarded differently\n", step, mismatches);
+			failed = 1;
+		} else if (node_length(rs.fib) > active) {
+			printf("step %u: fib has %d entries for %d active routes\n", step, node_length(rs.fib), active);
+			failed = 1;
+		} else if (rs.fib != before) {
+			printf("step %u: fib emitted again with nothing changed\n", step);
+			failed = 1;
+		}
+	}
+
+	printf("fib: %u steps, %d routes, %d fib entries, %s\n", step, node_length(rs.rtable), node_length(rs.fib),
+		failed ? "MISMATCH" : "ok");
+
+	fib_destroy(&rs);
+	return failed;
+}
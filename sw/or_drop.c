@@ -0,0 +1,214 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "or_drop.h"
+#include "or_data_types.h"
+#include "or_utils.h"
+#include "or_flow.h"
+#include "or_timer.h"
+
+/*
+ * Every place the pipeline gives up on a packet counts it here by reason and by the interface
+ * it was on, in the worker_slot of the thread. The readers sum the slots and keep what they
+ * saw, so each of them gets rates over the time since its own last read.
+ */
+
+static const char* drop_names[DROP_NUM_REASONS] = {
+	"invalid", "iface-down", "ttl-expired", "no-route", "hairpin",
+	"arp-timeout", "unsupported", "nat-no-port", "send-failed", "bad-lsu"
+};
+
+drop_stats* drop_stats_create(void) {
+	drop_stats* ds;
+
+	if (posix_memalign((void**)&ds, 64, sizeof(drop_stats)) != 0) {
+		perror("Failure allocating drop stats");
+		exit(1);
+	}
+	memset(ds, 0, sizeof(drop_stats));
+
+	if (pthread_mutex_init(&(ds->reader_lock), NULL) != 0) {
+		perror("Failure initializing drop reader lock");
+		exit(1);
+	}
+
+	return ds;
+}
+
+void drop_stats_destroy(drop_stats* ds) {
+	if (!ds) {
+		return;
+	}
+	pthread_mutex_destroy(&(ds->reader_lock));
+	free(ds);
+}
+
+/*
+ * IS THREAD SAFE
+ * Counts a dropped packet, iface is where it arrived or was headed, NULL if neither.
+ */
+void drop_count(router_state* rs, int reason, const char* iface) {
+	drop_stats* ds = rs->drop_stats;
+	int slot = worker_slot();
+	int i = flow_ifindex(iface);
+
+	assert((reason >= 0) && (reason < DROP_NUM_REASONS));
+
+	if (i >= DROP_MAX_IFACES) {
+		i = 0;
+	}
+
+	if (slot != WORKER_SHARED) {
+		ds->workers[slot].count[i][reason]++;
+	} else {
+		__sync_fetch_and_add(&(ds->workers[slot].count[i][reason]), 1);
+	}
+}
+
+/*
+ * NOT THREAD SAFE, LOCK THE READERS
+ * Sums the slots into total, the growth since reader last looked into delta.
+ * Returns: ms since reader last looked, 0 on its first read
+ */
+static uint64_t drop_read(drop_stats* ds, drop_reader* reader, uint64_t total[DROP_MAX_IFACES][DROP_NUM_REASONS],
+		uint64_t delta[DROP_MAX_IFACES][DROP_NUM_REASONS]) {
+	uint64_t now = timer_now_ms();
+	uint64_t interval = reader->last_ms ? (now - reader->last_ms) : 0;
+	int w, i, r;
+
+	memset(total, 0, sizeof(uint64_t) * DROP_MAX_IFACES * DROP_NUM_REASONS);
+	for (w = 0; w <= NUM_WORKERS; ++w) {
+		for (i = 0; i < DROP_MAX_IFACES; ++i) {
+			for (r = 0; r < DROP_NUM_REASONS; ++r) {
+				total[i][r] += ds->workers[w].count[i][r];
+			}
+		}
+	}
+
+	for (i = 0; i < DROP_MAX_IFACES; ++i) {
+		for (r = 0; r < DROP_NUM_REASONS; ++r) {
+			delta[i][r] = total[i][r] - reader->last[i][r];
+			reader->last[i][r] = total[i][r];
+		}
+	}
+	reader->last_ms = now;
+
+	return interval;
+}
+
+static void drop_iface_name(int i, char* name, int len) {
+	if (i == 0) {
+		snprintf(name, len, "none");
+	} else {
+		snprintf(name, len, "eth%d", i - 1);
+	}
+}
+
+void sprint_drops(router_state* rs, char** buf, int* len) {
+	drop_stats* ds = rs->drop_stats;
+	uint64_t total[DROP_MAX_IFACES][DROP_NUM_REASONS];
+	uint64_t delta[DROP_MAX_IFACES][DROP_NUM_REASONS];
+	uint64_t interval;
+	int alloc_size = 1024;
+	char* buffer = calloc(1, alloc_size);
+	char line[256];
+	char name[16];
+	int i, r;
+
+	pthread_mutex_lock(&(ds->reader_lock));
+	interval = drop_read(ds, &(ds->readers[DROP_READER_CLI]), total, delta);
+	pthread_mutex_unlock(&(ds->reader_lock));
+
+	snprintf(line, 256, "%-12s %12s %12s  %s (rates over %.1f s)\n", "Reason", "Total", "Per second",
+		"By interface", interval / 1000.0);
+	buffer = my_strncat(buffer, line, &alloc_size);
+
+	for (r = 0; r < DROP_NUM_REASONS; ++r) {
+		uint64_t sum = 0, dsum = 0;
+		for (i = 0; i < DROP_MAX_IFACES; ++i) {
+			sum += total[i][r];
+			dsum += delta[i][r];
+		}
+
+		snprintf(line, 256, "%-12s %12llu %12.1f ", drop_names[r], (unsigned long long)sum,
+			interval ? (dsum * 1000.0 / interval) : 0.0);
+		buffer = my_strncat(buffer, line, &alloc_size);
+
+		for (i = 0; i < DROP_MAX_IFACES; ++i) {
+			if (total[i][r]) {
+				drop_iface_name(i, name, 16);
+				snprintf(line, 256, " %s %llu", name, (unsigned long long)total[i][r]);
+				buffer = my_strncat(buffer, line, &alloc_size);
+			}
+		}
+		buffer = my_strncat(buffer, "\n", &alloc_size);
+	}
+
+	*buf = buffer;
+	*len = strlen(buffer);
+}
+
+/* same as sprint_drops for scripts, with its own rate interval */
+void sprint_drops_json(router_state* rs, char** buf, int* len) {
+	drop_stats* ds = rs->drop_stats;
+	uint64_t total[DROP_MAX_IFACES][DROP_NUM_REASONS];
+	uint64_t delta[DROP_MAX_IFACES][DROP_NUM_REASONS];
+	uint64_t interval;
+	int alloc_size = 1024;
+	char* buffer = calloc(1, alloc_size);
+	char line[256];
+	char name[16];
+	int i, r, first;
+
+	pthread_mutex_lock(&(ds->reader_lock));
+	interval = drop_read(ds, &(ds->readers[DROP_READER_WWW]), total, delta);
+	pthread_mutex_unlock(&(ds->reader_lock));
+
+	snprintf(line, 256, "{\"interval_ms\": %llu, \"reasons\": {", (unsigned long long)interval);
+	buffer = my_strncat(buffer, line, &alloc_size);
+
+	for (r = 0; r < DROP_NUM_REASONS; ++r) {
+		uint64_t sum = 0, dsum = 0;
+		for (i = 0; i < DROP_MAX_IFACES; ++i) {
+			sum += total[i][r];
+			dsum += delta[i][r];
+		}
+
+		snprintf(line, 256, "%s\"%s\": {\"total\": %llu, \"rate\": %.3f, \"ifaces\": {", (r ? ", " : ""),
+			drop_names[r], (unsigned long long)sum, interval ? (dsum * 1000.0 / interval) : 0.0);
+		buffer = my_strncat(buffer, line, &alloc_size);
+
+		first = 1;
+		for (i = 0; i < DROP_MAX_IFACES; ++i) {
+			if (total[i][r]) {
+				drop_iface_name(i, name, 16);
+				snprintf(line, 256, "%s\"%s\": {\"total\": %llu, \"rate\": %.3f}", (first ? "" : ", "), name,
+					(unsigned long long)total[i][r], interval ? (delta[i][r] * 1000.0 / interval) : 0.0);
+				buffer = my_strncat(buffer, line, &alloc_size);
+				first = 0;
+			}
+		}
+		buffer = my_strncat(buffer, "}}", &alloc_size);
+	}
+	buffer = my_strncat(buffer, "}}\n", &alloc_size);
+
+	*buf = buffer;
+	*len = strlen(buffer);
+}
+
+void cli_show_ip_drops(router_state* rs, cli_request* req) {
+	char* buf;
+	int len;
+
+	sprint_drops(rs, &buf, &len);
+	send_to_socket(req->sockfd, buf, len);
+	free(buf);
+}
@@ -0,0 +1,23 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#ifndef OR_DROP_H_
+#define OR_DROP_H_
+
+#include "or_data_types.h"
+#include "sr_base_internal.h"
+
+drop_stats* drop_stats_create(void);
+void drop_stats_destroy(drop_stats* ds);
+
+void drop_count(router_state* rs, int reason, const char* iface);
+
+void sprint_drops(router_state* rs, char** buf, int* len);
+void sprint_drops_json(router_state* rs, char** buf, int* len);
+
+void cli_show_ip_drops(router_state* rs, cli_request* req);
+
+#endif /*OR_DROP_H_*/
@@ -0,0 +1,490 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <assert.h>
+
+#include "or_fib.h"
+#include "or_data_types.h"
+#include "or_output.h"
+#include "or_rtable.h"
+#include "or_utils.h"
+
+/*
+ * The hardware only has ROUTER_OP_LUT_ROUTE_TABLE_DEPTH route slots, so rather than writing
+ * the rtable out verbatim we compress it with ORTC (Draves et al., "Constructing Optimal
+ * IP Routing Tables") into the smallest prefix set that forwards every address the same way.
+ *
+ * The routes are kept in a binary trie that persists across updates. Each node caches
+ * the ORTC candidate set of its subtree, so a route change only recomputes the sets
+ * on the path from the changed prefix to the root (plus any subtree whose inherited
+ * next hop changed). Next hops are (gw, iface) pairs interned into a small table so the
+ * candidate sets fit in a 64 bit mask.
+ *
+ * Only pass 2 is incremental. The rtable is edited in place by several callers that
+ * don't say what they changed, so every update walks the whole rtable into the trie and
+ * sweeps the whole trie for withdrawn routes, O(routes * 32). When the trie came out
+ * unchanged the fib is kept as it is, otherwise pass 3 emits it again from the root.
+ * That is linear in the trie, its output is bounded by the hardware table.
+ *
+ * Addresses not covered by any route must stay uncovered, otherwise the hardware would
+ * forward packets the software would have answered with ICMP net unknown. Any subtree
+ * containing such a hole is therefore never covered by an aggregate.
+ */
+
+#define FIB_NH_BIT(nh) (((uint64_t)1) << (nh))
+
+static int fib_prefix_len(uint32_t mask) {
+	int i;
+	int bits = 0;
+	for (i = 0; i < 32; ++i) {
+		if ((mask >> i) & 0x1) {
+			++bits;
+		}
+	}
+	return bits;
+}
+
+static uint32_t fib_len_to_mask(int len) {
+	return (len == 0) ? 0 : (0xFFFFFFFF << (32 - len));
+}
+
+/*
+ * Returns the index of the next hop matching the entry with its reference taken,
+ * or FIB_NO_ROUTE if the table is full.
+ */
+static int fib_get_next_hop(router_state* rs, rtable_entry* re) {
+	int i;
+	int free_slot = FIB_NO_ROUTE;
+
+	for (i = 0; i < FIB_MAX_NEXT_HOPS; ++i) {
+		fib_next_hop* nh = &(rs->fib_next_hops[i]);
+		if (nh->refs == 0) {
+			if (free_slot == FIB_NO_ROUTE) {
+				free_slot = i;
+			}
+		} else if ((nh->gw.s_addr == re->gw.s_addr) && (strncmp(nh->iface, re->iface, IF_LEN) == 0)) {
+			++nh->refs;
+			return i;
+		}
+	}
+
+	if (free_slot != FIB_NO_ROUTE) {
+		fib_next_hop* nh = &(rs->fib_next_hops[free_slot]);
+		nh->gw.s_addr = re->gw.s_addr;
+		strncpy(nh->iface, re->iface, IF_LEN);
+		nh->refs = 1;
+	}
+
+	return free_slot;
+}
+
+static void fib_put_next_hop(router_state* rs, int nh) {
+	assert(nh >= 0 && nh < FIB_MAX_NEXT_HOPS);
+	assert(rs->fib_next_hops[nh].refs > 0);
+	--rs->fib_next_hops[nh].refs;
+}
+
+static void fib_mark_dirty(fib_node* n) {
+	while (n) {
+		n->dirty = 1;
+		n = n->parent;
+	}
+}
+
+static fib_node* fib_node_create(fib_node* parent) {
+	fib_node* n = (fib_node*)calloc(1, sizeof(fib_node));
+	n->parent = parent;
+	n->nh = FIB_NO_ROUTE;
+	n->inherited = FIB_NO_ROUTE;
+	n->dirty = 1;
+	return n;
+}
+
+/* ip in host byte order */
+static fib_node* fib_find_or_create(router_state* rs, uint32_t ip, int len) {
+	int depth;
+
+	if (!rs->fib_trie) {
+		rs->fib_trie = fib_node_create(NULL);
+	}
+
+	fib_node* n = rs->fib_trie;
+	for (depth = 0; depth < len; ++depth) {
+		int bit = (ip >> (31 - depth)) & 0x1;
+		if (!n->child[bit]) {
+			n->child[bit] = fib_node_create(n);
+			fib_mark_dirty(n);
+		}
+		n = n->child[bit];
+	}
+
+	return n;
+}
+
+/*
+ * Withdraws routes that were not refreshed in this generation and frees empty leaves.
+ * Returns 1 if the node itself was freed.
+ */
+static int fib_sweep(router_state* rs, fib_node* n) {
+	int i;
+	for (i = 0; i < 2; ++i) {
+		if (n->child[i] && fib_sweep(rs, n->child[i])) {
+			n->child[i] = NULL;
+			fib_mark_dirty(n);
+		}
+	}
+
+	if ((n->nh != FIB_NO_ROUTE) && (n->gen != rs->fib_gen)) {
+		fib_put_next_hop(rs, n->nh);
+		n->nh = FIB_NO_ROUTE;
+		fib_mark_dirty(n);
+	}
+
+	if ((n->nh == FIB_NO_ROUTE) && !n->child[0] && !n->child[1]) {
+		free(n);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* ORTC passes 1 and 2, missing children are treated as leaves inheriting our next hop */
+static void fib_compute_sets(fib_node* n, int inherited) {
+	int i;
+
+	if (!n->dirty && (n->inherited == inherited)) {
+		return;
+	}
+
+	int eff = (n->nh != FIB_NO_ROUTE) ? n->nh : inherited;
+	uint64_t set[2];
+	int hole[2];
+
+	if (!n->child[0] && !n->child[1]) {
+		n->has_hole = (eff == FIB_NO_ROUTE);
+		n->set = n->has_hole ? 0 : FIB_NH_BIT(eff);
+	} else {
+		for (i = 0; i < 2; ++i) {
+			if (n->child[i]) {
+				fib_compute_sets(n->child[i], eff);
+				set[i] = n->child[i]->set;
+				hole[i] = n->child[i]->has_hole;
+			} else {
+				hole[i] = (eff == FIB_NO_ROUTE);
+				set[i] = hole[i] ? 0 : FIB_NH_BIT(eff);
+			}
+		}
+
+		n->has_hole = (hole[0] || hole[1]);
+		if (n->has_hole) {
+			n->set = 0;
+		} else if (set[0] & set[1]) {
+			n->set = set[0] & set[1];
+		} else {
+			n->set = set[0] | set[1];
+		}
+	}
+
+	n->inherited = inherited;
+	n->dirty = 0;
+}
+
+static void fib_emit_entry(router_state* rs, node** out, uint32_t prefix, int len, int nh) {
+	rtable_entry* entry = (rtable_entry*)calloc(1, sizeof(rtable_entry));
+	entry->ip.s_addr = htonl(prefix);
+	entry->mask.s_addr = htonl(fib_len_to_mask(len));
+	entry->gw.s_addr = rs->fib_next_hops[nh].gw.s_addr;
+	strncpy(entry->iface, rs->fib_next_hops[nh].iface, IF_LEN);
+	entry->is_active = 1;
+	entry->is_static = 0;
+
+	node* n = node_create();
+	n->data = entry;
+	if (out[len] == NULL) {
+		out[len] = n;
+	} else {
+		node_push_back(out[len], n);
+	}
+}
+
+static int fib_lowest_next_hop(uint64_t set) {
+	int i;
+	for (i = 0; i < FIB_MAX_NEXT_HOPS; ++i) {
+		if (set & FIB_NH_BIT(i)) {
+			return i;
+		}
+	}
+	return FIB_NO_ROUTE;
+}
+
+/* ORTC pass 3, out is indexed by prefix length */
+static void fib_emit(router_state* rs, fib_node* n, uint32_t prefix, int len, int chosen_above, node** out) {
+	int i;
+	int chosen;
+
+	if (n->has_hole) {
+		chosen = FIB_NO_ROUTE;
+	} else if ((chosen_above != FIB_NO_ROUTE) && (n->set & FIB_NH_BIT(chosen_above))) {
+		chosen = chosen_above;
+	} else {
+		chosen = fib_lowest_next_hop(n->set);
+		fib_emit_entry(rs, out, prefix, len, chosen);
+	}
+
+	if (!n->child[0] && !n->child[1]) {
+		return;
+	}
+
+	int eff = (n->nh != FIB_NO_ROUTE) ? n->nh : n->inherited;
+	for (i = 0; i < 2; ++i) {
+		uint32_t child_prefix = prefix | (((uint32_t)i) << (31 - len));
+		if (n->child[i]) {
+			fib_emit(rs, n->child[i], child_prefix, len + 1, chosen, out);
+		} else if ((eff != FIB_NO_ROUTE) && (eff != chosen)) {
+			fib_emit_entry(rs, out, child_prefix, len + 1, eff);
+		}
+	}
+}
+
+static void fib_free_trie(fib_node* n) {
+	if (n) {
+		fib_free_trie(n->child[0]);
+		fib_free_trie(n->child[1]);
+		free(n);
+	}
+}
+
+static void fib_free_list(node** head) {
+	while (*head) {
+		node_remove(head, *head);
+	}
+}
+
+/*
+ * Brings the aggregated fib in line with the active routes of the rtable, see the top
+ * of the file for what is redone each time.
+ * NOT Threadsafe, ensure rtable locked for write
+ */
+void fib_update(router_state* rs) {
+	int i;
+
+	if (!rs->fib_next_hops) {
+		rs->fib_next_hops = (fib_next_hop*)calloc(FIB_MAX_NEXT_HOPS, sizeof(fib_next_hop));
+	}
+
+	++rs->fib_gen;
+	rs->fib_overflow = 0;
+
+	node* cur = rs->rtable;
+	while (cur) {
+		rtable_entry* re = (rtable_entry*)cur->data;
+		cur = cur->next;
+
+		if (!re->is_active) {
+			continue;
+		}
+
+		int len = fib_prefix_len(ntohl(re->mask.s_addr));
+		uint32_t ip = ntohl(re->ip.s_addr) & fib_len_to_mask(len);
+		fib_node* n = fib_find_or_create(rs, ip, len);
+
+		/* the rtable is sorted so the first active entry for a prefix is the one get_next_hop uses */
+		if (n->gen == rs->fib_gen) {
+			continue;
+		}
+		n->gen = rs->fib_gen;
+
+		int nh = fib_get_next_hop(rs, re);
+		if (nh == FIB_NO_ROUTE) {
+			rs->fib_overflow = 1;
+			continue;
+		}
+
+		if (nh != n->nh) {
+			if (n->nh != FIB_NO_ROUTE) {
+				fib_put_next_hop(rs, n->nh);
+			}
+			n->nh = nh;
+			fib_mark_dirty(n);
+		} else {
+			fib_put_next_hop(rs, nh);
+		}
+	}
+
+	if (rs->fib_trie && fib_sweep(rs, rs->fib_trie)) {
+		rs->fib_trie = NULL;
+	}
+
+	if (rs->fib_overflow || !rs->fib_trie) {
+		/* too many distinct next hops to aggregate, write_rtable_to_hw falls back to the rtable */
+		fib_free_list(&(rs->fib));
+		return;
+	}
+
+	/* every change marks the path up to the root, a clean root forwards as before */
+	if (!rs->fib_trie->dirty && rs->fib) {
+		return;
+	}
+
+	fib_free_list(&(rs->fib));
+	fib_compute_sets(rs->fib_trie, FIB_NO_ROUTE);
+
+	node* out[33];
+	bzero(out, sizeof(out));
+	fib_emit(rs, rs->fib_trie, 0, 0, FIB_NO_ROUTE, out);
+
+	/* longest prefixes first, same order as the rtable */
+	for (i = 32; i >= 0; --i) {
+		if (out[i] == NULL) {
+			continue;
+		}
+		if (rs->fib == NULL) {
+			rs->fib = out[i];
+		} else {
+			node* tail = rs->fib;
+			while (tail->next) {
+				tail = tail->next;
+			}
+			tail->next = out[i];
+			out[i]->prev = tail;
+		}
+	}
+}
+
+/*
+ * NOT Threadsafe, ensure rtable locked for write
+ */
+void fib_destroy(router_state* rs) {
+	fib_free_list(&(rs->fib));
+	fib_free_trie(rs->fib_trie);
+	rs->fib_trie = NULL;
+	free(rs->fib_next_hops);
+	rs->fib_next_hops = NULL;
+}
+
+/*
+ * Longest prefix match over a list of rtable entries, ignoring inactive ones.
+ * Returns: the matching entry or NULL
+ */
+rtable_entry* fib_lookup(node* table, struct in_addr* destination) {
+	rtable_entry* lpm = NULL;
+	int most_bits_matched = -1;
+	uint32_t dest_ip = ntohl(destination->s_addr);
+
+	while (table) {
+		rtable_entry* re = (rtable_entry*)table->data;
+		if (re->is_active) {
+			uint32_t mask = ntohl(re->mask.s_addr);
+			int bits_matched = fib_prefix_len(mask);
+			if (((ntohl(re->ip.s_addr) & mask) == (dest_ip & mask)) && (bits_matched > most_bits_matched)) {
+				lpm = re;
+				most_bits_matched = bits_matched;
+			}
+		}
+		table = table->next;
+	}
+
+	return lpm;
+}
+
+static int fib_lookup_matches(router_state* rs, uint32_t addr) {
+	struct in_addr dest;
+	dest.s_addr = htonl(addr);
+
+	rtable_entry* a = fib_lookup(rs->rtable, &dest);
+	rtable_entry* b = fib_lookup(rs->fib, &dest);
+
+	if (!a || !b) {
+		return (a == b);
+	}
+
+	return ((a->gw.s_addr == b->gw.s_addr) && (strncmp(a->iface, b->iface, IF_LEN) == 0));
+}
+
+/*
+ * Checks that the aggregated fib forwards like the rtable. Every route is probed at
+ * its first and last address and at one random address inside it, plus samples uniformly
+ * random addresses.
+ * NOT Threadsafe, ensure rtable locked
+ * Returns: the number of addresses forwarded differently
+ */
+int fib_verify(router_state* rs, unsigned int samples) {
+	unsigned int i;
+	int mismatches = 0;
+
+	if (rs->fib_overflow) {
+		return 0;
+	}
+
+	node* cur = rs->rtable;
+	while (cur) {
+		rtable_entry* re = (rtable_entry*)cur->data;
+		uint32_t mask = ntohl(re->mask.s_addr);
+		uint32_t first = ntohl(re->ip.s_addr) & mask;
+		uint32_t last = first | ~mask;
+		uint32_t random_addr = first | (((uint32_t)rand() << 16 ^ (uint32_t)rand()) & ~mask);
+
+		mismatches += !fib_lookup_matches(rs, first);
+		mismatches += !fib_lookup_matches(rs, last);
+		mismatches += !fib_lookup_matches(rs, random_addr);
+
+		cur = cur->next;
+	}
+
+	for (i = 0; i < samples; ++i) {
+		uint32_t addr = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+		mismatches += !fib_lookup_matches(rs, addr);
+	}
+
+	return mismatches;
+}
+
+
+void cli_show_ip_fib(router_state *rs, cli_request *req) {
+	char *fib_info;
+	int len;
+	char line[128];
+
+	lock_rtable_rd(rs);
+	if (rs->fib_overflow) {
+		snprintf(line, 128, "FIB aggregation disabled: more than %i distinct next hops\n", FIB_MAX_NEXT_HOPS);
+		send_to_socket(req->sockfd, line, strlen(line));
+		unlock_rtable(rs);
+		return;
+	}
+	snprintf(line, 128, "%i routes aggregated to %i\n", node_length(rs->rtable), node_length(rs->fib));
+	sprint_fib(rs, &fib_info, &len);
+	unlock_rtable(rs);
+
+	send_to_socket(req->sockfd, line, strlen(line));
+	send_to_socket(req->sockfd, fib_info, len);
+	free(fib_info);
+}
+
+void cli_show_ip_fib_help(router_state *rs, cli_request *req) {
+	char *usage = "usage: show ip fib\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+}
+
+void cli_ip_fib_verify(router_state *rs, cli_request *req) {
+	unsigned int samples = 0;
+	char line[128];
+
+	if (sscanf(req->command, "ip fib verify %u", &samples) != 1) {
+		samples = 10000;
+	}
+
+	lock_rtable_rd(rs);
+	int mismatches = fib_verify(rs, samples);
+	unlock_rtable(rs);
+
+	snprintf(line, 128, "%i mismatches over %u random addresses and every route\n", mismatches, samples);
+	send_to_socket(req->sockfd, line, strlen(line));
+}
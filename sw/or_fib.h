@@ -0,0 +1,22 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#ifndef OR_FIB_H_
+#define OR_FIB_H_
+
+#include "or_data_types.h"
+#include "sr_base_internal.h"
+
+void fib_update(router_state* rs);
+void fib_destroy(router_state* rs);
+rtable_entry* fib_lookup(node* table, struct in_addr* destination);
+int fib_verify(router_state* rs, unsigned int samples);
+
+void cli_show_ip_fib(router_state *rs, cli_request *req);
+void cli_show_ip_fib_help(router_state *rs, cli_request *req);
+void cli_ip_fib_verify(router_state *rs, cli_request *req);
+
+#endif /*OR_FIB_H_*/
@@ -0,0 +1,666 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "or_flow.h"
+#include "or_data_types.h"
+#include "or_utils.h"
+#include "or_ip.h"
+#include "or_timer.h"
+
+/*
+ * Flow telemetry. Forwarded packets are accounted per (src, dst, sport, dport, proto, ingress,
+ * egress) in the cache of the forwarding thread's worker, 1 in sample of them if sampling is
+ * on. Every FLOW_SWEEP_INTERVAL the sweep takes out the flows that have been idle for the
+ * inactive timeout or alive for the active timeout, at most export_rate a second, and sends
+ * them to the collector as IPFIX (RFC 7011) over udp. Flows past that budget stay in the
+ * cache until the next sweep. Each worker has a fixed pool of entries, a new flow finding it
+ * empty is counted as an overflow and not tracked.
+ *
+ * A forwarding thread with a slot of its own (worker_register) is the only writer of its
+ * worker's chains and free list and takes no lock. It claims an entry with a compare and swap
+ * from LIVE to BUSY while it updates it, the sweep claims an expired one from LIVE to DEAD,
+ * copies it out and pushes it on the worker's dead list. Neither side ever waits for the
+ * other: a packet finding its flow DEAD starts a new entry, the sweep skips a BUSY one since
+ * it was just hit. The owner unlinks the dead entries on its next packet. Threads without a
+ * slot share the WORKER_SHARED worker and take its lock among themselves.
+ */
+
+#define IPFIX_VERSION 10
+#define IPFIX_TEMPLATE_SET 2
+#define IPFIX_TEMPLATE_ID 256
+#define IPFIX_HDR_LEN 16
+#define IPFIX_SET_HDR_LEN 4
+
+/* flowEndReason */
+#define FLOW_END_IDLE 1
+#define FLOW_END_ACTIVE 2
+
+/* information element id and length of each field of our data records, in order */
+static const uint16_t flow_template[][2] = {
+	{ 8, 4 },	/* sourceIPv4Address */
+	{ 12, 4 },	/* destinationIPv4Address */
+	{ 7, 2 },	/* sourceTransportPort */
+	{ 11, 2 },	/* destinationTransportPort */
+	{ 4, 1 },	/* protocolIdentifier */
+	{ 6, 1 },	/* tcpControlBits */
+	{ 10, 4 },	/* ingressInterface */
+	{ 14, 4 },	/* egressInterface */
+	{ 2, 8 },	/* packetDeltaCount */
+	{ 1, 8 },	/* octetDeltaCount */
+	{ 152, 8 },	/* flowStartMilliseconds */
+	{ 153, 8 },	/* flowEndMilliseconds */
+	{ 136, 1 },	/* flowEndReason */
+	{ 34, 4 }	/* samplingInterval */
+};
+#define FLOW_TEMPLATE_FIELDS (sizeof(flow_template) / sizeof(flow_template[0]))
+#define FLOW_RECORD_LEN 59
+#define FLOW_TEMPLATE_SET_LEN (IPFIX_SET_HDR_LEN + 4 + (FLOW_TEMPLATE_FIELDS * 4))
+
+/* an expired flow on its way out */
+struct flow_export {
+	flow_entry e;
+	uint8_t reason;
+};
+typedef struct flow_export flow_export;
+
+static uint32_t flow_hash(const flow_key* k) {
+	uint32_t h = k->src;
+	h = (h * 0x9E3779B1) ^ k->dst;
+	h = (h * 0x9E3779B1) ^ ((((uint32_t)k->sport) << 16) | k->dport);
+	h = (h * 0x9E3779B1) ^ ((((uint32_t)k->proto) << 16) | (((uint32_t)k->in_if) << 8) | k->out_if);
+	h *= 0x9E3779B1;
+	return h ^ (h >> 16);
+}
+
+/*
+ * NOT THREAD SAFE, OWNER OF THE WORKER ONLY
+ * Empties the worker, entries the sweep has claimed stay out until they come back on the
+ * dead list.
+ */
+static void flow_worker_clear(flow_worker* w) {
+	flow_entry* e;
+	int i;
+
+	memset(w->buckets, 0, sizeof(w->buckets));
+	w->free_entries = NULL;
+	w->num_entries = 0;
+	for (i = FLOW_MAX_ENTRIES - 1; i >= 0; --i) {
+		e = &(w->entries[i]);
+		if ((e->state == FLOW_ENTRY_FREE) || __sync_bool_compare_and_swap(&(e->state), FLOW_ENTRY_LIVE, FLOW_ENTRY_FREE)) {
+			e->next = w->free_entries;
+			w->free_entries = e;
+		} else {
+			w->num_entries++;
+		}
+	}
+}
+
+/*
+ * NOT THREAD SAFE, OWNER OF THE WORKER ONLY
+ * Takes back the entries the sweep exported. One cleared out from under the sweep is in no
+ * chain anymore.
+ */
+static void flow_worker_reap(flow_worker* w) {
+	flow_entry* e = __sync_lock_test_and_set(&(w->dead), NULL);
+	flow_entry* next;
+	flow_entry** prev;
+
+	while (e) {
+		next = e->dead_next;
+		prev = &(w->buckets[e->hash & (FLOW_HASH_BUCKETS - 1)]);
+		while (*prev && (*prev != e)) {
+			prev = &((*prev)->next);
+		}
+		if (*prev) {
+			*prev = e->next;
+		}
+		e->state = FLOW_ENTRY_FREE;
+		e->next = w->free_entries;
+		w->free_entries = e;
+		w->num_entries--;
+		e = next;
+	}
+}
+
+/* Returns: the flowEndReason e has expired for, 0 if it has not */
+static uint8_t flow_expired(const flow_entry* e, uint64_t now, uint64_t active, uint64_t inactive) {
+	if (e->last + inactive <= now) {
+		return FLOW_END_IDLE;
+	}
+	if (e->first + active <= now) {
+		return FLOW_END_ACTIVE;
+	}
+	return 0;
+}
+
+flow_cache* flow_cache_create(void) {
+	flow_cache* fc = (flow_cache*)calloc(1, sizeof(flow_cache));
+	int i;
+
+	for (i = 0; i <= NUM_WORKERS; ++i) {
+		flow_worker* w = &(fc->workers[i]);
+		if (pthread_mutex_init(&(w->lock), NULL) != 0) {
+			perror("Failure initializing flow worker lock");
+			exit(1);
+		}
+		w->entries = (flow_entry*)calloc(FLOW_MAX_ENTRIES, sizeof(flow_entry));
+		flow_worker_clear(w);
+	}
+
+	if (pthread_mutex_init(&(fc->config_lock), NULL) != 0) {
+		perror("Failure initializing flow config lock");
+		exit(1);
+	}
+
+	fc->sockfd = -1;
+	fc->sample = 1;
+	fc->active_timeout = FLOW_DEFAULT_ACTIVE_TIMEOUT;
+	fc->inactive_timeout = FLOW_DEFAULT_INACTIVE_TIMEOUT;
+	fc->export_rate = FLOW_DEFAULT_EXPORT_RATE;
+
+	return fc;
+}
+
+void flow_cache_destroy(flow_cache* fc) {
+	int i;
+
+	if (!fc) {
+		return;
+	}
+
+	for (i = 0; i <= NUM_WORKERS; ++i) {
+		pthread_mutex_destroy(&(fc->workers[i].lock));
+		free(fc->workers[i].entries);
+	}
+	if (fc->sockfd >= 0) {
+		close(fc->sockfd);
+	}
+	pthread_mutex_destroy(&(fc->config_lock));
+	free(fc);
+}
+
+/* Returns: the interface number plus one, eth2 is 3, 0 if the name has none */
+uint8_t flow_ifindex(const char* iface) {
+	const char* p;
+
+	if (!iface) {
+		return 0;
+	}
+
+	p = iface + strlen(iface);
+	while ((p > iface) && (p[-1] >= '0') && (p[-1] <= '9')) {
+		--p;
+	}
+
+	return (*p) ? (uint8_t)(atoi(p) + 1) : 0;
+}
+
+/*
+ * IS THREAD SAFE
+ * Accounts a packet forwarded from in_iface to out_iface.
+ */
+void flow_account(router_state* rs, const uint8_t* packet, unsigned int len, const char* in_iface, const char* out_iface) {
+	flow_cache* fc = rs->flow_cache;
+	flow_worker* w;
+	flow_entry* e;
+	flow_key k;
+	ip_hdr* ip;
+	const uint8_t* l4;
+	uint8_t flags = 0;
+	uint32_t sample, count;
+	uint32_t b;
+	uint64_t now;
+	int slot;
+
+	if (!fc || !fc->enabled) {
+		return;
+	}
+
+	slot = worker_slot();
+	w = &(fc->workers[slot]);
+	sample = fc->sample;
+	if (slot != WORKER_SHARED) {
+		w->packets++;
+		count = ++(w->sample_count);
+	} else {
+		__sync_fetch_and_add(&(w->packets), 1);
+		count = __sync_add_and_fetch(&(w->sample_count), 1);
+	}
+	if ((sample > 1) && ((count % sample) != 0)) {
+		return;
+	}
+
+	ip = get_ip_hdr(packet, len);
+	l4 = ((const uint8_t*)ip) + (ip->ip_hl * 4);
+
+	memset(&k, 0, sizeof(flow_key));
+	k.src = ip->ip_src.s_addr;
+	k.dst = ip->ip_dst.s_addr;
+	k.proto = ip->ip_p;
+	k.in_if = flow_ifindex(in_iface);
+	k.out_if = flow_ifindex(out_iface);
+
+	/* first fragments only reach here, is_packet_valid drops the rest */
+	if ((k.proto == IP_PROTO_TCP) && (l4 + sizeof(nat_tcp_hdr) <= packet + len)) {
+		nat_tcp_hdr* tcp = (nat_tcp_hdr*)l4;
+		k.sport = tcp->tcp_sport;
+		k.dport = tcp->tcp_dport;
+		flags = tcp->tcp_flags;
+	} else if ((k.proto == IP_PROTO_UDP) && (l4 + sizeof(nat_udp_hdr) <= packet + len)) {
+		nat_udp_hdr* udp = (nat_udp_hdr*)l4;
+		k.sport = udp->udp_sport;
+		k.dport = udp->udp_dport;
+	} else if ((k.proto == IP_PROTO_ICMP) && (l4 + sizeof(icmp_hdr) <= packet + len)) {
+		icmp_hdr* icmp = (icmp_hdr*)l4;
+		k.dport = htons((((uint16_t)icmp->icmp_type) << 8) | icmp->icmp_code);
+	}
+
+	b = flow_hash(&k);
+	now = timer_now_ms();
+
+	if (slot == WORKER_SHARED) {
+		pthread_mutex_lock(&(w->lock));
+	}
+
+	if (w->clear_gen != fc->clear_gen) {
+		flow_worker_clear(w);
+		w->clear_gen = fc->clear_gen;
+	}
+	if (w->dead) {
+		flow_worker_reap(w);
+	}
+
+	for (e = w->buckets[b & (FLOW_HASH_BUCKETS - 1)]; e; e = e->next) {
+		if ((e->hash == b) && (memcmp(&(e->key), &k, sizeof(flow_key)) == 0)
+				&& __sync_bool_compare_and_swap(&(e->state), FLOW_ENTRY_LIVE, FLOW_ENTRY_BUSY)) {
+			break;
+		}
+	}
+
+	if (!e) {
+		if (!w->free_entries) {
+			w->overflows++;
+			if (slot == WORKER_SHARED) {
+				pthread_mutex_unlock(&(w->lock));
+			}
+			return;
+		}
+
+		/* free entries are the owner's alone, the sweep only claims LIVE ones */
+		e = w->free_entries;
+		w->free_entries = e->next;
+		memset(e, 0, sizeof(flow_entry));
+		e->state = FLOW_ENTRY_BUSY;
+		e->key = k;
+		e->hash = b;
+		e->first = now;
+		e->next = w->buckets[b & (FLOW_HASH_BUCKETS - 1)];
+		w->buckets[b & (FLOW_HASH_BUCKETS - 1)] = e;
+		w->num_entries++;
+		w->created++;
+	}
+
+	e->last = now;
+	e->packets++;
+	e->bytes += ntohs(ip->ip_len);
+	e->tcp_flags |= flags;
+
+	/* the sweep copies the entry once it claims it, it has to see all of the above */
+	__sync_synchronize();
+	e->state = FLOW_ENTRY_LIVE;
+
+	if (slot == WORKER_SHARED) {
+		pthread_mutex_unlock(&(w->lock));
+	}
+}
+
+static uint8_t* flow_put16(uint8_t* p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static uint8_t* flow_put32(uint8_t* p, uint32_t v) {
+	p = flow_put16(p, v >> 16);
+	return flow_put16(p, v);
+}
+
+static uint8_t* flow_put64(uint8_t* p, uint64_t v) {
+	p = flow_put32(p, v >> 32);
+	return flow_put32(p, v);
+}
+
+/* NOT THREAD SAFE, LOCK THE CONFIG */
+static void flow_send(flow_cache* fc, uint8_t* msg, unsigned int len) {
+	if (sendto(fc->sockfd, msg, len, 0, (struct sockaddr*)&(fc->collector), sizeof(struct sockaddr_in)) != (int)len) {
+		fc->send_errors++;
+	} else {
+		fc->messages++;
+	}
+}
+
+/*
+ * NOT THREAD SAFE, LOCK THE CONFIG
+ * Sends the expired flows, as many to a message as fit, with the template ahead of the
+ * first record when it is due.
+ */
+static void flow_export_records(router_state* rs, flow_export* out, unsigned int count, uint64_t now) {
+	flow_cache* fc = rs->flow_cache;
+	uint8_t msg[FLOW_EXPORT_MTU];
+	uint8_t* p;
+	uint8_t* set = NULL;
+	struct timeval tv;
+	uint64_t offset;
+	unsigned int i = 0, f, in_msg;
+	int with_template;
+
+	gettimeofday(&tv, NULL);
+	offset = ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000) - now;	/* monotonic to epoch */
+
+	with_template = (fc->last_template == 0) || ((tv.tv_sec - fc->last_template) >= FLOW_TEMPLATE_INTERVAL);
+	if (!count && !with_template) {
+		return;
+	}
+
+	do {
+		p = flow_put16(msg, IPFIX_VERSION);
+		p = flow_put16(p, 0);	/* length, below */
+		p = flow_put32(p, tv.tv_sec);
+		p = flow_put32(p, fc->sequence);
+		p = flow_put32(p, ntohl(rs->router_id));
+
+		if (with_template) {
+			p = flow_put16(p, IPFIX_TEMPLATE_SET);
+			p = flow_put16(p, FLOW_TEMPLATE_SET_LEN);
+			p = flow_put16(p, IPFIX_TEMPLATE_ID);
+			p = flow_put16(p, FLOW_TEMPLATE_FIELDS);
+			for (f = 0; f < FLOW_TEMPLATE_FIELDS; ++f) {
+				p = flow_put16(p, flow_template[f][0]);
+				p = flow_put16(p, flow_template[f][1]);
+			}
+			fc->last_template = tv.tv_sec;
+			with_template = 0;
+		}
+
+		in_msg = 0;
+		if (i < count) {
+			set = p;
+			p += IPFIX_SET_HDR_LEN;
+			while ((i < count) && ((p + FLOW_RECORD_LEN) <= (msg + FLOW_EXPORT_MTU))) {
+				flow_entry* e = &(out[i].e);
+				memcpy(p, &(e->key.src), 4);
+				memcpy(p + 4, &(e->key.dst), 4);
+				memcpy(p + 8, &(e->key.sport), 2);
+				memcpy(p + 10, &(e->key.dport), 2);
+				p += 12;
+				*p++ = e->key.proto;
+				*p++ = e->tcp_flags;
+				p = flow_put32(p, e->key.in_if);
+				p = flow_put32(p, e->key.out_if);
+				p = flow_put64(p, e->packets);
+				p = flow_put64(p, e->bytes);
+				p = flow_put64(p, e->first + offset);
+				p = flow_put64(p, e->last + offset);
+				*p++ = out[i].reason;
+				p = flow_put32(p, (fc->sample > 1) ? fc->sample : 1);
+				++i;
+				++in_msg;
+			}
+			flow_put16(set, IPFIX_TEMPLATE_ID);
+			flow_put16(set + 2, p - set);
+		}
+
+		flow_put16(msg + 2, p - msg);
+		fc->sequence += in_msg;
+		fc->exported += in_msg;
+		flow_send(fc, msg, p - msg);
+	} while (i < count);
+}
+
+/*
+ * NOT THREAD SAFE, LOCK THE CONFIG
+ * Each owner clears its worker on its next packet, the sweep leaves the stale ones alone.
+ */
+static void flow_cache_clear(flow_cache* fc) {
+	fc->clear_gen++;
+}
+
+/*
+ * Timer callback, expires and exports flows. Claimed flows are copied out and handed back to
+ * their owner, the encoding and sending happen after. Takes no worker lock.
+ */
+void flow_sweep_timer(router_state* rs, uint32_t key, uint32_t id) {
+	flow_cache* fc = rs->flow_cache;
+	flow_export* out;
+	flow_entry* e;
+	uint64_t now = timer_now_ms();
+	uint64_t active, inactive;
+	unsigned int budget, count = 0;
+	uint8_t reason;
+	int i, j;
+
+	pthread_mutex_lock(&(fc->config_lock));
+
+	if (!fc->enabled) {
+		pthread_mutex_unlock(&(fc->config_lock));
+		return;
+	}
+
+	budget = ((uint64_t)fc->export_rate * FLOW_SWEEP_INTERVAL) / 1000;
+	if (budget == 0) {
+		budget = 1;
+	} else if (budget > (NUM_WORKERS + 1) * FLOW_MAX_ENTRIES) {
+		budget = (NUM_WORKERS + 1) * FLOW_MAX_ENTRIES;
+	}
+	out = (flow_export*)malloc(budget * sizeof(flow_export));
+	active = (uint64_t)fc->active_timeout * 1000;
+	inactive = (uint64_t)fc->inactive_timeout * 1000;
+
+	for (i = 0; i <= NUM_WORKERS; ++i) {
+		flow_worker* w = &(fc->workers[(fc->next_worker + i) % (NUM_WORKERS + 1)]);
+
+		if (w->clear_gen != fc->clear_gen) {
+			continue;
+		}
+
+		for (j = 0; j < FLOW_MAX_ENTRIES; ++j) {
+			e = &(w->entries[j]);
+			if ((e->state != FLOW_ENTRY_LIVE) || !flow_expired(e, now, active, inactive)) {
+				continue;
+			}
+			if (count == budget) {
+				fc->deferred++;
+				continue;
+			}
+			if (!__sync_bool_compare_and_swap(&(e->state), FLOW_ENTRY_LIVE, FLOW_ENTRY_DEAD)) {
+				continue;	/* hit in the meantime */
+			}
+
+			/*
+			 * Hit between the check and the claim, give it back. A packet of the flow
+			 * finding it DEAD just now starts a second entry, collectors sum the two.
+			 */
+			if (!(reason = flow_expired(e, now, active, inactive))) {
+				e->state = FLOW_ENTRY_LIVE;
+				continue;
+			}
+
+			out[count].e = *e;
+			out[count].reason = reason;
+			++count;
+
+			/* only the sweep pushes and the owner takes the whole list, no ABA */
+			do {
+				e->dead_next = w->dead;
+			} while (!__sync_bool_compare_and_swap(&(w->dead), e->dead_next, e));
+		}
+	}
+	fc->next_worker = (fc->next_worker + 1) % (NUM_WORKERS + 1);
+
+	flow_export_records(rs, out, count, now);
+	free(out);
+
+	pthread_mutex_unlock(&(fc->config_lock));
+}
+
+void cli_show_ip_flow(router_state* rs, cli_request* req) {
+	flow_cache* fc = rs->flow_cache;
+	char line[256];
+	char ip[INET_ADDRSTRLEN];
+	int i;
+
+	pthread_mutex_lock(&(fc->config_lock));
+
+	if (fc->enabled) {
+		inet_ntop(AF_INET, &(fc->collector.sin_addr), ip, INET_ADDRSTRLEN);
+		snprintf(line, 256, "Collector: %s:%u  Sample: 1 in %u  Timeouts: active %u s, inactive %u s  Rate: %u/s\n",
+			ip, ntohs(fc->collector.sin_port), (fc->sample > 1) ? fc->sample : 1,
+			fc->active_timeout, fc->inactive_timeout, fc->export_rate);
+	} else {
+		snprintf(line, 256, "Flow export is off, set a collector with ip flow collector\n");
+	}
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	snprintf(line, 256, "Exported: %llu  Deferred: %llu  Messages: %llu  Send errors: %llu  Sequence: %u\n",
+		(unsigned long long)fc->exported, (unsigned long long)fc->deferred,
+		(unsigned long long)fc->messages, (unsigned long long)fc->send_errors, fc->sequence);
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	/* owners update these without a lock, a line may be a packet behind */
+	for (i = 0; i <= NUM_WORKERS; ++i) {
+		flow_worker* w = &(fc->workers[i]);
+		if (i == WORKER_SHARED) {
+			snprintf(line, 256, "Shared");
+		} else {
+			snprintf(line, 256, "Worker %d", i);
+		}
+		snprintf(line + strlen(line), 256 - strlen(line), ": %u/%u flows  Packets: %llu  Created: %llu  Overflows: %llu\n",
+			w->num_entries, FLOW_MAX_ENTRIES, (unsigned long long)w->packets,
+			(unsigned long long)w->created, (unsigned long long)w->overflows);
+		send_to_socket(req->sockfd, line, strlen(line));
+	}
+
+	pthread_mutex_unlock(&(fc->config_lock));
+}
+
+void cli_ip_flow_collector(router_state* rs, cli_request* req) {
+	flow_cache* fc = rs->flow_cache;
+	char ip_str[64];
+	unsigned int port = 0;
+	struct in_addr ip;
+	char* msg;
+
+	if (sscanf(req->command, "ip flow collector %63s %u", ip_str, &port) < 1) {
+		msg = "usage: ip flow collector <ip> <port>|none\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	pthread_mutex_lock(&(fc->config_lock));
+
+	if (strcmp(ip_str, "none") == 0) {
+		fc->enabled = 0;
+		flow_cache_clear(fc);
+		pthread_mutex_unlock(&(fc->config_lock));
+		msg = "Flow export off\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	if ((inet_pton(AF_INET, ip_str, &ip) != 1) || (port == 0) || (port > 65535)) {
+		pthread_mutex_unlock(&(fc->config_lock));
+		msg = "Invalid collector address or port\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	if ((fc->sockfd < 0) && ((fc->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)) {
+		pthread_mutex_unlock(&(fc->config_lock));
+		msg = "Failure opening the export socket\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	memset(&(fc->collector), 0, sizeof(struct sockaddr_in));
+	fc->collector.sin_family = AF_INET;
+	fc->collector.sin_addr = ip;
+	fc->collector.sin_port = htons(port);
+	fc->last_template = 0;	/* a new collector needs the template first */
+	fc->enabled = 1;
+
+	pthread_mutex_unlock(&(fc->config_lock));
+
+	msg = "Flow collector set\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_ip_flow_sample(router_state* rs, cli_request* req) {
+	flow_cache* fc = rs->flow_cache;
+	unsigned int sample;
+	char* msg;
+
+	if (sscanf(req->command, "ip flow sample %u", &sample) != 1) {
+		msg = "usage: ip flow sample N, 1 accounts every packet\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	pthread_mutex_lock(&(fc->config_lock));
+	fc->sample = sample;
+	pthread_mutex_unlock(&(fc->config_lock));
+
+	msg = "Flow sampling set\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_ip_flow_timeout(router_state* rs, cli_request* req) {
+	flow_cache* fc = rs->flow_cache;
+	unsigned int active, inactive;
+	char* msg;
+
+	if ((sscanf(req->command, "ip flow timeout %u %u", &active, &inactive) != 2) || (active == 0) || (inactive == 0)) {
+		msg = "usage: ip flow timeout <active seconds> <inactive seconds>\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	pthread_mutex_lock(&(fc->config_lock));
+	fc->active_timeout = active;
+	fc->inactive_timeout = inactive;
+	pthread_mutex_unlock(&(fc->config_lock));
+
+	msg = "Flow timeouts set\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_ip_flow_rate(router_state* rs, cli_request* req) {
+	flow_cache* fc = rs->flow_cache;
+	unsigned int rate;
+	char* msg;
+
+	if ((sscanf(req->command, "ip flow rate %u", &rate) != 1) || (rate == 0)) {
+		msg = "usage: ip flow rate <records per second>\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	pthread_mutex_lock(&(fc->config_lock));
+	fc->export_rate = rate;
+	pthread_mutex_unlock(&(fc->config_lock));
+
+	msg = "Flow export rate set\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
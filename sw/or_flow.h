@@ -0,0 +1,26 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#ifndef OR_FLOW_H_
+#define OR_FLOW_H_
+
+#include "or_data_types.h"
+#include "sr_base_internal.h"
+
+flow_cache* flow_cache_create(void);
+void flow_cache_destroy(flow_cache* fc);
+
+uint8_t flow_ifindex(const char* iface);
+void flow_account(router_state* rs, const uint8_t* packet, unsigned int len, const char* in_iface, const char* out_iface);
+void flow_sweep_timer(router_state* rs, uint32_t key, uint32_t id);
+
+void cli_show_ip_flow(router_state* rs, cli_request* req);
+void cli_ip_flow_collector(router_state* rs, cli_request* req);
+void cli_ip_flow_sample(router_state* rs, cli_request* req);
+void cli_ip_flow_timeout(router_state* rs, cli_request* req);
+void cli_ip_flow_rate(router_state* rs, cli_request* req);
+
+#endif /*OR_FLOW_H_*/
@@ -18,8 +18,10 @@
 #include "or_rtable.h"
 #include "or_dijkstra.h"
 #include "or_pwospf.h"
+#include "or_lsdb.h"
 #include "reg_defines.h"
 #include "or_netfpga.h"
+#include "or_lockprof.h"
 
 int iface_match_ip(router_state* rs, uint32_t ip) {
 
@@ -82,7 +84,7 @@ void lock_if_list_rd(router_state *rs) {
 
 	assert(rs);
 
-	if(pthread_rwlock_rdlock(rs->if_list_lock) != 0) {
+	if(lockprof_rdlock(rs->if_list_lock, LOCK_IF_LIST, LOCKPROF_SITE) != 0) {
 		perror("Failure getting iface list read lock");
 	}
 }
@@ -91,7 +93,7 @@ void lock_if_list_wr(router_state *rs) {
 
 	assert(rs);
 
-	if(pthread_rwlock_wrlock(rs->if_list_lock) != 0) {
+	if(lockprof_wrlock(rs->if_list_lock, LOCK_IF_LIST, LOCKPROF_SITE) != 0) {
 		perror("Failure getting iface list write lock");
 	}
 }
@@ -100,6 +102,7 @@ void unlock_if_list(router_state *rs) {
 
 	assert(rs);
 
+	lockprof_release(LOCK_IF_LIST);
 	if(pthread_rwlock_unlock(rs->if_list_lock) != 0) {
 		perror("Failure unlocking iface list lock");
 	}
@@ -294,7 +297,8 @@ int iface_up(router_state* rs, char* interface) {
 		pi->router_id = 0;
 
 		/* add the above interface adv if not already present */
-		pwospf_router *our_router = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
+		lock_mutex_pwospf_router_list(rs);
+		pwospf_router *our_router = attach_pwospf_area(rs, iface->area_id);
 		if(is_route_present(our_router, pi) == 0) {
 
 			node *n = node_create();
@@ -313,7 +317,7 @@ int iface_up(router_state* rs, char* interface) {
 		}
 
 		/* build the information for the lsu flood targetting ALL our neighbors */
-		lock_mutex_pwospf_router_list(rs);
+		pwospf_lsu_changed(rs);
 		propagate_pwospf_changes(rs, NULL);
 		unlock_mutex_pwospf_router_list(rs);
 
@@ -361,8 +365,9 @@ int iface_down(router_state* rs, char* interface) {
 		}
 
 		/* remove interface entries from our router entry in the router list */
-		pwospf_router *our_router = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
-		node *rl_cur = our_router->interface_list;
+		lock_mutex_pwospf_router_list(rs);
+		pwospf_router *our_router = lsdb_lookup(rs, iface->area_id, rs->router_id);
+		node *rl_cur = our_router ? our_router->interface_list : NULL;
 		node *rl_next = 0;
 
 		while(rl_cur) {
@@ -380,10 +385,12 @@ int iface_down(router_state* rs, char* interface) {
 		/* recompute fwd table */
 		if(iface_removed == 1) {
 			/* build lsu flood for our neighbors not connected to this interface*/
-			lock_mutex_pwospf_router_list(rs);
+			pwospf_lsu_changed(rs);
 			propagate_pwospf_changes(rs, interface);
-			unlock_mutex_pwospf_router_list(rs);
+		}
+		unlock_mutex_pwospf_router_list(rs);
 
+		if(iface_removed == 1) {
 			/* signal the lsu bcast thread to send the packets */
 			pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
 		}
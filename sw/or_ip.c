@@ -24,15 +24,27 @@
 #include "or_pwospf.h"
 #include "sr_lwtcp_glue.h"
 #include "or_nat.h"
+#include "or_flow.h"
+#include "or_drop.h"
+#include "or_latency.h"
 #include "or_data_types.h"
 
 void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned int len, const char* interface) {
 
 	router_state *rs = get_router_state(sr);
+	LATENCY_VAR(t_ip);
+	LATENCY_VAR(t);
+	int local, valid;
 
+	LATENCY_START(rs, t_ip);
 
 	/* Check if the packet is invalid, if so drop it */
-	if (!is_packet_valid(packet, len)) {
+	LATENCY_START(rs, t);
+	valid = is_packet_valid(packet, len);
+	LATENCY_END(rs, LAT_VALIDATE, t);
+	if (!valid) {
+		drop_count(rs, DROP_INVALID, interface);
+		LATENCY_END(rs, LAT_IP, t_ip);
 		return;
 	}
 
@@ -44,13 +56,17 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 	/* check for incoming wan interface */
 	iface_entry* iface = get_iface(rs, interface);
 	if(iface->is_wan ==1) {
-		lock_nat_table(rs);
+		LATENCY_START(rs, t);
 		process_nat_ext_packet(rs, packet, len);
-		unlock_nat_table(rs);
+		LATENCY_END(rs, LAT_NAT, t);
 	}
 
 	/* Check if the packet is headed to one of our interfaces */
-	if (iface_match_ip(rs, (get_ip_hdr(packet, len))->ip_dst.s_addr)) {
+	LATENCY_START(rs, t);
+	local = iface_match_ip(rs, (get_ip_hdr(packet, len))->ip_dst.s_addr);
+	LATENCY_END(rs, LAT_LOCAL, t);
+
+	if (local) {
 		ip_hdr* ip = get_ip_hdr(packet, len);
 
 		switch (ip->ip_p) {
@@ -66,6 +82,7 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 				break;
 			case IP_PROTO_UDP:
 				/* We don't accept UDP so ICMP reply port unreachable*/
+				drop_count(rs, DROP_UNSUPPORTED, interface);
 				if (send_icmp_packet(sr, packet, len, ICMP_TYPE_DESTINATION_UNREACHABLE, ICMP_CODE_PORT_UNREACHABLE) != 0) {
 					//printf("Failure sending icmp reply\n");
 				}
@@ -73,6 +90,7 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 			default:
 				/* If other? return ICMP protocol unreachable */
 				//printf("Unknown protocol, sending ICMP unreachable\n");
+				drop_count(rs, DROP_UNSUPPORTED, interface);
 				if (send_icmp_packet(sr, packet, len, ICMP_TYPE_DESTINATION_UNREACHABLE, ICMP_CODE_PROTOCOL_UNREACHABLE) != 0) {
 					//printf("Failure sending icmp reply\n");
 				}
@@ -92,11 +110,16 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 		inet_pton(AF_INET, "255.255.255.0", &ngrp_mask);
 
 		/* is there an entry in our routing table for the destination? */
-		if(get_next_hop(&next_hop, next_hop_iface, IF_LEN,
+		LATENCY_START(rs, t);
+		int no_route = get_next_hop(&next_hop, next_hop_iface, IF_LEN,
 			 	rs,
-			 	&((get_ip_hdr(packet, len))->ip_dst))) {
+			 	&((get_ip_hdr(packet, len))->ip_dst));
+		LATENCY_END(rs, LAT_LPM, t);
+
+		if(no_route) {
 
 			/* send ICMP no route to host */
+			drop_count(rs, DROP_NO_ROUTE, interface);
 			uint8_t icmp_type = ICMP_TYPE_DESTINATION_UNREACHABLE;
 			uint8_t icmp_code = ICMP_CODE_NET_UNKNOWN;
 			send_icmp_packet(sr, packet, len, icmp_type, icmp_code);
@@ -105,6 +128,7 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 
 			if(strncmp(interface, next_hop_iface, IF_LEN) == 0){
 				/* send ICMP net unreachable */
+				drop_count(rs, DROP_HAIRPIN, interface);
 				uint8_t icmp_type = ICMP_TYPE_DESTINATION_UNREACHABLE;
 				uint8_t icmp_code = ICMP_CODE_NET_UNREACHABLE;
 				send_icmp_packet(sr, packet, len, icmp_type, icmp_code);
@@ -113,19 +137,25 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 
 				/* check for outgoing interface is WAN */
 				iface_entry* iface = get_iface(rs, next_hop_iface);
+				int nat_drop = 0;
 				if(iface->is_wan) {
 
-					lock_nat_table(rs);
-					process_nat_int_packet(rs, packet, len, iface->ip);
-					unlock_nat_table(rs);
+					LATENCY_START(rs, t);
+					nat_drop = process_nat_int_packet(rs, packet, len, iface->ip);
+					LATENCY_END(rs, LAT_NAT, t);
 				}
 
 				ip_hdr *ip = get_ip_hdr(packet, len);
 
-				/* is ttl < 1? */
-				if(ip->ip_ttl == 1) {
+				if(nat_drop) {
+					/* no external port left to translate to, drop the packet */
+					drop_count(rs, DROP_NAT_NO_PORT, next_hop_iface);
+
+				} else if(ip->ip_ttl == 1) {
+					/* ttl < 1 */
 
 					/* send ICMP time exceeded */
+					drop_count(rs, DROP_TTL_EXPIRED, interface);
 					uint8_t icmp_type = ICMP_TYPE_TIME_EXCEEDED;
 					uint8_t icmp_code = ICMP_CODE_TTL_EXCEEDED;
 					send_icmp_packet(sr, packet, len, icmp_type, icmp_code);
@@ -153,6 +183,7 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 				 	uint8_t* packet_copy = (uint8_t*)malloc(len);
 				 	memcpy(packet_copy, packet, len);
 				 	
+				 	LATENCY_START(rs, t);
 				 	lock_atable_rd(rs);
 				 	
 				 	node* n = get_atable_entry(&(ip->ip_dst), &ngrp_mask, rs);
@@ -185,6 +216,7 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 					
 					if (ngrp_ip.s_addr == 0)
 						ngrp_ip = (ip->ip_dst);
+					LATENCY_END(rs, LAT_MULTIPATH, t);
 				
 					send_ip(sr, packet_copy, len, &(ngrp_ip), ngrp_iface);
 					
@@ -200,6 +232,8 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 					//printf("or_ip.c: an IP packet sent to %s is forwarded to %s\n", ngrp_ip_str, next_hop_iface);
 
 					unlock_atable(rs);
+
+					flow_account(rs, packet, len, interface, ngrp_iface);
 					
 					lock_rstable_wr(rs);
 					
@@ -216,6 +250,8 @@ void process_ip_packet(struct sr_instance* sr, const uint8_t * packet, unsigned
 	unlock_if_list(rs);
 	unlock_arp_queue(rs);
 	unlock_arp_cache(rs);
+
+	LATENCY_END(rs, LAT_IP, t_ip);
 }
 
 /*
@@ -374,7 +410,7 @@ uint32_t send_ip_packet(struct sr_instance *sr, uint8_t proto, uint32_t src, uin
 }
 
 void cli_show_ip_help(router_state *rs, cli_request* req) {
-	char *usage = "usage: show ip [route interface arp]\n";
+	char *usage = "usage: show ip [route fib interface arp flow drops latency]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 }
 
@@ -383,6 +419,6 @@ void cli_ip_help(router_state *rs, cli_request* req) {
 	char *usage0 = "usage: ip <args>\n";
 	send_to_socket(req->sockfd, usage0, strlen(usage0));
 
-	char *usage1 = "ip [route interface arp]\n";
+	char *usage1 = "ip [route fib interface arp flow latency]\n";
 	send_to_socket(req->sockfd, usage1, strlen(usage1));
 }
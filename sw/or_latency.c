@@ -0,0 +1,214 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "or_latency.h"
+#include "or_data_types.h"
+#include "or_utils.h"
+
+/*
+ * Per stage latency, recorded into the worker_slot of the thread. The buckets are log linear
+ * like an HDR histogram: exact below 16 ns, then 16 per power of two, so any percentile read
+ * back is within 1/16 of the real value. Reading sums the slots, a read racing a write may be
+ * off by the packet in flight.
+ */
+
+static const char* latency_names[LAT_NUM_STAGES] = {
+	"rx", "ip", "validate", "local", "lpm", "nat", "multipath", "arp", "tx"
+};
+
+latency_stats* latency_stats_create(void) {
+	latency_stats* ls;
+
+	if (posix_memalign((void**)&ls, 64, sizeof(latency_stats)) != 0) {
+		perror("Failure allocating latency stats");
+		exit(1);
+	}
+	memset(ls, 0, sizeof(latency_stats));
+
+	return ls;
+}
+
+void latency_stats_destroy(latency_stats* ls) {
+	free(ls);
+}
+
+static int latency_bucket(uint64_t ns) {
+	int msb;
+	int b;
+
+	if (ns < (1 << LAT_SUB_BITS)) {
+		return ns;
+	}
+
+	msb = 63 - __builtin_clzll(ns);
+	b = ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + ((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+
+	return (b < LAT_NUM_BUCKETS) ? b : (LAT_NUM_BUCKETS - 1);
+}
+
+/* Returns: the smallest value that lands in bucket b */
+static uint64_t latency_bucket_floor(int b) {
+	int shift;
+
+	if (b < (1 << LAT_SUB_BITS)) {
+		return b;
+	}
+
+	shift = (b >> LAT_SUB_BITS) - 1;
+	return ((uint64_t)((1 << LAT_SUB_BITS) + (b & ((1 << LAT_SUB_BITS) - 1)))) << shift;
+}
+
+/*
+ * IS THREAD SAFE
+ * Adds the time since start, from latency_now, to the histogram of stage.
+ */
+void latency_record(router_state* rs, int stage, uint64_t start) {
+	struct timespec ts;
+	latency_hist* h;
+	uint64_t ns;
+	int slot = worker_slot();
+
+	assert((stage >= 0) && (stage < LAT_NUM_STAGES));
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec - start;
+	h = &(rs->latency_stats->workers[slot].stage[stage]);
+
+	if (slot != WORKER_SHARED) {
+		h->count[latency_bucket(ns)]++;
+		h->sum_ns += ns;
+		if (ns > h->max_ns) {
+			h->max_ns = ns;
+		}
+	} else {
+		__sync_fetch_and_add(&(h->count[latency_bucket(ns)]), 1);
+		__sync_fetch_and_add(&(h->sum_ns), ns);
+		if (ns > h->max_ns) {
+			h->max_ns = ns;	/* may lose a race, it is only a hint */
+		}
+	}
+}
+
+/* Returns: the value at quantile q of h, an upper bound within one bucket */
+static uint64_t latency_quantile(latency_hist* h, uint64_t total, double q) {
+	uint64_t rank = (uint64_t)(q * total);
+	uint64_t seen = 0;
+	uint64_t upper;
+	int b;
+
+	for (b = 0; b < LAT_NUM_BUCKETS; ++b) {
+		seen += h->count[b];
+		if (seen > rank) {
+			break;
+		}
+	}
+	if (b >= LAT_NUM_BUCKETS - 1) {
+		return h->max_ns;
+	}
+
+	upper = latency_bucket_floor(b + 1) - 1;
+	return (upper < h->max_ns) ? upper : h->max_ns;
+}
+
+/* Sums stage across workers first to last - 1 into h, returns the sample count */
+static uint64_t latency_sum(latency_stats* ls, int stage, int first, int last, latency_hist* h) {
+	uint64_t total = 0;
+	int w, b;
+
+	memset(h, 0, sizeof(latency_hist));
+	for (w = first; w < last; ++w) {
+		latency_hist* wh = &(ls->workers[w].stage[stage]);
+		for (b = 0; b < LAT_NUM_BUCKETS; ++b) {
+			h->count[b] += wh->count[b];
+			total += wh->count[b];
+		}
+		h->sum_ns += wh->sum_ns;
+		if (wh->max_ns > h->max_ns) {
+			h->max_ns = wh->max_ns;
+		}
+	}
+
+	return total;
+}
+
+/* show ip latency [worker] */
+void cli_show_ip_latency(router_state* rs, cli_request* req) {
+	latency_stats* ls = rs->latency_stats;
+	latency_hist* h = (latency_hist*)malloc(sizeof(latency_hist));
+	char line[256];
+	int first = 0, last = NUM_WORKERS + 1;
+	int worker, s;
+	uint64_t total;
+
+	if (sscanf(req->command, "show ip latency %d", &worker) == 1) {
+		if ((worker < 0) || (worker > NUM_WORKERS)) {
+			snprintf(line, 256, "Forwarding threads are 0 to %d in the order they started, %d is every other thread\n",
+				NUM_WORKERS - 1, WORKER_SHARED);
+			send_to_socket(req->sockfd, line, strlen(line));
+			free(h);
+			return;
+		}
+		first = worker;
+		last = worker + 1;
+	}
+
+#ifdef _NOLATENCY_
+	snprintf(line, 256, "Latency recording was compiled out (_NOLATENCY_)\n");
+#else
+	snprintf(line, 256, "Recording is %s, times in us\n", ls->enabled ? "on" : "off");
+#endif
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	snprintf(line, 256, "%-10s %12s %10s %10s %10s %10s %10s\n", "Stage", "Count", "Mean", "p50", "p99", "p999", "Max");
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	for (s = 0; s < LAT_NUM_STAGES; ++s) {
+		total = latency_sum(ls, s, first, last, h);
+		if (total == 0) {
+			snprintf(line, 256, "%-10s %12u\n", latency_names[s], 0);
+		} else {
+			snprintf(line, 256, "%-10s %12llu %10.2f %10.2f %10.2f %10.2f %10.2f\n", latency_names[s],
+				(unsigned long long)total, (h->sum_ns / (double)total) / 1000.0,
+				latency_quantile(h, total, 0.5) / 1000.0, latency_quantile(h, total, 0.99) / 1000.0,
+				latency_quantile(h, total, 0.999) / 1000.0, h->max_ns / 1000.0);
+		}
+		send_to_socket(req->sockfd, line, strlen(line));
+	}
+
+	free(h);
+}
+
+/* ip latency on|off|reset */
+void cli_ip_latency(router_state* rs, cli_request* req) {
+	latency_stats* ls = rs->latency_stats;
+	char arg[16];
+	char* msg;
+
+	if (sscanf(req->command, "ip latency %15s", arg) != 1) {
+		arg[0] = '\0';
+	}
+
+	if (strcmp(arg, "on") == 0) {
+		ls->enabled = 1;
+		msg = "Latency recording on\n";
+	} else if (strcmp(arg, "off") == 0) {
+		ls->enabled = 0;
+		msg = "Latency recording off\n";
+	} else if (strcmp(arg, "reset") == 0) {
+		/* packets being recorded right now may survive the reset */
+		memset(ls->workers, 0, sizeof(ls->workers));
+		msg = "Latency histograms cleared\n";
+	} else {
+		msg = "usage: ip latency on|off|reset, off keeps the histograms, reset clears them\n";
+	}
+
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
@@ -0,0 +1,53 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#ifndef OR_LATENCY_H_
+#define OR_LATENCY_H_
+
+#include <time.h>
+
+#include "or_data_types.h"
+#include "sr_base_internal.h"
+
+latency_stats* latency_stats_create(void);
+void latency_stats_destroy(latency_stats* ls);
+
+void latency_record(router_state* rs, int stage, uint64_t start);
+
+void cli_show_ip_latency(router_state* rs, cli_request* req);
+void cli_ip_latency(router_state* rs, cli_request* req);
+
+static inline uint64_t latency_now(router_state* rs) {
+	struct timespec ts;
+
+	if (!rs->latency_stats->enabled) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Times a stage, built with -D_NOLATENCY_ they compile to nothing:
+ *
+ *	LATENCY_VAR(t);
+ *	LATENCY_START(rs, t);
+ *	... the stage ...
+ *	LATENCY_END(rs, LAT_LPM, t);
+ *
+ * With recording turned off at runtime a stage costs a load and a branch.
+ */
+#ifndef _NOLATENCY_
+#define LATENCY_VAR(t) uint64_t t
+#define LATENCY_START(rs, t) ((t) = latency_now(rs))
+#define LATENCY_END(rs, stage, t) do { if (t) { latency_record((rs), (stage), (t)); } } while (0)
+#else
+#define LATENCY_VAR(t)
+#define LATENCY_START(rs, t)
+#define LATENCY_END(rs, stage, t)
+#endif
+
+#endif /*OR_LATENCY_H_*/
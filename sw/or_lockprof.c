@@ -0,0 +1,494 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <execinfo.h>
+#include <assert.h>
+
+#include "or_lockprof.h"
+#include "or_data_types.h"
+#include "or_utils.h"
+
+/*
+ * Lock contention profile. With profiling on, every lock_* wrapper tries its lock first and
+ * only a failed try counts as contended and has its wait timed. Counters and log2 histograms
+ * of wait and hold time are kept by worker_slot, contended call sites in a small table per
+ * lock filled with compare and swap. With profiling off a lock still costs the bookkeeping of
+ * what the thread holds, a few thread local updates.
+ *
+ * In _DEBUG_ builds, which the Makefile builds by default, every acquisition made while the
+ * thread already holds another lock also scans what it holds and records the order, taking
+ * two locks in both orders is reported as an inversion. Define _NOLOCKORDER_ to leave it out.
+ *
+ * The state is global rather than in router_state since the nat shard and pool wrappers are
+ * handed their lock alone.
+ */
+
+#ifndef _NOLOCKPROF_
+
+typedef struct lockprof_counts {
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t wait_max_ns;
+	uint64_t hold_max_ns;
+	uint64_t wait[LOCKPROF_NUM_BUCKETS];
+	uint64_t hold[LOCKPROF_NUM_BUCKETS];
+} lockprof_counts;
+
+typedef struct lockprof_worker {
+	lockprof_counts lock[LOCK_NUM];
+} __attribute__ ((aligned (64))) lockprof_worker;
+
+typedef struct lockprof_site {
+	void* pc;
+	uint64_t contended;
+	uint64_t wait_ns;
+} lockprof_site;
+
+static const char* lockprof_names[LOCK_NUM] = {
+	"arp cache", "arp queue", "if list", "rtable", "atable", "rstable", "nat table",
+	"nat shard", "nat pools", "pwospf routers", "pwospf lsu queue", "cli commands",
+	"local ip filters", "netfpga stats"
+};
+
+static volatile int lockprof_enabled = 0;
+static lockprof_worker lockprof_workers[NUM_WORKERS + 1];	/* by worker_slot */
+static lockprof_site lockprof_sites[LOCK_NUM][LOCKPROF_NUM_SITES];
+static uint64_t lockprof_sites_lost[LOCK_NUM];
+
+/* what this thread holds: a depth for recursive read locks, when it took each (0 if untimed) */
+static __thread int lockprof_depth[LOCK_NUM];
+static __thread uint64_t lockprof_since[LOCK_NUM];
+static __thread int lockprof_held;	/* ids with a depth above 0 */
+
+#if defined(_DEBUG_) && !defined(_NOLOCKORDER_)
+#define LOCKPROF_ORDER
+/* order[a][b] is where b was first taken with a held, inverted[a][b] is set once reported */
+static void* lockprof_order[LOCK_NUM][LOCK_NUM];
+static int lockprof_inverted[LOCK_NUM][LOCK_NUM];
+#endif
+
+static uint64_t lockprof_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int lockprof_bucket(uint64_t ns) {
+	int b = ns ? (63 - __builtin_clzll(ns)) : 0;
+
+	return (b < LOCKPROF_NUM_BUCKETS) ? b : (LOCKPROF_NUM_BUCKETS - 1);
+}
+
+static void lockprof_add(uint64_t* counter, uint64_t n, int shared) {
+	if (shared) {
+		__sync_fetch_and_add(counter, n);
+	} else {
+		*counter += n;
+	}
+}
+
+static void lockprof_max(uint64_t* counter, uint64_t n) {
+	if (n > *counter) {
+		*counter = n;	/* the shared slot may lose a race, it is only a hint */
+	}
+}
+
+/* Counts a contended acquisition against the call site that waited */
+static void lockprof_add_site(int id, void* site, uint64_t wait_ns) {
+	int h = (((uintptr_t)site) >> 2) % LOCKPROF_NUM_SITES;
+	int i;
+
+	for (i = 0; i < LOCKPROF_NUM_SITES; ++i) {
+		lockprof_site* s = &(lockprof_sites[id][(h + i) % LOCKPROF_NUM_SITES]);
+		if (s->pc == NULL) {
+			__sync_bool_compare_and_swap(&(s->pc), NULL, site);
+		}
+		if (s->pc == site) {
+			__sync_fetch_and_add(&(s->contended), 1);
+			__sync_fetch_and_add(&(s->wait_ns), wait_ns);
+			return;
+		}
+	}
+
+	__sync_fetch_and_add(&(lockprof_sites_lost[id]), 1);
+}
+
+#ifdef LOCKPROF_ORDER
+static void lockprof_check_order(int id, void* site) {
+	int h;
+
+	if (lockprof_held == 0) {
+		return;
+	}
+
+	for (h = 0; h < LOCK_NUM; ++h) {
+		if ((h == id) || (lockprof_depth[h] == 0)) {
+			continue;
+		}
+
+		if (lockprof_order[id][h] && !lockprof_inverted[id][h]
+				&& __sync_bool_compare_and_swap(&(lockprof_inverted[id][h]), 0, 1)) {
+			lockprof_inverted[h][id] = 1;
+			fprintf(stderr, "Lock order inversion: %s then %s at %p, but %s then %s at %p\n",
+				lockprof_names[h], lockprof_names[id], site, lockprof_names[id], lockprof_names[h],
+				lockprof_order[id][h]);
+		}
+
+		if (!lockprof_order[h][id]) {
+			__sync_bool_compare_and_swap(&(lockprof_order[h][id]), NULL, site);
+		}
+	}
+}
+#endif
+
+/* Bookkeeping once the pthread call returned rc, wait is 0 unless it blocked */
+static void lockprof_acquired(int id, void* site, int rc, int contended, uint64_t wait_ns) {
+	lockprof_counts* c;
+	int slot, shared;
+
+	if (rc != 0) {
+		return;
+	}
+
+#ifdef LOCKPROF_ORDER
+	lockprof_check_order(id, site);
+#endif
+
+	if (lockprof_depth[id]++ > 0) {
+		return;
+	}
+	lockprof_held++;
+	lockprof_since[id] = 0;
+
+	if (!lockprof_enabled) {
+		return;
+	}
+
+	slot = worker_slot();
+	shared = (slot == WORKER_SHARED);
+	c = &(lockprof_workers[slot].lock[id]);
+
+	lockprof_add(&(c->acquired), 1, shared);
+	if (contended) {
+		lockprof_add(&(c->contended), 1, shared);
+		lockprof_add(&(c->wait_ns), wait_ns, shared);
+		lockprof_add(&(c->wait[lockprof_bucket(wait_ns)]), 1, shared);
+		lockprof_max(&(c->wait_max_ns), wait_ns);
+		lockprof_add_site(id, site, wait_ns);
+	}
+
+	lockprof_since[id] = lockprof_now();
+}
+
+/*
+ * IS THREAD SAFE
+ * Takes the read lock, counting and timing it if the profile is on.
+ */
+int lockprof_rdlock(pthread_rwlock_t* l, int id, void* site) {
+	uint64_t start;
+	int rc;
+
+	assert((id >= 0) && (id < LOCK_NUM));
+
+	if (!lockprof_enabled) {
+		rc = pthread_rwlock_rdlock(l);
+		lockprof_acquired(id, site, rc, 0, 0);
+		return rc;
+	}
+
+	if ((rc = pthread_rwlock_tryrdlock(l)) != EBUSY) {
+		lockprof_acquired(id, site, rc, 0, 0);
+		return rc;
+	}
+
+	start = lockprof_now();
+	rc = pthread_rwlock_rdlock(l);
+	lockprof_acquired(id, site, rc, 1, lockprof_now() - start);
+	return rc;
+}
+
+int lockprof_wrlock(pthread_rwlock_t* l, int id, void* site) {
+	uint64_t start;
+	int rc;
+
+	assert((id >= 0) && (id < LOCK_NUM));
+
+	if (!lockprof_enabled) {
+		rc = pthread_rwlock_wrlock(l);
+		lockprof_acquired(id, site, rc, 0, 0);
+		return rc;
+	}
+
+	if ((rc = pthread_rwlock_trywrlock(l)) != EBUSY) {
+		lockprof_acquired(id, site, rc, 0, 0);
+		return rc;
+	}
+
+	start = lockprof_now();
+	rc = pthread_rwlock_wrlock(l);
+	lockprof_acquired(id, site, rc, 1, lockprof_now() - start);
+	return rc;
+}
+
+int lockprof_mutex_lock(pthread_mutex_t* m, int id, void* site) {
+	uint64_t start;
+	int rc;
+
+	assert((id >= 0) && (id < LOCK_NUM));
+
+	if (!lockprof_enabled) {
+		rc = pthread_mutex_lock(m);
+		lockprof_acquired(id, site, rc, 0, 0);
+		return rc;
+	}
+
+	if ((rc = pthread_mutex_trylock(m)) != EBUSY) {
+		lockprof_acquired(id, site, rc, 0, 0);
+		return rc;
+	}
+
+	start = lockprof_now();
+	rc = pthread_mutex_lock(m);
+	lockprof_acquired(id, site, rc, 1, lockprof_now() - start);
+	return rc;
+}
+
+/*
+ * IS THREAD SAFE
+ * Call just before unlocking, records the hold time when the last hold on id goes.
+ */
+void lockprof_release(int id) {
+	lockprof_counts* c;
+	uint64_t held;
+	int slot;
+
+	assert((id >= 0) && (id < LOCK_NUM));
+
+	if ((lockprof_depth[id] == 0) || (--lockprof_depth[id] > 0)) {
+		return;
+	}
+	lockprof_held--;
+
+	if (lockprof_since[id] == 0) {
+		return;
+	}
+
+	held = lockprof_now() - lockprof_since[id];
+	lockprof_since[id] = 0;
+
+	slot = worker_slot();
+	c = &(lockprof_workers[slot].lock[id]);
+	lockprof_add(&(c->hold[lockprof_bucket(held)]), 1, (slot == WORKER_SHARED));
+	lockprof_max(&(c->hold_max_ns), held);
+}
+
+/* Returns: the value at quantile q of a log2 histogram, the top of its bucket capped at max */
+static uint64_t lockprof_quantile(uint64_t* hist, double q, uint64_t max) {
+	uint64_t total = 0, seen = 0, rank;
+	int b;
+
+	for (b = 0; b < LOCKPROF_NUM_BUCKETS; ++b) {
+		total += hist[b];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	rank = (uint64_t)(q * total);
+	for (b = 0; b < LOCKPROF_NUM_BUCKETS - 1; ++b) {
+		seen += hist[b];
+		if (seen > rank) {
+			break;
+		}
+	}
+
+	if (b == LOCKPROF_NUM_BUCKETS - 1) {
+		return max;
+	}
+	return (((2ULL << b) - 1) < max) ? ((2ULL << b) - 1) : max;
+}
+
+/* Sums lock id across the slots into c */
+static void lockprof_sum(int id, lockprof_counts* c) {
+	int w, b;
+
+	memset(c, 0, sizeof(lockprof_counts));
+	for (w = 0; w <= NUM_WORKERS; ++w) {
+		lockprof_counts* wc = &(lockprof_workers[w].lock[id]);
+		c->acquired += wc->acquired;
+		c->contended += wc->contended;
+		c->wait_ns += wc->wait_ns;
+		for (b = 0; b < LOCKPROF_NUM_BUCKETS; ++b) {
+			c->wait[b] += wc->wait[b];
+			c->hold[b] += wc->hold[b];
+		}
+		if (wc->wait_max_ns > c->wait_max_ns) {
+			c->wait_max_ns = wc->wait_max_ns;
+		}
+		if (wc->hold_max_ns > c->hold_max_ns) {
+			c->hold_max_ns = wc->hold_max_ns;
+		}
+	}
+}
+
+static void lockprof_send_sites(cli_request* req, int id, int max_sites) {
+	lockprof_site sites[LOCKPROF_NUM_SITES];
+	lockprof_site tmp;
+	void* pcs[LOCKPROF_NUM_SITES];
+	char** names;
+	char line[512];
+	int i, j, n = 0;
+
+	for (i = 0; i < LOCKPROF_NUM_SITES; ++i) {
+		if (lockprof_sites[id][i].pc) {
+			sites[n++] = lockprof_sites[id][i];
+		}
+	}
+
+	/* few enough to sort by hand, most total wait first */
+	for (i = 1; i < n; ++i) {
+		for (j = i; (j > 0) && (sites[j].wait_ns > sites[j - 1].wait_ns); --j) {
+			tmp = sites[j];
+			sites[j] = sites[j - 1];
+			sites[j - 1] = tmp;
+		}
+	}
+	if (n > max_sites) {
+		n = max_sites;
+	}
+
+	for (i = 0; i < n; ++i) {
+		pcs[i] = sites[i].pc;
+	}
+	names = backtrace_symbols(pcs, n);
+
+	for (i = 0; i < n; ++i) {
+		snprintf(line, 512, "    %10.3f ms %10llu waits  %s\n", sites[i].wait_ns / 1000000.0,
+			(unsigned long long)sites[i].contended, names ? names[i] : "?");
+		send_to_socket(req->sockfd, line, strlen(line));
+	}
+	if (lockprof_sites_lost[id]) {
+		snprintf(line, 512, "    %llu waits from sites past the first %d\n",
+			(unsigned long long)lockprof_sites_lost[id], LOCKPROF_NUM_SITES);
+		send_to_socket(req->sockfd, line, strlen(line));
+	}
+
+	free(names);
+}
+
+#endif
+
+/* show locks [number of sites per lock] */
+void cli_show_locks(router_state* rs, cli_request* req) {
+#ifdef _NOLOCKPROF_
+	char* msg = "Lock profiling was compiled out (_NOLOCKPROF_)\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+#else
+	lockprof_counts* counts = (lockprof_counts*)malloc(sizeof(lockprof_counts) * LOCK_NUM);
+	int order[LOCK_NUM];
+	char line[256];
+	int max_sites = 3;
+	int i, j, tmp;
+
+	if ((sscanf(req->command, "show locks %d", &max_sites) == 1) && (max_sites < 0)) {
+		max_sites = 0;
+	}
+
+	for (i = 0; i < LOCK_NUM; ++i) {
+		lockprof_sum(i, &(counts[i]));
+		order[i] = i;
+	}
+
+	/* most total wait first */
+	for (i = 1; i < LOCK_NUM; ++i) {
+		for (j = i; (j > 0) && (counts[order[j]].wait_ns > counts[order[j - 1]].wait_ns); --j) {
+			tmp = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = tmp;
+		}
+	}
+
+	snprintf(line, 256, "Profiling is %s, times in us\n", lockprof_enabled ? "on" : "off");
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	snprintf(line, 256, "%-17s %12s %10s %12s %9s %9s %9s %9s %9s\n", "Lock", "Acquired", "Contended",
+		"Wait total", "Wait p50", "Wait p99", "Hold p50", "Hold p99", "Hold max");
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	for (i = 0; i < LOCK_NUM; ++i) {
+		lockprof_counts* c = &(counts[order[i]]);
+		if (c->acquired == 0) {
+			continue;
+		}
+
+		snprintf(line, 256, "%-17s %12llu %9.2f%% %12.1f %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+			lockprof_names[order[i]], (unsigned long long)c->acquired, (c->contended * 100.0) / c->acquired,
+			c->wait_ns / 1000.0, lockprof_quantile(c->wait, 0.5, c->wait_max_ns) / 1000.0,
+			lockprof_quantile(c->wait, 0.99, c->wait_max_ns) / 1000.0,
+			lockprof_quantile(c->hold, 0.5, c->hold_max_ns) / 1000.0,
+			lockprof_quantile(c->hold, 0.99, c->hold_max_ns) / 1000.0, c->hold_max_ns / 1000.0);
+		send_to_socket(req->sockfd, line, strlen(line));
+
+		if (c->contended && (max_sites > 0)) {
+			lockprof_send_sites(req, order[i], max_sites);
+		}
+	}
+
+#ifdef LOCKPROF_ORDER
+	for (i = 0; i < LOCK_NUM; ++i) {
+		for (j = i + 1; j < LOCK_NUM; ++j) {
+			if (lockprof_inverted[i][j]) {
+				snprintf(line, 256, "Order inversion: %s then %s at %p, %s then %s at %p\n",
+					lockprof_names[i], lockprof_names[j], lockprof_order[i][j],
+					lockprof_names[j], lockprof_names[i], lockprof_order[j][i]);
+				send_to_socket(req->sockfd, line, strlen(line));
+			}
+		}
+	}
+#endif
+
+	free(counts);
+#endif
+}
+
+/* locks profile on|off|reset */
+void cli_locks_profile(router_state* rs, cli_request* req) {
+	char arg[16];
+	char* msg;
+
+	if (sscanf(req->command, "locks profile %15s", arg) != 1) {
+		arg[0] = '\0';
+	}
+
+#ifdef _NOLOCKPROF_
+	msg = "Lock profiling was compiled out (_NOLOCKPROF_)\n";
+#else
+	if (strcmp(arg, "on") == 0) {
+		lockprof_enabled = 1;
+		msg = "Lock profiling on\n";
+	} else if (strcmp(arg, "off") == 0) {
+		lockprof_enabled = 0;
+		msg = "Lock profiling off\n";
+	} else if (strcmp(arg, "reset") == 0) {
+		/* locks being waited on right now may survive the reset */
+		memset(lockprof_workers, 0, sizeof(lockprof_workers));
+		memset(lockprof_sites, 0, sizeof(lockprof_sites));
+		memset(lockprof_sites_lost, 0, sizeof(lockprof_sites_lost));
+		msg = "Lock profile cleared\n";
+	} else {
+		msg = "usage: locks profile on|off|reset\n";
+	}
+#endif
+
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
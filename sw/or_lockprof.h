@@ -0,0 +1,37 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#ifndef OR_LOCKPROF_H_
+#define OR_LOCKPROF_H_
+
+#include <pthread.h>
+
+#include "or_data_types.h"
+#include "sr_base_internal.h"
+
+/*
+ * The lock_* wrappers take their locks through these, id is one of LOCK_* and site is the
+ * wrapper's caller, LOCKPROF_SITE. They return what the pthread call returned. Built with
+ * -D_NOLOCKPROF_ they are the plain pthread calls.
+ */
+#ifndef _NOLOCKPROF_
+int lockprof_rdlock(pthread_rwlock_t* l, int id, void* site);
+int lockprof_wrlock(pthread_rwlock_t* l, int id, void* site);
+int lockprof_mutex_lock(pthread_mutex_t* m, int id, void* site);
+void lockprof_release(int id);
+#define LOCKPROF_SITE __builtin_return_address(0)
+#else
+#define lockprof_rdlock(l, id, site) pthread_rwlock_rdlock(l)
+#define lockprof_wrlock(l, id, site) pthread_rwlock_wrlock(l)
+#define lockprof_mutex_lock(m, id, site) pthread_mutex_lock(m)
+#define lockprof_release(id)
+#define LOCKPROF_SITE NULL
+#endif
+
+void cli_show_locks(router_state* rs, cli_request* req);
+void cli_locks_profile(router_state* rs, cli_request* req);
+
+#endif /*OR_LOCKPROF_H_*/
@@ -0,0 +1,175 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "or_lsdb.h"
+#include "or_data_types.h"
+#include "or_utils.h"
+
+/*
+ * The link state database is still rs->pwospf_router_list, SPF and the CLI walk it in
+ * order. This indexes its nodes by area and router id in an open addressed table (linear
+ * probing, deletes shift the run back so there are no tombstones), so handling an LSU
+ * costs the same however many routers we know. A router in more than one area, an ABR,
+ * has an entry per area. Everything here needs the pwospf_router_list_lock.
+ */
+
+static unsigned int lsdb_hash(uint32_t aid, uint32_t rid) {
+	return (rid * 2654435761U) ^ (aid * 40503U);
+}
+
+static node** lsdb_slot(pwospf_lsdb* db, uint32_t aid, uint32_t rid) {
+	unsigned int i = lsdb_hash(aid, rid) & db->mask;
+	while (db->slots[i]) {
+		pwospf_router* r = (pwospf_router*)db->slots[i]->data;
+		if ((r->router_id == rid) && (r->area_id == aid)) {
+			break;
+		}
+		i = (i + 1) & db->mask;
+	}
+	return &(db->slots[i]);
+}
+
+static void lsdb_grow(pwospf_lsdb* db) {
+	node** old = db->slots;
+	unsigned int old_size = old ? (db->mask + 1) : 0;
+	unsigned int size = old ? (2 * old_size) : 16;
+	unsigned int i;
+
+	db->slots = (node**)calloc(size, sizeof(node*));
+	db->mask = size - 1;
+	for (i = 0; i < old_size; ++i) {
+		if (old[i]) {
+			pwospf_router* r = (pwospf_router*)old[i]->data;
+			*lsdb_slot(db, r->area_id, r->router_id) = old[i];
+		}
+	}
+	free(old);
+}
+
+pwospf_router* lsdb_lookup(router_state* rs, uint32_t aid, uint32_t rid) {
+	if (!rs->pwospf_lsdb.slots) {
+		return NULL;
+	}
+
+	node* n = *lsdb_slot(&(rs->pwospf_lsdb), aid, rid);
+	return n ? (pwospf_router*)n->data : NULL;
+}
+
+/*
+ * Appends the router to the pwospf router list and indexes it
+ */
+void lsdb_add(router_state* rs, pwospf_router* router) {
+	pwospf_lsdb* db = &(rs->pwospf_lsdb);
+	node* n = node_create();
+	n->data = (void*)router;
+
+	if (rs->pwospf_router_list == NULL) {
+		rs->pwospf_router_list = n;
+	} else {
+		node_push_back(rs->pwospf_router_list, n);
+	}
+
+	/* keep it at most half full */
+	if (!db->slots || (2 * (db->count + 1) > (db->mask + 1))) {
+		lsdb_grow(db);
+	}
+
+	node** slot = lsdb_slot(db, router->area_id, router->router_id);
+	assert(*slot == NULL);
+	*slot = n;
+	db->count++;
+}
+
+/*
+ * Takes the router's entry for the area out of the index and the list, freeing it and its interfaces
+ * Returns: 1 if it was there, 0 otherwise
+ */
+int lsdb_remove(router_state* rs, uint32_t aid, uint32_t rid) {
+	pwospf_lsdb* db = &(rs->pwospf_lsdb);
+	node** slot;
+	node* n;
+	unsigned int i, j;
+
+	if (!db->slots || !*(slot = lsdb_slot(db, aid, rid))) {
+		return 0;
+	}
+	n = *slot;
+	*slot = NULL;
+	db->count--;
+
+	/* move back anything later in the run that would no longer be found */
+	i = slot - db->slots;
+	for (j = (i + 1) & db->mask; db->slots[j]; j = (j + 1) & db->mask) {
+		pwospf_router* r = (pwospf_router*)db->slots[j]->data;
+		unsigned int home = lsdb_hash(r->area_id, r->router_id) & db->mask;
+		if (((j - home) & db->mask) >= ((j - i) & db->mask)) {
+			db->slots[i] = db->slots[j];
+			db->slots[j] = NULL;
+			i = j;
+		}
+	}
+
+	pwospf_router* router = (pwospf_router*)n->data;
+	while (router->interface_list) {
+		node_remove(&(router->interface_list), router->interface_list);
+	}
+	node_remove(&(rs->pwospf_router_list), n);
+
+	return 1;
+}
+
+void lsdb_destroy(router_state* rs) {
+	free(rs->pwospf_lsdb.slots);
+	bzero(&(rs->pwospf_lsdb), sizeof(pwospf_lsdb));
+}
+
+/*
+ * Digest of the advertisements of an LSU. It doesn't depend on their order, the same
+ * as the comparison in populate_pwospf_router_interface_list, so an LSU with the same
+ * digest as the last one from its router can be skipped without looking at the list.
+ */
+uint64_t lsdb_digest(const pwospf_lsu_adv* advs, uint32_t num) {
+	uint64_t digest = num;
+	uint32_t i;
+
+	for (i = 0; i < num; ++i) {
+		uint64_t h = 14695981039346656037ULL;
+		uint32_t words[5];
+		const uint8_t* p = (const uint8_t*)words;
+		unsigned int k;
+
+		/* the subnet is masked when we store it, so hash it that way too */
+		words[0] = advs[i].pwospf_sub.s_addr & advs[i].pwospf_mask.s_addr;
+		words[1] = advs[i].pwospf_mask.s_addr;
+		words[2] = advs[i].pwospf_rid;
+		words[3] = advs[i].ngrp_rx_rate;
+		words[4] = advs[i].ngrp_tx_rate;
+
+		/* FNV-1a per advertisement, then mixed and summed */
+		for (k = 0; k < sizeof(words); ++k) {
+			h = (h ^ p[k]) * 1099511628211ULL;
+		}
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+
+		digest += h;
+	}
+
+	return digest;
+}
+
+/*
+ * Sequence numbers compared as serial numbers (RFC 1982), so 0 follows 65535
+ * Returns: 1 if seq is newer than than, 0 otherwise
+ */
+int lsdb_seq_newer(uint16_t seq, uint16_t than) {
+	return (int16_t)(uint16_t)(seq - than) > 0;
+}
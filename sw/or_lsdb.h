@@ -0,0 +1,21 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#ifndef OR_LSDB_H_
+#define OR_LSDB_H_
+
+#include "or_data_types.h"
+#include "sr_base_internal.h"
+
+pwospf_router* lsdb_lookup(router_state* rs, uint32_t aid, uint32_t rid);
+void lsdb_add(router_state* rs, pwospf_router* router);
+int lsdb_remove(router_state* rs, uint32_t aid, uint32_t rid);
+void lsdb_destroy(router_state* rs);
+
+uint64_t lsdb_digest(const pwospf_lsu_adv* advs, uint32_t num);
+int lsdb_seq_newer(uint16_t seq, uint16_t than);
+
+#endif /*OR_LSDB_H_*/
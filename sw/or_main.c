@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <string.h>
@@ -25,6 +26,7 @@
 #include "or_ip.h"
 #include "sr_base_internal.h"
 #include "or_rtable.h"
+#include "or_fib.h"
 #include "or_atable.h"
 #include "or_rstable.h"
 #include "or_iface.h"
@@ -33,6 +35,7 @@
 #include "or_vns.h"
 #include "or_sping.h"
 #include "or_pwospf.h"
+#include "or_lsdb.h"
 #include "or_dijkstra.h"
 #include "or_netfpga.h"
 #include "or_nat.h"
@@ -41,6 +44,12 @@
 #include "reg_defines.h"
 #include "or_www.h"
 #include "or_nat.h"
+#include "or_timer.h"
+#include "or_snapshot.h"
+#include "or_flow.h"
+#include "or_drop.h"
+#include "or_latency.h"
+#include "or_lockprof.h"
 
 inline router_state* get_router_state(struct sr_instance* sr) {
 	return (router_state*)sr->interface_subsystem;
@@ -116,11 +125,21 @@ void init(struct sr_instance* sr)
     	exit(1);
     }
 
-    rs->nat_table_cond = (pthread_cond_t*)malloc(sizeof(pthread_cond_t));
-    if (pthread_cond_init(rs->nat_table_cond, NULL) != 0) {
-			perror("Nat Table cond init error");
-			exit(1);
+    rs->nat_table = nat_table_create();
+
+    rs->flow_cache = flow_cache_create();
+
+    rs->drop_stats = drop_stats_create();
+    rs->latency_stats = latency_stats_create();
+
+    rs->timers = timer_wheel_create();
+
+    rs->snapshot_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+    if (pthread_mutex_init(rs->snapshot_mutex, NULL) != 0) {
+    	perror("Mutex init error");
+    	exit(1);
     }
+    strncpy(rs->snapshot_path, SNAPSHOT_DEFAULT_PATH, SNAPSHOT_PATH_LEN - 1);
 
     rs->local_ip_filter_list_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
     if (pthread_mutex_init(rs->local_ip_filter_list_mutex, NULL) != 0) {
@@ -128,19 +147,26 @@ void init(struct sr_instance* sr)
 			exit(1);
     }
 
-    rs->log_dumper_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
-    if (pthread_mutex_init(rs->log_dumper_mutex, NULL) != 0) {
-			perror("Log dumper mutex init error");
-			exit(1);
-    }
-
     rs->sr = sr;
 		rs->area_id = PWOSPF_AREA_ID;
 		rs->pwospf_hello_interval = PWOSPF_NEIGHBOR_TIMEOUT;
 		rs->pwospf_lsu_interval = PWOSPF_LSUINT;
 		rs->pwospf_lsu_broadcast = 1;
+		rs->pwospf_metric = PWOSPF_METRIC_RATE;
+		rs->pwospf_load_min_change = PWOSPF_LOAD_MIN_CHANGE;
+		rs->pwospf_lsu_generation = 1;
+		rs->pwospf_liveness_interval = PWOSPF_LIVENESS_INTERVAL;
+		rs->pwospf_liveness_multiplier = PWOSPF_LIVENESS_MULTIPLIER;
+		rs->spf_start_ms = PWOSPF_SPF_START;
+		rs->spf_hold_ms = PWOSPF_SPF_HOLD;
+		rs->spf_max_wait_ms = PWOSPF_SPF_MAX_WAIT;
+		rs->spf_cur_hold_ms = PWOSPF_SPF_HOLD;
 		rs->arp_ttl = INITIAL_ARP_TIMEOUT;
-		rs->nat_timeout = 120;
+		rs->nat_timeouts[NAT_TIMEOUT_TCP_SYN] = NAT_DEFAULT_TCP_SYN_TIMEOUT;
+		rs->nat_timeouts[NAT_TIMEOUT_TCP_EST] = NAT_DEFAULT_TCP_EST_TIMEOUT;
+		rs->nat_timeouts[NAT_TIMEOUT_TCP_FIN] = NAT_DEFAULT_TCP_FIN_TIMEOUT;
+		rs->nat_timeouts[NAT_TIMEOUT_UDP] = NAT_DEFAULT_UDP_TIMEOUT;
+		rs->nat_timeouts[NAT_TIMEOUT_ICMP] = NAT_DEFAULT_ICMP_TIMEOUT;
 
 		/* clear stats */
 		int i, j;
@@ -234,11 +260,16 @@ void init(struct sr_instance* sr)
     	exit(1);
     }
 
+    /* the spf throttle waits on the monotonic clock */
+    pthread_condattr_t dijkstra_cond_attr;
+    pthread_condattr_init(&dijkstra_cond_attr);
+    pthread_condattr_setclock(&dijkstra_cond_attr, CLOCK_MONOTONIC);
     rs->dijkstra_cond = (pthread_cond_t*)malloc(sizeof(pthread_cond_t));
-    if (pthread_cond_init(rs->dijkstra_cond, NULL) != 0) {
+    if (pthread_cond_init(rs->dijkstra_cond, &dijkstra_cond_attr) != 0) {
 			perror("Dijkstra cond init error");
 			exit(1);
     }
+    pthread_condattr_destroy(&dijkstra_cond_attr);
 
     /* Initialize WWW Mutex/Cond Var */
     rs->www_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
@@ -263,33 +294,23 @@ void init(struct sr_instance* sr)
 
     sr_set_subsystem(sr, (void*)rs);
 
-    /** SPAWN THE ARP QUEUE THREAD **/
-    rs->arp_thread = (pthread_t*)malloc(sizeof(pthread_t));
-
-    if(pthread_create(rs->arp_thread, NULL, arp_thread, (void *)sr) != 0) {
+    /** START THE TIMER EXECUTOR, IT RUNS ALL PERIODIC WORK BELOW **/
+    rs->timer_thread = (pthread_t*)malloc(sizeof(pthread_t));
+    if(pthread_create(rs->timer_thread, NULL, timer_thread, (void *)rs) != 0) {
 	    perror("Thread create error");
     }
 
+    /** ARP QUEUE RETRIES **/
+    timer_add(rs, 1000, 1000, arp_queue_timer, 0);
 
-    /** SPAWN THE PWOSPF HELLO BROADCAST THREAD **/
-    rs->pwospf_hello_thread = (pthread_t*)malloc(sizeof(pthread_t));
-    if(pthread_create(rs->pwospf_hello_thread, NULL, pwospf_hello_thread, (void *)sr) != 0) {
-		perror("Thread create error");
-    }
+    /** PWOSPF HELLO BROADCAST **/
+    timer_add(rs, 0, 0, pwospf_hello_timer, 0);
 
+    /** PWOSPF NEIGHBOR LIVENESS **/
+    timer_add(rs, 0, 0, pwospf_liveness_timer, 0);
 
-    /** SPAWN THE PWOSPF LSU BROADCAST THREAD **/
-    rs->pwospf_lsu_thread = (pthread_t*)malloc(sizeof(pthread_t));
-    if(pthread_create(rs->pwospf_lsu_thread, NULL, pwospf_lsu_thread, (void *)sr) != 0) {
-	    perror("Thread create error");
-    }
-
-
-    /** SPAWN THE PWOSPF LSU BCAST TIMEOUT THREAD **/
-    rs->pwospf_lsu_timeout_thread = (pthread_t*)malloc(sizeof(pthread_t));
-    if(pthread_create(rs->pwospf_lsu_timeout_thread, NULL, pwospf_lsu_timeout_thread, (void*)sr) != 0) {
-	    perror("Thread create error");
-    }
+    /** PWOSPF LSU BROADCAST **/
+    timer_add(rs, 5000, 0, pwospf_lsu_timer, 0);
 
     /** SPAWN THE DIJKSTRA THREAD **/
     rs->pwospf_dijkstra_thread = (pthread_t*)malloc(sizeof(pthread_t));
@@ -304,27 +325,22 @@ void init(struct sr_instance* sr)
 	    perror("Thread create error");
     }
 
-    /** Spawn the NAT Maintenance Thread **/
-    /*
-    rs->nat_maintenance_thread = (pthread_t*)malloc(sizeof(pthread_t));
-    if(pthread_create(rs->nat_maintenance_thread, NULL, nat_maintenance_thread, (void*)rs) != 0) {
-	    perror("Thread create error");
-    }
-    */
+    /** NAT MAINTENANCE, hit rates and the hw rows **/
+    timer_add(rs, NAT_MAINTENANCE_INTERVAL, NAT_MAINTENANCE_INTERVAL, nat_maintenance_timer, 0);
 
-    /* if we are on the NETFPGA spawn the stats thread */
+    /* if we are on the NETFPGA sample the stats */
 	if (rs->is_netfpga) {
-	    rs->stats_thread = (pthread_t*)malloc(sizeof(pthread_t));
-	    if(pthread_create(rs->stats_thread, NULL, netfpga_stats, (void*)rs) != 0) {
-		    perror("Thread create error");
-	    }
+	    timer_add(rs, 0, 500, netfpga_stats_timer, 0);
 	}
 	
-	/** SPAWN THE RSTABLE UPDATE THREAD **/
-	rs->rstable_thread = (pthread_t*)malloc(sizeof(pthread_t));
-	if (pthread_create(rs->rstable_thread, NULL, rstable_thread, (void*)get_router_state(sr)) != 0) {
-		perror("Thread create error");
-	}
+	/** RSTABLE UPDATE **/
+	timer_add(rs, 0, 500, rstable_timer, 0);
+
+	/** FLOW TELEMETRY EXPIRY AND EXPORT **/
+	timer_add(rs, FLOW_SWEEP_INTERVAL, FLOW_SWEEP_INTERVAL, flow_sweep_timer, 0);
+
+	/** WARM RESTART SNAPSHOT, writes only start once it has been restored **/
+	timer_add(rs, SNAPSHOT_INTERVAL, SNAPSHOT_INTERVAL, snapshot_timer, 0);
 }
 
 void init_add_interface(struct sr_instance* sr, struct sr_vns_if* vns_if) {
@@ -343,6 +359,7 @@ void init_add_interface(struct sr_instance* sr, struct sr_vns_if* vns_if) {
 	ie->mask = vns_if->mask;
 	ie->speed = vns_if->speed;
 	ie->is_wan = 0;
+	ie->area_id = rs->area_id;
 	memcpy(ie->addr, vns_if->addr, ETH_ADDR_LEN);
 	memcpy(ie->name, vns_if->name, IF_LEN);
 //	ie->hello_interval = PWOSPF_NEIGHBOR_TIMEOUT;
@@ -431,27 +448,16 @@ void init_router_list(struct sr_instance* sr){
 	assert(sr);
 	router_state *rs = get_router_state(sr);
 
-	/* build an entry for our router */
-	pwospf_router *our_router = (pwospf_router *)calloc(1, sizeof(pwospf_router));
-	our_router->router_id = rs->router_id;
-	our_router->area_id = rs->area_id;
-	our_router->seq = 0;
-	our_router->distance = 0;
-	our_router->shortest_path_found = 0;
-	time(&our_router->last_update);
-
-
-	/* insert our_router in the pwospf router list */
+	/* build an entry for our router, in the default area even if no interface is in it */
 	assert(rs->pwospf_router_list == NULL);
-	node *n = node_create();
-	n->data = (void *)our_router;
-	rs->pwospf_router_list = n;
+	attach_pwospf_area(rs, rs->area_id);
 
 
-	/* advertise what's directly connected to us */
+	/* advertise what's directly connected to us, each in its area */
 	node *il_walker = rs->if_list;
 	while(il_walker) {
 		iface_entry *ie = (iface_entry *)il_walker->data;
+		pwospf_router *our_router = attach_pwospf_area(rs, ie->area_id);
 
 		pwospf_interface *pi = (pwospf_interface *)calloc(1, sizeof(pwospf_interface));
 		pi->subnet.s_addr = (ie->ip & ie->mask);
@@ -563,7 +569,7 @@ void init_rtable(struct sr_instance* sr) {
 	if (default_route) {
 		lock_mutex_pwospf_router_list(rs);
 
-		pwospf_router* r = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
+		pwospf_router* r = lsdb_lookup(rs, rs->area_id, rs->router_id);
 		node* n = node_create();
 		n->data = default_route;
 
@@ -572,9 +578,14 @@ void init_rtable(struct sr_instance* sr) {
 		} else {
 			r->interface_list = n;
 		}
+		pwospf_lsu_changed(rs);
 
 		unlock_mutex_pwospf_router_list(rs);
 	}
+
+	/* pick up what we knew before a restart */
+	snapshot_restore(rs);
+
 	/* tell our dijkstra algorithm to run */
 	dijkstra_trigger(rs);
 }
@@ -621,6 +632,16 @@ void init_cli(struct sr_instance* sr) {
 	register_cli_command(&(rs->cli_commands), "show vns server ?", &cli_show_vns_server_help);
 	register_cli_command(&(rs->cli_commands), "show vns topology", &cli_show_vns_topology);
 	register_cli_command(&(rs->cli_commands), "show vns topology ?", &cli_show_vns_topology_help);
+	register_cli_command(&(rs->cli_commands), "show timers", &cli_show_timers);
+	register_cli_command(&(rs->cli_commands), "show snapshot", &cli_show_snapshot);
+	register_cli_command(&(rs->cli_commands), "snapshot save", &cli_snapshot_save);
+	register_cli_command(&(rs->cli_commands), "show log", &cli_show_log);
+	register_cli_command(&(rs->cli_commands), "log rotate", &cli_log_rotate);
+	register_cli_command(&(rs->cli_commands), "log filter", &cli_log_filter);
+	register_cli_command(&(rs->cli_commands), "log sample", &cli_log_sample);
+	register_cli_command(&(rs->cli_commands), "log select", &cli_log_select);
+	register_cli_command(&(rs->cli_commands), "show locks", &cli_show_locks);
+	register_cli_command(&(rs->cli_commands), "locks profile", &cli_locks_profile);
 
 
 	/* CLI: show ip ... */
@@ -632,6 +653,11 @@ void init_cli(struct sr_instance* sr) {
 	register_cli_command(&(rs->cli_commands), "show ip interface ?", &cli_show_ip_iface_help);
 	register_cli_command(&(rs->cli_commands), "show ip route", &cli_show_ip_rtable);
 	register_cli_command(&(rs->cli_commands), "show ip route ?", &cli_show_ip_rtable_help);
+	register_cli_command(&(rs->cli_commands), "show ip fib", &cli_show_ip_fib);
+	register_cli_command(&(rs->cli_commands), "show ip fib ?", &cli_show_ip_fib_help);
+	register_cli_command(&(rs->cli_commands), "show ip flow", &cli_show_ip_flow);
+	register_cli_command(&(rs->cli_commands), "show ip drops", &cli_show_ip_drops);
+	register_cli_command(&(rs->cli_commands), "show ip latency", &cli_show_ip_latency);
 
 
 	/* CLI: ip ... */
@@ -645,6 +671,12 @@ void init_cli(struct sr_instance* sr) {
 	register_cli_command(&(rs->cli_commands), "ip route del", &cli_ip_route_del);
 	register_cli_command(&(rs->cli_commands), "ip route del ?", &cli_ip_route_del_help);
 
+	/* CLI: ip fib ... */
+	register_cli_command(&(rs->cli_commands), "ip fib verify", &cli_ip_fib_verify);
+
+	/* CLI: ip latency ... */
+	register_cli_command(&(rs->cli_commands), "ip latency", &cli_ip_latency);
+
 	/* CLI: ip interface ... */
 	register_cli_command(&(rs->cli_commands), "ip interface ?", &cli_ip_interface_help);
 	register_cli_command(&(rs->cli_commands), "ip interface", &cli_ip_interface);
@@ -670,11 +702,17 @@ void init_cli(struct sr_instance* sr) {
 	register_cli_command(&(rs->cli_commands), "show pwospf iface ?", &cli_show_pwospf_iface_help);
 	register_cli_command(&(rs->cli_commands), "show pwospf router", &cli_show_pwospf_router_list);
 	register_cli_command(&(rs->cli_commands), "show pwospf info", &cli_show_pwospf_info);
+	register_cli_command(&(rs->cli_commands), "show pwospf area", &cli_show_pwospf_area);
 	register_cli_command(&(rs->cli_commands), "set aid", &cli_pwospf_set_aid);
 	register_cli_command(&(rs->cli_commands), "set aid ?", &cli_pwospf_set_aid_help);
+	register_cli_command(&(rs->cli_commands), "set iface area", &cli_pwospf_set_iface_area);
+	register_cli_command(&(rs->cli_commands), "area range", &cli_pwospf_area_range);
 	register_cli_command(&(rs->cli_commands), "set hello interval", &cli_pwospf_set_hello);
 	register_cli_command(&(rs->cli_commands), "set lsu broadcast", &cli_pwospf_set_lsu_broadcast);
 	register_cli_command(&(rs->cli_commands), "set lsu interval", &cli_pwospf_set_lsu_interval);
+	register_cli_command(&(rs->cli_commands), "set spf throttle", &cli_pwospf_set_spf_throttle);
+	register_cli_command(&(rs->cli_commands), "set metric", &cli_pwospf_set_metric);
+	register_cli_command(&(rs->cli_commands), "set liveness", &cli_pwospf_set_liveness);
 	register_cli_command(&(rs->cli_commands), "send hello", &cli_pwospf_send_hello);
 	register_cli_command(&(rs->cli_commands), "send lsu", &cli_pwospf_send_lsu);
 
@@ -696,7 +734,6 @@ void init_cli(struct sr_instance* sr) {
 	/* CLI: nat ... */
 	/*
 	register_cli_command(&(rs->cli_commands), "nat ?", &cli_nat_help);
-	register_cli_command(&(rs->cli_commands), "show nat table", &cli_show_nat_table);
 	register_cli_command(&(rs->cli_commands), "nat set", &cli_nat_set);
 	register_cli_command(&(rs->cli_commands), "nat reset", &cli_nat_reset);
 	register_cli_command(&(rs->cli_commands), "nat test", &cli_nat_test);
@@ -705,6 +742,12 @@ void init_cli(struct sr_instance* sr) {
 	register_cli_command(&(rs->cli_commands), "show hw nat table", &cli_show_hw_nat_table);
 	*/
 
+	/* the nat tuning commands and show nat table only touch the table, they stay live with the rest off */
+	register_cli_command(&(rs->cli_commands), "show nat table", &cli_show_nat_table);
+	register_cli_command(&(rs->cli_commands), "nat pool", &cli_nat_pool);
+	register_cli_command(&(rs->cli_commands), "nat parity", &cli_nat_parity);
+	register_cli_command(&(rs->cli_commands), "nat timeout", &cli_nat_timeout);
+
 	/* bubble sort command list */
 	int swapped = 0;
 	do {
@@ -739,8 +782,13 @@ void process_packet(struct sr_instance* sr, const uint8_t * packet, unsigned int
 	printf("&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&\n");
 	*/
 
-	if (iface_is_active(get_router_state(sr), (char*)interface) == 0) {
+	router_state* rs = get_router_state(sr);
+	LATENCY_VAR(t);
+	LATENCY_START(rs, t);
+
+	if (iface_is_active(rs, (char*)interface) == 0) {
 		/* drop the packet */
+		drop_count(rs, DROP_IFACE_DOWN, interface);
 		return;
 	}
 
@@ -754,15 +802,19 @@ void process_packet(struct sr_instance* sr, const uint8_t * packet, unsigned int
 
 		case ETH_TYPE_IP:
 			//printf(" ** -> Received IP packet of length %d\n", len);
+			LATENCY_END(rs, LAT_RX, t);
 			process_ip_packet(sr, packet, len, interface);
 			break;
 
 		case ETH_TYPE_ARP:
 			printf(" ** -> Received ARP packet of length %d\n", len);
+			LATENCY_END(rs, LAT_RX, t);
 			process_arp_packet(sr, packet, len, interface);
 			break;
 
-		default: break;
+		default:
+			drop_count(rs, DROP_UNSUPPORTED, interface);
+			break;
 	}
 
 }
@@ -773,9 +825,12 @@ void process_packet(struct sr_instance* sr, const uint8_t * packet, unsigned int
 int send_ip(struct sr_instance* sr, uint8_t* packet, unsigned int len, struct in_addr* next_hop, const char* out_iface) {
 
 	eth_hdr* eth = (eth_hdr*)packet;
+	LATENCY_VAR(t);
 
 	/*print_arp_cache(sr);*/
+	LATENCY_START(get_router_state(sr), t);
 	arp_cache_entry* ace = get_from_arp_cache(sr, next_hop);
+	LATENCY_END(get_router_state(sr), LAT_ARP, t);
 	if (ace) {
 		memcpy(eth->eth_dhost, ace->arp_ha, ETH_ADDR_LEN);
 
@@ -796,6 +851,9 @@ int send_ip(struct sr_instance* sr, uint8_t* packet, unsigned int len, struct in
 
 int send_packet(struct sr_instance* sr, uint8_t* packet, unsigned int len, const char* iface) {
 	router_state* rs = get_router_state(sr);
+	LATENCY_VAR(t);
+	LATENCY_START(rs, t);
+
 	if (pthread_mutex_lock(rs->write_lock) != 0) {
 		perror("Failure locking write lock\n");
 		exit(1);
@@ -833,6 +891,11 @@ int send_packet(struct sr_instance* sr, uint8_t* packet, unsigned int len, const
 		exit(1);
 	}
 
+	if (result != 0) {
+		drop_count(rs, DROP_SEND_FAILED, iface);
+	}
+
+	LATENCY_END(rs, LAT_TX, t);
 	return result;
 }
 
@@ -840,6 +903,9 @@ int send_packet(struct sr_instance* sr, uint8_t* packet, unsigned int len, const
 void destroy(struct sr_instance* sr) {
     router_state* rs = sr->interface_subsystem;
 
+    /* last snapshot for a warm restart, while everything is still there */
+    snapshot_write(rs);
+
     /** DESTROY LOCKS **/
     if (pthread_mutex_destroy(rs->write_lock) != 0) {
     	perror("Lock destroy error");
@@ -861,6 +927,7 @@ void destroy(struct sr_instance* sr) {
     }
     free(rs->if_list_lock);
 
+    fib_destroy(rs);
     if (pthread_rwlock_destroy(rs->rtable_lock) != 0) {
     	perror("Lock destroy error");
     }
@@ -871,17 +938,40 @@ void destroy(struct sr_instance* sr) {
     }
     free(rs->cli_commands_lock);
 
+    timer_wheel_destroy(rs->timers);
+
+    if (pthread_mutex_destroy(rs->snapshot_mutex) != 0) {
+    	perror("Lock destroy error");
+    }
+    free(rs->snapshot_mutex);
+
+    flow_cache_destroy(rs->flow_cache);
+    drop_stats_destroy(rs->drop_stats);
+    latency_stats_destroy(rs->latency_stats);
+
+    nat_table_destroy(rs->nat_table);
     if (pthread_mutex_destroy(rs->nat_table_mutex) != 0) {
     	perror("Lock destroy error");
     }
     free(rs->nat_table_mutex);
 
-    if (pthread_cond_destroy(rs->nat_table_cond) != 0) {
-    	perror("Cond destroy error");
+    /* our areas, with their cached lsus and spf trees, and the router id index */
+    while (rs->pwospf_areas) {
+    	pwospf_area* area = (pwospf_area*)rs->pwospf_areas->data;
+    	free(area->lsu_cache.packet);
+    	spf_tree_destroy(area->spf);
+    	while (area->summaries) {
+    		node_remove(&(area->summaries), area->summaries);
+    	}
+    	while (area->ranges) {
+    		node_remove(&(area->ranges), area->ranges);
+    	}
+    	node_remove(&(rs->pwospf_areas), rs->pwospf_areas);
     }
-    free(rs->nat_table_cond);
+    lsdb_destroy(rs);
 
     /* destroy dijkstra stuff */
+
     if (pthread_mutex_destroy(rs->dijkstra_mutex) != 0) {
     	perror("Mutex destroy error");
     }
@@ -9,6 +9,7 @@
 #include "string.h"
 #include "assert.h"
 #include "time.h"
+#include "stddef.h"
 
 #include "reg_defines.h"
 #include "or_nat.h"
@@ -20,18 +21,681 @@
 #include "or_ip.h"
 #include "or_icmp.h"
 #include "or_output.h"
+#include "or_lockprof.h"
+#include "or_timer.h"
+
+/* lo and hi in host byte order, inclusive, the pool is emptied */
+void nat_port_pool_init(nat_port_pool *pool, uint16_t lo, uint16_t hi) {
+	bzero(pool->used, sizeof(pool->used));
+	pool->lo = lo;
+	pool->hi = hi;
+	pool->cursor = lo;
+	pool->in_use = 0;
+	pool->high_water = 0;
+}
+
+/* bits of word w that fall inside the pool range */
+static uint64_t nat_port_range_mask(nat_port_pool *pool, uint32_t w) {
+	uint64_t mask = ~((uint64_t)0);
+	uint32_t first = w * 64;
+
+	if(pool->lo > first) {
+		mask &= ~((uint64_t)0) << (pool->lo - first);
+	}
+	if(pool->hi < first + 63) {
+		mask &= ~((uint64_t)0) >> (63 - (pool->hi - first));
+	}
+	return mask;
+}
+
+/*
+ * Takes the first free port at or after the cursor, wrapping once around the
+ * pool, a word of 64 ports is checked at a time. With parity set only ports
+ * of the same parity as hint are considered.
+ * Returns the port in host byte order, 0 if there is none
+ */
+uint16_t nat_port_alloc(nat_port_pool *pool, uint16_t hint, int parity) {
+	uint32_t first_word = pool->lo / 64;
+	uint32_t last_word = pool->hi / 64;
+	uint32_t num_words = last_word - first_word + 1;
+	uint64_t parity_mask = ~((uint64_t)0);
+	uint32_t n;
+
+	if(parity) {
+		parity_mask = (hint & 1) ? 0xAAAAAAAAAAAAAAAAULL : 0x5555555555555555ULL;
+	}
+
+	if((pool->cursor < pool->lo) || (pool->cursor > pool->hi)) {
+		pool->cursor = pool->lo;
+	}
+
+	uint32_t w = pool->cursor / 64;
+	uint64_t from_cursor = ~((uint64_t)0) << (pool->cursor % 64);
+
+	/* the cursor word is visited twice, once from the cursor and once on wrap */
+	for(n = 0; n <= num_words; ++n) {
+		uint64_t avail = ~(pool->used[w]) & nat_port_range_mask(pool, w) & parity_mask;
+		if(n == 0) {
+			avail &= from_cursor;
+		}
+
+		if(avail) {
+			uint32_t port = (w * 64) + __builtin_ctzll(avail);
+			pool->used[w] |= ((uint64_t)1) << (port % 64);
+			pool->cursor = port + 1;
+			if(++pool->in_use > pool->high_water) {
+				pool->high_water = pool->in_use;
+			}
+			return (uint16_t)port;
+		}
+
+		w = (w == last_word) ? first_word : w + 1;
+	}
+
+	return 0;
+}
+
+/* Marks port (host byte order) as taken, ports outside the pool are ignored */
+void nat_port_reserve(nat_port_pool *pool, uint16_t port) {
+	uint64_t bit = ((uint64_t)1) << (port % 64);
+
+	if((port < pool->lo) || (port > pool->hi) || (pool->used[port / 64] & bit)) {
+		return;
+	}
+
+	pool->used[port / 64] |= bit;
+	if(++pool->in_use > pool->high_water) {
+		pool->high_water = pool->in_use;
+	}
+}
+
+/* port in host byte order */
+void nat_port_release(nat_port_pool *pool, uint16_t port) {
+	uint64_t bit = ((uint64_t)1) << (port % 64);
+
+	if((port < pool->lo) || (port > pool->hi) || !(pool->used[port / 64] & bit)) {
+		return;
+	}
+
+	pool->used[port / 64] &= ~bit;
+	--pool->in_use;
+}
+
+static void nat_track_tcp(router_state *rs, nat_entry *ne, uint8_t flags, int nat_type);
+
+static uint32_t nat_hash(uint32_t ip, uint16_t port, uint8_t proto) {
+	uint32_t h = ip ^ (((uint32_t)port) << 16) ^ proto;
+	h *= 0x9E3779B1;
+	return h ^ (h >> 16);
+}
+
+/* shard of an internal endpoint, from the hash bits the buckets do not use */
+static uint8_t nat_shard_of(uint32_t ip, uint16_t port, uint8_t proto) {
+	return (uint8_t)(nat_hash(ip, port, proto) >> (32 - NAT_SHARD_BITS));
+}
+
+/* index into nat_table pools and ext_owner, -1 if proto is not translated */
+static int nat_pool_index(uint8_t proto) {
+	switch(proto) {
+		case IP_PROTO_TCP:
+			return NAT_POOL_TCP;
+		case IP_PROTO_UDP:
+			return NAT_POOL_UDP;
+		case IP_PROTO_ICMP:
+			return NAT_POOL_ICMP;
+		default:
+			return -1;
+	}
+}
+
+/* Returns the external port pool for proto, NULL if proto is not translated */
+nat_port_pool *nat_port_pool_for(nat_table *t, uint8_t proto) {
+	int p = nat_pool_index(proto);
+	return (p < 0) ? NULL : &(t->pools[p]);
+}
+
+static void lock_nat_pools(nat_table *t) {
+	if(lockprof_mutex_lock(&(t->pool_lock), LOCK_NAT_POOLS, LOCKPROF_SITE) != 0) {
+		perror("Failure getting nat pool lock");
+	}
+}
+
+static void unlock_nat_pools(nat_table *t) {
+	lockprof_release(LOCK_NAT_POOLS);
+	if(pthread_mutex_unlock(&(t->pool_lock)) != 0) {
+		perror("Failure unlocking nat pool lock");
+	}
+}
+
+void nat_lock_shard(nat_shard *shard) {
+	if(lockprof_mutex_lock(&(shard->lock), LOCK_NAT_SHARD, LOCKPROF_SITE) != 0) {
+		perror("Failure getting nat shard lock");
+	}
+}
+
+void nat_unlock_shard(nat_shard *shard) {
+	lockprof_release(LOCK_NAT_SHARD);
+	if(pthread_mutex_unlock(&(shard->lock)) != 0) {
+		perror("Failure unlocking nat shard lock");
+	}
+}
+
+/* Locks and returns the shard of an internal endpoint, arguments in network byte order */
+nat_shard *nat_lock_int_shard(nat_table *t, uint32_t ip, uint16_t port, uint8_t proto) {
+	nat_shard *shard = &(t->shards[nat_shard_of(ip, port, proto)]);
+	nat_lock_shard(shard);
+	return shard;
+}
+
+/*
+ * Locks and returns the shard holding the external port (network byte order),
+ * NULL if no entry uses it
+ */
+nat_shard *nat_lock_ext_shard(nat_table *t, uint16_t port, uint8_t proto) {
+	int p = nat_pool_index(proto);
+	if(p < 0) {
+		return NULL;
+	}
+
+	while(1) {
+		uint8_t owner = t->ext_owner[p][ntohs(port)];
+		if(owner == 0) {
+			return NULL;
+		}
+
+		nat_shard *shard = &(t->shards[owner - 1]);
+		nat_lock_shard(shard);
+		if(t->ext_owner[p][ntohs(port)] == owner) {
+			return shard;
+		}
+
+		/* the port changed hands while we waited for the lock */
+		nat_unlock_shard(shard);
+	}
+}
+
+nat_table *nat_table_create(void) {
+	nat_table *t = (nat_table *)calloc(1, sizeof(nat_table));
+	int i;
+
+	for(i = 0; i < NAT_NUM_SHARDS; ++i) {
+		nat_shard *shard = &(t->shards[i]);
+		if(pthread_mutex_init(&(shard->lock), NULL) != 0) {
+			perror("Failure initializing nat shard lock");
+			exit(1);
+		}
+		shard->num_buckets = NAT_TABLE_INITIAL_BUCKETS;
+		shard->int_buckets = (nat_entry **)calloc(shard->num_buckets, sizeof(nat_entry *));
+		shard->ext_buckets = (nat_entry **)calloc(shard->num_buckets, sizeof(nat_entry *));
+		shard->epoch = 1;	/* new entries have active_epoch 0 */
+	}
+
+	if(pthread_mutex_init(&(t->pool_lock), NULL) != 0) {
+		perror("Failure initializing nat pool lock");
+		exit(1);
+	}
+
+	for(i = 0; i < NAT_NUM_POOLS; ++i) {
+		nat_port_pool_init(&(t->pools[i]), NAT_DEFAULT_PORT_LO, NAT_DEFAULT_PORT_HI);
+	}
+	return t;
+}
+
+void nat_table_destroy(nat_table *t) {
+	int i;
+
+	for(i = 0; i < NAT_NUM_SHARDS; ++i) {
+		nat_shard *shard = &(t->shards[i]);
+		while(shard->slabs) {
+			node_remove(&shard->slabs, shard->slabs);
+		}
+		free(shard->int_buckets);
+		free(shard->ext_buckets);
+		pthread_mutex_destroy(&(shard->lock));
+	}
+	pthread_mutex_destroy(&(t->pool_lock));
+	free(t);
+}
+
+/* Number of entries over all shards, hold the NAT TABLE LOCK for an exact count */
+uint32_t nat_table_num_entries(nat_table *t) {
+	uint32_t total = 0;
+	int i;
+
+	for(i = 0; i < NAT_NUM_SHARDS; ++i) {
+		total += t->shards[i].num_entries;
+	}
+	return total;
+}
+
+/* NOT THREAD SAFE - acquire the lock of the shard
+ * Returns a zeroed entry that is not yet in the table
+ */
+nat_entry *nat_table_alloc_entry(nat_table *t, uint8_t shard_index) {
+	nat_shard *shard = &(t->shards[shard_index]);
+	int i;
+
+	if(shard->free_entries == NULL) {
+		nat_entry *slab = (nat_entry *)calloc(NAT_SLAB_SIZE, sizeof(nat_entry));
+		for(i = 0; i < NAT_SLAB_SIZE; ++i) {
+			slab[i].int_next = shard->free_entries;
+			shard->free_entries = &slab[i];
+		}
+
+		node *n = node_create();
+		n->data = (void *)slab;
+		if(shard->slabs == NULL) {
+			shard->slabs = n;
+		}
+		else {
+			node_push_back(shard->slabs, n);
+		}
+	}
+
+	nat_entry *ne = shard->free_entries;
+	shard->free_entries = ne->int_next;
+	bzero(ne, sizeof(nat_entry));
+	ne->shard = shard_index;
+
+	return ne;
+}
+
+/* Return an entry that never made it into the table back to the slab */
+void nat_table_free_entry(nat_table *t, nat_entry *ne) {
+	nat_shard *shard = &(t->shards[ne->shard]);
+	ne->int_next = shard->free_entries;
+	shard->free_entries = ne;
+}
+
+static void nat_shard_link(nat_shard *shard, nat_entry *ne) {
+	uint32_t i = nat_hash(ne->nat_int.ip.s_addr, ne->nat_int.port, ne->proto) & (shard->num_buckets - 1);
+	ne->int_next = shard->int_buckets[i];
+	shard->int_buckets[i] = ne;
+
+	uint32_t e = nat_hash(0, ne->nat_ext.port, ne->proto) & (shard->num_buckets - 1);
+	ne->ext_next = shard->ext_buckets[e];
+	shard->ext_buckets[e] = ne;
+}
+
+static void nat_shard_grow(nat_shard *shard) {
+	free(shard->int_buckets);
+	free(shard->ext_buckets);
+
+	shard->num_buckets *= 2;
+	shard->int_buckets = (nat_entry **)calloc(shard->num_buckets, sizeof(nat_entry *));
+	shard->ext_buckets = (nat_entry **)calloc(shard->num_buckets, sizeof(nat_entry *));
+
+	nat_entry *ne = shard->entries;
+	while(ne) {
+		nat_shard_link(shard, ne);
+		ne = ne->next;
+	}
+}
+
+static nat_entry *nat_shard_lookup_ext_port(nat_shard *shard, uint16_t port, uint8_t proto) {
+	nat_entry *ne = shard->ext_buckets[nat_hash(0, port, proto) & (shard->num_buckets - 1)];
+	while(ne) {
+		if((ne->nat_ext.port == port) && (ne->proto == proto)) {
+			return ne;
+		}
+		ne = ne->ext_next;
+	}
+	return NULL;
+}
+
+/* NOT THREAD SAFE - acquire the lock of the entry's shard
+ * Counts a hit, the first one in an epoch puts the entry on the active list for maintenance
+ */
+static void nat_hit(nat_shard *shard, nat_entry *ne) {
+	ne->hit_count++;
+
+	if(ne->active_epoch != shard->epoch) {
+		ne->active_epoch = shard->epoch;
+		ne->active_next = shard->active;
+		if(shard->active) {
+			shard->active->active_pprev = &(ne->active_next);
+		}
+		shard->active = ne;
+		ne->active_pprev = &(shard->active);
+	}
+}
+
+/* ones' complement adjustment for replacing the 16 bit word old by new (RFC 1624) */
+static uint32_t nat_delta_add(uint32_t delta, uint16_t old, uint16_t new) {
+	return delta + (uint16_t)(~old) + new;
+}
+
+static uint16_t nat_delta_fold(uint32_t delta) {
+	while(delta >> 16) {
+		delta = (delta & 0xFFFF) + (delta >> 16);
+	}
+	return (uint16_t)delta;
+}
+
+/* Fills in the template for packets arriving on the nat_type side */
+static void nat_build_rewrite(nat_entry *ne, int nat_type) {
+	nat_rewrite *rw = &(ne->rewrite[nat_type]);
+	nat_ip_port_pair *from = (nat_type == NAT_EXTERNAL) ? &(ne->nat_ext) : &(ne->nat_int);
+	nat_ip_port_pair *to = (nat_type == NAT_EXTERNAL) ? &(ne->nat_int) : &(ne->nat_ext);
+	uint16_t *old_ip = (uint16_t *)&(from->ip.s_addr);
+	uint16_t *new_ip = (uint16_t *)&(to->ip.s_addr);
+
+	bzero(rw, sizeof(nat_rewrite));
+	rw->ip = to->ip.s_addr;
+	rw->port = to->port;
+
+	/* inbound packets carry the address and port as destination, outbound as source */
+	rw->ip_off = (nat_type == NAT_EXTERNAL) ? offsetof(ip_hdr, ip_dst) : offsetof(ip_hdr, ip_src);
+	uint32_t ip_delta = nat_delta_add(nat_delta_add(0, old_ip[0], new_ip[0]), old_ip[1], new_ip[1]);
+	rw->ip_delta = nat_delta_fold(ip_delta);
+
+	switch(ne->proto) {
+		case IP_PROTO_TCP:
+			rw->port_off = (nat_type == NAT_EXTERNAL) ? offsetof(nat_tcp_hdr, tcp_dport) : offsetof(nat_tcp_hdr, tcp_sport);
+			rw->sum_off = offsetof(nat_tcp_hdr, tcp_sum);
+			rw->l4_delta = nat_delta_fold(nat_delta_add(ip_delta, from->port, to->port));
+			break;
+
+		case IP_PROTO_UDP:
+			rw->port_off = (nat_type == NAT_EXTERNAL) ? offsetof(nat_udp_hdr, udp_dport) : offsetof(nat_udp_hdr, udp_sport);
+			rw->sum_off = offsetof(nat_udp_hdr, udp_sum);
+			rw->sum_optional = 1;
+			rw->l4_delta = nat_delta_fold(nat_delta_add(ip_delta, from->port, to->port));
+			break;
+
+		default:
+			/* icmp echo, the checksum does not cover the ip header */
+			rw->port_off = offsetof(nat_icmp_hdr, icmp_opt1);
+			rw->sum_off = offsetof(nat_icmp_hdr, icmp_sum);
+			rw->l4_delta = nat_delta_fold(nat_delta_add(0, from->port, to->port));
+			break;
+	}
+}
+
+static void nat_adjust_checksum(uint16_t *sum, uint16_t delta, uint8_t optional) {
+	if(optional && (*sum == 0)) {
+		return;
+	}
+
+	uint16_t adjusted = ~nat_delta_fold((uint32_t)(uint16_t)(~(*sum)) + delta);
+	if(optional && (adjusted == 0)) {
+		adjusted = 0xFFFF;
+	}
+	*sum = adjusted;
+}
+
+/* Only icmp errors need their payload rewritten, they take the slow path */
+static int nat_can_fast_path(ip_hdr *ip, const uint8_t *packet, unsigned int len) {
+	if(ip->ip_p != IP_PROTO_ICMP) {
+		return 1;
+	}
+
+	nat_icmp_hdr *icmp = get_nat_icmp_hdr(packet, len);
+	return ((icmp->icmp_type == ICMP_TYPE_ECHO_REQUEST) || (icmp->icmp_type == ICMP_TYPE_ECHO_REPLY)) ? 1 : 0;
+}
+
+/* NOT THREAD SAFE - acquire the lock of the entry's shard
+ * Translates a packet arriving on the nat_type side with the entry's template
+ */
+static void nat_fast_rewrite(router_state *rs, nat_entry *ne, const uint8_t *packet, unsigned int len, int nat_type) {
+	uint8_t *ip = (uint8_t *)get_ip_hdr(packet, len);
+	uint8_t *l4 = ip + sizeof(ip_hdr);
+	nat_rewrite *rw = &(ne->rewrite[nat_type]);
+
+	if(ne->proto == IP_PROTO_TCP) {
+		nat_track_tcp(rs, ne, get_nat_tcp_hdr(packet, len)->tcp_flags, nat_type);
+	}
+
+	memcpy(ip + rw->ip_off, &(rw->ip), sizeof(uint32_t));
+	memcpy(l4 + rw->port_off, &(rw->port), sizeof(uint16_t));
+	nat_adjust_checksum((uint16_t *)(ip + offsetof(ip_hdr, ip_sum)), rw->ip_delta, 0);
+	nat_adjust_checksum((uint16_t *)(l4 + rw->sum_off), rw->l4_delta, rw->sum_optional);
+}
+
+/* NOT THREAD SAFE - acquire the lock of the entry's shard
+ * Marks the external port as used and owned by the shard, builds the rewrite templates
+ */
+void nat_table_insert(nat_table *t, nat_entry *ne) {
+	nat_shard *shard = &(t->shards[ne->shard]);
+
+	nat_build_rewrite(ne, NAT_EXTERNAL);
+	nat_build_rewrite(ne, NAT_INTERNAL);
+
+	if(shard->num_entries >= shard->num_buckets) {
+		nat_shard_grow(shard);
+	}
+
+	nat_shard_link(shard, ne);
+
+	ne->prev = NULL;
+	ne->next = shard->entries;
+	if(shard->entries) {
+		shard->entries->prev = ne;
+	}
+	shard->entries = ne;
+	++shard->num_entries;
+
+	int p = nat_pool_index(ne->proto);
+	if(p >= 0) {
+		lock_nat_pools(t);
+		nat_port_reserve(&(t->pools[p]), ntohs(ne->nat_ext.port));
+		t->ext_owner[p][ntohs(ne->nat_ext.port)] = ne->shard + 1;
+		unlock_nat_pools(t);
+	}
+}
+
+/* NOT THREAD SAFE - lock the nat table
+ * Adds a static translation, ports in network byte order
+ * Returns: the entry, NULL if the external port is mapped to another internal host
+ */
+nat_entry *nat_table_add(nat_table *t, struct in_addr *ext, uint16_t ext_port, struct in_addr *in, uint16_t int_port, uint8_t proto) {
+	/* an external port can only be owned by one shard */
+	uint8_t shard = nat_shard_of(in->s_addr, int_port, proto);
+	int p = nat_pool_index(proto);
+	if((p >= 0) && (t->ext_owner[p][ntohs(ext_port)] != 0) && (t->ext_owner[p][ntohs(ext_port)] != shard + 1)) {
+		return NULL;
+	}
+
+	nat_entry *ne = nat_table_alloc_entry(t, shard);
+	ne->nat_ext.ip = *ext;
+	ne->nat_int.ip = *in;
+	ne->nat_ext.port = ext_port;
+	ne->nat_int.port = int_port;
+	ne->proto = proto;
+	ne->is_static = 1;
+	ne->hits = 0;
+	time(&ne->last_hits_time);
+	ne->last_hits = 0;
+	ne->avg_hits_per_second = 0.0;
+	ne->hw_row = 0xFF;
+
+	/* PROBLEM: IF I USE THE compute_nat_checksums FUNCTION INSTEAD THE TCP CHECKSUM FAILS */
+	/*
+	ne->nat_ext.checksum = compute_nat_ip_port_checksum(&(ne->nat_ext));
+	ne->nat_int.checksum = compute_nat_ip_port_checksum(&(ne->nat_int));
+	*/
+
+	compute_nat_checksums(&(ne->nat_ext));
+	compute_nat_checksums(&(ne->nat_int));
+
+	nat_table_insert(t, ne);
+
+	return ne;
+}
+
+/* NOT THREAD SAFE - acquire the lock of the entry's shard
+ * Unlinks the entry and returns it to the slab
+ */
+void nat_table_remove(nat_table *t, nat_entry *ne) {
+	nat_shard *shard = &(t->shards[ne->shard]);
+
+	nat_entry **walker = &(shard->int_buckets[nat_hash(ne->nat_int.ip.s_addr, ne->nat_int.port, ne->proto) & (shard->num_buckets - 1)]);
+	while(*walker != ne) {
+		walker = &((*walker)->int_next);
+	}
+	*walker = ne->int_next;
+
+	walker = &(shard->ext_buckets[nat_hash(0, ne->nat_ext.port, ne->proto) & (shard->num_buckets - 1)]);
+	while(*walker != ne) {
+		walker = &((*walker)->ext_next);
+	}
+	*walker = ne->ext_next;
+
+	if(ne->prev) {
+		ne->prev->next = ne->next;
+	}
+	else {
+		shard->entries = ne->next;
+	}
+	if(ne->next) {
+		ne->next->prev = ne->prev;
+	}
+	--shard->num_entries;
+
+	if(ne->active_epoch == shard->epoch) {
+		*(ne->active_pprev) = ne->active_next;
+		if(ne->active_next) {
+			ne->active_next->active_pprev = ne->active_pprev;
+		}
+	}
+
+	/* the hw row is zeroed on the next sync unless it is reused */
+	if(ne->hw_row < NAT_HW_ROWS) {
+		t->hw_rows[ne->hw_row] = NULL;
+		t->hw_stale |= (1 << ne->hw_row);
+	}
+
+	/* static entries on different external ips may share the port */
+	int p = nat_pool_index(ne->proto);
+	if((p >= 0) && (nat_shard_lookup_ext_port(shard, ne->nat_ext.port, ne->proto) == NULL)) {
+		lock_nat_pools(t);
+		nat_port_release(&(t->pools[p]), ntohs(ne->nat_ext.port));
+		t->ext_owner[p][ntohs(ne->nat_ext.port)] = 0;
+		unlock_nat_pools(t);
+	}
+
+	nat_table_free_entry(t, ne);
+}
 
-/* NOT THREAD SAFE - acquire the NAT TABLE LOCK */
+/* NOT THREAD SAFE - acquire the lock of the endpoint's shard, all arguments in network byte order */
+nat_entry *nat_table_lookup_int(nat_table *t, uint32_t ip, uint16_t port, uint8_t proto) {
+	nat_shard *shard = &(t->shards[nat_shard_of(ip, port, proto)]);
+	nat_entry *ne = shard->int_buckets[nat_hash(ip, port, proto) & (shard->num_buckets - 1)];
+	while(ne) {
+		if((ne->nat_int.ip.s_addr == ip) && (ne->nat_int.port == port) && (ne->proto == proto)) {
+			return ne;
+		}
+		ne = ne->int_next;
+	}
+	return NULL;
+}
+
+/* NOT THREAD SAFE - acquire the lock of the port's shard, all arguments in network byte order */
+nat_entry *nat_table_lookup_ext(nat_table *t, uint32_t ip, uint16_t port, uint8_t proto) {
+	int p = nat_pool_index(proto);
+	if((p < 0) || (t->ext_owner[p][ntohs(port)] == 0)) {
+		return NULL;
+	}
+
+	nat_shard *shard = &(t->shards[t->ext_owner[p][ntohs(port)] - 1]);
+	nat_entry *ne = shard->ext_buckets[nat_hash(0, port, proto) & (shard->num_buckets - 1)];
+	while(ne) {
+		if((ne->nat_ext.ip.s_addr == ip) && (ne->nat_ext.port == port) && (ne->proto == proto)) {
+			return ne;
+		}
+		ne = ne->ext_next;
+	}
+	return NULL;
+}
+
+/* NOT THREAD SAFE - acquire the lock of the port's shard
+ * Returns any entry using the external port, port in network byte order
+ */
+nat_entry *nat_table_lookup_ext_port(nat_table *t, uint16_t port, uint8_t proto) {
+	int p = nat_pool_index(proto);
+	if((p < 0) || (t->ext_owner[p][ntohs(port)] == 0)) {
+		return NULL;
+	}
+	return nat_shard_lookup_ext_port(&(t->shards[t->ext_owner[p][ntohs(port)] - 1]), port, proto);
+}
+
+/* NOT THREAD SAFE - acquire the lock of the entry's shard
+ * Advances the tcp state from the flags of a packet arriving on the nat_type side
+ */
+static void nat_track_tcp(router_state *rs, nat_entry *ne, uint8_t flags, int nat_type) {
+	uint8_t state = ne->tcp_state;
+
+	if(flags & NAT_TCP_RST) {
+		ne->tcp_state = NAT_TCP_CLOSED;
+	}
+	else if(flags & NAT_TCP_FIN) {
+		/* a half closed connection may still send the other way, keep its timeout until both close */
+		ne->tcp_fin |= (1 << nat_type);
+		if((ne->tcp_state != NAT_TCP_CLOSED) && (ne->tcp_fin == ((1 << NAT_EXTERNAL) | (1 << NAT_INTERNAL)))) {
+			ne->tcp_state = NAT_TCP_FIN_WAIT;
+		}
+	}
+	else if(flags & NAT_TCP_SYN) {
+		if((flags & NAT_TCP_ACK) && (nat_type == NAT_EXTERNAL) && (ne->tcp_state == NAT_TCP_SYN_SENT)) {
+			ne->tcp_state = NAT_TCP_ESTABLISHED;
+		}
+		else if(!(flags & NAT_TCP_ACK)) {
+			/* a new connection, possibly reusing a closed mapping */
+			ne->tcp_state = NAT_TCP_SYN_SENT;
+			ne->tcp_fin = 0;
+		}
+	}
+	else if((flags & NAT_TCP_ACK) && (ne->tcp_state == NAT_TCP_NONE)) {
+		/* picked up mid stream */
+		ne->tcp_state = NAT_TCP_ESTABLISHED;
+	}
+
+	/* closing cuts the timeout, the idle check armed for the old one would come too late */
+	if(!ne->is_static && (ne->tcp_state != state) && ((ne->tcp_state == NAT_TCP_FIN_WAIT) || (ne->tcp_state == NAT_TCP_CLOSED))) {
+		nat_arm_expiry(rs, ne);
+	}
+}
+
+/* Returns the idle timeout for the entry given its protocol and tcp state */
+uint32_t nat_entry_timeout(router_state *rs, nat_entry *ne) {
+	switch(ne->proto) {
+		case IP_PROTO_TCP:
+			if(ne->tcp_state == NAT_TCP_ESTABLISHED) {
+				return rs->nat_timeouts[NAT_TIMEOUT_TCP_EST];
+			}
+			else if((ne->tcp_state == NAT_TCP_FIN_WAIT) || (ne->tcp_state == NAT_TCP_CLOSED)) {
+				return rs->nat_timeouts[NAT_TIMEOUT_TCP_FIN];
+			}
+			return rs->nat_timeouts[NAT_TIMEOUT_TCP_SYN];
+
+		case IP_PROTO_UDP:
+			return rs->nat_timeouts[NAT_TIMEOUT_UDP];
+
+		default:
+			return rs->nat_timeouts[NAT_TIMEOUT_ICMP];
+	}
+}
+
+/* THREAD SAFE - locks the shard the packet maps to */
 void process_nat_ext_packet(router_state *rs, const uint8_t *packet, unsigned int len) {
 
+	nat_shard *shard = NULL;
 
 	/* check the nat table for an entry */
-	nat_entry *ne = get_nat_table_entry(rs, packet, len, NAT_EXTERNAL);
+	nat_entry *ne = get_nat_table_entry(rs, packet, len, NAT_EXTERNAL, &shard);
 	if(ne) {
 		/* Increment Hits */
-		ne->hits++;
+		nat_hit(shard, ne);
 
 		ip_hdr *ip = get_ip_hdr(packet, len);
+
+		/* fast path, everything but icmp errors */
+		if(nat_can_fast_path(ip, packet, len)) {
+			nat_fast_rewrite(rs, ne, packet, len, NAT_EXTERNAL);
+			nat_unlock_shard(shard);
+			return;
+		}
+
 		nat_tcp_hdr *tcp = NULL;
 		nat_udp_hdr *udp = NULL;
 		nat_icmp_hdr *icmp = NULL;
@@ -46,6 +710,7 @@ void process_nat_ext_packet(router_state *rs, const uint8_t *packet, unsigned in
 
 			case IP_PROTO_TCP:
 				tcp = get_nat_tcp_hdr(packet, len);
+				nat_track_tcp(rs, ne, tcp->tcp_flags, NAT_EXTERNAL);
 
 				/* recompute tcp checksums */
 				checksum = nat_checksum(tcp->tcp_sum,  ne->nat_int.checksum, ne->nat_ext.checksum);
@@ -91,37 +756,56 @@ void process_nat_ext_packet(router_state *rs, const uint8_t *packet, unsigned in
 		bzero(&ip->ip_sum, sizeof(uint16_t));
 		ip->ip_sum = checksum;
 	}
+
+	if(shard) {
+		nat_unlock_shard(shard);
+	}
 }
 
 
-/* NOT THREAD SAFE */
-void process_nat_int_packet(router_state *rs, const uint8_t *packet, unsigned int len, uint32_t ext_ip) {
+/* THREAD SAFE - locks the shard the packet maps to
+ * Returns: 0 if the packet may be forwarded, 1 if it must be dropped
+ */
+int process_nat_int_packet(router_state *rs, const uint8_t *packet, unsigned int len, uint32_t ext_ip) {
 
 	ip_hdr *ip = get_ip_hdr(packet, len);
 	nat_entry *ne = NULL;
+	nat_shard *shard = NULL;
 	uint16_t checksum = 0;
 
-	/* check if we have a nat table entry */
-	if( (ip->ip_p == IP_PROTO_TCP) || (ip->ip_p == IP_PROTO_UDP) || (ip->ip_p == IP_PROTO_ICMP) ){
+	/* only tcp, udp and icmp can be translated */
+	if( (ip->ip_p != IP_PROTO_TCP) && (ip->ip_p != IP_PROTO_UDP) && (ip->ip_p != IP_PROTO_ICMP) ) {
+		return 0;
+	}
 
+	/* check if we have a nat table entry */
+	ne = get_nat_table_entry(rs, packet, len, NAT_INTERNAL, &shard);
+	if(ne && nat_can_fast_path(ip, packet, len)) {
+		nat_hit(shard, ne);
+		nat_fast_rewrite(rs, ne, packet, len, NAT_INTERNAL);
+		nat_unlock_shard(shard);
+		return 0;
+	}
+	else if(ne == NULL) {
 
-		ne = get_nat_table_entry(rs, packet, len, NAT_INTERNAL);
+		/* create nat table entry */
+		ne = create_nat_table_entry(rs, packet, len, ext_ip);
 		if(ne == NULL) {
-
-			/* create nat table entry */
-			ne = create_nat_table_entry(rs, packet, len, ext_ip);
+			nat_unlock_shard(shard);
+			return 1;
 		}
-
-		/* rewrite src ip and src port */
-		populate_nat_packet(ip, packet, len, ne, NAT_EXTERNAL);
 	}
 
+	/* rewrite src ip and src port */
+	populate_nat_packet(ip, packet, len, ne, NAT_EXTERNAL);
+
 	/* Increment Hits */
-	ne->hits++;
+	nat_hit(shard, ne);
 
 	/* rewrite the packet */
 	if(ip->ip_p == IP_PROTO_TCP) {
 		nat_tcp_hdr *tcp = get_nat_tcp_hdr(packet, len);
+		nat_track_tcp(rs, ne, tcp->tcp_flags, NAT_INTERNAL);
 
 		/* recompute tcp checsum */
 		checksum = nat_checksum(tcp->tcp_sum,  ne->nat_ext.checksum, ne->nat_int.checksum);
@@ -157,31 +841,51 @@ void process_nat_int_packet(router_state *rs, const uint8_t *packet, unsigned in
 
 
 	/* recompute ip checksum */
-	if( (ip->ip_p == IP_PROTO_TCP) || (ip->ip_p == IP_PROTO_UDP)  || (ip->ip_p == IP_PROTO_ICMP) ) {
-
-		checksum  = nat_checksum(ip->ip_sum, ne->nat_ext.checksum_ip, ne->nat_int.checksum);
-		bzero(&ip->ip_sum, sizeof(uint16_t));
-		ip->ip_sum = checksum;
+	checksum  = nat_checksum(ip->ip_sum, ne->nat_ext.checksum_ip, ne->nat_int.checksum);
+	bzero(&ip->ip_sum, sizeof(uint16_t));
+	ip->ip_sum = checksum;
 
-	}
+	nat_unlock_shard(shard);
+	return 0;
 }
 
 
-/* NOT THREAD SAFE - acquire the NAT TABLE LOCK */
+/* NOT THREAD SAFE - acquire the lock of the packet's internal shard
+ * Returns NULL if the external port pool for the protocol is exhausted
+ */
 nat_entry *create_nat_table_entry(router_state *rs, const uint8_t *packet, unsigned int len, uint32_t ext_ip) {
-	ip_hdr *ip = get_ip_hdr(packet, len);
+	nat_table *t = rs->nat_table;
+	uint8_t proto = get_nat_protocol(packet, len);
+	nat_port_pool *pool = nat_port_pool_for(t, proto);
+	nat_ip_port_pair pair;
+
+	if(pool == NULL) {
+		return NULL;
+	}
 
-	/* Generate a pseudo-random port # for the ext entry */
-	unsigned short port = (unsigned short) rand();
+	/* the key must match the one get_nat_table_entry locked the shard for */
+	get_nat_ip_port_pair(&pair, packet, len, NAT_INTERNAL);
 
-	while(1) {
-		if(port > 1024 && (is_unique_nat_ext_port(rs, port) == 1)) {
-			break;
-		}
-		port = (unsigned short) rand();
+	/* take an external port from the pool, keeping the parity if we can */
+	uint16_t port = 0;
+	lock_nat_pools(t);
+	if(t->preserve_parity) {
+		port = nat_port_alloc(pool, ntohs(pair.port), 1);
+	}
+	if(port == 0) {
+		port = nat_port_alloc(pool, 0, 0);
+	}
+	if(port == 0) {
+		++pool->failures;
+	}
+	unlock_nat_pools(t);
+
+	if(port == 0) {
+		return NULL;
 	}
 
-	nat_entry *ne = (nat_entry *)calloc(1, sizeof(nat_entry));
+	nat_entry *ne = nat_table_alloc_entry(t, nat_shard_of(pair.ip.s_addr, pair.port, proto));
+	ne->proto = proto;
 	ne->last_hits = 0;
 	time(&ne->last_hits_time);
 	ne->hits = 0;
@@ -194,57 +898,66 @@ nat_entry *create_nat_table_entry(router_state *rs, const uint8_t *packet, unsig
 	ne->nat_ext.port = htons(port);
 	compute_nat_checksums(&(ne->nat_ext));
 
-	ne->nat_int.ip.s_addr = ip->ip_src.s_addr;
-	ne->nat_int.port = get_src_port_number(packet, len, ip->ip_p);
+	ne->nat_int.ip.s_addr = pair.ip.s_addr;
+	ne->nat_int.port = pair.port;
 	compute_nat_checksums(&(ne->nat_int));
 
-	node *n = (node *)calloc(1, sizeof(node));
-	n->data = (void *)ne;
-	if(rs->nat_table == NULL) {
-		rs->nat_table = n;
-	}
-	else {
-		node_push_back(rs->nat_table, n);
-	}
-
-
-	/* signal the thread that we have a new entry
-	 * NOTE thread will have to wait to run until
-	 * we exit the lock
-	 */
-	pthread_cond_broadcast(rs->nat_table_cond);
+	nat_table_insert(t, ne);
+	nat_arm_expiry(rs, ne);
 
 	return ne;
 }
 
 
-/* NOT THREAD SAFE - acquire the NAT TABLE LOCK */
-nat_entry *get_nat_table_entry(router_state *rs, const uint8_t *packet, unsigned int len, int nat_type) {
+/*
+ * Locks the shard the packet maps to and returns it in shard, NULL if there
+ * is none, the caller unlocks it when done with the entry
+ */
+nat_entry *get_nat_table_entry(router_state *rs, const uint8_t *packet, unsigned int len, int nat_type, nat_shard **shard) {
 	assert(rs);
 	assert(packet);
+	assert(shard);
 
 	nat_ip_port_pair pair;
-	node *n = rs->nat_table;
-	nat_entry *ne = NULL;
-	int match_found = 0;
+	uint8_t proto = get_nat_protocol(packet, len);
 
 	bzero(&pair, sizeof(nat_ip_port_pair));
 	get_nat_ip_port_pair(&pair, packet, len, nat_type);
-	while(n) {
-		ne = (nat_entry *)n->data;
-		if(found_nat_table_match(ne, &pair, nat_type) == 1) {
-			match_found = 1;
-			break;
-		}
-		n = n->next;
-	}
 
-	if(match_found == 1) {
-		return ne;
+	switch(nat_type) {
+		case NAT_EXTERNAL:
+			*shard = nat_lock_ext_shard(rs->nat_table, pair.port, proto);
+			if(*shard == NULL) {
+				return NULL;
+			}
+			return nat_table_lookup_ext(rs->nat_table, pair.ip.s_addr, pair.port, proto);
+
+		case NAT_INTERNAL:
+			*shard = nat_lock_int_shard(rs->nat_table, pair.ip.s_addr, pair.port, proto);
+			return nat_table_lookup_int(rs->nat_table, pair.ip.s_addr, pair.port, proto);
+
+		default:
+			*shard = NULL;
+			return NULL;
 	}
-	else {
-		return NULL;
+}
+
+
+/*
+ * Returns the protocol a packet is translated under, for icmp errors this is
+ * the protocol of the packet carried in the icmp data
+ */
+uint8_t get_nat_protocol(const uint8_t *packet, unsigned int len) {
+	ip_hdr *ip = get_ip_hdr(packet, len);
+
+	if(ip->ip_p == IP_PROTO_ICMP) {
+		nat_icmp_hdr *icmp = get_nat_icmp_hdr(packet, len);
+		if( (icmp->icmp_type == ICMP_TYPE_TIME_EXCEEDED) || (icmp->icmp_type == ICMP_TYPE_DESTINATION_UNREACHABLE) ) {
+			return get_ip_hdr_from_icmp_data(packet, len)->ip_p;
+		}
 	}
+
+	return ip->ip_p;
 }
 
 
@@ -396,17 +1109,10 @@ int found_nat_table_match(nat_entry *ne, nat_ip_port_pair *nipp, int nat_type) {
 }
 
 
-int is_unique_nat_ext_port(router_state *rs, uint16_t port) {
-
-	node *n = rs->nat_table;
-	while(n) {
-		nat_entry *ne = (nat_entry *)n->data;
-		if(ne->nat_ext.port == port) {
-			return 0;
-		}
-		n = n->next;
-	}
-	return 1;
+/* port in network byte order */
+int is_unique_nat_ext_port(router_state *rs, uint16_t port, uint8_t proto) {
+	int p = nat_pool_index(proto);
+	return ((p < 0) || (rs->nat_table->ext_owner[p][ntohs(port)] == 0)) ? 1 : 0;
 }
 
 
@@ -511,10 +1217,19 @@ void cli_nat_help(router_state *rs, cli_request *req) {
 	msg = "\tnat test\n";
 	send_to_socket(req->sockfd, msg, strlen(msg));
 
-	msg = "\tnat add [ip_ext] [port_ext] [ip_int] [port_int]\n";
+	msg = "\tnat add [ip_ext] [port_ext] [ip_int] [port_int] [tcp udp icmp]\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+
+	msg = "\tnat del [ip_ext] [port_ext] [tcp udp icmp]\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+
+	msg = "\tnat pool [tcp udp icmp] [port_lo] [port_hi]\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+
+	msg = "\tnat parity [on off]\n";
 	send_to_socket(req->sockfd, msg, strlen(msg));
 
-	msg = "\tnat del [ip_ext] [port_ext]\n";
+	msg = "\tnat timeout [tcp-syn tcp-est tcp-fin udp icmp] [seconds]\n";
 	send_to_socket(req->sockfd, msg, strlen(msg));
 }
 
@@ -606,19 +1321,20 @@ void cli_nat_reset(router_state *rs, cli_request *req) {
 
 	lock_nat_table(rs);
 	/* blast out the software nat table */
-	node* cur = rs->nat_table;
-	node* next;
-	while(cur) {
-		next = cur->next;
-		node_remove(&rs->nat_table, cur);
-		cur = next;
+	int s;
+	for(s = 0; s < NAT_NUM_SHARDS; ++s) {
+		nat_shard *shard = &(rs->nat_table->shards[s]);
+		while(shard->entries) {
+			nat_table_remove(rs->nat_table, shard->entries);
+		}
 	}
 
 	/* blast out the hw nat table */
 	int i;
-	for (i = 0; i < 16; ++i) {
+	for (i = 0; i < NAT_HW_ROWS; ++i) {
 		write_nat_table_zero_to_hw(rs, i);
 	}
+	rs->nat_table->hw_stale = 0;
 
 	unlock_nat_table(rs);
 
@@ -627,88 +1343,71 @@ void cli_nat_reset(router_state *rs, cli_request *req) {
 }
 
 
+/* Returns the protocol named by str, tcp if str is NULL, 0 if unknown */
+static uint8_t parse_nat_protocol(const char *str) {
+	if((str == NULL) || (strncmp(str, "tcp", strlen("tcp")) == 0)) {
+		return IP_PROTO_TCP;
+	}
+	else if(strncmp(str, "udp", strlen("udp")) == 0) {
+		return IP_PROTO_UDP;
+	}
+	else if(strncmp(str, "icmp", strlen("icmp")) == 0) {
+		return IP_PROTO_ICMP;
+	}
+	return 0;
+}
+
 void cli_nat_add(router_state *rs, cli_request *req) {
 
 	char *ip_ext;
 	char *ip_int;
+	char *proto_str = NULL;
 	int port_ext;
 	int port_int;
 	char *msg;
+	struct in_addr ext, in;
 
-	if(sscanf(req->command, "nat add %as %d %as %d", &ip_ext, &port_ext, &ip_int, &port_int) != 4) {
+	if(sscanf(req->command, "nat add %as %d %as %d %as", &ip_ext, &port_ext, &ip_int, &port_int, &proto_str) < 4) {
 		msg = "Failure reading arguments.\n";
 		send_to_socket(req->sockfd, msg, strlen(msg));
 		return;
 	}
 
-	/* build the nat entry */
-	nat_entry *ne = (nat_entry *)calloc(1, sizeof(nat_entry));
-	if(inet_pton(AF_INET, ip_ext, &(ne->nat_ext.ip)) != 1) {
+	uint8_t proto = parse_nat_protocol(proto_str);
+	if(proto == 0) {
+		msg = "Failure reading protocol argument\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	if(inet_pton(AF_INET, ip_ext, &ext) != 1) {
 		msg = "Failure reading ip ext argument\n";
 		send_to_socket(req->sockfd, msg, strlen(msg));
 		return;
 	}
-	if(inet_pton(AF_INET, ip_int, &(ne->nat_int.ip)) != 1) {
+	if(inet_pton(AF_INET, ip_int, &in) != 1) {
 		msg = "Failure reading ip int argument\n";
 		send_to_socket(req->sockfd, msg, strlen(msg));
 		return;
 	}
 
-	ne->nat_ext.port = htons((uint16_t)port_ext);
-	ne->nat_int.port = htons((uint16_t)port_int);
-	ne->is_static = 1;
-	ne->hits = 0;
-	time(&ne->last_hits_time);
-	ne->last_hits = 0;
-	ne->avg_hits_per_second = 0.0;
-	ne->hw_row = 0xFF;
-
-	/* PROBLEM: IF I USE THE compute_nat_checksums FUNCTION INSTEAD THE TCP CHECKSUM FAILS */
-	/*
-	ne->nat_ext.checksum = compute_nat_ip_port_checksum(&(ne->nat_ext));
-	ne->nat_int.checksum = compute_nat_ip_port_checksum(&(ne->nat_int));
-	*/
-
-	compute_nat_checksums(&(ne->nat_ext));
-	compute_nat_checksums(&(ne->nat_int));
-
-	/* check if an existing NAT entry matches this external ip/port */
 	lock_nat_table(rs);
 
-	node* cur = rs->nat_table;
-	node* result = NULL;
-	while (cur) {
-		nat_entry* ne_existing = (nat_entry*)cur->data;
-		if ((ne_existing->nat_ext.ip.s_addr == ne->nat_ext.ip.s_addr) &&
-				(ne_existing->nat_ext.port == ne->nat_ext.port)) {
-
-			result = cur;
-			break;
-		}
-		cur = cur->next;
+	/* if an existing NAT entry matches this external ip/port, replace it */
+	nat_entry *ne = nat_table_lookup_ext(rs->nat_table, ext.s_addr, htons((uint16_t)port_ext), proto);
+	if(ne) {
+		nat_table_remove(rs->nat_table, ne);
 	}
 
-	/* if there is an existing entry, swap data */
-	if (result) {
-		free(result->data);
-		result->data = ne;
-	} else {
-		/* else append */
-		node *n = (node *)calloc(1, sizeof(node));
-		n->data = (void *)ne;
-
-		if (rs->nat_table == NULL) {
-			rs->nat_table = n;
-		}	else {
-			node_push_back(rs->nat_table, n);
-		}
+	if(!nat_table_add(rs->nat_table, &ext, htons((uint16_t)port_ext), &in, htons((uint16_t)port_int), proto)) {
+		unlock_nat_table(rs);
+		msg = "External port is already mapped to another internal host\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
 	}
 
 	unlock_nat_table(rs);
 
-	/* signal the thread that we have a new entry */
-	pthread_cond_broadcast(rs->nat_table_cond);
-
 	msg = "Succesfully added the nat table entry\n";
 	send_to_socket(req->sockfd, msg, strlen(msg));
 }
@@ -716,17 +1415,25 @@ void cli_nat_add(router_state *rs, cli_request *req) {
 void cli_nat_del(router_state *rs, cli_request *req) {
 
 	char *ip_ext;
+	char *proto_str = NULL;
 	int port_ext;
 	struct in_addr ip;
 	uint16_t port;
 	char *msg;
 
-	if(sscanf(req->command, "nat del %as %d", &ip_ext, &port_ext) != 2) {
+	if(sscanf(req->command, "nat del %as %d %as", &ip_ext, &port_ext, &proto_str) < 2) {
 		msg = "Failure reading arguments.\n";
 		send_to_socket(req->sockfd, msg, strlen(msg));
 		return;
 	}
 
+	uint8_t proto = parse_nat_protocol(proto_str);
+	if(proto == 0) {
+		msg = "Failure reading protocol argument\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
 	/* build the nat entry */
 	if(inet_pton(AF_INET, ip_ext, &(ip)) != 1) {
 		msg = "Failure reading ip ext argument\n";
@@ -739,29 +1446,15 @@ void cli_nat_del(router_state *rs, cli_request *req) {
 	/* check if an existing NAT entry matches this external ip/port */
 	lock_nat_table(rs);
 
-	node* cur = rs->nat_table;
-	node* result = NULL;
-	while (cur) {
-		nat_entry* ne_existing = (nat_entry*)cur->data;
-		if ((ne_existing->nat_ext.ip.s_addr == ip.s_addr) &&
-				(ne_existing->nat_ext.port == port)) {
-
-			result = cur;
-			break;
-		}
-		cur = cur->next;
-	}
+	nat_entry *result = nat_table_lookup_ext(rs->nat_table, ip.s_addr, port, proto);
 
 	/* if there is an existing entry delete */
 	if (result) {
-		node_remove(&rs->nat_table, result);
+		nat_table_remove(rs->nat_table, result);
 	}
 
 	unlock_nat_table(rs);
 
-	/* signal the thread that we have a new entry */
-	pthread_cond_broadcast(rs->nat_table_cond);
-
 	if (result) {
 		msg = "Succesfully deleted nat table entry\n";
 		send_to_socket(req->sockfd, msg, strlen(msg));
@@ -771,94 +1464,374 @@ void cli_nat_del(router_state *rs, cli_request *req) {
 	}
 }
 
-void* nat_maintenance_thread(void* arg) {
-	router_state* rs = (router_state*)arg;
-	struct timespec wake_up_time;
-	struct timeval cur_timeval;
-	time_t now;
+void cli_nat_pool(router_state *rs, cli_request *req) {
+
+	char *proto_str;
+	int lo;
+	int hi;
+	char *msg;
+
+	if(sscanf(req->command, "nat pool %as %d %d", &proto_str, &lo, &hi) != 3) {
+		msg = "Failure reading arguments.\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	uint8_t proto = parse_nat_protocol(proto_str);
+	nat_port_pool *pool = nat_port_pool_for(rs->nat_table, proto);
+	if(pool == NULL) {
+		msg = "Failure reading protocol argument\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	if((lo < 1) || (hi > 65535) || (lo > hi)) {
+		msg = "Invalid port range\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	lock_nat_table(rs);
+
+	/* rebuild the used ports from the entries already in the table */
+	nat_port_pool_init(pool, (uint16_t)lo, (uint16_t)hi);
+
+	int s;
+	for(s = 0; s < NAT_NUM_SHARDS; ++s) {
+		nat_entry *ne = rs->nat_table->shards[s].entries;
+		while(ne) {
+			if(ne->proto == proto) {
+				nat_port_reserve(pool, ntohs(ne->nat_ext.port));
+			}
+			ne = ne->next;
+		}
+	}
+
+	unlock_nat_table(rs);
+
+	msg = "Succesfully set the nat port pool\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_nat_parity(router_state *rs, cli_request *req) {
+
+	char *arg;
+	char *msg;
+
+	if(sscanf(req->command, "nat parity %as", &arg) != 1) {
+		msg = "Failure reading arguments.\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	lock_nat_table(rs);
+	if(strncmp(arg, "on", strlen("on")) == 0) {
+		rs->nat_table->preserve_parity = 1;
+		msg = "NAT port parity preservation enabled\n";
+	}
+	else if(strncmp(arg, "off", strlen("off")) == 0) {
+		rs->nat_table->preserve_parity = 0;
+		msg = "NAT port parity preservation disabled\n";
+	}
+	else {
+		msg = "Invalid arguments\n";
+	}
+	unlock_nat_table(rs);
+
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_nat_timeout(router_state *rs, cli_request *req) {
+
+	char *names[NAT_NUM_TIMEOUTS] = { "tcp-syn", "tcp-est", "tcp-fin", "udp", "icmp" };
+	char *name;
+	int seconds;
+	char *msg;
+	int i;
+
+	/* without arguments list the current timeouts */
+	if(sscanf(req->command, "nat timeout %as %d", &name, &seconds) != 2) {
+		for(i = 0; i < NAT_NUM_TIMEOUTS; ++i) {
+			char line[32];
+			snprintf(line, 32, "%-8s %u\n", names[i], rs->nat_timeouts[i]);
+			send_to_socket(req->sockfd, line, strlen(line));
+		}
+		return;
+	}
+
+	for(i = 0; i < NAT_NUM_TIMEOUTS; ++i) {
+		if(strcmp(name, names[i]) == 0) {
+			break;
+		}
+	}
+
+	if((i == NAT_NUM_TIMEOUTS) || (seconds <= 0)) {
+		msg = "Invalid arguments\n";
+		send_to_socket(req->sockfd, msg, strlen(msg));
+		return;
+	}
+
+	lock_nat_table(rs);
+	rs->nat_timeouts[i] = seconds;
+	unlock_nat_table(rs);
+
+	msg = "Succesfully set the nat timeout\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+/* Returns 1 if a deserves a hw row more than b, entries already in hw win ties */
+static int nat_hotter(nat_entry *a, nat_entry *b) {
+	if (a->avg_hits_per_second != b->avg_hits_per_second) {
+		return (a->avg_hits_per_second > b->avg_hits_per_second) ? 1 : 0;
+	}
+	return ((a->hw_row != 0xFF) && (b->hw_row == 0xFF)) ? 1 : 0;
+}
+
+/* Keeps the NAT_HW_ROWS hottest entries offered so far in a min heap */
+static void nat_top_offer(nat_entry **heap, unsigned int *size, nat_entry *ne) {
+	unsigned int i;
+
+	if (*size < NAT_HW_ROWS) {
+		/* sift up */
+		i = (*size)++;
+		while ((i > 0) && nat_hotter(heap[(i - 1) / 2], ne)) {
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = ne;
+		return;
+	}
+
+	if (!nat_hotter(ne, heap[0])) {
+		return;
+	}
 
+	/* replace the coldest and sift down */
+	i = 0;
 	while (1) {
-		/* Determine the time when to wake up next */
-		gettimeofday(&cur_timeval, NULL);
-		wake_up_time.tv_sec = cur_timeval.tv_sec + 1;
-		wake_up_time.tv_nsec = cur_timeval.tv_usec;
+		unsigned int c = (2 * i) + 1;
+		if (c >= *size) {
+			break;
+		}
+		if ((c + 1 < *size) && nat_hotter(heap[c], heap[c + 1])) {
+			++c;
+		}
+		if (!nat_hotter(ne, heap[c])) {
+			break;
+		}
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = ne;
+}
 
-		/* sleep */
-		pthread_cond_timedwait(rs->dijkstra_cond, rs->dijkstra_mutex, &wake_up_time);
+/* NOT THREAD SAFE - hold nat_table_mutex
+ * Moves the hw rows to the top entries, rewriting only rows that change hands
+ */
+static void nat_sync_hw(router_state *rs, nat_entry **top, unsigned int num_top) {
+	nat_table *t = rs->nat_table;
+	uint32_t keep = 0;
+	unsigned int i;
+	uint8_t row;
+
+	for (i = 0; i < num_top; ++i) {
+		if (top[i]->hw_row != 0xFF) {
+			keep |= (1 << top[i]->hw_row);
+		}
+	}
 
-		/* update our current time */
-		time(&now);
+	/* evict rows that fell out of the top */
+	for (row = 0; row < NAT_HW_ROWS; ++row) {
+		if (t->hw_rows[row] && !(keep & (1 << row))) {
+			t->hw_rows[row]->hw_row = 0xFF;
+			t->hw_rows[row] = NULL;
+			t->hw_stale |= (1 << row);
+		}
+	}
 
-		/* update the rolling average, get hits from hw if exist */
-		node* cur = rs->nat_table;
-		node* next;
-		while (cur) {
-			next = cur->next;
-			nat_entry* ne = (nat_entry*)cur->data;
+	/* newcomers take the free rows */
+	row = 0;
+	for (i = 0; i < num_top; ++i) {
+		if (top[i]->hw_row != 0xFF) {
+			continue;
+		}
+		while (t->hw_rows[row]) {
+			++row;
+		}
+		t->hw_rows[row] = top[i];
+		top[i]->hw_row = row;
+		t->hw_stale &= ~(1 << row);
+		write_nat_table_entry_to_hw(rs, top[i], row);
+	}
 
-			/*
-			if (rs->is_netfpga && (ne->hw_row != 0xFF)) {
-				ne->hits += (get_hw_hits(rs, ne->hw_row) - ne->last_hits);
+	for (row = 0; row < NAT_HW_ROWS; ++row) {
+		if (t->hw_stale & (1 << row)) {
+			write_nat_table_zero_to_hw(rs, row);
+		}
+	}
+	t->hw_stale = 0;
+}
+
+/* NOT THREAD SAFE - hold nat_table_mutex and the lock of the entry's shard
+ * Steps the rolling average for epoch, a second with no hits counts as a rate of 0
+ */
+static void nat_step_average(nat_entry *ne, uint32_t epoch) {
+	uint32_t hits = ne->hit_count;
+	uint32_t idle = epoch - ne->rate_epoch;
+
+	/* the seconds it sat off the active list, the average reaches 0 long before idle does */
+	while((idle-- > 1) && (ne->avg_hits_per_second > 0.0)) {
+		ne->avg_hits_per_second *= 0.25;
+	}
+
+	ne->avg_hits_per_second = (0.75 * (double)(hits - ne->hits)) + (0.25 * ne->avg_hits_per_second);
+	ne->hits = hits;
+	ne->rate_epoch = epoch;
+}
+
+/*
+ * Timer callback, every NAT_MAINTENANCE_INTERVAL. Only the entries hit in the last second, taken off each
+ * shard's active list, and the hw rows' occupants are looked at, so the cost follows the
+ * traffic and not the size of the table. Idle entries are expired by their own timers,
+ * see nat_expire_timer.
+ */
+void nat_maintenance_timer(router_state* rs, uint32_t key, uint32_t id) {
+	nat_table *t = rs->nat_table;
+	nat_entry* top[NAT_HW_ROWS];
+	nat_entry* ne;
+	unsigned int num_top = 0;
+	uint32_t epoch;
+	uint8_t row;
+	int s;
+
+	/* holding the mutex keeps the cli from removing entries while we run */
+	if(lockprof_mutex_lock(rs->nat_table_mutex, LOCK_NAT_TABLE, (void*)&nat_maintenance_timer) != 0) {
+		perror("Failure getting nat table lock");
+	}
+
+	/* one shard at a time so translation in the others carries on */
+	for (s = 0; s < NAT_NUM_SHARDS; ++s) {
+		nat_shard *shard = &(t->shards[s]);
+		nat_lock_shard(shard);
+
+		/* close the epoch, hits from here on go on a fresh list */
+		epoch = shard->epoch++;
+		ne = shard->active;
+		shard->active = NULL;
+
+		while (ne) {
+			nat_step_average(ne, epoch);
+			if (rs->is_netfpga && (ne->tcp_state != NAT_TCP_FIN_WAIT) && (ne->tcp_state != NAT_TCP_CLOSED)) {
+				/* only we and the cli remove entries, so these stay valid after unlocking */
+				nat_top_offer(top, &num_top, ne);
 			}
-			*/
+			ne = ne->active_next;
+		}
 
-			/* update our moving average */
-			double cur_avg = ((double)(ne->hits - ne->last_hits)) / difftime(now, ne->last_hits_time);
-			ne->avg_hits_per_second = (0.75 * cur_avg) + (0.25 * ne->avg_hits_per_second);
+		/* rows gone quiet have to decay to be evicted */
+		for (row = 0; row < NAT_HW_ROWS; ++row) {
+			ne = t->hw_rows[row];
+			if (!ne || (ne->shard != s) || (ne->rate_epoch == epoch)) {
+				continue;
+			}
 
-			/* update last hits */
-			if (ne->last_hits != ne->hits) {
-				ne->last_hits_time = now;
-				ne->last_hits = ne->hits;
+			/*
+			if (rs->is_netfpga) {
+				ne->hit_count += (get_hw_hits(rs, ne->hw_row) - ne->last_hits);
 			}
+			*/
 
-			/* expire if not hits for a long time */
-			if (!ne->is_static && (difftime(now, ne->last_hits_time) > rs->nat_timeout)) {
-				node_remove(&rs->nat_table, cur);
+			nat_step_average(ne, epoch);
+			if ((ne->tcp_state != NAT_TCP_FIN_WAIT) && (ne->tcp_state != NAT_TCP_CLOSED)) {
+				nat_top_offer(top, &num_top, ne);
 			}
+		}
+
+		nat_unlock_shard(shard);
+	}
+
+	/* write to hw if we are running hw */
+	if (rs->is_netfpga) {
+		nat_sync_hw(rs, top, num_top);
+	}
+
+	lockprof_release(LOCK_NAT_TABLE);
+	if(pthread_mutex_unlock(rs->nat_table_mutex) != 0) {
+		perror("Failure unlocking nat table lock");
+	}
+}
+
+/* NOT THREAD SAFE - acquire the lock of the entry's shard
+ * Schedules the next idle check of a dynamic entry, a step of its timeout away at most so
+ * it goes no more than a step past the timeout after its last hit
+ */
+void nat_arm_expiry(router_state *rs, nat_entry *ne) {
+	uint32_t timeout = nat_entry_timeout(rs, ne);
+	uint32_t step = (timeout / NAT_EXPIRY_STEPS) + 1;
+	time_t now;
+
+	time(&now);
+	double remaining = difftime(ne->last_hits_time + timeout, now);
+	if(remaining < 0) {
+		remaining = 0;
+	}
+	else if(remaining > step) {
+		remaining = step;
+	}
 
-			/* reset the hw row because we will be pushing back down to hw shortly */
-			ne->hw_row = 0xFF;
+	ne->timer_id = timer_add(rs, ((uint32_t)remaining + 1) * 1000, 0, nat_expire_timer, (((uint32_t)ne->proto) << 16) | ntohs(ne->nat_ext.port));
+}
+
+/*
+ * Timer callback, key is the protocol and the external port (host byte order) of a dynamic
+ * entry. Hits since the last check count as activity now.
+ */
+void nat_expire_timer(router_state *rs, uint32_t key, uint32_t id) {
+	nat_table *t = rs->nat_table;
+	uint8_t proto = key >> 16;
+	uint16_t port = htons(key & 0xFFFF);
+	nat_shard *shard;
+	nat_entry *ne = NULL;
+	time_t now;
+
+	/* removing an entry may free its hw row, only that needs the table mutex besides the shard */
+	if(lockprof_mutex_lock(rs->nat_table_mutex, LOCK_NAT_TABLE, (void*)&nat_expire_timer) != 0) {
+		perror("Failure getting nat table lock");
+	}
 
-			cur = next;
+	shard = nat_lock_ext_shard(t, port, proto);
+	if(shard) {
+		/* the entry may be gone, or a later timer may have replaced this one */
+		ne = shard->ext_buckets[nat_hash(0, port, proto) & (shard->num_buckets - 1)];
+		while(ne && !((ne->nat_ext.port == port) && (ne->proto == proto) && (ne->timer_id == id))) {
+			ne = ne->ext_next;
 		}
+	}
 
-		/* bubble sort by avg hits per second */
-		int swapped = 0;
-		do {
-			swapped = 0;
-			node* cur = rs->nat_table;
-			while (cur && cur->next) {
-				nat_entry* a = (nat_entry*)cur->data;
-				nat_entry* b = (nat_entry*)cur->next->data;
-				if (a->avg_hits_per_second < b->avg_hits_per_second) {
-					cur->data = b;
-					cur->next->data = a;
-					swapped = 1;
-				}
+	if(ne) {
+		uint32_t hits = ne->hit_count;
 
-				cur = cur->next;
-			}
-		} while (swapped);
+		time(&now);
+		if(ne->last_hits != hits) {
+			ne->last_hits_time = now;
+			ne->last_hits = hits;
+		}
 
-		/* write to hw if we are running hw */
-		if (rs->is_netfpga) {
-			int i = 0;
-			node* cur = rs->nat_table;
-
-  		for(i=0; i<16; ++i) {
-	  		if(cur) {
-	    		nat_entry *nat = (nat_entry *)cur->data;
-	    		nat->hw_row = i;
-					write_nat_table_entry_to_hw(rs, nat, i);
-					cur = cur->next;
-				} else {
-					write_nat_table_zero_to_hw(rs, i);
-				}
-			}
+		if(difftime(now, ne->last_hits_time) > nat_entry_timeout(rs, ne)) {
+			nat_table_remove(t, ne);
+		}
+		else {
+			nat_arm_expiry(rs, ne);
 		}
 	}
-	return NULL;
+
+	if(shard) {
+		nat_unlock_shard(shard);
+	}
+	lockprof_release(LOCK_NAT_TABLE);
+	if(pthread_mutex_unlock(rs->nat_table_mutex) != 0) {
+		perror("Failure unlocking nat table lock");
+	}
 }
 
 uint32_t get_hw_hits(router_state *rs, uint8_t row) {
@@ -908,15 +1881,28 @@ void write_nat_table_zero_to_hw(router_state *rs, uint8_t row) {
 }
 
 
+/* Locks the whole table, the packet path only ever takes a single shard */
 void lock_nat_table(router_state *rs) {
 	assert(rs);
-	if(pthread_mutex_lock(rs->nat_table_mutex) != 0) {
+	if(lockprof_mutex_lock(rs->nat_table_mutex, LOCK_NAT_TABLE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting nat table lock");
 	}
+
+	int i;
+	for(i = 0; i < NAT_NUM_SHARDS; ++i) {
+		nat_lock_shard(&(rs->nat_table->shards[i]));
+	}
 }
 
 void unlock_nat_table(router_state *rs) {
 	assert(rs);
+
+	int i;
+	for(i = NAT_NUM_SHARDS - 1; i >= 0; --i) {
+		nat_unlock_shard(&(rs->nat_table->shards[i]));
+	}
+
+	lockprof_release(LOCK_NAT_TABLE);
 	if(pthread_mutex_unlock(rs->nat_table_mutex) != 0) {
 		perror("Failure unlocking nat table lock");
 	}
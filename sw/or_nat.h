@@ -9,11 +9,34 @@
 
 #include "or_data_types.h"
 
+nat_table *nat_table_create(void);
+void nat_table_destroy(nat_table *t);
+uint32_t nat_table_num_entries(nat_table *t);
+void nat_lock_shard(nat_shard *shard);
+void nat_unlock_shard(nat_shard *shard);
+nat_shard *nat_lock_int_shard(nat_table *t, uint32_t ip, uint16_t port, uint8_t proto);
+nat_shard *nat_lock_ext_shard(nat_table *t, uint16_t port, uint8_t proto);
+nat_entry *nat_table_alloc_entry(nat_table *t, uint8_t shard_index);
+void nat_table_free_entry(nat_table *t, nat_entry *ne);
+void nat_table_insert(nat_table *t, nat_entry *ne);
+nat_entry *nat_table_add(nat_table *t, struct in_addr *ext, uint16_t ext_port, struct in_addr *in, uint16_t int_port, uint8_t proto);
+void nat_table_remove(nat_table *t, nat_entry *ne);
+nat_entry *nat_table_lookup_int(nat_table *t, uint32_t ip, uint16_t port, uint8_t proto);
+nat_entry *nat_table_lookup_ext(nat_table *t, uint32_t ip, uint16_t port, uint8_t proto);
+nat_entry *nat_table_lookup_ext_port(nat_table *t, uint16_t port, uint8_t proto);
+
+nat_port_pool *nat_port_pool_for(nat_table *t, uint8_t proto);
+void nat_port_pool_init(nat_port_pool *pool, uint16_t lo, uint16_t hi);
+uint16_t nat_port_alloc(nat_port_pool *pool, uint16_t hint, int parity);
+void nat_port_reserve(nat_port_pool *pool, uint16_t port);
+void nat_port_release(nat_port_pool *pool, uint16_t port);
+
 void process_nat_ext_packet(router_state *rs, const uint8_t *packet, unsigned int len);
-void process_nat_int_packet(router_state *rs, const uint8_t *packet, unsigned int len, uint32_t ext_ip);
+int process_nat_int_packet(router_state *rs, const uint8_t *packet, unsigned int len, uint32_t ext_ip);
 
 
-nat_entry *get_nat_table_entry(router_state *rs, const uint8_t *packet, unsigned int len, int nat_type);
+nat_entry *get_nat_table_entry(router_state *rs, const uint8_t *packet, unsigned int len, int nat_type, nat_shard **shard);
+uint8_t get_nat_protocol(const uint8_t *packet, unsigned int len);
 void get_nat_ip_port_pair(nat_ip_port_pair *pair, const uint8_t *packet, unsigned int len, int nat_type);
 void get_nat_port_from_icmp(nat_ip_port_pair *pair, const uint8_t *packet, unsigned int len, int nat_type);
 
@@ -24,7 +47,7 @@ uint16_t get_src_port_number_from_icmp(const uint8_t *packet, unsigned int len);
 
 
 int found_nat_table_match(nat_entry *ne, nat_ip_port_pair *nipp, int nat_type);
-int is_unique_nat_ext_port(router_state *rs, uint16_t port);
+int is_unique_nat_ext_port(router_state *rs, uint16_t port, uint8_t proto);
 
 
 nat_tcp_hdr *get_nat_tcp_hdr(const uint8_t *packet, unsigned int len);
@@ -38,7 +61,10 @@ uint16_t get_nat_echo_id_from_icmp_data(const uint8_t *packet, unsigned int len)
 void compute_nat_checksums(nat_ip_port_pair *pair);
 uint16_t nat_checksum(uint16_t old, uint16_t pos, uint16_t neg);
 
-void* nat_maintenance_thread(void* arg);
+uint32_t nat_entry_timeout(router_state *rs, nat_entry *ne);
+void nat_maintenance_timer(router_state* rs, uint32_t key, uint32_t id);
+void nat_arm_expiry(router_state *rs, nat_entry *ne);
+void nat_expire_timer(router_state *rs, uint32_t key, uint32_t id);
 void write_nat_table_entry_to_hw(router_state *rs, nat_entry *ne, uint8_t row);
 void write_nat_table_zero_to_hw(router_state *rs, uint8_t row);
 uint32_t get_hw_hits(router_state *rs, uint8_t row);
@@ -51,6 +77,9 @@ void cli_nat_set(router_state *rs, cli_request *req);
 void cli_nat_reset(router_state *rs, cli_request *req);
 void cli_nat_add(router_state *rs, cli_request *req);
 void cli_nat_del(router_state *rs, cli_request *req);
+void cli_nat_pool(router_state *rs, cli_request *req);
+void cli_nat_parity(router_state *rs, cli_request *req);
+void cli_nat_timeout(router_state *rs, cli_request *req);
 
 void lock_nat_table(router_state *rs);
 void unlock_nat_table(router_state *rs);
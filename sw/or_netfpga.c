@@ -19,6 +19,8 @@
 #include "reg_defines.h"
 #include "sr_dumper.h"
 #include "or_utils.h"
+#include "or_pwospf.h"
+#include "or_lockprof.h"
 
 unsigned char getPortNumber(char* name) {
 	if (strcmp(ETH0, name) == 0) {
@@ -112,9 +114,7 @@ void netfpga_input(struct sr_instance* sr) {
 				int read_bytes = read(rs->raw_sockets[i], readBuf, READ_BUF_SIZE);
 
 				/* log packet */
-				pthread_mutex_lock(rs->log_dumper_mutex);
-				sr_log_packet(sr, (unsigned char*)readBuf, read_bytes);
-				pthread_mutex_unlock(rs->log_dumper_mutex);
+				sr_log_packet(sr, (unsigned char*)readBuf, read_bytes, internal_names[i], SR_DUMP_RX);
 
 				/* send packet */
 				sr_integ_input(sr, readBuf, read_bytes, internal_names[i]);
@@ -134,9 +134,7 @@ void netfpga_input_callback(unsigned char* arg, const struct pcap_pkthdr * pkt_h
 	char* internal_names[4] = {"eth0", "eth1", "eth2", "eth3"};
 
 	/* log packet */
-	pthread_mutex_lock(rs->log_dumper_mutex);
-	sr_log_packet(sr, (unsigned char*)packet, pkt_hdr->caplen);
-	pthread_mutex_unlock(rs->log_dumper_mutex);
+	sr_log_packet(sr, (unsigned char*)packet, pkt_hdr->caplen, internal_names[input_arg->interface_num], SR_DUMP_RX);
 
 	/* send packet */
 	sr_integ_input(sr, packet, pkt_hdr->caplen, internal_names[input_arg->interface_num]);
@@ -168,9 +166,7 @@ int netfpga_output(struct sr_instance* sr, uint8_t* packet, unsigned int len, co
 	int i = 0;
 
 	/* log the packet */
-	pthread_mutex_lock(rs->log_dumper_mutex);
-	sr_log_packet(sr, packet, len);
-	pthread_mutex_unlock(rs->log_dumper_mutex);
+	sr_log_packet(sr, packet, len, iface, SR_DUMP_TX);
 
 
 	char* internal_names[4] = {"eth0", "eth1", "eth2", "eth3"};
@@ -378,91 +374,75 @@ unsigned int set_wr_ctrl_word(nf2device* nf2, unsigned char port, unsigned int v
 }
 
 /*
- * Stats thread for the NETFPGA Ports
+ * Timer callback, samples the NETFPGA port stats every 500ms
  */
-void* netfpga_stats(void* arg) {
-	router_state* rs = (router_state*)arg;
+void netfpga_stats_timer(router_state* rs, uint32_t key, uint32_t id) {
 	struct timeval now;
 	uint32_t rx_packets, tx_packets, rx_bytes, tx_bytes;
 	uint32_t rx_packets_diff, tx_packets_diff, rx_bytes_diff, tx_bytes_diff;
 	long double timeDiff;
 	int i, j;
 
-	while (1) {
-//		printf("or_netfpga.c: NetFPGA begin recording its stats...\n");
-    	gettimeofday(&now, NULL);
-		if (now.tv_sec == rs->stats_last_time.tv_sec) {
-			/* must be a later usec time */
-			timeDiff = (((long double)(now.tv_usec - rs->stats_last_time.tv_usec)) / (long double)1000000);
-		} else {
-			timeDiff = (now.tv_sec - rs->stats_last_time.tv_sec - 1) + ((long double)((1000000 - rs->stats_last_time.tv_usec) + now.tv_usec) / (long double)1000000);
-		}
+//	printf("or_netfpga.c: NetFPGA begin recording its stats...\n");
+	gettimeofday(&now, NULL);
+	if (now.tv_sec == rs->stats_last_time.tv_sec) {
+		/* must be a later usec time */
+		timeDiff = (((long double)(now.tv_usec - rs->stats_last_time.tv_usec)) / (long double)1000000);
+	} else {
+		timeDiff = (now.tv_sec - rs->stats_last_time.tv_sec - 1) + ((long double)((1000000 - rs->stats_last_time.tv_usec) + now.tv_usec) / (long double)1000000);
+	}
 
-		lock_netfpga_stats(rs);
-
-		printf("port #     rx_pkts     tx_pkts   rx_kbytes   tx_kbytes     pkt/s   kbyte/s        time\n");
-		printf("======================================================================================\n");
-		for (i = 0; i < 8; ++i) {
-			/* read all the values */
-			rx_packets = get_rx_queue_num_pkts_received(&rs->netfpga, i);
-			tx_packets = get_tx_queue_num_pkts_sent(&rs->netfpga, i);
-			rx_bytes = get_rx_queue_num_bytes_received(&rs->netfpga, i);
-			tx_bytes = get_tx_queue_num_bytes_sent(&rs->netfpga, i);
-
-			/* compute differences */
-			rx_packets_diff = rx_packets - rs->stats_last[i][0];
-			tx_packets_diff = tx_packets - rs->stats_last[i][1];
-			rx_bytes_diff = rx_bytes - rs->stats_last[i][2];
-			tx_bytes_diff = tx_bytes - rs->stats_last[i][3];
-
-			/* bytes_diff will be in kB */
-			rx_bytes_diff /= 1024;
-			tx_bytes_diff /= 1024;
-
-			/* update averages */
-			rs->stats_avg[i][0] = ((double)rx_packets_diff) / timeDiff;
-			rs->stats_avg[i][1] = ((double)tx_packets_diff) / timeDiff;
-			rs->stats_avg[i][2] = ((double)rx_bytes_diff) / timeDiff;
-			rs->stats_avg[i][3] = ((double)tx_bytes_diff) / timeDiff;
-
-			/* store data back */
-			rs->stats_last[i][0] = rx_packets;
-			rs->stats_last[i][1] = tx_packets;
-			rs->stats_last[i][2] = rx_bytes;
-			rs->stats_last[i][3] = tx_bytes;
-			rs->stats_last_time = now;
-
-			printf("%6d  %10d  %10d  %10d  %10d  %8.2Lf  %8.2Lf  %u\n", i, rs->stats_last[i][0], rs->stats_last[i][1], rs->stats_last[i][2], rs->stats_last[i][3], rs->stats_avg[i][0] + rs->stats_avg[i][1], rs->stats_avg[i][2] + rs->stats_avg[i][3], now);
-		}
+	lock_netfpga_stats(rs);
 
-		node* cur = NULL;
-		pwospf_router* r = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
-		
-		if (r != NULL) {
-
-			cur = r->interface_list;
-			j = 0;
-		
-			while (cur) {
-				pwospf_interface* iface = (pwospf_interface*)cur->data;
-				iface->rx_rate = (uint32_t)(rs->stats_avg[j][2]);
-				iface->tx_rate = (uint32_t)(rs->stats_avg[j][3]);
-				//printf("or_netfpga.c: iface->rx_rate[%d] = %d (kbytes)\n", j, iface->rx_rate);
-				//printf("or_netfpga.c: iface->tx_rate[%d] = %d (kbytes)\n", j, iface->tx_rate);
-				cur = cur->next;
-				j++;
-			}
-			
-		}
+	printf("port #     rx_pkts     tx_pkts   rx_kbytes   tx_kbytes     pkt/s   kbyte/s        time\n");
+	printf("======================================================================================\n");
+	for (i = 0; i < 8; ++i) {
+		/* read all the values */
+		rx_packets = get_rx_queue_num_pkts_received(&rs->netfpga, i);
+		tx_packets = get_tx_queue_num_pkts_sent(&rs->netfpga, i);
+		rx_bytes = get_rx_queue_num_bytes_received(&rs->netfpga, i);
+		tx_bytes = get_tx_queue_num_bytes_sent(&rs->netfpga, i);
+
+		/* compute differences */
+		rx_packets_diff = rx_packets - rs->stats_last[i][0];
+		tx_packets_diff = tx_packets - rs->stats_last[i][1];
+		rx_bytes_diff = rx_bytes - rs->stats_last[i][2];
+		tx_bytes_diff = tx_bytes - rs->stats_last[i][3];
 
-		unlock_netfpga_stats(rs);
-		printf("======================================================================================\n");
-		printf("or_netfpga.c: NetFPGA end recording its stats.\n");
-		printf("or_netfpga.c: There are %d interfaces in this router.\n", j);
-		usleep(500000);
+		/* bytes_diff will be in kB */
+		rx_bytes_diff /= 1024;
+		tx_bytes_diff /= 1024;
+
+		/* update averages */
+		rs->stats_avg[i][0] = ((double)rx_packets_diff) / timeDiff;
+		rs->stats_avg[i][1] = ((double)tx_packets_diff) / timeDiff;
+		rs->stats_avg[i][2] = ((double)rx_bytes_diff) / timeDiff;
+		rs->stats_avg[i][3] = ((double)tx_bytes_diff) / timeDiff;
+
+		/* store data back */
+		rs->stats_last[i][0] = rx_packets;
+		rs->stats_last[i][1] = tx_packets;
+		rs->stats_last[i][2] = rx_bytes;
+		rs->stats_last[i][3] = tx_bytes;
+		rs->stats_last_time = now;
+
+		printf("%6d  %10d  %10d  %10d  %10d  %8.2Lf  %8.2Lf  %u\n", i, rs->stats_last[i][0], rs->stats_last[i][1], rs->stats_last[i][2], rs->stats_last[i][3], rs->stats_avg[i][0] + rs->stats_avg[i][1], rs->stats_avg[i][2] + rs->stats_avg[i][3], now);
 	}
 
-	return NULL;
+	/* the rates of our interfaces go into our LSU, in port order */
+	uint32_t rx_rates[8];
+	uint32_t tx_rates[8];
+	for (j = 0; j < 8; ++j) {
+		rx_rates[j] = (uint32_t)(rs->stats_avg[j][2]);
+		tx_rates[j] = (uint32_t)(rs->stats_avg[j][3]);
+	}
+
+	unlock_netfpga_stats(rs);
+
+	pwospf_update_link_metrics(rs, rx_rates, tx_rates, 8);
+
+	printf("======================================================================================\n");
+	printf("or_netfpga.c: NetFPGA end recording its stats.\n");
 }
 
 /* IS THREADSAFE */
@@ -583,18 +563,20 @@ local_ip_filter_entry* get_local_ip_filter_by_ip(router_state*rs, struct in_addr
 }
 
 void lock_local_ip_filters(router_state* rs) {
-	pthread_mutex_lock(rs->local_ip_filter_list_mutex);
+	lockprof_mutex_lock(rs->local_ip_filter_list_mutex, LOCK_LOCAL_IP_FILTERS, LOCKPROF_SITE);
 }
 
 void unlock_local_ip_filters(router_state* rs) {
+	lockprof_release(LOCK_LOCAL_IP_FILTERS);
 	pthread_mutex_unlock(rs->local_ip_filter_list_mutex);
 }
 
 void lock_netfpga_stats(router_state* rs) {
-	pthread_mutex_lock(rs->stats_mutex);
+	lockprof_mutex_lock(rs->stats_mutex, LOCK_NETFPGA_STATS, LOCKPROF_SITE);
 }
 
 void unlock_netfpga_stats(router_state* rs) {
+	lockprof_release(LOCK_NETFPGA_STATS);
 	pthread_mutex_unlock(rs->stats_mutex);
 }
 
@@ -40,7 +40,7 @@ void get_incoming_interface(char *iface, unsigned int len, unsigned int queue);
 
 void lock_netfpga_stats(router_state* rs);
 void unlock_netfpga_stats(router_state* rs);
-void* netfpga_stats(void* arg);
+void netfpga_stats_timer(router_state* rs, uint32_t key, uint32_t id);
 
 /* ip filter functions */
 void trigger_local_ip_filters_change(router_state* rs);
@@ -304,6 +304,7 @@ void sprint_pwospf_router_list(router_state *rs, char **buf, int *len) {
 		num_entries = num_entries + (1 + node_length(pi));
 		rl = rl->next;
 	}
+	num_entries += node_length(rs->pwospf_areas);
 
 
 
@@ -311,50 +312,63 @@ void sprint_pwospf_router_list(router_state *rs, char **buf, int *len) {
 	COPY_STRING(buffer, total_len, PWOSPF_ROUTER_LIST_COL);
 
 
-	node *router_list_walker = rs->pwospf_router_list;
-	while(router_list_walker) {
+	/* one block per area, an ABR is listed in each of its areas */
+	node *area_walker;
+	for (area_walker = rs->pwospf_areas; area_walker; area_walker = area_walker->next) {
+		uint32_t area_id = ((pwospf_area *)area_walker->data)->area_id;
+		char header[PWOSPF_ROUTER_LIST_TO_STRING_LEN];
+		snprintf(header, PWOSPF_ROUTER_LIST_TO_STRING_LEN, "Area %u\n", area_id);
+		COPY_STRING(buffer, total_len, header);
 
-		pwospf_router *rle = (pwospf_router *)router_list_walker->data;
+		node *router_list_walker = rs->pwospf_router_list;
+		while(router_list_walker) {
 
-		char last_update[47];
-		bzero(last_update, 47);
-		time(&now);
-		diff = difftime(now, rle->last_update);
-		if( (int)diff > (rs->pwospf_lsu_interval * 3) ) {
-			snprintf(last_update, 47, "%s", "EXP");
-		} else {
-			snprintf(last_update, 47, "%i", (int)diff);
-		}
-
-
-		char line[PWOSPF_ROUTER_LIST_TO_STRING_LEN];
-		bzero(line, PWOSPF_ROUTER_LIST_TO_STRING_LEN);
-		snprintf(line, PWOSPF_ROUTER_LIST_TO_STRING_LEN, "%-20s%-5d%-5d%-5s%-5d%-5d\n",
-			 inet_ntop(AF_INET, &(rle->router_id), rid_str, 16),
-			 ntohl(rle->area_id),
-			 rle->seq,
-			 last_update,
-			 rle->distance,
-			 rle->shortest_path_found);
-		COPY_STRING(buffer, total_len, line);
+			pwospf_router *rle = (pwospf_router *)router_list_walker->data;
+			if (rle->area_id != area_id) {
+				router_list_walker = router_list_walker->next;
+				continue;
+			}
 
-		node *interface_walker = rle->interface_list;
-		while(interface_walker) {
+			char last_update[47];
+			bzero(last_update, 47);
+			time(&now);
+			diff = difftime(now, rle->last_update);
+			if( (int)diff > (rs->pwospf_lsu_interval * 3) ) {
+				snprintf(last_update, 47, "%s", "EXP");
+			} else {
+				snprintf(last_update, 47, "%i", (int)diff);
+			}
 
-			pwospf_interface *iface = (pwospf_interface *)interface_walker->data;
 
+			char line[PWOSPF_ROUTER_LIST_TO_STRING_LEN];
 			bzero(line, PWOSPF_ROUTER_LIST_TO_STRING_LEN);
-			snprintf(line, PWOSPF_ROUTER_LIST_TO_STRING_LEN, "          %-20s%-20s%-20s%-5i\n",
-				 inet_ntop(AF_INET, &(iface->subnet), subnet_str, 16),
-				 inet_ntop(AF_INET, &(iface->mask), mask_str, 16),
-				 inet_ntop(AF_INET, &(iface->router_id), rid_str, 16),
-				 iface->is_active);
+			snprintf(line, PWOSPF_ROUTER_LIST_TO_STRING_LEN, "%-20s%-5d%-5d%-5s%-5d%-5d\n",
+				 inet_ntop(AF_INET, &(rle->router_id), rid_str, 16),
+				 rle->area_id,
+				 rle->seq,
+				 last_update,
+				 rle->distance,
+				 rle->shortest_path_found);
 			COPY_STRING(buffer, total_len, line);
 
-			interface_walker = interface_walker->next;
-		}
+			node *interface_walker = rle->interface_list;
+			while(interface_walker) {
+
+				pwospf_interface *iface = (pwospf_interface *)interface_walker->data;
+
+				bzero(line, PWOSPF_ROUTER_LIST_TO_STRING_LEN);
+				snprintf(line, PWOSPF_ROUTER_LIST_TO_STRING_LEN, "          %-20s%-20s%-20s%-5i\n",
+					 inet_ntop(AF_INET, &(iface->subnet), subnet_str, 16),
+					 inet_ntop(AF_INET, &(iface->mask), mask_str, 16),
+					 inet_ntop(AF_INET, &(iface->router_id), rid_str, 16),
+					 iface->is_active);
+				COPY_STRING(buffer, total_len, line);
+
+				interface_walker = interface_walker->next;
+			}
 
-		router_list_walker = router_list_walker->next;
+			router_list_walker = router_list_walker->next;
+		}
 	}
 
 	*buf = buffer;
@@ -369,10 +383,9 @@ void sprint_pwospf_router_list(router_state *rs, char **buf, int *len) {
 #define RTABLE_MAX_IFACE_LEN 18
 
 /* NOT THREAD SAFE */
-void sprint_rtable(router_state *rs, char **buf, int *len)
+static void sprint_rtable_list(node *rtable, char **buf, int *len)
 {
 
-	assert(rs);
 	assert(buf);
 	assert(len);
 
@@ -385,10 +398,10 @@ void sprint_rtable(router_state *rs, char **buf, int *len)
 	char gw_str[16];
 	char mask_str[16];
 
-	buffer = calloc(strlen(RTABLE_COL) + RTABLE_ENTRY_TO_STRING_LEN * node_length(rs->rtable), sizeof(char) );
+	buffer = calloc(strlen(RTABLE_COL) + RTABLE_ENTRY_TO_STRING_LEN * node_length(rtable), sizeof(char) );
 	COPY_STRING(buffer, total_len, RTABLE_COL);
 
-	rtable_walker = rs->rtable;
+	rtable_walker = rtable;
 	while(rtable_walker) {
 		re = (rtable_entry *)rtable_walker->data;
 
@@ -412,6 +425,18 @@ void sprint_rtable(router_state *rs, char **buf, int *len)
 
 }
 
+void sprint_rtable(router_state *rs, char **buf, int *len)
+{
+	assert(rs);
+	sprint_rtable_list(rs->rtable, buf, len);
+}
+
+void sprint_fib(router_state *rs, char **buf, int *len)
+{
+	assert(rs);
+	sprint_rtable_list(rs->fib, buf, len);
+}
+
 
 
 
@@ -469,50 +494,78 @@ void print_sping_queue(struct sr_instance *sr)
 }
 
 
-#define NAT_COL "EXT IP          Port   INT IP          Port   Hits   LHits  HPS     LHits TDelta HW  S\n"
-#define NAT_ENTRY_TO_STR_LEN 88
+#define NAT_COL "EXT IP          Port   INT IP          Port   Hits   LHits  HPS     LHits TDelta HW  S Proto State\n"
+#define NAT_ENTRY_TO_STR_LEN 100
+#define NAT_POOL_COL "\nProto Port Range    In Use Size   High   Failures\n"
+#define NAT_POOL_TO_STR_LEN 60
 void sprint_nat_table(router_state *rs, char **buf, unsigned int *len) {
 
+	char *nat_tcp_states[] = { "none", "syn", "est", "fin", "close" };
 	char ext_ip_str[16];
 	char int_ip_str[16];
-	int nat_table_size = node_length(rs->nat_table);
+	int nat_table_size = nat_table_num_entries(rs->nat_table);
 	time_t now;
 	uint32_t diff = 0;
 
-	char *buffer = (char *)calloc(strlen(NAT_COL) + nat_table_size*NAT_ENTRY_TO_STR_LEN, sizeof(char));
+	char *buffer = (char *)calloc(strlen(NAT_COL) + nat_table_size*NAT_ENTRY_TO_STR_LEN + strlen(NAT_POOL_COL) + NAT_NUM_POOLS*NAT_POOL_TO_STR_LEN, sizeof(char));
 	unsigned int total_len = 0;
 
 	COPY_STRING(buffer, total_len, NAT_COL);
 
-	node *n = rs->nat_table;
-	while(n) {
-		nat_entry *ne = (nat_entry *)n->data;
+	int s;
+	for(s = 0; s < NAT_NUM_SHARDS; ++s) {
+		nat_entry *ne = rs->nat_table->shards[s].entries;
+		while(ne) {
 
-		char last_update[47];
-		bzero(last_update, 47);
-		time(&now);
-		diff = (int)difftime(now, ne->last_hits_time);
-		inet_ntop(AF_INET, &(ne->nat_ext.ip), ext_ip_str, 16);
-		inet_ntop(AF_INET, &(ne->nat_int.ip), int_ip_str, 16);
-
-		char line[NAT_ENTRY_TO_STR_LEN];
-		bzero(line, NAT_ENTRY_TO_STR_LEN);
-		snprintf(line, NAT_ENTRY_TO_STR_LEN, "%-15s %-6u %-15s %-6u %-6u %-6u %-7.2f %-12u %-3u %-1s\n",
-				ext_ip_str,
-				ntohs(ne->nat_ext.port),
-				int_ip_str,
-				ntohs(ne->nat_int.port),
-				ne->hits,
-				ne->last_hits,
-				ne->avg_hits_per_second,
-				diff,
-				ne->hw_row,
-				(ne->is_static == 1) ? "Y" : "N");
-		COPY_STRING(buffer, total_len, line);
+			char last_update[47];
+			bzero(last_update, 47);
+			time(&now);
+			diff = (int)difftime(now, ne->last_hits_time);
+			inet_ntop(AF_INET, &(ne->nat_ext.ip), ext_ip_str, 16);
+			inet_ntop(AF_INET, &(ne->nat_int.ip), int_ip_str, 16);
+
+			char line[NAT_ENTRY_TO_STR_LEN];
+			bzero(line, NAT_ENTRY_TO_STR_LEN);
+			snprintf(line, NAT_ENTRY_TO_STR_LEN, "%-15s %-6u %-15s %-6u %-6u %-6u %-7.2f %-12u %-3u %-1s %-5s %-5s\n",
+					ext_ip_str,
+					ntohs(ne->nat_ext.port),
+					int_ip_str,
+					ntohs(ne->nat_int.port),
+					ne->hits,
+					ne->last_hits,
+					ne->avg_hits_per_second,
+					diff,
+					ne->hw_row,
+					(ne->is_static == 1) ? "Y" : "N",
+					(ne->proto == IP_PROTO_TCP) ? "tcp" : ((ne->proto == IP_PROTO_UDP) ? "udp" : "icmp"),
+					(ne->proto == IP_PROTO_TCP) ? nat_tcp_states[ne->tcp_state] : "-");
+			COPY_STRING(buffer, total_len, line);
 
-		n = n->next;
+			ne = ne->next;
+		}
 	}
 
+	/* external port usage and exhaustion per protocol */
+	COPY_STRING(buffer, total_len, NAT_POOL_COL);
+
+	char *pool_names[NAT_NUM_POOLS] = { "tcp", "udp", "icmp" };
+	int i;
+	for(i = 0; i < NAT_NUM_POOLS; ++i) {
+		nat_port_pool *pool = &(rs->nat_table->pools[i]);
+		char range[16];
+		snprintf(range, 16, "%u-%u", pool->lo, pool->hi);
+
+		char line[NAT_POOL_TO_STR_LEN];
+		bzero(line, NAT_POOL_TO_STR_LEN);
+		snprintf(line, NAT_POOL_TO_STR_LEN, "%-5s %-13s %-6u %-6u %-6u %-8u\n",
+				pool_names[i],
+				range,
+				pool->in_use,
+				pool->hi - pool->lo + 1,
+				pool->high_water,
+				pool->failures);
+		COPY_STRING(buffer, total_len, line);
+	}
 
 	*buf = buffer;
 	*len = total_len;
@@ -779,7 +832,7 @@ void print_tcp_load(const uint8_t *packet, unsigned int len) {
 	indent(3);
 	printf("Acq # = %X\n", ntohl(tcp->tcp_ack));
 	indent(3);
-	printf("Unused = %X %X %X %X\n", tcp->unused1[0], tcp->unused1[1], tcp->unused1[2], tcp->unused1[3]);
+	printf("Offset = %X Flags = %X Window = %d\n", tcp->tcp_off, tcp->tcp_flags, ntohs(tcp->tcp_win));
 	indent(3);
 	printf("Sum = %X\n", tcp->tcp_sum);
 	indent(3);
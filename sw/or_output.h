@@ -15,6 +15,7 @@ void sprint_if_list(router_state *rs, char **buf, int *len);
 void sprint_pwospf_if_list(router_state *rs, char **buf, int *len);
 void sprint_pwospf_router_list(router_state *rs, char **buf, int *len);
 void sprint_rtable(router_state *rs, char **buf, int *len);
+void sprint_fib(router_state *rs, char **buf, int *len);
 void print_arp_queue(struct sr_instance* sr);
 void print_sping_queue(struct sr_instance* sr);
 void sprint_nat_table(router_state *rs, char **buf, unsigned int *len);
@@ -20,6 +20,11 @@
 #include "or_ip.h"
 #include "or_dijkstra.h"
 #include "or_arp.h"
+#include "or_atable.h"
+#include "or_lsdb.h"
+#include "or_timer.h"
+#include "or_lockprof.h"
+#include "or_drop.h"
 
 void process_pwospf_packet(struct sr_instance* sr, const uint8_t * packet, unsigned int len, const char* interface) {
 
@@ -36,10 +41,18 @@ void process_pwospf_packet(struct sr_instance* sr, const uint8_t * packet, unsig
 
 	pwospf_hdr* pwospf = get_pwospf_hdr(packet, len);
 
+	/* only take it in the area of the interface it came in on */
+	iface_entry* iface = get_iface(rs, interface);
+	if (!iface || (ntohl(pwospf->pwospf_aid) != iface->area_id)) {
+		return;
+	}
+
 	if (pwospf->pwospf_type == PWOSPF_TYPE_HELLO) {
 		process_pwospf_hello_packet(sr, packet, len, interface);
 	} else if (pwospf->pwospf_type == PWOSPF_TYPE_LINK_STATE_UPDATE) {
 		process_pwospf_lsu_packet(sr, packet, len, interface);
+	} else if (pwospf->pwospf_type == PWOSPF_TYPE_LIVENESS) {
+		process_pwospf_liveness_packet(sr, packet, len, interface);
 	}
 }
 
@@ -56,17 +69,19 @@ void process_pwospf_hello_packet(struct sr_instance* sr, const uint8_t * packet,
 		return;
 	}
 
-	/* We got a hello packet so we definitely need to unlock and relock interface in write mode */
+	/* We got a hello packet so we definitely need to unlock and relock interface in write mode,
+	 * and the rtable too since a new neighbor brings its static routes back */
 	unlock_rtable(rs);
 	unlock_if_list(rs);
 	lock_if_list_wr(rs);
-	lock_rtable_rd(rs);
+	lock_rtable_wr(rs);
 	lock_mutex_pwospf_router_list(rs);
 
 	iface_entry* iface = get_iface(rs, interface);
 
 	/* Drop the packet if the masks don't match */
 	if (iface->mask != hello_hdr->pwospf_mask.s_addr) {
+		unlock_mutex_pwospf_router_list(rs);
 		return;
 	}
 
@@ -92,6 +107,7 @@ void process_pwospf_hello_packet(struct sr_instance* sr, const uint8_t * packet,
 		time(&(nbr->last_rcvd_hello));
 		nbr->ip.s_addr = iphdr->ip_src.s_addr;
 		nbr->router_id = pwospf->pwospf_rid;
+		nbr->timer_id = timer_add(rs, (3 * rs->pwospf_hello_interval + 1) * 1000, 0, pwospf_nbr_timer, nbr->router_id);
 
 		node* n = node_create();
 		n->data = nbr;
@@ -101,9 +117,8 @@ void process_pwospf_hello_packet(struct sr_instance* sr, const uint8_t * packet,
 			node_push_back(iface->nbr_routers, n);
 		}
 
-		/* update our router's associated interface neighbor */
-		pwospf_router* r = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
-		assert(r);
+		/* update our router's associated interface neighbor, in the area of the interface */
+		pwospf_router* r = attach_pwospf_area(rs, iface->area_id);
 
 
 		/* find the pwospf_interface on our router so we can update the neighboring rid */
@@ -114,6 +129,7 @@ void process_pwospf_hello_packet(struct sr_instance* sr, const uint8_t * packet,
 			/* check if we have an interface with a blank router id */
 			if ((interface->subnet.s_addr == (iface->ip & iface->mask)) && (interface->mask.s_addr == iface->mask) && (interface->router_id == 0)) {
 				interface->router_id = nbr->router_id;
+				pwospf_lsu_changed(rs);
 				found = 1;
 				break;
 			}
@@ -128,11 +144,18 @@ void process_pwospf_hello_packet(struct sr_instance* sr, const uint8_t * packet,
 			node *n = node_create();
 			n->data = interface;
 
-			assert(r->interface_list);
-			node_push_back(r->interface_list, n);
+			if (r->interface_list == NULL) {
+				r->interface_list = n;
+			} else {
+				node_push_back(r->interface_list, n);
+			}
+			pwospf_lsu_changed(rs);
 		}
 
 
+		/* static routes through it were taken down if it timed out before */
+		activate_routes_via(rs, iface->name, &(nbr->ip));
+
 		/*received a hello from a new neighbor interfaces */
 		update_neighbors = 1;
 
@@ -175,7 +198,6 @@ void broadcast_pwospf_hello_packet(struct sr_instance* sr) {
 	pwospf_hdr *pwospf = get_pwospf_hdr(packet, len);
 	pwospf_hello_hdr *hello = get_pwospf_hello_hdr(packet, len);
 	uint8_t default_addr[ETH_ADDR_LEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-	int interface_has_timedout = 0;
 
 	/* send one hello packet per interface */
 	node *iface_walker = rs->if_list;
@@ -187,46 +209,96 @@ void broadcast_pwospf_hello_packet(struct sr_instance* sr) {
 
 			/* construct the hello packet */
 			populate_pwospf_hello(hello, ie->mask, rs->pwospf_hello_interval);
-			populate_pwospf(pwospf, PWOSPF_TYPE_HELLO, sizeof(pwospf_hdr)+sizeof(pwospf_hello_hdr), rs->router_id, rs->area_id);
+			populate_pwospf(pwospf, PWOSPF_TYPE_HELLO, sizeof(pwospf_hdr)+sizeof(pwospf_hello_hdr), rs->router_id, ie->area_id);
 			pwospf->pwospf_sum = htons(compute_pwospf_checksum(pwospf));
 			populate_ip(ip, sizeof(pwospf_hdr)+sizeof(pwospf_hello_hdr), IP_PROTO_PWOSPF, ie->ip, htonl(PWOSPF_HELLO_TIP));
 			ip->ip_sum = htons(compute_ip_checksum(ip));
 			populate_eth_hdr(eth, default_addr, ie->addr, ETH_TYPE_IP);
 
-			/* send hello packet and update the time sent */
+			/* send hello packet and update the time sent, dead neighbors are caught by their own timers */
 			send_packet(sr, packet, len, ie->name);
 			time((time_t *)(&ie->last_sent_hello));
 
-
-			/* disable timed out interface */
-			/* have to lock the router list because we update our pwospf router from inside */
-			lock_mutex_pwospf_router_list(rs);
-			if(determine_timedout_interface(rs, ie) == 1) {
-				/* the outer loop checks all interfaces, so we need this if statement */
-				interface_has_timedout = 1;
-			}
-			unlock_mutex_pwospf_router_list(rs);
-
 		}
 
 		iface_walker = iface_walker->next;
 	}
 
+	free(packet);
 
-	/* One of neighbor interfaces has timed out */
-	if(interface_has_timedout == 1) {
+}
 
-		/* flood with lsu updates */
-		lock_mutex_pwospf_router_list(rs);
-		propagate_pwospf_changes(rs, NULL);
-		unlock_mutex_pwospf_router_list(rs);
+/*
+ * NOT THREAD SAFE, lock the if_list
+ * Sends a liveness packet out of every active interface with a neighbor on it
+ */
+void broadcast_pwospf_liveness_packet(struct sr_instance* sr) {
 
-		/*send it to every neighbor */
-		pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+	assert(sr);
+
+	router_state *rs = get_router_state(sr);
+	unsigned int len = sizeof(eth_hdr) + sizeof(ip_hdr) + sizeof(pwospf_hdr) + sizeof(pwospf_liveness_hdr);
+	uint8_t *packet = calloc(len, sizeof(uint8_t));
+	eth_hdr *eth = (eth_hdr *)packet;
+	ip_hdr *ip = get_ip_hdr(packet, len);
+	pwospf_hdr *pwospf = get_pwospf_hdr(packet, len);
+	pwospf_liveness_hdr *liveness = (pwospf_liveness_hdr *)get_pwospf_hello_hdr(packet, len);
+	uint8_t default_addr[ETH_ADDR_LEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+	/* the pwospf part only differs in the area */
+	liveness->pwospf_interval = htons(rs->pwospf_liveness_interval);
+	liveness->pwospf_mult = rs->pwospf_liveness_multiplier;
+
+	node *iface_walker = rs->if_list;
+	while(iface_walker) {
+		iface_entry *ie = (iface_entry *)iface_walker->data;
+
+		if((ie->is_active & 0x1) && ie->nbr_routers) {
+			populate_pwospf(pwospf, PWOSPF_TYPE_LIVENESS, sizeof(pwospf_hdr)+sizeof(pwospf_liveness_hdr), rs->router_id, ie->area_id);
+			pwospf->pwospf_sum = htons(compute_pwospf_checksum(pwospf));
+			populate_ip(ip, sizeof(pwospf_hdr)+sizeof(pwospf_liveness_hdr), IP_PROTO_PWOSPF, ie->ip, htonl(PWOSPF_HELLO_TIP));
+			ip->ip_sum = htons(compute_ip_checksum(ip));
+			populate_eth_hdr(eth, default_addr, ie->addr, ETH_TYPE_IP);
+
+			send_packet(sr, packet, len, ie->name);
+		}
+
+		iface_walker = iface_walker->next;
 	}
 
 	free(packet);
+}
+
+void process_pwospf_liveness_packet(struct sr_instance* sr, const uint8_t * packet, unsigned int len, const char* interface) {
+	router_state* rs = get_router_state(sr);
+	ip_hdr* iphdr = get_ip_hdr(packet, len);
+	pwospf_hdr* pwospf = get_pwospf_hdr(packet, len);
+	pwospf_liveness_hdr* liveness = (pwospf_liveness_hdr *)get_pwospf_hello_hdr(packet, len);
+
+	if ((ntohs(pwospf->pwospf_len) < sizeof(pwospf_hdr) + sizeof(pwospf_liveness_hdr)) ||
+			(liveness->pwospf_interval == 0) || (liveness->pwospf_mult == 0)) {
+		return;
+	}
+
+	/* we update the neighbor so relock the interface list for writing */
+	unlock_rtable(rs);
+	unlock_if_list(rs);
+	lock_if_list_wr(rs);
+	lock_rtable_rd(rs);
 
+	/* only neighbors we already know from their hellos are tracked */
+	iface_entry* iface = get_iface(rs, interface);
+	node* cur = iface ? iface->nbr_routers : NULL;
+	while (cur) {
+		nbr_router* nbr = (nbr_router*)cur->data;
+		if ((nbr->ip.s_addr == iphdr->ip_src.s_addr) && (nbr->router_id == pwospf->pwospf_rid)) {
+			nbr->last_rcvd_liveness = timer_now_ms();
+			nbr->liveness_detect = ntohs(liveness->pwospf_interval) * liveness->pwospf_mult;
+			break;
+		}
+		cur = cur->next;
+	}
+	/* unlocking of the above will be automatically performed in process ip packet */
 }
 
 
@@ -247,69 +319,93 @@ int determine_timedout_interface(router_state *rs, iface_entry *iface) {
 		if (diff > (3 * rs->pwospf_hello_interval)) {
 			//printf("HELLO Timed Out %s\n", iface->name);
 			interface_has_timedout = 1;
+			remove_pwospf_neighbor(rs, iface, cur);
+		}
 
-			/* delete this interface from our router entry */
-			pwospf_router *our_router = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
-			node *n = our_router->interface_list;
-
-			/* first count how many routers are on this same subnet */
-			int count = 0;
-			while(n) {
-				pwospf_interface *pi = (pwospf_interface *)n->data;
+		cur = next;
+	}
 
-				if( (pi->subnet.s_addr == (iface->ip & iface->mask)) && (pi->mask.s_addr == iface->mask)) {
-					++count;
-				}
+	return interface_has_timedout;
+}
 
-				n = n->next;
-			}
+/*
+ * NOT THREAD SAFE, lock the if_list for writes and the pwospf_router_list
+ * Takes the neighbor in nbr_node off iface and out of our own router entry
+ */
+void remove_pwospf_neighbor(router_state *rs, iface_entry *iface, node *nbr_node) {
 
-			assert(count > 0);
-			if (count == 1) {
-				/* if there is only one then we zero out its neighbor router, else we delete it */
+	nbr_router* nbr = (nbr_router*)nbr_node->data;
 
-				/* find this interface */
-				n = our_router->interface_list;
-				while(n) {
-					pwospf_interface *pi = (pwospf_interface *)n->data;
+	/* delete this interface from our router entry in its area */
+	pwospf_router *our_router = lsdb_lookup(rs, iface->area_id, rs->router_id);
+	node *n = our_router->interface_list;
 
-					if( (pi->subnet.s_addr == (iface->ip & iface->mask)) && (pi->mask.s_addr == iface->mask)) {
-						pi->router_id = 0;
-						break;
-					}
+	/* first count how many routers are on this same subnet */
+	int count = 0;
+	while(n) {
+		pwospf_interface *pi = (pwospf_interface *)n->data;
 
-					n = n->next;
-				}
+		if( (pi->subnet.s_addr == (iface->ip & iface->mask)) && (pi->mask.s_addr == iface->mask)) {
+			++count;
+		}
 
-			} else {
-				/* delete this interface */
+		n = n->next;
+	}
 
-				n = our_router->interface_list;
-				while(n) {
-					pwospf_interface *pi = (pwospf_interface *)n->data;
+	assert(count > 0);
+	if (count == 1) {
+		/* if there is only one then we zero out its neighbor router, else we delete it */
 
-					if( (pi->subnet.s_addr == (iface->ip & iface->mask)) && (pi->mask.s_addr == iface->mask) && (nbr->router_id == pi->router_id)) {
-						node_remove(&our_router->interface_list, n);
-						break;
-					}
+		/* find this interface */
+		n = our_router->interface_list;
+		while(n) {
+			pwospf_interface *pi = (pwospf_interface *)n->data;
 
-					n = n->next;
-				}
+			if( (pi->subnet.s_addr == (iface->ip & iface->mask)) && (pi->mask.s_addr == iface->mask)) {
+				pi->router_id = 0;
+				break;
 			}
 
-			/* delete this neighbor from our physical interface list */
-			node_remove(&iface->nbr_routers, cur);
-
+			n = n->next;
 		}
 
-		cur = next;
+	} else {
+		/* delete this interface */
+
+		n = our_router->interface_list;
+		while(n) {
+			pwospf_interface *pi = (pwospf_interface *)n->data;
+
+			if( (pi->subnet.s_addr == (iface->ip & iface->mask)) && (pi->mask.s_addr == iface->mask) && (nbr->router_id == pi->router_id)) {
+				node_remove(&our_router->interface_list, n);
+				break;
+			}
+
+			n = n->next;
+		}
 	}
 
-	return interface_has_timedout;
+	/* delete this neighbor from our physical interface list */
+	node_remove(&iface->nbr_routers, nbr_node);
+	pwospf_lsu_changed(rs);
 }
 
 
 
+/* do the advertisements the LSU claims fit in both its pwospf length and what we received? */
+static int pwospf_lsu_fits(const uint8_t *packet, unsigned int len) {
+	pwospf_hdr *pwospf = get_pwospf_hdr(packet, len);
+	unsigned int headers = sizeof(pwospf_hdr) + sizeof(pwospf_lsu_hdr);
+	unsigned int pwospf_len = ntohs(pwospf->pwospf_len);
+
+	if ((len < ETH_HDR_LEN + sizeof(ip_hdr) + headers) || (pwospf_len < headers) ||
+			(pwospf_len > len - ETH_HDR_LEN - sizeof(ip_hdr))) {
+		return 0;
+	}
+
+	return ntohl(get_pwospf_lsu_hdr(packet, len)->pwospf_num) <= (pwospf_len - headers) / sizeof(pwospf_lsu_adv);
+}
+
 void process_pwospf_lsu_packet(struct sr_instance* sr, const uint8_t * packet, unsigned int len, const char* interface) {
 
 	assert(sr);
@@ -325,12 +421,20 @@ void process_pwospf_lsu_packet(struct sr_instance* sr, const uint8_t * packet, u
 	int update_neighbors = 0;
 	int bcast_incoming_lsu_packet = 0;
 	int rebroadcast_packet = 0;
+	uint32_t *old_rids = NULL;
+	unsigned int num_old_rids = 0;
 
 	/* If our router id == the lsu update id, drop pckt */
 	if(rs->router_id == pwospf->pwospf_rid) {
 		return;
 	}
 
+	/* nothing below looks at an advertisement before this */
+	if (!pwospf_lsu_fits(packet, len)) {
+		drop_count(rs, DROP_BAD_LSU, interface);
+		return;
+	}
+
 
 	/* Lock rtable and router_list for writes */
 	unlock_rtable(get_router_state(sr));
@@ -338,27 +442,39 @@ void process_pwospf_lsu_packet(struct sr_instance* sr, const uint8_t * packet, u
 	lock_mutex_pwospf_router_list(rs);
 
 
-	/* Get the pwospf_router with the matching rid with this packet */
-	router = get_router_by_rid(pwospf->pwospf_rid, rs->pwospf_router_list);
+	/* Get the pwospf_router with the matching rid with this packet, in the area it was flooded in */
+	router = lsdb_lookup(rs, ntohl(pwospf->pwospf_aid), pwospf->pwospf_rid);
 
 	if (router) {
 
-		/* If the seq # match, drop packet, ow update this router's info */
-		if( (router->seq != ntohs(lsu->pwospf_seq)) && ( ntohs(lsu->pwospf_seq) > router->seq  ) ) {
+		/* If the seq # isn't newer, drop packet, ow update this router's info */
+		if(lsdb_seq_newer(ntohs(lsu->pwospf_seq), router->seq)) {
 			rebroadcast_packet = 1;
 			time(&(router->last_update));
-			router->seq = htons(lsu->pwospf_seq);
+			router->seq = ntohs(lsu->pwospf_seq);
 
 			/* If contents differ from last LSU update, update our neighbors */
-			if(populate_pwospf_router_interface_list(router, (uint8_t *)packet, len) == 1) {
-				update_neighbors = 1;
+			uint64_t digest = lsdb_digest((pwospf_lsu_adv *)get_pwospf_lsu_data(packet, len), ntohl(lsu->pwospf_num));
+			if(digest != router->digest) {
+				router->digest = digest;
+
+				/* remember who it was adjacent to, their links may go inactive */
+				node *cur = router->interface_list;
+				old_rids = (uint32_t *)malloc((node_length(cur) + 1) * sizeof(uint32_t));
+				for (; cur; cur = cur->next) {
+					old_rids[num_old_rids++] = ((pwospf_interface *)cur->data)->router_id;
+				}
+
+				if(populate_pwospf_router_interface_list(router, (uint8_t *)packet, len) == 1) {
+					update_neighbors = 1;
+				}
 			}
 
 		}
 
 	} else {
 		rebroadcast_packet = 1;
-		add_new_router_neighbor(rs, packet, len);
+		router = add_new_router_neighbor(rs, packet, len);
 
 
 		/* new neighbor */
@@ -370,30 +486,21 @@ void process_pwospf_lsu_packet(struct sr_instance* sr, const uint8_t * packet, u
 	uint16_t ttl = ntohs(lsu->pwospf_ttl) - 1;
 	if((rebroadcast_packet == 1) && (ttl > 0)) {
 
-		/* need to forward a copy of this lsu packet to the other neighbors */
-		unsigned int bcasted_pwospf_packet_len = ntohs(pwospf->pwospf_len);
-		uint8_t *bcasted_pwospf_packet = calloc(bcasted_pwospf_packet_len, sizeof(uint8_t));
-		memcpy(bcasted_pwospf_packet, pwospf, bcasted_pwospf_packet_len);
-
-		/* update ttl */
-		pwospf_lsu_hdr *bcasted_lsu = (pwospf_lsu_hdr *)(bcasted_pwospf_packet + sizeof(pwospf_hdr));
-		bcasted_lsu->pwospf_ttl = htons(ttl);
-
-		/* recompute checksum */
-		pwospf_hdr *bcasted_pwospf = (pwospf_hdr *)(bcasted_pwospf_packet);
-		bcasted_pwospf->pwospf_sum = htons(compute_pwospf_checksum(bcasted_pwospf));
+		/* we are done reading it, so update the ttl in place, every neighbor gets a copy of it */
+		lsu->pwospf_ttl = htons(ttl);
+		update_pwospf_checksum(pwospf, ttl + 1, ttl);
 
 		/* broadcast the packet to the other neighbors */
 		ip_hdr* ip = get_ip_hdr(packet, len);
-		broadcast_pwospf_lsu_packet(sr, bcasted_pwospf, &ip->ip_src);
-		free(bcasted_pwospf_packet);
+		broadcast_pwospf_lsu_packet(sr, pwospf, &ip->ip_src);
 		bcast_incoming_lsu_packet = 1;
 	}
 
 	/* lsu packet has changed our known world, build data to inform the other 3 neighbors */
 	if(update_neighbors == 1) {
-		propagate_pwospf_changes(rs, NULL);
+		propagate_pwospf_router_change(rs, router, old_rids, num_old_rids);
 	}
+	free(old_rids);
 
 
 	/* unlock the pwospf_router_list */
@@ -408,7 +515,7 @@ void process_pwospf_lsu_packet(struct sr_instance* sr, const uint8_t * packet, u
 
 
 
-void add_new_router_neighbor(router_state *rs, const uint8_t *packet, unsigned int len) {
+pwospf_router *add_new_router_neighbor(router_state *rs, const uint8_t *packet, unsigned int len) {
 
 	pwospf_hdr *pwospf = get_pwospf_hdr(packet, len);
 	pwospf_lsu_hdr *lsu = get_pwospf_lsu_hdr(packet, len);
@@ -419,9 +526,11 @@ void add_new_router_neighbor(router_state *rs, const uint8_t *packet, unsigned i
 	new_router->router_id = pwospf->pwospf_rid;
 	new_router->area_id = ntohl(pwospf->pwospf_aid);
 	new_router->seq = ntohs(lsu->pwospf_seq);
+	new_router->digest = lsdb_digest((pwospf_lsu_adv *)get_pwospf_lsu_data(packet, len), ntohl(lsu->pwospf_num));
 	time(&new_router->last_update);
 	new_router->distance = 0;
 	new_router->shortest_path_found = 0;
+	new_router->timer_id = timer_add(rs, (3 * rs->pwospf_lsu_interval + 1) * 1000, 0, pwospf_router_timer, new_router->router_id);
 
 
 	/* copy the LS advs into the interface list */
@@ -429,15 +538,9 @@ void add_new_router_neighbor(router_state *rs, const uint8_t *packet, unsigned i
 
 
 	/* update the pwospf router list */
-	node *n = node_create();
-	n->data = (void *)new_router;
-	if(rs->pwospf_router_list == NULL) {
-		rs->pwospf_router_list = n;
-	}
-	else {
-		node_push_back(rs->pwospf_router_list, n);
-	}
+	lsdb_add(rs, new_router);
 
+	return new_router;
 }
 
 
@@ -457,17 +560,18 @@ void broadcast_pwospf_lsu_packet(struct sr_instance *sr, pwospf_hdr *pwospf, str
 
 	router_state *rs = get_router_state(sr);
 	node *iface_walker = rs->if_list;
+	uint32_t area_id = ntohl(pwospf->pwospf_aid);
 	//pwospf_lsu_hdr *lsu = (pwospf_lsu_hdr *)( ((uint8_t *) pwospf) + sizeof(pwospf_hdr));
 
 	/*
 	 * encapsulate the pwospf data in a new ip packet
-	 * send it to every neighbor except *potentially* the one who sent the packet in the first place
+	 * send it to every neighbor in its area except *potentially* the one who sent the packet in the first place
 	 */
 	int send_on_this_interface = 1;
 	while(iface_walker) {
 		iface_entry *iface = (iface_entry *)iface_walker->data;
 
-		if (iface->is_active && (iface->nbr_routers != NULL)) {
+		if (iface->is_active && (iface->nbr_routers != NULL) && (iface->area_id == area_id)) {
 			node* cur = iface->nbr_routers;
 			while (cur) {
 				nbr_router* nbr = (nbr_router*)cur->data;
@@ -531,6 +635,11 @@ int is_pwospf_packet_valid(router_state *rs, const uint8_t *packet, unsigned int
 
 	pwospf_hdr *pwospf = get_pwospf_hdr(packet, len);
 
+	/* the checksum covers pwospf_len bytes, they have to be there */
+	if ((len < ETH_HDR_LEN + sizeof(ip_hdr) + sizeof(pwospf_hdr)) ||
+			(ntohs(pwospf->pwospf_len) > len - ETH_HDR_LEN - sizeof(ip_hdr))) {
+		return 0;
+	}
 
 	/* Check for PWOSPFV2 */
 	if(pwospf->pwospf_ver != 2) {
@@ -539,6 +648,8 @@ int is_pwospf_packet_valid(router_state *rs, const uint8_t *packet, unsigned int
 
 	uint16_t pckt_sum = htons(pwospf->pwospf_sum);
 	uint16_t sum = compute_pwospf_checksum(pwospf);
+	/* computing it cleared the field, put it back since lsus are forwarded as received */
+	pwospf->pwospf_sum = htons(pckt_sum);
 
 	/* Check the checksum */
 	if(pckt_sum != sum) {
@@ -551,11 +662,6 @@ int is_pwospf_packet_valid(router_state *rs, const uint8_t *packet, unsigned int
 		return 0;
 	}
 
-	/* Check for area id */
-	if(ntohl(pwospf->pwospf_aid) != rs->area_id) {
-		return 0;
-	}
-
 	/* if router id is equal to hours we need to dump the packet */
 	if (ntohl(pwospf->pwospf_rid) == rs->router_id) {
 		return 0;
@@ -599,6 +705,24 @@ uint16_t compute_pwospf_checksum(pwospf_hdr *pwospf) {
 
 
 
+/*
+ * Patches the checksum for one 16 bit field of the packet (both values in host order)
+ * having gone from old_value to new_value, the incremental update of RFC 1624
+ */
+void update_pwospf_checksum(pwospf_hdr *pwospf, uint16_t old_value, uint16_t new_value) {
+
+	unsigned long sum = (uint16_t)~ntohs(pwospf->pwospf_sum);
+	sum += (uint16_t)~old_value;
+	sum += new_value;
+
+	/* sum carries */
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum += (sum >> 16);
+
+	pwospf->pwospf_sum = htons((uint16_t)~sum);
+}
+
+
 int populate_pwospf_router_interface_list(pwospf_router *router, uint8_t *packet, unsigned int len) {
 
 	pwospf_lsu_hdr *lsu = get_pwospf_lsu_hdr(packet, len);
@@ -624,8 +748,9 @@ int populate_pwospf_router_interface_list(pwospf_router *router, uint8_t *packet
 			new_iface_list_entry->mask.s_addr =  next_packet_adv->pwospf_mask.s_addr;
 			new_iface_list_entry->router_id = next_packet_adv->pwospf_rid;
 			new_iface_list_entry->is_active = 0;
-			new_iface_list_entry->rx_rate = next_packet_adv->ngrp_rx_rate;
+			new_iface_list_entry->rx_rate = next_packet_adv->ngrp_rx_rate & PWOSPF_ADV_RATE;
 			new_iface_list_entry->tx_rate = next_packet_adv->ngrp_tx_rate;
+			new_iface_list_entry->is_summary = ((next_packet_adv->ngrp_rx_rate & PWOSPF_ADV_SUMMARY) != 0);
 			printf("or_pwospf.c: router_id = %d, rx_rate = %d, tx_rate = %d\n", next_packet_adv->pwospf_rid, next_packet_adv->ngrp_rx_rate, next_packet_adv->ngrp_tx_rate);
 
 
@@ -662,8 +787,9 @@ int populate_pwospf_router_interface_list(pwospf_router *router, uint8_t *packet
 				if( (interface_list_entry->subnet.s_addr == (next_packet_adv->pwospf_sub.s_addr & next_packet_adv->pwospf_mask.s_addr)) &&
 				    (interface_list_entry->mask.s_addr == next_packet_adv->pwospf_mask.s_addr) &&
 				    (interface_list_entry->router_id == next_packet_adv->pwospf_rid) && 
-				    (interface_list_entry->rx_rate == next_packet_adv->ngrp_rx_rate) &&
-				    (interface_list_entry->tx_rate == next_packet_adv->ngrp_tx_rate)) {
+				    (interface_list_entry->rx_rate == (next_packet_adv->ngrp_rx_rate & PWOSPF_ADV_RATE)) &&
+				    (interface_list_entry->tx_rate == next_packet_adv->ngrp_tx_rate) &&
+				    (interface_list_entry->is_summary == ((next_packet_adv->ngrp_rx_rate & PWOSPF_ADV_SUMMARY) != 0))) {
 
 					is_new_adv = 0;
 					break;
@@ -681,12 +807,13 @@ int populate_pwospf_router_interface_list(pwospf_router *router, uint8_t *packet
 				pwospf_interface *new_iface_list_entry = (pwospf_interface *) calloc(1, sizeof(pwospf_interface));
 
 				/* populate the new adv */
-				new_iface_list_entry->subnet.s_addr = next_packet_adv->pwospf_sub.s_addr & next_packet_adv->pwospf_sub.s_addr;
+				new_iface_list_entry->subnet.s_addr = next_packet_adv->pwospf_sub.s_addr & next_packet_adv->pwospf_mask.s_addr;
 				new_iface_list_entry->mask.s_addr =  next_packet_adv->pwospf_mask.s_addr;
 				new_iface_list_entry->router_id = next_packet_adv->pwospf_rid;
 				new_iface_list_entry->is_active = 0;
-				new_iface_list_entry->rx_rate = next_packet_adv->ngrp_rx_rate;
+				new_iface_list_entry->rx_rate = next_packet_adv->ngrp_rx_rate & PWOSPF_ADV_RATE;
 				new_iface_list_entry->tx_rate = next_packet_adv->ngrp_tx_rate;
+				new_iface_list_entry->is_summary = ((next_packet_adv->ngrp_rx_rate & PWOSPF_ADV_SUMMARY) != 0);
 				printf("or_pwospf.c: router_id = %d, rx_rate = %d, tx_rate = %d\n", next_packet_adv->pwospf_rid, next_packet_adv->ngrp_rx_rate, next_packet_adv->ngrp_tx_rate);
 
 				/* insert the new adv into the list */
@@ -717,8 +844,9 @@ int populate_pwospf_router_interface_list(pwospf_router *router, uint8_t *packet
 				if ((interface_list_entry->subnet.s_addr == (next_packet_adv->pwospf_sub.s_addr & next_packet_adv->pwospf_mask.s_addr)) &&
 				    (interface_list_entry->mask.s_addr == next_packet_adv->pwospf_mask.s_addr) &&
 				    (interface_list_entry->router_id == next_packet_adv->pwospf_rid) &&
-				    (interface_list_entry->rx_rate == next_packet_adv->ngrp_rx_rate) &&
-				    (interface_list_entry->tx_rate == next_packet_adv->ngrp_tx_rate)) {
+				    (interface_list_entry->rx_rate == (next_packet_adv->ngrp_rx_rate & PWOSPF_ADV_RATE)) &&
+				    (interface_list_entry->tx_rate == next_packet_adv->ngrp_tx_rate) &&
+				    (interface_list_entry->is_summary == ((next_packet_adv->ngrp_rx_rate & PWOSPF_ADV_SUMMARY) != 0))) {
 
 						found = 1;
 						break;
@@ -759,6 +887,30 @@ void propagate_pwospf_changes(router_state *rs, char *exclude_this_interface) {
 	start_lsu_bcast_flood(rs, exclude_this_interface);
 }
 
+/*
+ * NOT THREAD SAFE, lock the pwospf_router_list
+ * The same as propagate_pwospf_changes for an lsu that changed one router, only that
+ * router and the ones it was adjacent to (old_rids) can have links change state.
+ */
+void propagate_pwospf_router_change(router_state *rs, pwospf_router *router, uint32_t *old_rids, unsigned int num_old_rids) {
+
+	unsigned int i;
+
+	determine_active_interfaces(rs, router);
+	for (i = 0; i < num_old_rids; ++i) {
+		pwospf_router *other = old_rids[i] ? lsdb_lookup(rs, router->area_id, old_rids[i]) : NULL;
+		if (other && (other != router)) {
+			determine_active_interfaces(rs, other);
+		}
+	}
+
+	/* recompute fwd table */
+	dijkstra_trigger(rs);
+
+	/* build a new IP-LSU update packet */
+	start_lsu_bcast_flood(rs, NULL);
+}
+
 void determine_active_interfaces(router_state *rs, pwospf_router *router) {
 
 	node *il_this_walker = router->interface_list;
@@ -767,7 +919,7 @@ void determine_active_interfaces(router_state *rs, pwospf_router *router) {
 		pwospf_interface *pi_this = (pwospf_interface *)il_this_walker->data;
 		pi_this->is_active = 0;
 
-		pwospf_router *another_router = get_router_by_rid(pi_this->router_id, rs->pwospf_router_list);
+		pwospf_router *another_router = lsdb_lookup(rs, router->area_id, pi_this->router_id);
 		if(another_router) {
 
 			node *il_another_walker = another_router->interface_list;
@@ -802,39 +954,272 @@ void start_lsu_bcast_flood(router_state *rs, char *exclude_this_interface) {
 	}
 
 	//printf("* LSU FLOOD TRIGGERED *\n");
-	/* SEND LSU PACKETS */
-	uint8_t *pwospf_packet = 0;
-	unsigned int pwospf_packet_len = 0;
-	pwospf_hdr *pwospf = 0;
+	/* SEND LSU PACKETS, one into each area we are in */
+	node *area_walker;
+	for (area_walker = rs->pwospf_areas; area_walker; area_walker = area_walker->next) {
+		pwospf_area *area = (pwospf_area *)area_walker->data;
+		pwospf_lsu_cache *cache = &(area->lsu_cache);
+		pwospf_router *our_router = lsdb_lookup(rs, area->area_id, rs->router_id);
+
+		if (!our_router) {
+			continue;
+		}
+
+		if (!cache->packet || (cache->generation != rs->pwospf_lsu_generation)) {
+			/* what we advertise changed, encode it again */
+			free(cache->packet);
+			construct_pwospf_lsu_packet(rs, area, &(cache->packet), &(cache->len));
+			cache->generation = rs->pwospf_lsu_generation;
+			cache->encodes++;
+		} else {
+			/* same contents, only the sequence number moves on */
+			pwospf_lsu_hdr *lsu = (pwospf_lsu_hdr *)(cache->packet + sizeof(pwospf_hdr));
+			uint16_t old_seq = ntohs(lsu->pwospf_seq);
+			lsu->pwospf_seq = htons(our_router->seq);
+			update_pwospf_checksum((pwospf_hdr *)cache->packet, old_seq, our_router->seq);
+			our_router->seq += 1;
+		}
+		cache->floods++;
+
+		broadcast_pwospf_lsu_packet((struct sr_instance *)rs->sr, (pwospf_hdr *)cache->packet, NULL);
+
+		/* update the last sent flood time */
+		time(&(our_router->last_update));
+	}
+}
+
+/*
+ * NOT THREAD SAFE, lock the pwospf_router_list
+ * Call whenever anything we advertise in our LSU changes, so the next flood encodes it again
+ */
+void pwospf_lsu_changed(router_state *rs) {
+	rs->pwospf_lsu_generation++;
+}
+
+/*
+ * NOT THREAD SAFE, lock the pwospf_router_list
+ * Returns: the area with this id, made the first time it is asked for
+ */
+pwospf_area *get_pwospf_area(router_state *rs, uint32_t area_id) {
+	node *cur;
+	for (cur = rs->pwospf_areas; cur; cur = cur->next) {
+		if (((pwospf_area *)cur->data)->area_id == area_id) {
+			return (pwospf_area *)cur->data;
+		}
+	}
+
+	pwospf_area *area = (pwospf_area *)calloc(1, sizeof(pwospf_area));
+	area->area_id = area_id;
+	area->spf = spf_tree_create();
+
+	node *n = node_create();
+	n->data = (void *)area;
+	if (rs->pwospf_areas == NULL) {
+		rs->pwospf_areas = n;
+	} else {
+		node_push_back(rs->pwospf_areas, n);
+	}
+
+	return area;
+}
+
+/*
+ * NOT THREAD SAFE, lock the pwospf_router_list
+ * Returns: our router entry in the area, added if none of our interfaces were in it yet
+ */
+pwospf_router *attach_pwospf_area(router_state *rs, uint32_t area_id) {
+	pwospf_router *our_router = lsdb_lookup(rs, area_id, rs->router_id);
+	if (our_router) {
+		return our_router;
+	}
+
+	pwospf_area *area = get_pwospf_area(rs, area_id);
+	our_router = (pwospf_router *)calloc(1, sizeof(pwospf_router));
+	our_router->router_id = rs->router_id;
+	our_router->area_id = area_id;
+	our_router->seq = area->last_seq;	/* carry on from our last entry, if there was one */
+	time(&our_router->last_update);
+	lsdb_add(rs, our_router);
+	pwospf_lsu_changed(rs);
+
+	return our_router;
+}
+
+/*
+ * NOT THREAD SAFE, lock the pwospf_router_list
+ * Drops our entry from an area none of our interfaces are in any more, the other
+ * routers of the area age out on their own
+ */
+void detach_pwospf_area(router_state *rs, uint32_t area_id) {
+	pwospf_area *area = get_pwospf_area(rs, area_id);
+	pwospf_router *our_router = lsdb_lookup(rs, area_id, rs->router_id);
+
+	if (our_router) {
+		area->last_seq = our_router->seq;
+		lsdb_remove(rs, area_id, rs->router_id);
+	}
+	while (area->summaries) {
+		node_remove(&(area->summaries), area->summaries);
+	}
+	free(area->lsu_cache.packet);
+	area->lsu_cache.packet = NULL;
+	pwospf_lsu_changed(rs);
+}
+
+/*
+ * NOT THREAD SAFE, lock the pwospf_router_list
+ * Returns: the number of areas we have an entry in, more than one makes us an ABR
+ */
+unsigned int pwospf_num_areas(router_state *rs) {
+	unsigned int num = 0;
+	node *cur;
+	for (cur = rs->pwospf_areas; cur; cur = cur->next) {
+		if (lsdb_lookup(rs, ((pwospf_area *)cur->data)->area_id, rs->router_id)) {
+			++num;
+		}
+	}
+	return num;
+}
+
+/* the range of the area that covers subnet/mask, if any */
+static pwospf_area_range *get_area_range(pwospf_area *area, struct in_addr *subnet, struct in_addr *mask) {
+	node *cur;
+	for (cur = area->ranges; cur; cur = cur->next) {
+		pwospf_area_range *range = (pwospf_area_range *)cur->data;
+		if (((subnet->s_addr & range->mask.s_addr) == range->subnet.s_addr) &&
+		    ((mask->s_addr & range->mask.s_addr) == range->mask.s_addr)) {
+			return range;
+		}
+	}
+	return NULL;
+}
 
-	construct_pwospf_lsu_packet(rs, &pwospf_packet, &pwospf_packet_len);
+static pwospf_interface *get_summary(node *summaries, struct in_addr *subnet, struct in_addr *mask) {
+	node *cur;
+	for (cur = summaries; cur; cur = cur->next) {
+		pwospf_interface *pi = (pwospf_interface *)cur->data;
+		if ((pi->subnet.s_addr == subnet->s_addr) && (pi->mask.s_addr == mask->s_addr)) {
+			return pi;
+		}
+	}
+	return NULL;
+}
+
+static int summaries_equal(node *a, node *b) {
+	node *cur;
+	if (node_length(a) != node_length(b)) {
+		return 0;
+	}
+	for (cur = a; cur; cur = cur->next) {
+		pwospf_interface *pi = (pwospf_interface *)cur->data;
+		if (!get_summary(b, &(pi->subnet), &(pi->mask))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Called by the dijkstra thread with the routes it found in each area (in area_ids order),
+ * no locks held. As an ABR we summarize the intra-area routes of every area into all the
+ * others, and into a non-backbone area the backbone's inter-area routes as well, so
+ * inter-area traffic always crosses the backbone. A prefix inside one of its area's
+ * ranges goes out as the range. Areas whose summaries changed get a new LSU.
+ */
+void pwospf_update_summaries(router_state *rs, uint32_t *area_ids, node **routes, unsigned int num) {
+	unsigned int a, b;
+	int changed = 0;
+
+	lock_if_list_rd(rs);
+	lock_mutex_pwospf_router_list(rs);
+
+	for (a = 0; a < num; ++a) {
+		pwospf_area *area = get_pwospf_area(rs, area_ids[a]);
+		node *summaries = NULL;
+
+		for (b = 0; (num > 1) && (b < num); ++b) {
+			if (b == a) {
+				continue;
+			}
+
+			int relay_inter = (area_ids[b] == PWOSPF_BACKBONE_AREA) && (area_ids[a] != PWOSPF_BACKBONE_AREA);
+			pwospf_area *from = get_pwospf_area(rs, area_ids[b]);
+			node *cur;
+			for (cur = routes[b]; cur; cur = cur->next) {
+				rtable_entry *re = (rtable_entry *)cur->data;
+				struct in_addr subnet = re->ip;
+				struct in_addr mask = re->mask;
+
+				if (re->is_inter_area && !relay_inter) {
+					continue;
+				}
+
+				pwospf_area_range *range = get_area_range(from, &subnet, &mask);
+				if (range) {
+					subnet = range->subnet;
+					mask = range->mask;
+				}
+
+				if (!get_summary(summaries, &subnet, &mask)) {
+					pwospf_interface *pi = (pwospf_interface *)calloc(1, sizeof(pwospf_interface));
+					pi->subnet.s_addr = subnet.s_addr & mask.s_addr;
+					pi->mask.s_addr = mask.s_addr;
+					pi->is_summary = 1;
+
+					node *n = node_create();
+					n->data = (void *)pi;
+					if (summaries == NULL) {
+						summaries = n;
+					} else {
+						node_push_back(summaries, n);
+					}
+				}
+			}
+		}
 
-	pwospf = (pwospf_hdr *)pwospf_packet;
+		if (summaries_equal(area->summaries, summaries)) {
+			while (summaries) {
+				node_remove(&summaries, summaries);
+			}
+		} else {
+			while (area->summaries) {
+				node_remove(&(area->summaries), area->summaries);
+			}
+			area->summaries = summaries;
+			changed = 1;
+		}
+	}
+
+	if (changed) {
+		pwospf_lsu_changed(rs);
+		start_lsu_bcast_flood(rs, NULL);
+	}
 
-	broadcast_pwospf_lsu_packet((struct sr_instance *)rs->sr, pwospf, NULL);
-	free(pwospf_packet);
+	unlock_mutex_pwospf_router_list(rs);
+	unlock_if_list(rs);
 
-	/* update the last sent flood time */
-	pwospf_router *our_router = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
-	time(&(our_router->last_update));
+	if (changed) {
+		pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+	}
 }
 
 
 
 
-void construct_pwospf_lsu_packet(router_state *rs, uint8_t **pwospf_packet, unsigned int *pwospf_packet_len) {
+void construct_pwospf_lsu_packet(router_state *rs, pwospf_area *area, uint8_t **pwospf_packet, unsigned int *pwospf_packet_len) {
 
 	assert(rs);
+	assert(area);
 	assert(pwospf_packet);
 	assert(pwospf_packet_len);
 
-	pwospf_router *our_router = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
+	pwospf_router *our_router = lsdb_lookup(rs, area->area_id, rs->router_id);
 	assert(our_router);
 
 	/* build the advertisements */
 	pwospf_lsu_adv *iface_adv = 0;
 	uint32_t pwospf_num = 0;
-	construct_pwospf_lsu_adv(rs, &iface_adv, &pwospf_num);
+	construct_pwospf_lsu_adv(rs, area, &iface_adv, &pwospf_num);
 
 
 	/* allocate memory for the packet */
@@ -846,7 +1231,7 @@ void construct_pwospf_lsu_packet(router_state *rs, uint8_t **pwospf_packet, unsi
 
 
 	/* populate the fields of the packet */
-	populate_pwospf(pwospf, PWOSPF_TYPE_LINK_STATE_UPDATE, len, rs->router_id, rs->area_id);
+	populate_pwospf(pwospf, PWOSPF_TYPE_LINK_STATE_UPDATE, len, rs->router_id, area->area_id);
 	populate_pwospf_lsu(lsu, our_router->seq, pwospf_num);
 	memcpy(lsu_adv, iface_adv, pwospf_num*sizeof(pwospf_lsu_adv));
 
@@ -867,35 +1252,45 @@ void construct_pwospf_lsu_packet(router_state *rs, uint8_t **pwospf_packet, unsi
 }
 
 
-void construct_pwospf_lsu_adv(router_state *rs, pwospf_lsu_adv **lsu_adv, uint32_t *pwospf_num) {
+/*
+ * Our links in the area, then the summaries we advertise into it. Summaries are stubs with
+ * the PWOSPF_ADV_SUMMARY bit of the rx rate set, so they reach the routers of the area like
+ * any other subnet of ours.
+ */
+void construct_pwospf_lsu_adv(router_state *rs, pwospf_area *area, pwospf_lsu_adv **lsu_adv, uint32_t *pwospf_num) {
 	assert(rs);
+	assert(area);
 	assert(lsu_adv);
 	assert(pwospf_num);
 
+	node* lists[2];
 	node* cur = NULL;
 	pwospf_lsu_adv *iface_adv = 0;
 	pwospf_lsu_adv *iface_adv_walker = 0;
 	uint32_t num = 0;
+	int k;
 
-	pwospf_router* r = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
+	pwospf_router* r = lsdb_lookup(rs, area->area_id, rs->router_id);
 	assert(r);
 
-	num = node_length(r->interface_list);
+	lists[0] = r->interface_list;
+	lists[1] = area->summaries;
+	num = node_length(lists[0]) + node_length(lists[1]);
 	iface_adv = (pwospf_lsu_adv *)calloc(num, sizeof(pwospf_lsu_adv));
 	iface_adv_walker = iface_adv;
 
-	cur = r->interface_list;
-	while (cur) {
-		pwospf_interface* iface = (pwospf_interface*)cur->data;
+	for (k = 0; k < 2; ++k) {
+		for (cur = lists[k]; cur; cur = cur->next) {
+			pwospf_interface* iface = (pwospf_interface*)cur->data;
 
-		iface_adv_walker->pwospf_sub.s_addr = iface->subnet.s_addr;
-		iface_adv_walker->pwospf_mask.s_addr = iface->mask.s_addr;
-		iface_adv_walker->pwospf_rid = iface->router_id;
-		iface_adv_walker->ngrp_rx_rate = iface->rx_rate;
-		iface_adv_walker->ngrp_tx_rate = iface->tx_rate;	
+			iface_adv_walker->pwospf_sub.s_addr = iface->subnet.s_addr;
+			iface_adv_walker->pwospf_mask.s_addr = iface->mask.s_addr;
+			iface_adv_walker->pwospf_rid = iface->router_id;
+			iface_adv_walker->ngrp_rx_rate = (iface->rx_rate & PWOSPF_ADV_RATE) | (iface->is_summary ? PWOSPF_ADV_SUMMARY : 0);
+			iface_adv_walker->ngrp_tx_rate = iface->tx_rate;
 
-		cur = cur->next;
-		iface_adv_walker++;
+			iface_adv_walker++;
+		}
 	}
 
 	*lsu_adv = iface_adv;
@@ -1010,17 +1405,259 @@ void cli_pwospf_set_aid(router_state *rs, cli_request *req) {
 		return;
 	}
 
+	/* every interface moves to the area, along with the default route we advertise */
+	lock_if_list_wr(rs);
+	lock_rtable_rd(rs);
+	lock_mutex_pwospf_router_list(rs);
+
+	uint32_t old_area_id = rs->area_id;
 	rs->area_id = area_id;
-	send_to_socket(req->sockfd, "Area id has been set\n", strlen("Area id has been set\n"));
-}
+	pwospf_router *our_router = attach_pwospf_area(rs, area_id);
 
-void cli_pwospf_set_aid_help(router_state *rs, cli_request *req) {
-	char *usage = "usage: aid set [number]\n";
-	send_to_socket(req->sockfd, usage, strlen(usage));
-}
+	node *il_walker;
+	for (il_walker = rs->if_list; il_walker; il_walker = il_walker->next) {
+		pwospf_set_iface_area(rs, (iface_entry *)il_walker->data, area_id);
+	}
+	if ((old_area_id != area_id) && lsdb_lookup(rs, old_area_id, rs->router_id)) {
+		detach_pwospf_area(rs, old_area_id);
+	}
 
+	pwospf_interface *default_route = default_route_present(rs);
+	if (default_route && !is_route_present(our_router, default_route)) {
+		node *n = node_create();
+		n->data = default_route;
+		if (our_router->interface_list == NULL) {
+			our_router->interface_list = n;
+		} else {
+			node_push_back(our_router->interface_list, n);
+		}
+	} else {
+		free(default_route);
+	}
 
-void cli_pwospf_set_hello(router_state *rs, cli_request *req) {
+	pwospf_lsu_changed(rs);
+	propagate_pwospf_changes(rs, NULL);
+
+	unlock_mutex_pwospf_router_list(rs);
+	unlock_rtable(rs);
+	unlock_if_list(rs);
+
+	pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+	send_to_socket(req->sockfd, "Area id has been set\n", strlen("Area id has been set\n"));
+}
+
+/*
+ * NOT THREAD SAFE, lock the if_list for writes and the pwospf_router_list
+ * Moves an interface to another area. Its neighbors are dropped, hellos bring them back
+ * in the new area, and its links move to our entry there. We leave the old area if that
+ * was our last interface in it, unless it is the area new interfaces go to.
+ */
+void pwospf_set_iface_area(router_state *rs, iface_entry *iface, uint32_t area_id) {
+	uint32_t old_area_id = iface->area_id;
+	node *cur;
+
+	if (old_area_id == area_id) {
+		return;
+	}
+
+	while (iface->nbr_routers) {
+		node_remove(&(iface->nbr_routers), iface->nbr_routers);
+	}
+
+	pwospf_router *old_router = lsdb_lookup(rs, old_area_id, rs->router_id);
+	cur = old_router ? old_router->interface_list : NULL;
+	while (cur) {
+		node *next = cur->next;
+		pwospf_interface *pi = (pwospf_interface *)cur->data;
+		if ((pi->subnet.s_addr == (iface->ip & iface->mask)) && (pi->mask.s_addr == iface->mask)) {
+			node_remove(&(old_router->interface_list), cur);
+		}
+		cur = next;
+	}
+	iface->area_id = area_id;
+
+	pwospf_router *our_router = attach_pwospf_area(rs, area_id);
+	if (iface->is_active) {
+		pwospf_interface *pi = (pwospf_interface *)calloc(1, sizeof(pwospf_interface));
+		pi->subnet.s_addr = iface->ip & iface->mask;
+		pi->mask.s_addr = iface->mask;
+		pi->router_id = 0;
+
+		node *n = node_create();
+		n->data = (void *)pi;
+		if (our_router->interface_list == NULL) {
+			our_router->interface_list = n;
+		} else {
+			node_push_back(our_router->interface_list, n);
+		}
+	}
+
+	if (old_router && (old_area_id != rs->area_id)) {
+		for (cur = rs->if_list; cur; cur = cur->next) {
+			if (((iface_entry *)cur->data)->area_id == old_area_id) {
+				break;
+			}
+		}
+		if (!cur) {
+			detach_pwospf_area(rs, old_area_id);
+		}
+	}
+
+	pwospf_lsu_changed(rs);
+}
+
+void cli_pwospf_set_iface_area(router_state *rs, cli_request *req) {
+	char name[IF_LEN];
+	uint32_t area_id = 0;
+
+	if (sscanf(req->command, "set iface area %31s %u", name, &area_id) != 2) {
+		send_to_socket(req->sockfd, "Failure reading arguments.\n", strlen("Failure reading arguments.\n"));
+		return;
+	}
+
+	lock_if_list_wr(rs);
+	iface_entry *iface = get_iface(rs, name);
+	if (!iface) {
+		unlock_if_list(rs);
+		send_to_socket(req->sockfd, "Interface not found.\n", strlen("Interface not found.\n"));
+		return;
+	}
+
+	lock_mutex_pwospf_router_list(rs);
+	pwospf_set_iface_area(rs, iface, area_id);
+	propagate_pwospf_changes(rs, NULL);
+	unlock_mutex_pwospf_router_list(rs);
+	unlock_if_list(rs);
+
+	pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+
+	char* msg = "Interface area set.\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_pwospf_area_range(router_state *rs, cli_request *req) {
+	char op[8];
+	char subnet_str[16];
+	char mask_str[16];
+	uint32_t area_id;
+	struct in_addr subnet, mask;
+	char* msg = NULL;
+
+	if ((sscanf(req->command, "area range %7s %u %15s %15s", op, &area_id, subnet_str, mask_str) != 4) ||
+			(inet_pton(AF_INET, subnet_str, &subnet) != 1) || (inet_pton(AF_INET, mask_str, &mask) != 1)) {
+		send_to_socket(req->sockfd, "Failure reading arguments.\n", strlen("Failure reading arguments.\n"));
+		return;
+	}
+	subnet.s_addr &= mask.s_addr;
+
+	lock_mutex_pwospf_router_list(rs);
+	pwospf_area *area = get_pwospf_area(rs, area_id);
+	node *cur;
+	for (cur = area->ranges; cur; cur = cur->next) {
+		pwospf_area_range *range = (pwospf_area_range *)cur->data;
+		if ((range->subnet.s_addr == subnet.s_addr) && (range->mask.s_addr == mask.s_addr)) {
+			break;
+		}
+	}
+
+	if (strcmp("add", op) == 0) {
+		if (!cur) {
+			pwospf_area_range *range = (pwospf_area_range *)calloc(1, sizeof(pwospf_area_range));
+			range->subnet = subnet;
+			range->mask = mask;
+
+			node *n = node_create();
+			n->data = (void *)range;
+			if (area->ranges == NULL) {
+				area->ranges = n;
+			} else {
+				node_push_back(area->ranges, n);
+			}
+		}
+		msg = "Area range added.\n";
+	} else if (strcmp("del", op) == 0) {
+		if (cur) {
+			node_remove(&(area->ranges), cur);
+			msg = "Area range deleted.\n";
+		} else {
+			msg = "Area range not found.\n";
+		}
+	} else {
+		msg = "Failure reading arguments.\n";
+	}
+	unlock_mutex_pwospf_router_list(rs);
+
+	/* summaries are worked out after spf */
+	dijkstra_trigger(rs);
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_show_pwospf_area(router_state *rs, cli_request *req) {
+	char line[256];
+	char subnet_str[16];
+	char mask_str[16];
+	node *area_walker;
+	node *cur;
+
+	lock_if_list_rd(rs);
+	lock_mutex_pwospf_router_list(rs);
+
+	int is_abr = (pwospf_num_areas(rs) > 1);
+	for (area_walker = rs->pwospf_areas; area_walker; area_walker = area_walker->next) {
+		pwospf_area *area = (pwospf_area *)area_walker->data;
+		int attached = (lsdb_lookup(rs, area->area_id, rs->router_id) != NULL);
+		unsigned int num_routers = 0;
+
+		for (cur = rs->pwospf_router_list; cur; cur = cur->next) {
+			if (((pwospf_router *)cur->data)->area_id == area->area_id) {
+				++num_routers;
+			}
+		}
+
+		snprintf(line, 256, "Area %u%s%s\n  Routers: %u  SPF Settled: %u  LSU Floods: %u  LSU Encodes: %u\n  Interfaces:",
+			area->area_id, (area->area_id == PWOSPF_BACKBONE_AREA) ? " (backbone)" : "",
+			!attached ? " (not attached)" : (is_abr ? " (ABR)" : ""),
+			num_routers, area->spf_settled, area->lsu_cache.floods, area->lsu_cache.encodes);
+		send_to_socket(req->sockfd, line, strlen(line));
+
+		for (cur = rs->if_list; cur; cur = cur->next) {
+			iface_entry *ie = (iface_entry *)cur->data;
+			if (ie->area_id == area->area_id) {
+				snprintf(line, 256, " %s", ie->name);
+				send_to_socket(req->sockfd, line, strlen(line));
+			}
+		}
+
+		snprintf(line, 256, "\n  Summaries: %u\n", node_length(area->summaries));
+		send_to_socket(req->sockfd, line, strlen(line));
+		for (cur = area->summaries; cur; cur = cur->next) {
+			pwospf_interface *pi = (pwospf_interface *)cur->data;
+			snprintf(line, 256, "    %-16s%-16s\n", inet_ntop(AF_INET, &(pi->subnet), subnet_str, 16),
+				inet_ntop(AF_INET, &(pi->mask), mask_str, 16));
+			send_to_socket(req->sockfd, line, strlen(line));
+		}
+
+		snprintf(line, 256, "  Ranges: %u\n", node_length(area->ranges));
+		send_to_socket(req->sockfd, line, strlen(line));
+		for (cur = area->ranges; cur; cur = cur->next) {
+			pwospf_area_range *range = (pwospf_area_range *)cur->data;
+			snprintf(line, 256, "    %-16s%-16s\n", inet_ntop(AF_INET, &(range->subnet), subnet_str, 16),
+				inet_ntop(AF_INET, &(range->mask), mask_str, 16));
+			send_to_socket(req->sockfd, line, strlen(line));
+		}
+	}
+
+	unlock_mutex_pwospf_router_list(rs);
+	unlock_if_list(rs);
+}
+
+void cli_pwospf_set_aid_help(router_state *rs, cli_request *req) {
+	char *usage = "usage: set aid [number]\n\tmoves every interface to the area\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+}
+
+
+void cli_pwospf_set_hello(router_state *rs, cli_request *req) {
 
 	uint32_t hello_interval = 0;
 	if(sscanf(req->command, "set hello interval %u", &hello_interval) != 1) {
@@ -1064,6 +1701,192 @@ void cli_pwospf_set_lsu_interval(router_state *rs, cli_request *req) {
 	send_to_socket(req->sockfd, msg, strlen(msg));
 }
 
+void cli_pwospf_set_spf_throttle(router_state *rs, cli_request *req) {
+	uint32_t start, hold, max_wait;
+	if ((sscanf(req->command, "set spf throttle %u %u %u", &start, &hold, &max_wait) != 3) || (hold > max_wait)) {
+		send_to_socket(req->sockfd, "Failure reading arguments.\n", strlen("Failure reading arguments.\n"));
+		return;
+	}
+
+	pthread_mutex_lock(rs->dijkstra_mutex);
+	rs->spf_start_ms = start;
+	rs->spf_hold_ms = hold;
+	rs->spf_max_wait_ms = max_wait;
+	rs->spf_cur_hold_ms = hold;
+	pthread_mutex_unlock(rs->dijkstra_mutex);
+
+	char* msg = "SPF throttle set.\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_pwospf_set_liveness(router_state *rs, cli_request *req) {
+	uint32_t interval, multiplier = PWOSPF_LIVENESS_MULTIPLIER;
+	node *il_cur, *cur;
+
+	if ((sscanf(req->command, "set liveness %u %u", &interval, &multiplier) < 1) ||
+			(interval > 0xFFFF) || (multiplier == 0) || (multiplier > 0xFF)) {
+		send_to_socket(req->sockfd, "Failure reading arguments.\n", strlen("Failure reading arguments.\n"));
+		return;
+	}
+
+	/* restart every session, their detect times are from before */
+	lock_if_list_wr(rs);
+	rs->pwospf_liveness_interval = interval;
+	rs->pwospf_liveness_multiplier = multiplier;
+	for (il_cur = rs->if_list; il_cur; il_cur = il_cur->next) {
+		for (cur = ((iface_entry *)il_cur->data)->nbr_routers; cur; cur = cur->next) {
+			((nbr_router *)cur->data)->liveness_detect = 0;
+		}
+	}
+	unlock_if_list(rs);
+
+	char* msg = interval ? "Liveness set.\n" : "Liveness off.\n";
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_pwospf_set_metric(router_state *rs, cli_request *req) {
+	char mode[16];
+	uint32_t min_change = PWOSPF_LOAD_MIN_CHANGE;
+	char* msg;
+
+	if (sscanf(req->command, "set metric %15s %u", mode, &min_change) < 1) {
+		send_to_socket(req->sockfd, "Failure reading arguments.\n", strlen("Failure reading arguments.\n"));
+		return;
+	}
+
+	lock_mutex_pwospf_router_list(rs);
+	if (strcmp("rate", mode) == 0) {
+		rs->pwospf_metric = PWOSPF_METRIC_RATE;
+		msg = "Metric set to measured rate.\n";
+	} else if ((strcmp("load", mode) == 0) && (min_change > 0)) {
+		rs->pwospf_metric = PWOSPF_METRIC_LOAD;
+		rs->pwospf_load_min_change = min_change;
+		msg = "Metric set to load.\n";
+
+		/* let the next sample advertise a cost straight away */
+		node* area_walker;
+		node* cur;
+		for (area_walker = rs->pwospf_areas; area_walker; area_walker = area_walker->next) {
+			pwospf_router* our_router = lsdb_lookup(rs, ((pwospf_area*)area_walker->data)->area_id, rs->router_id);
+			for (cur = our_router ? our_router->interface_list : NULL; cur; cur = cur->next) {
+				pwospf_interface* iface = (pwospf_interface*)cur->data;
+				iface->tx_rate = 0;
+				iface->load_changed = 0;
+			}
+		}
+		pwospf_lsu_changed(rs);
+	} else {
+		msg = "Failure reading arguments.\n";
+	}
+	unlock_mutex_pwospf_router_list(rs);
+
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+/* Returns: 1 if a measured rate is off the advertised one by PWOSPF_RATE_MIN_CHANGE percent */
+static int pwospf_rate_moved(uint32_t advertised, uint32_t measured) {
+	uint64_t delta = (measured > advertised) ? (measured - advertised) : (advertised - measured);
+	uint64_t larger = (measured > advertised) ? measured : advertised;
+	return ((delta * 100) >= (larger * PWOSPF_RATE_MIN_CHANGE)) && (delta > 0);
+}
+
+/*
+ * Takes the measured rates of our ports, indexed by port, into our own LSUs. SPF uses
+ * the advertised tx rate as the link cost. In rate mode that is the measured byte rate,
+ * as NGRP has always done. The samples come every 500ms and jitter, so the rates we
+ * advertise only move when one is off by PWOSPF_RATE_MIN_CHANGE percent and the last
+ * move has held for PWOSPF_LOAD_HOLD_DOWN. Otherwise every sample would make the next
+ * flood encode our LSU again.
+ *
+ * In load mode it is 1 + the utilization of the port against its speed scaled to
+ * PWOSPF_LOAD_LEVELS - 1. The utilization is an exponentially weighted average, and the
+ * cost only moves when it is off by pwospf_load_min_change levels and has held for
+ * PWOSPF_LOAD_HOLD_DOWN, so two paths under similar load don't flip back and forth. A
+ * moved cost is flooded and SPF is triggered right away instead of waiting out the
+ * LSU interval.
+ */
+void pwospf_update_link_metrics(router_state *rs, uint32_t *rx_rates, uint32_t *tx_rates, unsigned int num) {
+	int changed = 0;
+	time_t now;
+	node* area_walker;
+	node* cur;
+
+	time(&now);
+
+	lock_if_list_rd(rs);
+	lock_mutex_pwospf_router_list(rs);
+
+	for (area_walker = rs->pwospf_areas; area_walker; area_walker = area_walker->next) {
+		pwospf_router* our_router = lsdb_lookup(rs, ((pwospf_area*)area_walker->data)->area_id, rs->router_id);
+
+		for (cur = our_router ? our_router->interface_list : NULL; cur; cur = cur->next) {
+			pwospf_interface* iface = (pwospf_interface*)cur->data;
+
+			/* find the port the link is on, the default route has none */
+			iface_entry* ie = NULL;
+			node* if_walker;
+			for (if_walker = rs->if_list; if_walker; if_walker = if_walker->next) {
+				ie = (iface_entry*)if_walker->data;
+				if (((ie->ip & ie->mask) == iface->subnet.s_addr) && (ie->mask == iface->mask.s_addr) && (ie->area_id == our_router->area_id)) {
+					break;
+				}
+				ie = NULL;
+			}
+			int j = ie ? atable_port_of(ie->name) : -1;
+			if ((j < 0) || (j >= num)) {
+				continue;
+			}
+
+			/* the rx rate is advertised in both modes, the tx rate is the cost in rate mode */
+			int rate_mode = (rs->pwospf_metric == PWOSPF_METRIC_RATE);
+			if ((pwospf_rate_moved(iface->rx_rate, rx_rates[j]) || (rate_mode && pwospf_rate_moved(iface->tx_rate, tx_rates[j])))
+				&& (difftime(now, iface->rate_changed) >= PWOSPF_LOAD_HOLD_DOWN)) {
+				/* the top bit of the advertised rx rate is PWOSPF_ADV_SUMMARY */
+				iface->rx_rate = (rx_rates[j] > PWOSPF_ADV_RATE) ? PWOSPF_ADV_RATE : rx_rates[j];
+				if (rate_mode) {
+					iface->tx_rate = tx_rates[j];
+				}
+				iface->rate_changed = now;
+				pwospf_lsu_changed(rs);
+			}
+
+			if (rate_mode) {
+				continue;
+			}
+
+			uint32_t speed = (ie->speed > 0) ? ie->speed : PWOSPF_DEFAULT_SPEED;
+			double utilization = ((double)tx_rates[j] * 8) / ((double)speed * 1000000);
+			if (utilization > 1) {
+				utilization = 1;
+			}
+			iface->load += (utilization - iface->load) * PWOSPF_LOAD_DAMPING;
+
+			uint32_t cost = 1 + (uint32_t)((iface->load * (PWOSPF_LOAD_LEVELS - 1)) + 0.5);
+			uint32_t delta = (cost > iface->tx_rate) ? (cost - iface->tx_rate) : (iface->tx_rate - cost);
+			if ((iface->tx_rate == 0) ||
+				((delta >= rs->pwospf_load_min_change) && (difftime(now, iface->load_changed) >= PWOSPF_LOAD_HOLD_DOWN))) {
+				if (cost != iface->tx_rate) {
+					iface->tx_rate = cost;
+					iface->load_changed = now;
+					pwospf_lsu_changed(rs);
+					changed = 1;
+				}
+			}
+		}
+	}
+
+	if (changed) {
+		start_lsu_bcast_flood(rs, NULL);
+	}
+
+	unlock_mutex_pwospf_router_list(rs);
+	unlock_if_list(rs);
+
+	if (changed) {
+		dijkstra_trigger(rs);
+	}
+}
+
 void cli_pwospf_help(router_state *rs, cli_request *req) {
 	char *usage = 0;
 
@@ -1076,9 +1899,18 @@ void cli_pwospf_help(router_state *rs, cli_request *req) {
 	usage = "\tshow pwospf router\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
+	usage = "\tshow pwospf area\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
 	usage = "\tset aid [value]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
+	usage = "\tset iface area [interface] [value]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tarea range [add del] [area] [subnet] [mask]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
 	usage = "\tset hello interval [value]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
@@ -1088,6 +1920,15 @@ void cli_pwospf_help(router_state *rs, cli_request *req) {
 	usage = "\tset lsu interval [value]\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
+	usage = "\tset spf throttle [start ms] [hold ms] [max wait ms]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tset metric [rate load] [min change]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
+	usage = "\tset liveness [interval ms] [multiplier]\n";
+	send_to_socket(req->sockfd, usage, strlen(usage));
+
 	usage = "\tsend hello\n";
 	send_to_socket(req->sockfd, usage, strlen(usage));
 
@@ -1105,8 +1946,30 @@ void cli_show_pwospf_info(router_state *rs, cli_request *req) {
 	char buf[512];
 	bzero(buf, 512);
 
-	sprintf(buf, "Area ID: %u\nHello Interval: %u\nLSU Interval: %u\n\n",
-		rs->area_id, rs->pwospf_hello_interval, rs->pwospf_lsu_interval);
+	sprintf(buf, "Area ID: %u\nHello Interval: %u\nLSU Interval: %u\nMetric: %s\n"
+		"Liveness: %u ms x %u\nLiveness Downs: %u\n",
+		rs->area_id, rs->pwospf_hello_interval, rs->pwospf_lsu_interval,
+		(rs->pwospf_metric == PWOSPF_METRIC_LOAD) ? "load" : "rate",
+		rs->pwospf_liveness_interval, rs->pwospf_liveness_multiplier, rs->pwospf_liveness_downs);
+	send_to_socket(req->sockfd, buf, strlen(buf));
+
+	pthread_mutex_lock(rs->dijkstra_mutex);
+	snprintf(buf, 512, "SPF Throttle: start %u ms, hold %u ms, max wait %u ms (current hold %u ms)\n"
+		"SPF Runs: %u\nSPF Coalesced Triggers: %u\nSPF Last Run: %u.%03u ms\n",
+		rs->spf_start_ms, rs->spf_hold_ms, rs->spf_max_wait_ms, rs->spf_cur_hold_ms,
+		rs->spf_runs, rs->spf_coalesced, rs->spf_last_run_us / 1000, rs->spf_last_run_us % 1000);
+	pthread_mutex_unlock(rs->dijkstra_mutex);
+	send_to_socket(req->sockfd, buf, strlen(buf));
+
+	uint32_t floods = 0, encodes = 0;
+	node *area_walker;
+	lock_mutex_pwospf_router_list(rs);
+	for (area_walker = rs->pwospf_areas; area_walker; area_walker = area_walker->next) {
+		floods += ((pwospf_area *)area_walker->data)->lsu_cache.floods;
+		encodes += ((pwospf_area *)area_walker->data)->lsu_cache.encodes;
+	}
+	snprintf(buf, 512, "Areas: %u\nLSU Floods: %u\nLSU Encodes: %u\n\n", pwospf_num_areas(rs), floods, encodes);
+	unlock_mutex_pwospf_router_list(rs);
 	send_to_socket(req->sockfd, buf, strlen(buf));
 
 	lock_mutex_pwospf_router_list(rs);
@@ -1130,133 +1993,241 @@ void cli_show_pwospf_info(router_state *rs, cli_request *req) {
 }
 
 
-void *pwospf_hello_thread(void *param) {
+/*
+ * Timer callback, sends our hellos and re-arms against the current hello interval
+ */
+void pwospf_hello_timer(router_state *rs, uint32_t key, uint32_t id) {
 
-	assert(param);
-	struct sr_instance *sr = (struct sr_instance *)param;
-	router_state *rs = get_router_state(sr);
+	lock_if_list_wr(rs);
+	broadcast_pwospf_hello_packet(rs->sr);
+	unlock_if_list(rs);
 
-	while(1) {
+	uint32_t delay = (rs->pwospf_hello_interval > 1) ? (rs->pwospf_hello_interval - 1) : 1;
+	timer_add(rs, delay * 1000, 0, pwospf_hello_timer, 0);
+}
 
-		lock_if_list_wr(rs);
-		broadcast_pwospf_hello_packet(sr);
-		unlock_if_list(rs);
 
-		sleep(rs->pwospf_hello_interval-1);
+/*
+ * Timer callback, floods our lsu once lsu interval has passed since our last update
+ */
+void pwospf_lsu_timer(router_state *rs, uint32_t key, uint32_t id) {
+
+	time_t now;
+	int diff;
+	int flood = 0;
+	uint32_t delay = 1;
+
+	lock_mutex_pwospf_router_list(rs);
+
+	/* all our areas are flooded together, go by the one that went longest */
+	pwospf_router *our_router = NULL;
+	node *area_walker;
+	for (area_walker = rs->pwospf_areas; area_walker; area_walker = area_walker->next) {
+		pwospf_router *r = lsdb_lookup(rs, ((pwospf_area *)area_walker->data)->area_id, rs->router_id);
+		if (r && (!our_router || (r->last_update < our_router->last_update))) {
+			our_router = r;
+		}
 	}
+
+	if (our_router) {
+		time(&now);
+		diff = (int)difftime(now, our_router->last_update);
+
+		/* send an lsu update if we haven't done so */
+		if (diff > (rs->pwospf_lsu_interval)) {
+			printf("or_pwospf.c: pwospf_lsu_timer fires at time %d and diff = %d\n", now, diff);
+			start_lsu_bcast_flood(rs, NULL);
+			flood = 1;
+			delay = rs->pwospf_lsu_interval + 1;
+		} else {
+			/* something else updated us since, wait out the rest of the interval */
+			delay = rs->pwospf_lsu_interval + 1 - diff;
+		}
+	}
+	unlock_mutex_pwospf_router_list(rs);
+
+	/* signal the lsu bcast thread to send the packets */
+	if (flood) {
+		pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+	}
+
+	timer_add(rs, delay * 1000, 0, pwospf_lsu_timer, 0);
 }
 
 
-void *pwospf_lsu_thread(void *param) {
+/*
+ * Timer callback, sends our liveness packets and takes down any neighbor that has been
+ * silent for its detect time. Its routes and alphas are pulled right here so traffic
+ * moves to the paths left, before the flood and SPF have caught up.
+ */
+void pwospf_liveness_timer(router_state *rs, uint32_t key, uint32_t id) {
 
-	assert(param);
-	struct sr_instance *sr = (struct sr_instance *)param;
-	router_state *rs = get_router_state(sr);
+	uint32_t interval = rs->pwospf_liveness_interval;
+	uint64_t now;
+	int down = 0;
+	node *il_cur;
 
-	time_t now;
-	int diff;
+	if (interval == 0) {
+		timer_add(rs, PWOSPF_LIVENESS_IDLE, 0, pwospf_liveness_timer, 0);
+		return;
+	}
 
-	sleep(5);
-	while(1) {
+	lock_if_list_wr(rs);
+	broadcast_pwospf_liveness_packet(rs->sr);
+
+	now = timer_now_ms();
+	for (il_cur = rs->if_list; il_cur && !down; il_cur = il_cur->next) {
+		node *cur;
+		for (cur = ((iface_entry *)il_cur->data)->nbr_routers; cur; cur = cur->next) {
+			nbr_router *nbr = (nbr_router *)cur->data;
+			if (nbr->liveness_detect && ((now - nbr->last_rcvd_liveness) > nbr->liveness_detect)) {
+				down = 1;
+				break;
+			}
+		}
+	}
 
+	if (down) {
+		lock_rtable_wr(rs);
+		lock_atable_wr(rs);
 		lock_mutex_pwospf_router_list(rs);
-		pwospf_router *our_router = get_router_by_rid(rs->router_id, rs->pwospf_router_list);
-		unlock_mutex_pwospf_router_list(rs);
-		time(&now);
-		if (our_router) {
-			diff = (int)difftime(now, our_router->last_update);
-
-			/* send an lsu update if we haven't done so */
-			if(diff > (rs->pwospf_lsu_interval)) {
-				printf("or_pwospf.c: pwospf_lsu_thread wakes up at time %d and diff = %d\n", now, diff);
-				lock_mutex_pwospf_router_list(rs);
-				start_lsu_bcast_flood(rs, NULL);
-				unlock_mutex_pwospf_router_list(rs);
-
-				/* signal the lsu bcast thread to send the packets */
-				pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+
+		for (il_cur = rs->if_list; il_cur; il_cur = il_cur->next) {
+			iface_entry *ie = (iface_entry *)il_cur->data;
+			node *cur = ie->nbr_routers;
+			while (cur) {
+				node *next = cur->next;
+				nbr_router *nbr = (nbr_router *)cur->data;
+				if (nbr->liveness_detect && ((now - nbr->last_rcvd_liveness) > nbr->liveness_detect)) {
+					/* alphas first, so the routes move to a next hop that is still up */
+					atable_drop_next_hop(rs, atable_port_of(ie->name), &(nbr->ip));
+					deactivate_routes_via(rs, ie->name, &(nbr->ip));
+					remove_pwospf_neighbor(rs, ie, cur);
+					rs->pwospf_liveness_downs++;
+				}
+				cur = next;
 			}
 		}
 
-		/* poll every 1 second */
-		sleep(1);
+		/* flood it and run spf */
+		propagate_pwospf_changes(rs, NULL);
+
+		unlock_mutex_pwospf_router_list(rs);
+		unlock_atable(rs);
+		unlock_rtable(rs);
+	}
+
+	unlock_if_list(rs);
+
+	if (down) {
+		pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
 	}
 
+	timer_add(rs, interval, 0, pwospf_liveness_timer, 0);
 }
 
-void *pwospf_lsu_timeout_thread(void *param) {
 
-	assert(param);
-	struct sr_instance *sr = (struct sr_instance *)param;
-	router_state *rs = get_router_state(sr);
+/*
+ * Timer callback, key is the router id of a neighbor on one of our interfaces
+ */
+void pwospf_nbr_timer(router_state *rs, uint32_t key, uint32_t id) {
+
 	time_t now;
-	int diff;
 	int timeout_occured = 0;
 
-	while(1) {
-		timeout_occured = 0;
-		lock_mutex_pwospf_router_list(rs);
-
-		node *rl_cur = rs->pwospf_router_list;
-		node *rl_next = NULL;
+	lock_if_list_wr(rs);
+	/* have to lock the router list because we update our pwospf router from inside */
+	lock_mutex_pwospf_router_list(rs);
 
-		/* eliminate lsu timedout entries */
-		while(rl_cur) {
-			rl_next = rl_cur->next;
+	node *il_cur = rs->if_list;
+	while (il_cur) {
+		iface_entry *ie = (iface_entry *)il_cur->data;
 
-			pwospf_router *rl_entry = (pwospf_router *)rl_cur->data;
-			/* don't time out ourself */
-			if (rl_entry->router_id == rs->router_id) {
-				rl_cur = rl_next;
-				continue;
+		node *cur = ie->nbr_routers;
+		while (cur) {
+			nbr_router *nbr = (nbr_router *)cur->data;
+			if ((nbr->router_id == key) && (nbr->timer_id == id)) {
+				break;
 			}
+			cur = cur->next;
+		}
 
+		if (cur) {
+			nbr_router *nbr = (nbr_router *)cur->data;
 			time(&now);
-			diff = (int)difftime(now, rl_entry->last_update);
-
-			/* if(diff > 3 * LSUINT) */
-			if (diff > (rs->pwospf_lsu_interval * 3)) {
-				char addr[16];
-				inet_ntop(AF_INET, &(rl_entry->router_id), addr, 16);
-				//printf("PWOSPF ROUTER LENGTH: %u\n", node_length(rs->pwospf_router_list));
-				//printf("Timing out router with id: %s\n", addr);
-				node *il_cur = rl_entry->interface_list;
-				node *il_next = NULL;
-
-				while(il_cur) {
-					il_next = il_cur->next;
-					node_remove(&rl_entry->interface_list, il_cur);
-					il_cur = il_next;
-				}
-
-				node_remove(&rs->pwospf_router_list, rl_cur);
-				timeout_occured = 1;
+			double remaining = difftime(nbr->last_rcvd_hello + (3 * rs->pwospf_hello_interval), now);
+			if (remaining < 0) {
+				timeout_occured = determine_timedout_interface(rs, ie);
+			} else {
+				/* heard from since we were armed */
+				nbr->timer_id = timer_add(rs, (uint32_t)(remaining + 1) * 1000, 0, pwospf_nbr_timer, key);
 			}
-
-			rl_cur = rl_next;
+			break;
 		}
 
+		il_cur = il_cur->next;
+	}
 
-		/* build lsu flood information for all our neighbors */
-		if(timeout_occured == 1) {
-			//printf("PWOSPF ROUTER LENGTH: %u\n", node_length(rs->pwospf_router_list));
-			propagate_pwospf_changes(rs, NULL);
-		}
+	/* flood with lsu updates */
+	if (timeout_occured == 1) {
+		propagate_pwospf_changes(rs, NULL);
+	}
 
+	unlock_mutex_pwospf_router_list(rs);
+	unlock_if_list(rs);
 
-		unlock_mutex_pwospf_router_list(rs);
+	/* send it to every neighbor */
+	if (timeout_occured == 1) {
+		pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+	}
+}
+
+
+/*
+ * Timer callback, key is the router id of a router in the pwospf router list, the id
+ * tells which of its areas
+ */
+void pwospf_router_timer(router_state *rs, uint32_t key, uint32_t id) {
 
+	time_t now;
+	int timeout_occured = 0;
+	pwospf_router *rl_entry = NULL;
+	node *area_walker;
 
-		/* signal thread to send the lsu flood */
-		if(timeout_occured == 1) {
-			pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+	lock_mutex_pwospf_router_list(rs);
+
+	for (area_walker = rs->pwospf_areas; area_walker && !rl_entry; area_walker = area_walker->next) {
+		rl_entry = lsdb_lookup(rs, ((pwospf_area *)area_walker->data)->area_id, key);
+		if (rl_entry && (rl_entry->timer_id != id)) {
+			rl_entry = NULL;
 		}
+	}
 
+	/* the router may be gone, or been timed out and learnt again since */
+	if (rl_entry && (rl_entry->timer_id == id)) {
 
-		sleep(1);
+		time(&now);
+		double remaining = difftime(rl_entry->last_update + (rs->pwospf_lsu_interval * 3), now);
+		if (remaining < 0) {
+			lsdb_remove(rs, rl_entry->area_id, key);
+			timeout_occured = 1;
+		} else {
+			/* an lsu arrived since we were armed */
+			rl_entry->timer_id = timer_add(rs, (uint32_t)(remaining + 1) * 1000, 0, pwospf_router_timer, key);
+		}
 	}
 
+	/* build lsu flood information for all our neighbors */
+	if (timeout_occured == 1) {
+		propagate_pwospf_changes(rs, NULL);
+	}
 
+	unlock_mutex_pwospf_router_list(rs);
+
+	/* signal thread to send the lsu flood */
+	if (timeout_occured == 1) {
+		pthread_cond_signal(rs->pwospf_lsu_bcast_cond);
+	}
 }
 
 
@@ -1353,7 +2324,7 @@ void cli_pwospf_send_lsu(router_state *rs, cli_request *req) {
 
 void lock_mutex_pwospf_router_list(router_state* rs) {
 	assert(rs);
-	if(pthread_mutex_lock(rs->pwospf_router_list_lock) != 0) {
+	if(lockprof_mutex_lock(rs->pwospf_router_list_lock, LOCK_PWOSPF_ROUTER_LIST, LOCKPROF_SITE) != 0) {
 		perror("Failure getting router list mutex lock");
 	}
 }
@@ -1361,6 +2332,7 @@ void lock_mutex_pwospf_router_list(router_state* rs) {
 
 void unlock_mutex_pwospf_router_list(router_state* rs) {
 	assert(rs);
+	lockprof_release(LOCK_PWOSPF_ROUTER_LIST);
 	if(pthread_mutex_unlock(rs->pwospf_router_list_lock) != 0) {
 		perror("Failure unlocking router list mutex");
 	}
@@ -1369,13 +2341,14 @@ void unlock_mutex_pwospf_router_list(router_state* rs) {
 
 void lock_mutex_pwospf_lsu_queue(router_state *rs) {
 	assert(rs);
-	if(pthread_mutex_lock(rs->pwospf_lsu_queue_lock) != 0) {
+	if(lockprof_mutex_lock(rs->pwospf_lsu_queue_lock, LOCK_PWOSPF_LSU_QUEUE, LOCKPROF_SITE) != 0) {
 		perror("Failure unlocking lsu queue mutex");
 	}
 }
 
 void unlock_mutex_pwospf_lsu_queue(router_state *rs){
 	assert(rs);
+	lockprof_release(LOCK_PWOSPF_LSU_QUEUE);
 	if(pthread_mutex_unlock(rs->pwospf_lsu_queue_lock) != 0) {
 		perror("Failure unlocking lsu queue mutex");
 	}
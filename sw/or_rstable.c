@@ -14,6 +14,7 @@
 #include "or_rstable.h"
 #include "or_data_types.h"
 #include "or_utils.h"
+#include "or_lockprof.h"
 
 /* !! NOT THREAD SAFE !!
  * LOCK RS FOR READING BEFORE CALLING THE FUNCTION
@@ -262,31 +263,15 @@ int reset_rstable_entry(node* n) {
 	
 }
 
-/* THREAD ITSELF */
-void* rstable_thread(void* arg) {
+/* Timer callback, refreshes the rates every 500ms */
+void rstable_timer(router_state* rs, uint32_t key, uint32_t id) {
 
-	router_state* rs = (router_state*)arg;
-	
-	//struct timeval now;
-	
-	while (1) {
-	
-		//gettimeofday(&now, NULL);
-	
-		//printf("or_rstable.c: rstable_thread called at %d\n", now);
-	
-		lock_rstable_wr(rs);
-				
-		compute_rstable(rs);
-		sprint_rstable(rs);
-		
-		unlock_rstable(rs);
-		
-		usleep(500000);
-		
-	}
+	lock_rstable_wr(rs);
+			
+	compute_rstable(rs);
+	sprint_rstable(rs);
 	
-	return NULL;
+	unlock_rstable(rs);
 
 }
 
@@ -402,7 +387,7 @@ int sprint_rstable(router_state* rs) {
 void lock_rstable_rd(router_state *rs) {
 	assert(rs);
 
-	if(pthread_rwlock_rdlock(rs->rstable_lock) != 0) {
+	if(lockprof_rdlock(rs->rstable_lock, LOCK_RSTABLE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting rstable read lock");
 	}
 }
@@ -410,7 +395,7 @@ void lock_rstable_rd(router_state *rs) {
 void lock_rstable_wr(router_state *rs) {
 	assert(rs);
 
-	if(pthread_rwlock_wrlock(rs->rstable_lock) != 0) {
+	if(lockprof_wrlock(rs->rstable_lock, LOCK_RSTABLE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting rstable write lock");
 	}
 }
@@ -418,6 +403,7 @@ void lock_rstable_wr(router_state *rs) {
 void unlock_rstable(router_state *rs) {
 	assert(rs);
 
+	lockprof_release(LOCK_RSTABLE);
 	if(pthread_rwlock_unlock(rs->rstable_lock) != 0) {
 		perror("Failure unlocking rstable lock");
 	}
@@ -20,7 +20,7 @@ int update_flow_only(unsigned int length, node* n);
 int update_rstable_entry(struct in_addr* destination, struct in_addr* mask, double rate, unsigned int flow, unsigned int last_flow, struct timeval* now, node* n);
 int reset_rstable_entry(node* n);
 
-void* rstable_thread(void* arg);
+void rstable_timer(router_state* rs, uint32_t key, uint32_t id);
 
 int compute_rstable(router_state* rs);
 int delete_rstable(router_state* rs);
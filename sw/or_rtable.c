@@ -16,6 +16,9 @@
 #include "or_output.h"
 #include "or_utils.h"
 #include "or_netfpga.h"
+#include "or_fib.h"
+#include "or_atable.h"
+#include "or_lockprof.h"
 #include "nf2/nf2util.h"
 #include "reg_defines.h"
 
@@ -169,6 +172,77 @@ int deactivate_routes(router_state* rs, char* interface) {
 	return 0;
 }
 
+/*
+ * NOT THREAD SAFE: lock rtable write and atable write
+ * For a neighbor gone down: static routes through gw on interface are deactivated, dynamic
+ * ones move to the best next hop the atable has left for them, or are removed.
+ * Returns: number of routes changed
+ */
+int deactivate_routes_via(router_state* rs, char* interface, struct in_addr* gw) {
+	node *cur = NULL;
+	node *next = NULL;
+	rtable_entry* entry = NULL;
+	struct in_addr next_hop;
+	int changed = 0;
+	int port;
+
+	cur = rs->rtable;
+	while (cur) {
+		next = cur->next;
+		entry = (rtable_entry*)cur->data;
+		if ((entry->gw.s_addr == gw->s_addr) && (strncmp(entry->iface, interface, 32) == 0)) {
+			if (entry->is_static) {
+				entry->is_active = 0;
+			} else if ((port = atable_best_port(&(entry->ip), &(entry->mask), &next_hop, rs)) >= 0) {
+				entry->gw = next_hop;
+				snprintf(entry->iface, 32, "eth%d", port);
+			} else {
+				node_remove(&(rs->rtable), cur);
+			}
+			++changed;
+		}
+
+		cur = next;
+	}
+
+	/* write new rtable out to hardware */
+	if (changed) {
+		trigger_rtable_modified(rs);
+	}
+
+	return changed;
+}
+
+/*
+ * NOT THREAD SAFE: lock rtable write
+ * For a neighbor come back up: static routes through gw on interface that
+ * deactivate_routes_via took down are active again.
+ * Returns: number of routes changed
+ */
+int activate_routes_via(router_state* rs, char* interface, struct in_addr* gw) {
+	node *cur = NULL;
+	rtable_entry* entry = NULL;
+	int changed = 0;
+
+	cur = rs->rtable;
+	while (cur) {
+		entry = (rtable_entry*)cur->data;
+		if (entry->is_static && !entry->is_active && (entry->gw.s_addr == gw->s_addr) && (strncmp(entry->iface, interface, 32) == 0)) {
+			entry->is_active = 1;
+			++changed;
+		}
+
+		cur = cur->next;
+	}
+
+	/* write new rtable out to hardware */
+	if (changed) {
+		trigger_rtable_modified(rs);
+	}
+
+	return changed;
+}
+
 /*
  * NOT THREAD SAFE: lock rtable write
  * Returns: 0 on success, 1 on error
@@ -195,6 +269,17 @@ int activate_routes(router_state* rs, char* interface) {
 	return 0;
 }
 
+/*
+ * Order the rtable is kept in: longest mask first, then by descending ip, static
+ * before dynamic.
+ * Returns: 1 if b belongs before a, 0 otherwise
+ */
+int rtable_entry_after(rtable_entry* a, rtable_entry* b) {
+	return ((ntohl(a->mask.s_addr) < ntohl(b->mask.s_addr)) ||
+		((a->mask.s_addr == b->mask.s_addr) && (ntohl(a->ip.s_addr) < ntohl(b->ip.s_addr))) ||
+		((a->mask.s_addr == b->mask.s_addr) && (a->ip.s_addr == b->ip.s_addr) && !a->is_static && b->is_static));
+}
+
 /*
  * NOT Threadsafe, ensure rtable locked for write
  */
@@ -208,9 +293,7 @@ void trigger_rtable_modified(router_state* rs) {
 		while (cur && cur->next) {
 			rtable_entry* a = (rtable_entry*)cur->data;
 			rtable_entry* b = (rtable_entry*)cur->next->data;
-			if ((ntohl(a->mask.s_addr) < ntohl(b->mask.s_addr)) ||
-				((a->mask.s_addr == b->mask.s_addr) && (ntohl(a->ip.s_addr) < ntohl(b->ip.s_addr))) ||
-				((a->mask.s_addr == b->mask.s_addr) && (a->ip.s_addr == b->ip.s_addr) && !a->is_static && b->is_static)) {
+			if (rtable_entry_after(a, b)) {
 				cur->data = b;
 				cur->next->data = a;
 				swapped = 1;
@@ -220,6 +303,9 @@ void trigger_rtable_modified(router_state* rs) {
 		}
 	} while (swapped);
 
+	/* aggregate the active routes so they fit in the hardware */
+	fib_update(rs);
+
 	if (rs->is_netfpga) {
 		write_rtable_to_hw(rs);
 	}
@@ -228,7 +314,12 @@ void trigger_rtable_modified(router_state* rs) {
 void write_rtable_to_hw(router_state* rs) {
 	/* naively iterate through the 32 slots in hardware updating all entries */
 	int i = 0;
-	node* cur = rs->rtable;
+	node* cur = rs->fib;
+
+	/* the aggregated fib could not be built, write the rtable as is */
+	if (rs->fib_overflow) {
+		cur = rs->rtable;
+	}
 
 	/* find first active entry before entering the loop */
 	while (cur && !(((rtable_entry*)cur->data)->is_active)) {
@@ -275,7 +366,7 @@ void write_rtable_to_hw(router_state* rs) {
 void lock_rtable_rd(router_state *rs) {
 	assert(rs);
 
-	if(pthread_rwlock_rdlock(rs->rtable_lock) != 0) {
+	if(lockprof_rdlock(rs->rtable_lock, LOCK_RTABLE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting rtable read lock");
 	}
 }
@@ -283,7 +374,7 @@ void lock_rtable_rd(router_state *rs) {
 void lock_rtable_wr(router_state *rs) {
 	assert(rs);
 
-	if(pthread_rwlock_wrlock(rs->rtable_lock) != 0) {
+	if(lockprof_wrlock(rs->rtable_lock, LOCK_RTABLE, LOCKPROF_SITE) != 0) {
 		perror("Failure getting rtable write lock");
 	}
 }
@@ -291,6 +382,7 @@ void lock_rtable_wr(router_state *rs) {
 void unlock_rtable(router_state *rs) {
 	assert(rs);
 
+	lockprof_release(LOCK_RTABLE);
 	if(pthread_rwlock_unlock(rs->rtable_lock) != 0) {
 		perror("Failure unlocking rtable lock");
 	}
@@ -15,8 +15,11 @@ int add_route(router_state* rs, struct in_addr* dest, struct in_addr* gateway, s
 int del_route(router_state* rs, struct in_addr* dest, struct in_addr* mask);
 
 int deactivate_routes(router_state* rs, char* interface);
+int deactivate_routes_via(router_state* rs, char* interface, struct in_addr* gw);
+int activate_routes_via(router_state* rs, char* interface, struct in_addr* gw);
 int activate_routes(router_state* rs, char* interface);
 
+int rtable_entry_after(rtable_entry* a, rtable_entry* b);
 void trigger_rtable_modified(router_state* rs);
 void write_rtable_to_hw(router_state* rs);
 
@@ -0,0 +1,616 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "or_snapshot.h"
+#include "or_data_types.h"
+#include "or_utils.h"
+#include "or_main.h"
+#include "or_arp.h"
+#include "or_nat.h"
+#include "or_iface.h"
+#include "or_rtable.h"
+#include "or_atable.h"
+#include "or_pwospf.h"
+#include "or_lsdb.h"
+#include "or_timer.h"
+
+/*
+ * Warm restart. Every SNAPSHOT_INTERVAL and on shutdown we write out what takes longest to
+ * learn again: the arp cache, the nat translations and their port pools, the lsdb, and the
+ * routes and alphas spf made from it. At startup, once the interfaces and static routes are
+ * in, the file is mapped and whatever is still young enough is put back, so we forward
+ * straight away and spf starts from the old lsdb instead of an empty one. Each section is
+ * copied out under its own lock, they need not agree with each other, whatever is stale
+ * gets corrected by arp, nat and pwospf as usual.
+ */
+
+static const unsigned int snapshot_rec_size[SNAPSHOT_NUM_SECTIONS] = {
+	sizeof(snapshot_arp), sizeof(snapshot_nat), sizeof(snapshot_nat_pool), sizeof(snapshot_router),
+	sizeof(snapshot_link), sizeof(snapshot_route), sizeof(snapshot_alpha)
+};
+
+static const char* snapshot_section_name[SNAPSHOT_NUM_SECTIONS] = {
+	"arp", "nat", "nat pool", "router", "link", "route", "alpha"
+};
+
+struct snapshot_section {
+	uint8_t* data;
+	uint32_t count;
+	uint32_t cap;	/* in records */
+};
+
+/* Returns: a zeroed record at the end of the section */
+static void* snapshot_append(struct snapshot_section* secs, int type) {
+	struct snapshot_section* sec = &(secs[type]);
+
+	if (sec->count == sec->cap) {
+		sec->cap = sec->cap ? (2 * sec->cap) : 64;
+		sec->data = (uint8_t*)realloc(sec->data, sec->cap * snapshot_rec_size[type]);
+	}
+
+	void* rec = sec->data + (sec->count * snapshot_rec_size[type]);
+	bzero(rec, snapshot_rec_size[type]);
+	sec->count++;
+
+	return rec;
+}
+
+static void snapshot_save_arp(router_state* rs, struct snapshot_section* secs) {
+	node* cur;
+
+	lock_arp_cache_rd(rs);
+	for (cur = rs->arp_cache; cur; cur = cur->next) {
+		arp_cache_entry* entry = (arp_cache_entry*)cur->data;
+		snapshot_arp* rec = (snapshot_arp*)snapshot_append(secs, SNAPSHOT_ARP);
+
+		rec->ip = entry->ip.s_addr;
+		memcpy(rec->ha, entry->arp_ha, ETH_ADDR_LEN);
+		rec->is_static = (entry->is_static == 1);
+		rec->refreshed = (int64_t)entry->TTL;
+	}
+	unlock_arp_cache(rs);
+}
+
+static void snapshot_save_nat(router_state* rs, struct snapshot_section* secs) {
+	nat_table* t = rs->nat_table;
+	nat_entry* ne;
+	int i;
+
+	lock_nat_table(rs);
+	for (i = 0; i < NAT_NUM_SHARDS; ++i) {
+		for (ne = t->shards[i].entries; ne; ne = ne->next) {
+			snapshot_nat* rec = (snapshot_nat*)snapshot_append(secs, SNAPSHOT_NAT);
+
+			rec->ext_ip = ne->nat_ext.ip.s_addr;
+			rec->int_ip = ne->nat_int.ip.s_addr;
+			rec->ext_port = ne->nat_ext.port;
+			rec->int_port = ne->nat_int.port;
+			rec->proto = ne->proto;
+			rec->is_static = ne->is_static;
+			rec->tcp_state = ne->tcp_state;
+			rec->tcp_fin = ne->tcp_fin;
+			rec->last_hits_time = (int64_t)ne->last_hits_time;
+		}
+	}
+
+	/* with every shard held nothing is allocating from the pools */
+	for (i = 0; i < NAT_NUM_POOLS; ++i) {
+		snapshot_nat_pool* rec = (snapshot_nat_pool*)snapshot_append(secs, SNAPSHOT_NAT_POOL);
+
+		rec->lo = t->pools[i].lo;
+		rec->hi = t->pools[i].hi;
+		rec->cursor = t->pools[i].cursor;
+	}
+	unlock_nat_table(rs);
+}
+
+static void snapshot_save_lsdb(router_state* rs, struct snapshot_section* secs) {
+	node* cur;
+	node* link;
+
+	lock_mutex_pwospf_router_list(rs);
+	for (cur = rs->pwospf_router_list; cur; cur = cur->next) {
+		pwospf_router* r = (pwospf_router*)cur->data;
+		snapshot_router* rec = (snapshot_router*)snapshot_append(secs, SNAPSHOT_ROUTER);
+
+		rec->router_id = r->router_id;
+		rec->area_id = r->area_id;
+		rec->seq = r->seq;
+		rec->digest = r->digest;
+		rec->last_update = (int64_t)r->last_update;
+
+		for (link = r->interface_list; link; link = link->next) {
+			pwospf_interface* pi = (pwospf_interface*)link->data;
+			snapshot_link* l = (snapshot_link*)snapshot_append(secs, SNAPSHOT_LINK);
+
+			l->subnet = pi->subnet.s_addr;
+			l->mask = pi->mask.s_addr;
+			l->router_id = pi->router_id;
+			l->rx_rate = pi->rx_rate;
+			l->tx_rate = pi->tx_rate;
+			l->is_active = pi->is_active;
+			l->is_summary = pi->is_summary;
+			rec->num_links++;
+		}
+	}
+	unlock_mutex_pwospf_router_list(rs);
+}
+
+static void snapshot_save_routes(router_state* rs, struct snapshot_section* secs) {
+	node* cur;
+
+	lock_rtable_rd(rs);
+	for (cur = rs->rtable; cur; cur = cur->next) {
+		rtable_entry* re = (rtable_entry*)cur->data;
+		if (re->is_static) {
+			continue;
+		}
+
+		snapshot_route* rec = (snapshot_route*)snapshot_append(secs, SNAPSHOT_ROUTE);
+		rec->ip = re->ip.s_addr;
+		rec->gw = re->gw.s_addr;
+		rec->mask = re->mask.s_addr;
+		memcpy(rec->iface, re->iface, IF_LEN);
+		rec->is_active = re->is_active;
+		rec->is_inter_area = re->is_inter_area;
+	}
+	unlock_rtable(rs);
+
+	lock_atable_rd(rs);
+	for (cur = rs->atable; cur; cur = cur->next) {
+		atable_entry* ae = (atable_entry*)cur->data;
+		snapshot_alpha* rec = (snapshot_alpha*)snapshot_append(secs, SNAPSHOT_ALPHA);
+		int i;
+
+		rec->ip = ae->ip.s_addr;
+		rec->mask = ae->mask.s_addr;
+		for (i = 0; i < 4; ++i) {
+			rec->next_hop[i] = ae->next_hop_ip[i].s_addr;
+			rec->alpha[i] = ae->alpha[i];
+		}
+	}
+	unlock_atable(rs);
+}
+
+/*
+ * IS THREAD SAFE
+ * Writes a temporary file and renames it over the last snapshot, so dying part way
+ * through leaves the previous one in place.
+ * Returns: 0 on success, 1 on failure
+ */
+int snapshot_write(router_state* rs) {
+	struct snapshot_section secs[SNAPSHOT_NUM_SECTIONS];
+	snapshot_hdr hdr;
+	char tmp[SNAPSHOT_PATH_LEN + 4];
+	uint32_t offset = sizeof(snapshot_hdr);
+	int failed = 0;
+	int i;
+
+	pthread_mutex_lock(rs->snapshot_mutex);
+
+	if (!rs->snapshot_ready) {
+		pthread_mutex_unlock(rs->snapshot_mutex);
+		return 1;
+	}
+
+	bzero(secs, sizeof(secs));
+	snapshot_save_arp(rs, secs);
+	snapshot_save_nat(rs, secs);
+	snapshot_save_lsdb(rs, secs);
+	snapshot_save_routes(rs, secs);
+
+	bzero(&hdr, sizeof(snapshot_hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.router_id = rs->router_id;
+	hdr.written = (int64_t)time(NULL);
+	for (i = 0; i < SNAPSHOT_NUM_SECTIONS; ++i) {
+		hdr.offset[i] = offset;
+		hdr.count[i] = secs[i].count;
+		offset += secs[i].count * snapshot_rec_size[i];
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", rs->snapshot_path);
+	FILE* file = fopen(tmp, "w");
+	if (!file) {
+		perror("Failure opening snapshot file");
+		failed = 1;
+	} else {
+		if (fwrite(&hdr, sizeof(snapshot_hdr), 1, file) != 1) {
+			failed = 1;
+		}
+		for (i = 0; (i < SNAPSHOT_NUM_SECTIONS) && !failed; ++i) {
+			if (secs[i].count && (fwrite(secs[i].data, snapshot_rec_size[i], secs[i].count, file) != secs[i].count)) {
+				failed = 1;
+			}
+		}
+		if ((fflush(file) != 0) || (fsync(fileno(file)) != 0)) {
+			failed = 1;
+		}
+		if (fclose(file) != 0) {
+			failed = 1;
+		}
+
+		if (failed) {
+			perror("Failure writing snapshot file");
+			unlink(tmp);
+		} else if (rename(tmp, rs->snapshot_path) != 0) {
+			perror("Failure renaming snapshot file");
+			unlink(tmp);
+			failed = 1;
+		}
+	}
+
+	for (i = 0; i < SNAPSHOT_NUM_SECTIONS; ++i) {
+		free(secs[i].data);
+	}
+
+	if (failed) {
+		rs->snapshot_failures++;
+	} else {
+		rs->snapshot_writes++;
+		rs->snapshot_last_write = (time_t)hdr.written;
+	}
+
+	pthread_mutex_unlock(rs->snapshot_mutex);
+
+	return failed;
+}
+
+static void snapshot_restore_arp(router_state* rs, const uint8_t* map, const snapshot_hdr* hdr, time_t now) {
+	const snapshot_arp* recs = (const snapshot_arp*)(map + hdr->offset[SNAPSHOT_ARP]);
+	struct in_addr ip;
+	char mac[ETH_ADDR_LEN];
+	uint32_t i;
+
+	lock_arp_cache_wr(rs);
+	for (i = 0; i < hdr->count[SNAPSHOT_ARP]; ++i) {
+		ip.s_addr = recs[i].ip;
+
+		if (!recs[i].is_static && (difftime(now, (time_t)recs[i].refreshed) > rs->arp_ttl)) {
+			rs->snapshot_aged[SNAPSHOT_ARP]++;
+			continue;
+		}
+		/* learnt or configured since we started */
+		if (get_from_arp_cache(rs->sr, &ip)) {
+			continue;
+		}
+
+		memcpy(mac, recs[i].ha, ETH_ADDR_LEN);
+		update_arp_cache(rs->sr, &ip, mac, recs[i].is_static);
+
+		if (!recs[i].is_static) {
+			/* keep the age it had, the timer armed for it as new just goes stale */
+			arp_cache_entry* entry = get_from_arp_cache(rs->sr, &ip);
+			entry->TTL = (time_t)recs[i].refreshed;
+			arp_arm_expiry(rs, entry);
+		}
+
+		rs->snapshot_restored[SNAPSHOT_ARP]++;
+	}
+	unlock_arp_cache(rs);
+}
+
+static void snapshot_restore_nat(router_state* rs, const uint8_t* map, const snapshot_hdr* hdr, time_t now) {
+	const snapshot_nat_pool* pools = (const snapshot_nat_pool*)(map + hdr->offset[SNAPSHOT_NAT_POOL]);
+	const snapshot_nat* recs = (const snapshot_nat*)(map + hdr->offset[SNAPSHOT_NAT]);
+	nat_table* t = rs->nat_table;
+	nat_entry probe;
+	nat_entry* ne;
+	struct in_addr ext, in;
+	uint32_t i;
+
+	lock_nat_table(rs);
+
+	/* pick up allocation where we left off, unless the pool has been set differently */
+	for (i = 0; (i < hdr->count[SNAPSHOT_NAT_POOL]) && (i < NAT_NUM_POOLS); ++i) {
+		if ((pools[i].lo == t->pools[i].lo) && (pools[i].hi == t->pools[i].hi)) {
+			t->pools[i].cursor = pools[i].cursor;
+			rs->snapshot_restored[SNAPSHOT_NAT_POOL]++;
+		}
+	}
+
+	for (i = 0; i < hdr->count[SNAPSHOT_NAT]; ++i) {
+		bzero(&probe, sizeof(nat_entry));
+		probe.proto = recs[i].proto;
+		probe.tcp_state = recs[i].tcp_state;
+
+		if (!recs[i].is_static && (difftime(now, (time_t)recs[i].last_hits_time) > nat_entry_timeout(rs, &probe))) {
+			rs->snapshot_aged[SNAPSHOT_NAT]++;
+			continue;
+		}
+		if (nat_table_lookup_ext(t, recs[i].ext_ip, recs[i].ext_port, recs[i].proto)) {
+			continue;
+		}
+
+		ext.s_addr = recs[i].ext_ip;
+		in.s_addr = recs[i].int_ip;
+		ne = nat_table_add(t, &ext, recs[i].ext_port, &in, recs[i].int_port, recs[i].proto);
+		if (!ne) {
+			continue;
+		}
+		ne->is_static = recs[i].is_static;
+		ne->tcp_state = recs[i].tcp_state;
+		ne->tcp_fin = recs[i].tcp_fin;
+		ne->last_hits_time = (time_t)recs[i].last_hits_time;
+		if (!ne->is_static) {
+			nat_arm_expiry(rs, ne);
+		}
+
+		rs->snapshot_restored[SNAPSHOT_NAT]++;
+	}
+
+	unlock_nat_table(rs);
+}
+
+/* NOT THREAD SAFE, LOCK THE PWOSPF ROUTER LIST */
+static int snapshot_area_attached(router_state* rs, uint32_t aid) {
+	node* cur;
+
+	for (cur = rs->pwospf_areas; cur; cur = cur->next) {
+		if (((pwospf_area*)cur->data)->area_id == aid) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void snapshot_restore_lsdb(router_state* rs, const uint8_t* map, const snapshot_hdr* hdr, time_t now, int fresh) {
+	const snapshot_router* recs = (const snapshot_router*)(map + hdr->offset[SNAPSHOT_ROUTER]);
+	const snapshot_link* links = (const snapshot_link*)(map + hdr->offset[SNAPSHOT_LINK]);
+	uint32_t next_link = 0;
+	uint32_t i, j;
+
+	lock_mutex_pwospf_router_list(rs);
+	for (i = 0; i < hdr->count[SNAPSHOT_ROUTER]; ++i) {
+		const snapshot_router* rec = &(recs[i]);
+		const snapshot_link* l = &(links[next_link]);
+
+		next_link += rec->num_links;
+		if (next_link > hdr->count[SNAPSHOT_LINK]) {
+			break;
+		}
+		if (!snapshot_area_attached(rs, rec->area_id)) {
+			continue;
+		}
+
+		if (rec->router_id == rs->router_id) {
+			/* carry on our sequence numbers, or neighbours still holding our old lsu drop the new ones */
+			pwospf_router* ours = lsdb_lookup(rs, rec->area_id, rs->router_id);
+			if (ours && lsdb_seq_newer(rec->seq, ours->seq)) {
+				ours->seq = rec->seq;
+			}
+			continue;
+		}
+
+		if (lsdb_lookup(rs, rec->area_id, rec->router_id)) {
+			continue;
+		}
+		/* only what was still alive when we wrote it */
+		if (!fresh || (difftime((time_t)hdr->written, (time_t)rec->last_update) > (3 * rs->pwospf_lsu_interval))) {
+			rs->snapshot_aged[SNAPSHOT_ROUTER]++;
+			continue;
+		}
+
+		pwospf_router* r = (pwospf_router*)calloc(1, sizeof(pwospf_router));
+		r->router_id = rec->router_id;
+		r->area_id = rec->area_id;
+		r->seq = rec->seq;
+		r->digest = rec->digest;
+
+		for (j = 0; j < rec->num_links; ++j) {
+			pwospf_interface* pi = (pwospf_interface*)calloc(1, sizeof(pwospf_interface));
+			pi->subnet.s_addr = l[j].subnet;
+			pi->mask.s_addr = l[j].mask;
+			pi->router_id = l[j].router_id;
+			pi->rx_rate = l[j].rx_rate;
+			pi->tx_rate = l[j].tx_rate;
+			pi->is_active = l[j].is_active;
+			pi->is_summary = l[j].is_summary;
+
+			node* n = node_create();
+			n->data = (void*)pi;
+			if (r->interface_list == NULL) {
+				r->interface_list = n;
+			} else {
+				node_push_back(r->interface_list, n);
+			}
+			rs->snapshot_restored[SNAPSHOT_LINK]++;
+		}
+
+		/* a full dead interval for its lsus to reach us again, or it ages out as usual */
+		time(&r->last_update);
+		r->timer_id = timer_add(rs, (3 * rs->pwospf_lsu_interval + 1) * 1000, 0, pwospf_router_timer, r->router_id);
+		lsdb_add(rs, r);
+
+		rs->snapshot_restored[SNAPSHOT_ROUTER]++;
+	}
+	unlock_mutex_pwospf_router_list(rs);
+}
+
+static void snapshot_restore_routes(router_state* rs, const uint8_t* map, const snapshot_hdr* hdr) {
+	const snapshot_route* routes = (const snapshot_route*)(map + hdr->offset[SNAPSHOT_ROUTE]);
+	const snapshot_alpha* alphas = (const snapshot_alpha*)(map + hdr->offset[SNAPSHOT_ALPHA]);
+	struct in_addr ip, mask, next_hops[4];
+	double alpha[4];
+	node* cur;
+	uint32_t i;
+	int j;
+
+	lock_if_list_rd(rs);
+	lock_rtable_wr(rs);
+	for (i = 0; i < hdr->count[SNAPSHOT_ROUTE]; ++i) {
+		rtable_entry* entry = (rtable_entry*)calloc(1, sizeof(rtable_entry));
+		entry->ip.s_addr = routes[i].ip;
+		entry->gw.s_addr = routes[i].gw;
+		entry->mask.s_addr = routes[i].mask;
+		memcpy(entry->iface, routes[i].iface, IF_LEN);
+		entry->iface[IF_LEN - 1] = '\0';
+		entry->is_active = routes[i].is_active;
+		entry->is_inter_area = routes[i].is_inter_area;
+
+		/* the rtable file wins, and the interface must still be there */
+		for (cur = rs->rtable; cur; cur = cur->next) {
+			rtable_entry* re = (rtable_entry*)cur->data;
+			if ((re->ip.s_addr == entry->ip.s_addr) && (re->mask.s_addr == entry->mask.s_addr)) {
+				break;
+			}
+		}
+		if (cur || !get_interface(rs->sr, entry->iface)) {
+			free(entry);
+			continue;
+		}
+
+		node* n = node_create();
+		n->data = entry;
+		if (rs->rtable == NULL) {
+			rs->rtable = n;
+		} else {
+			node_push_back(rs->rtable, n);
+		}
+		rs->snapshot_restored[SNAPSHOT_ROUTE]++;
+	}
+	if (rs->snapshot_restored[SNAPSHOT_ROUTE]) {
+		trigger_rtable_modified(rs);
+	}
+	unlock_rtable(rs);
+	unlock_if_list(rs);
+
+	lock_atable_wr(rs);
+	for (i = 0; i < hdr->count[SNAPSHOT_ALPHA]; ++i) {
+		ip.s_addr = alphas[i].ip;
+		mask.s_addr = alphas[i].mask;
+		for (j = 0; j < 4; ++j) {
+			next_hops[j].s_addr = alphas[i].next_hop[j];
+			alpha[j] = alphas[i].alpha[j];
+		}
+
+		add_atable_entry(&ip, &mask, next_hops, alpha, rs);
+		rs->snapshot_restored[SNAPSHOT_ALPHA]++;
+	}
+	unlock_atable(rs);
+}
+
+/*
+ * IS THREAD SAFE
+ * Call once the interfaces, the rtable file and our pwospf router are in, and run spf
+ * after. Whatever happens, periodic writes are allowed from here on.
+ */
+void snapshot_restore(router_state* rs) {
+	struct stat st;
+	const uint8_t* map;
+	const snapshot_hdr* hdr;
+	time_t now;
+	double age;
+	int i;
+
+	pthread_mutex_lock(rs->snapshot_mutex);
+	rs->snapshot_ready = 1;
+
+	int fd = open(rs->snapshot_path, O_RDONLY);
+	if (fd < 0) {
+		/* first start, cold */
+		pthread_mutex_unlock(rs->snapshot_mutex);
+		return;
+	}
+
+	if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(snapshot_hdr))) {
+		close(fd);
+		pthread_mutex_unlock(rs->snapshot_mutex);
+		return;
+	}
+
+	map = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("Failure mapping snapshot file");
+		pthread_mutex_unlock(rs->snapshot_mutex);
+		return;
+	}
+
+	hdr = (const snapshot_hdr*)map;
+	time(&now);
+	age = difftime(now, (time_t)hdr->written);
+
+	int valid = (hdr->magic == SNAPSHOT_MAGIC) && (hdr->version == SNAPSHOT_VERSION) &&
+		(hdr->router_id == rs->router_id) && (age >= 0) && (age <= SNAPSHOT_MAX_AGE);
+	for (i = 0; (i < SNAPSHOT_NUM_SECTIONS) && valid; ++i) {
+		if ((hdr->offset[i] < sizeof(snapshot_hdr)) || (hdr->offset[i] > st.st_size) ||
+				(hdr->count[i] > ((st.st_size - hdr->offset[i]) / snapshot_rec_size[i]))) {
+			valid = 0;
+		}
+	}
+
+	int fresh = valid && (age <= SNAPSHOT_LSDB_MAX_AGE);
+	if (valid) {
+		printf("Restoring snapshot %s written %.0f seconds ago\n", rs->snapshot_path, age);
+
+		snapshot_restore_arp(rs, map, hdr, now);
+		snapshot_restore_nat(rs, map, hdr, now);
+		snapshot_restore_lsdb(rs, map, hdr, now, fresh);
+		if (fresh) {
+			snapshot_restore_routes(rs, map, hdr);
+		}
+	} else {
+		printf("Ignoring snapshot %s, it is stale or not ours\n", rs->snapshot_path);
+	}
+
+	munmap((void*)map, st.st_size);
+	pthread_mutex_unlock(rs->snapshot_mutex);
+}
+
+/*
+ * Timer callback, writes the periodic snapshot
+ */
+void snapshot_timer(router_state* rs, uint32_t key, uint32_t id) {
+	snapshot_write(rs);
+}
+
+void cli_snapshot_save(router_state* rs, cli_request* req) {
+	char* msg;
+
+	if (snapshot_write(rs) == 0) {
+		msg = "Snapshot written\n";
+	} else {
+		msg = "Failure writing snapshot\n";
+	}
+	send_to_socket(req->sockfd, msg, strlen(msg));
+}
+
+void cli_show_snapshot(router_state* rs, cli_request* req) {
+	char line[256];
+	int i;
+
+	pthread_mutex_lock(rs->snapshot_mutex);
+
+	/* the path alone may fill a line */
+	send_to_socket(req->sockfd, "Path: ", strlen("Path: "));
+	send_to_socket(req->sockfd, rs->snapshot_path, strlen(rs->snapshot_path));
+	snprintf(line, 256, "  Writes: %u  Failures: %u  Last: %.0f s ago\n", rs->snapshot_writes, rs->snapshot_failures,
+		(rs->snapshot_last_write ? difftime(time(NULL), rs->snapshot_last_write) : -1.0));
+	send_to_socket(req->sockfd, line, strlen(line));
+
+	snprintf(line, 256, "%-10s %10s %10s\n", "Restored", "Entries", "Too old");
+	send_to_socket(req->sockfd, line, strlen(line));
+	for (i = 0; i < SNAPSHOT_NUM_SECTIONS; ++i) {
+		snprintf(line, 256, "%-10s %10u %10u\n", snapshot_section_name[i], rs->snapshot_restored[i], rs->snapshot_aged[i]);
+		send_to_socket(req->sockfd, line, strlen(line));
+	}
+
+	pthread_mutex_unlock(rs->snapshot_mutex);
+}
@@ -0,0 +1,20 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#ifndef OR_SNAPSHOT_H_
+#define OR_SNAPSHOT_H_
+
+#include "or_data_types.h"
+#include "sr_base_internal.h"
+
+int snapshot_write(router_state* rs);
+void snapshot_restore(router_state* rs);
+void snapshot_timer(router_state* rs, uint32_t key, uint32_t id);
+
+void cli_snapshot_save(router_state* rs, cli_request* req);
+void cli_show_snapshot(router_state* rs, cli_request* req);
+
+#endif /*OR_SNAPSHOT_H_*/
@@ -0,0 +1,282 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "or_timer.h"
+#include "or_data_types.h"
+#include "or_utils.h"
+
+/*
+ * Every periodic job and per entry timeout in the control plane runs off one hierarchical
+ * timer wheel (Varghese and Lauck, the same layout as the Linux kernel timers). Ticks are
+ * 1ms. Level 0 holds everything due in the next 256ms, one slot per tick. Each higher level
+ * covers 64 times the span of the one below it. When level 0 wraps, the next slot of level 1
+ * is cascaded back down, and so on, so adding a timer and firing it are both O(1).
+ *
+ * A single executor thread sleeps until the next non-empty level 0 slot (or the next cascade)
+ * and runs the callbacks with the wheel unlocked, so callbacks may take any router lock and
+ * add timers of their own. Timers are never cancelled: owners stamp the returned id on their
+ * entry and callbacks ignore firings whose id no longer matches.
+ */
+
+uint64_t timer_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+timer_wheel* timer_wheel_create(void) {
+	timer_wheel* w = (timer_wheel*)calloc(1, sizeof(timer_wheel));
+	pthread_condattr_t attr;
+
+	if (pthread_mutex_init(&(w->lock), NULL) != 0) {
+		perror("Timer wheel mutex init error");
+		exit(1);
+	}
+
+	/* sleep on the monotonic clock so wall clock changes don't stall us */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (pthread_cond_init(&(w->cond), &attr) != 0) {
+		perror("Timer wheel cond init error");
+		exit(1);
+	}
+	pthread_condattr_destroy(&attr);
+
+	w->now = timer_now_ms();
+	return w;
+}
+
+static void timer_free_list(timer_entry* e) {
+	timer_entry* next;
+	while (e) {
+		next = e->next;
+		free(e);
+		e = next;
+	}
+}
+
+void timer_wheel_destroy(timer_wheel* w) {
+	int i, j;
+
+	if (!w) {
+		return;
+	}
+
+	for (i = 0; i < TIMER_L0_SIZE; ++i) {
+		timer_free_list(w->l0[i]);
+	}
+	for (i = 0; i < TIMER_LEVELS; ++i) {
+		for (j = 0; j < TIMER_LN_SIZE; ++j) {
+			timer_free_list(w->ln[i][j]);
+		}
+	}
+
+	pthread_cond_destroy(&(w->cond));
+	pthread_mutex_destroy(&(w->lock));
+	free(w);
+}
+
+/* NOT THREAD SAFE, LOCK THE WHEEL */
+static void timer_insert(timer_wheel* w, timer_entry* e) {
+	timer_entry** slot;
+	int64_t delta = (int64_t)(e->expires - w->now);
+	uint64_t expires = e->expires;
+
+	if (delta < 0) {
+		/* already due, run on the next tick */
+		slot = &(w->l0[w->now & (TIMER_L0_SIZE - 1)]);
+	} else if (delta < TIMER_L0_SIZE) {
+		slot = &(w->l0[expires & (TIMER_L0_SIZE - 1)]);
+	} else if (delta < (1 << (TIMER_L0_BITS + TIMER_LN_BITS))) {
+		slot = &(w->ln[0][(expires >> TIMER_L0_BITS) & (TIMER_LN_SIZE - 1)]);
+	} else if (delta < (1 << (TIMER_L0_BITS + 2 * TIMER_LN_BITS))) {
+		slot = &(w->ln[1][(expires >> (TIMER_L0_BITS + TIMER_LN_BITS)) & (TIMER_LN_SIZE - 1)]);
+	} else {
+		/* past the top of the wheel, park it in the farthest slot and let it cascade again */
+		if (delta >= (1LL << (TIMER_L0_BITS + 3 * TIMER_LN_BITS))) {
+			expires = w->now + (1LL << (TIMER_L0_BITS + 3 * TIMER_LN_BITS)) - 1;
+		}
+		slot = &(w->ln[2][(expires >> (TIMER_L0_BITS + 2 * TIMER_LN_BITS)) & (TIMER_LN_SIZE - 1)]);
+	}
+
+	e->next = *slot;
+	*slot = e;
+}
+
+/* NOT THREAD SAFE, LOCK THE WHEEL */
+static int timer_cascade(timer_wheel* w, int level) {
+	int index = (w->now >> (TIMER_L0_BITS + level * TIMER_LN_BITS)) & (TIMER_LN_SIZE - 1);
+	timer_entry* e = w->ln[level][index];
+	timer_entry* next;
+
+	w->ln[level][index] = NULL;
+	while (e) {
+		next = e->next;
+		timer_insert(w, e);
+		e = next;
+	}
+
+	return index;
+}
+
+/* NOT THREAD SAFE, LOCK THE WHEEL
+ * Advances one tick and returns the timers that expired on it
+ */
+static timer_entry* timer_tick(timer_wheel* w) {
+	int index = w->now & (TIMER_L0_SIZE - 1);
+	int level;
+	timer_entry* due;
+
+	if (index == 0) {
+		for (level = 0; level < TIMER_LEVELS; ++level) {
+			if (timer_cascade(w, level) != 0) {
+				break;
+			}
+		}
+	}
+
+	due = w->l0[index];
+	w->l0[index] = NULL;
+	w->now++;
+
+	return due;
+}
+
+/* NOT THREAD SAFE, LOCK THE WHEEL
+ * Returns the tick to wake up at, 0 if there is nothing to wait for
+ */
+static uint64_t timer_next_expiry(timer_wheel* w) {
+	uint64_t t;
+
+	if (w->count == 0) {
+		return 0;
+	}
+
+	/* higher levels only hand timers down at a cascade, so stop looking there */
+	for (t = w->now; ; ++t) {
+		if (w->l0[t & (TIMER_L0_SIZE - 1)]) {
+			return t;
+		}
+		if (((t + 1) & (TIMER_L0_SIZE - 1)) == 0) {
+			return t + 1;
+		}
+	}
+}
+
+/*
+ * IS THREAD SAFE
+ * Runs fn(rs, key, id) after delay_ms, then every period_ms if period_ms is non zero.
+ * Returns the id of the timer, never 0.
+ */
+uint32_t timer_add(router_state* rs, uint32_t delay_ms, uint32_t period_ms, timer_fn fn, uint32_t key) {
+	assert(rs);
+	assert(fn);
+
+	timer_wheel* w = rs->timers;
+	timer_entry* e = (timer_entry*)calloc(1, sizeof(timer_entry));
+	uint32_t id;
+
+	e->expires = timer_now_ms() + delay_ms;
+	e->period = period_ms;
+	e->fn = fn;
+	e->key = key;
+
+	pthread_mutex_lock(&(w->lock));
+
+	if (++(w->next_id) == 0) {
+		++(w->next_id);
+	}
+	id = e->id = w->next_id;
+
+	timer_insert(w, e);
+	w->count++;
+
+	/* wake the executor if it is asleep past this timer */
+	if ((w->next_wakeup == 0) || (e->expires < w->next_wakeup)) {
+		pthread_cond_signal(&(w->cond));
+	}
+
+	pthread_mutex_unlock(&(w->lock));
+
+	return id;
+}
+
+void* timer_thread(void* arg) {
+	router_state* rs = (router_state*)arg;
+	timer_wheel* w = rs->timers;
+	timer_entry* due;
+	timer_entry* e;
+	struct timespec until;
+	uint64_t cur;
+
+	pthread_mutex_lock(&(w->lock));
+
+	while (1) {
+		cur = timer_now_ms();
+		while (w->now <= cur) {
+			due = timer_tick(w);
+			if (!due) {
+				continue;
+			}
+
+			pthread_mutex_unlock(&(w->lock));
+			for (e = due; e; e = e->next) {
+				e->fn(rs, e->key, e->id);
+			}
+			pthread_mutex_lock(&(w->lock));
+
+			while (due) {
+				e = due;
+				due = due->next;
+				w->fired++;
+
+				if (e->period) {
+					/* keep the phase, skipping any periods a slow callback made us miss */
+					do {
+						e->expires += e->period;
+					} while (e->expires < w->now);
+					timer_insert(w, e);
+				} else {
+					free(e);
+					w->count--;
+				}
+			}
+		}
+
+		w->next_wakeup = timer_next_expiry(w);
+		w->wakeups++;
+
+		if (w->next_wakeup == 0) {
+			pthread_cond_wait(&(w->cond), &(w->lock));
+		} else {
+			until.tv_sec = w->next_wakeup / 1000;
+			until.tv_nsec = (w->next_wakeup % 1000) * 1000000;
+			pthread_cond_timedwait(&(w->cond), &(w->lock), &until);
+		}
+	}
+
+	pthread_mutex_unlock(&(w->lock));
+	return NULL;
+}
+
+void cli_show_timers(router_state* rs, cli_request* req) {
+	timer_wheel* w = rs->timers;
+	char line[256];
+
+	pthread_mutex_lock(&(w->lock));
+	snprintf(line, 256, "Pending: %u  Fired: %llu  Wakeups: %llu  Next: %lld ms\n", w->count,
+		(unsigned long long)w->fired, (unsigned long long)w->wakeups,
+		(w->next_wakeup ? (long long)(w->next_wakeup - timer_now_ms()) : -1LL));
+	pthread_mutex_unlock(&(w->lock));
+
+	send_to_socket(req->sockfd, line, strlen(line));
+}
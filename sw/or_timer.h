@@ -0,0 +1,22 @@
+/*
+ * Authors: NGRP
+ * Date: 04/2013
+ *
+ */
+
+#ifndef OR_TIMER_H_
+#define OR_TIMER_H_
+
+#include "or_data_types.h"
+#include "sr_base_internal.h"
+
+timer_wheel* timer_wheel_create(void);
+void timer_wheel_destroy(timer_wheel* w);
+
+uint64_t timer_now_ms(void);
+uint32_t timer_add(router_state* rs, uint32_t delay_ms, uint32_t period_ms, timer_fn fn, uint32_t key);
+void* timer_thread(void* arg);
+
+void cli_show_timers(router_state* rs, cli_request* req);
+
+#endif /*OR_TIMER_H_*/
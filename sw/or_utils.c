@@ -406,3 +406,34 @@ int getMax(int* int_array, int len) {
 
 	return max;
 }
+
+/*
+ * Per worker counters. Each forwarding thread registers once and owns a slot it updates
+ * without atomics, every other thread (cli, timers, pwospf) shares WORKER_SHARED.
+ */
+static __thread int worker_slot_id = WORKER_SHARED;
+static __thread int worker_registered = 0;
+static int worker_next_slot = 0;
+
+/*
+ * IS THREAD SAFE
+ * Called by a forwarding thread before it handles a packet, only the first call does anything.
+ * Returns: its slot, WORKER_SHARED if NUM_WORKERS threads already have one
+ */
+int worker_register(void) {
+	int slot;
+
+	if (!worker_registered) {
+		worker_registered = 1;
+		slot = __sync_fetch_and_add(&worker_next_slot, 1);
+		if (slot < NUM_WORKERS) {
+			worker_slot_id = slot;
+		}
+	}
+	return worker_slot_id;
+}
+
+/* Returns: the calling thread's slot, updates to WORKER_SHARED must be atomic */
+int worker_slot(void) {
+	return worker_slot_id;
+}
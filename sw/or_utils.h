@@ -33,4 +33,7 @@ char* my_strncat(char* left, char* right, int* left_alloc_size);
 char* urlencode(char* str);
 char* urldecode(char* str);
 int getMax(int* int_array, int len);
+
+int worker_register(void);
+int worker_slot(void);
 #endif /*OR_UTILS_H_*/
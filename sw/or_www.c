@@ -9,6 +9,7 @@
 #include "or_utils.h"
 #include "or_cli.h"
 #include "or_output.h"
+#include "or_drop.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -245,6 +246,25 @@ void service_request(www_client_thread_info* info) {
 	  free(body);
 	  free(result);
 
+	} else if (strncmp(url, "/drops.json", 11) == 0) {
+		/* drop counters for scripts, rates are since the last fetch */
+		char* body;
+		int body_len;
+		sprint_drops_json(rs, &body, &body_len);
+
+		int alloc_size = 512;
+		char* result = calloc(1, 512);
+		strcpy(result, "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\n");
+		char content_length[128];
+		sprintf(content_length, "Content-Length: %u\r\n\r\n", body_len);
+		result = my_strncat(result, content_length, &alloc_size);
+		result = my_strncat(result, body, &alloc_size);
+
+		send_all(rs, info, (uint8_t*)result, strlen(result));
+
+		free(body);
+		free(result);
+
 	} else if (strncmp(url, "/stats.html", 11) == 0) {
 	  int alloc_size = 512;
 	  char* result = calloc(1, alloc_size);
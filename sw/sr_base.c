@@ -52,6 +52,7 @@
 
 #include "sr_vns.h"
 #include "sr_base_internal.h"
+#include "sr_dumper.h"
 
 #ifdef _CPUMODE_
 #include "sr_cpu_extension_nf2.h"
@@ -92,6 +93,7 @@ void* sr_init_low_level_subystem(int argc, char **argv)
 
     char  *client = 0;
     char  *logfile = 0;
+    char  *logfilter = 0;
 
 
     char  *interface = "nf2c0"; /* Default NetFPGA interface for card 0 */
@@ -111,7 +113,7 @@ void* sr_init_low_level_subystem(int argc, char **argv)
 
     sr = (struct sr_instance*) malloc(sizeof(struct sr_instance));
 
-    while ((c = getopt(argc, argv, "hs:v:p:c:t:r:l:i:m:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:c:t:r:l:f:i:m:")) != EOF)
     {
         switch (c)
         {
@@ -140,6 +142,9 @@ void* sr_init_low_level_subystem(int argc, char **argv)
             case 'l':
                 logfile = optarg;
                 break;
+            case 'f':
+                logfilter = optarg;
+                break;
             case 'm':
                 cpuhw = optarg;
                 break;
@@ -199,6 +204,16 @@ void* sr_init_low_level_subystem(int argc, char **argv)
 
     /* -- log all packets sent/received to logfile (if non-null) -- */
     sr_vns_init_log(sr, logfile);
+    if ( logfilter )
+    {
+        char errbuf[PCAP_ERRBUF_SIZE];
+        if ( sr_dump_set_filter(sr, logfilter, errbuf) != 0 )
+        {
+            fprintf(stderr, "Error in log filter \"%s\": %s\n", logfilter,
+                    sr->dumper ? errbuf : "no log file");
+            exit(1);
+        }
+    }
 
     sr_lwip_transport_startup();
 
@@ -359,6 +374,7 @@ void sr_init_instance(struct sr_instance* sr)
     sr->vhost[0] = 0;
     sr->topo_id  = 0;
     sr->logfile  = 0;
+    sr->dumper   = 0;
     sr->hw_init  = 0;
 
     sr->interface_subsystem = 0;
@@ -394,6 +410,7 @@ static void usage(char* argv0)
     printf("Options: \n");
     printf("     -r rtable.file\n");
     printf("     -l log.file\n");
+    printf("     -f \"log filter\" (pcap filter expression)\n");
     printf("     -i nf2cX (X being the first port of the NetFPGA card desired)\n");
     printf("     -u cpuhw.file\n");
 } /* -- usage -- */
@@ -87,7 +87,8 @@ struct sr_instance
     char rtable[32];/* filename for routing table          */
     unsigned short topo_id; /* topology id */
     struct sockaddr_in sr_addr; /* address to server */
-    FILE* logfile; /* file to log all received/sent packets to */
+    FILE* logfile; /* unused with the dumper, its writer thread owns the file */
+    struct sr_dumper* dumper; /* capture ring and writer feeding logfile */
     volatile uint8_t  hw_init; /* bool : hardware has been initialized */
     pthread_mutex_t   send_lock; /* experimental */
 
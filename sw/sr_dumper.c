@@ -2,6 +2,12 @@
 #include <sys/types.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 
 #include "sr_dumper.h"
@@ -9,31 +15,146 @@
 #include "sr_base_internal.h"
 
 
+/*
+ * Interfaces are told apart by the number their name ends in (eth0 is bit
+ * 0), anything else shares the top bit.
+ */
+uint32_t sr_dump_iface_bit(const char* iface)
+{
+    uint32_t n = 0;
+    int digits = 0;
+    int i;
+
+    if (!iface)
+    { return 1u << 31; }
+
+    for (i = 0; iface[i] && (i < 32); ++i)
+    {
+        if ((iface[i] >= '0') && (iface[i] <= '9'))
+        {
+            n = (n * 10) + (iface[i] - '0');
+            digits = 1;
+        }
+        else
+        {
+            n = 0;
+            digits = 0;
+        }
+    }
+
+    return (digits && (n < 31)) ? (1u << n) : (1u << 31);
+}
+
+/* xorshift, one state per thread so random sampling shares nothing */
+static __thread uint32_t sr_dump_seed;
+
+static uint32_t sr_dump_rand(void)
+{
+    uint32_t x = sr_dump_seed;
+
+    if (!x)
+    { x = (uint32_t)time(NULL) ^ (uint32_t)(uintptr_t)&sr_dump_seed; }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sr_dump_seed = x;
+
+    return x;
+}
+
+static int sr_dump_match(struct sr_dump_filter* f, const uint8_t* buf, int len, const char* iface, int dir)
+{
+    if (!(f->dirs & dir) || !(f->ifaces & sr_dump_iface_bit(iface)))
+    { return 0; }
+
+    if (f->has_prog && !bpf_filter(f->prog.bf_insns, buf, len, len))
+    { return 0; }
+
+    if (f->sample > 1)
+    {
+        if (f->sample_random)
+        { return (sr_dump_rand() % f->sample) == 0; }
+        return (__sync_fetch_and_add(&(f->sample_count), 1) % f->sample) == 0;
+    }
+
+    return 1;
+}
+
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
  * Scope:  Global
  *
+ * Packets that don't match the filter stop after a couple of compares and
+ * the bpf program, if there is one. Otherwise claims a slot of the capture ring (bounded MPMC queue after Vyukov, here
+ * with a single consumer) and copies up to snaplen bytes into it. Never
+ * blocks: if the writer has fallen a whole ring behind the packet is
+ * dropped and counted.
+ *
  *---------------------------------------------------------------------------*/
 
-void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
+void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len, const char* iface, int dir )
 {
-    struct pcap_pkthdr h;
+    struct sr_dumper* d;
+    struct sr_dump_slot* slot;
+    struct timeval ts;
+    uint32_t pos;
+    int32_t dif;
     int size;
+    int match;
+    uint32_t epoch;
 
     /* REQUIRES */
     assert(sr);
 
-    if(!sr->logfile)
+    d = sr->dumper;
+    if(!d)
     {return; }
 
-    size = min(SR_PACKET_DUMP_SIZE, len);
+    /* counted while it holds the filter, so the writer knows when a
+       replaced one can go */
+    epoch = d->filter_epoch & 1;
+    __sync_fetch_and_add(&(d->matching[epoch]), 1);
+    match = sr_dump_match(d->filter, buf, len, iface, dir);
+    __sync_fetch_and_sub(&(d->matching[epoch]), 1);
+    if (!match)
+    { return; }
+
+    pos = d->head;
+    for (;;)
+    {
+        slot = &(d->slots[pos & (SR_DUMP_RING_SLOTS - 1)]);
+        dif = (int32_t)(slot->seq - pos);
+        if (dif == 0)
+        {
+            if (__sync_bool_compare_and_swap(&(d->head), pos, pos + 1))
+            { break; }
+            pos = d->head;
+        }
+        else if (dif < 0)
+        {
+            /* the writer has not freed this slot yet, the ring is full */
+            __sync_fetch_and_add(&(d->dropped), 1);
+            return;
+        }
+        else
+        {
+            /* another producer took it */
+            pos = d->head;
+        }
+    }
 
-    gettimeofday(&h.ts, 0);
-    h.caplen = size;
-    h.len = (size < SR_PACKET_DUMP_SIZE) ? size : SR_PACKET_DUMP_SIZE;
+    size = min(d->snaplen, len);
 
-    sr_dump(sr->logfile, &h, buf);
-    fflush(sr->logfile);
+    gettimeofday(&ts, 0);
+    slot->hdr.ts.tv_sec = ts.tv_sec;
+    slot->hdr.ts.tv_usec = ts.tv_usec;
+    slot->hdr.caplen = size;
+    slot->hdr.len = len;
+    memcpy(slot->data, buf, size);
+
+    /* publish the contents before handing the slot to the writer */
+    __sync_synchronize();
+    slot->seq = pos + 1;
 } /* -- sr_log_packet -- */
 
 static void
@@ -98,6 +219,371 @@ sr_dump(FILE *fp, const struct pcap_pkthdr *h, const unsigned char *sp)
 void
 sr_dump_close(FILE *fp)
 {
-  fclose(fp);
+  if (fp != stdout)
+    fclose(fp);
+}
+
+/*
+ * Writer side, only the writer thread touches the file. Moves the current
+ * file to fname.N and starts a fresh one.
+ */
+static void
+sr_dump_rotate(struct sr_dumper* d)
+{
+    char rotated[sizeof(d->fname) + 16];
+
+    sr_dump_close(d->fp);
+
+    d->file_seq++;
+    snprintf(rotated, sizeof(rotated), "%s.%u", d->fname, d->file_seq);
+    if (rename(d->fname, rotated) != 0)
+    { perror("sr_dump_rotate: rename"); }
+
+    if (d->rotate_keep && (d->file_seq > d->rotate_keep))
+    {
+        snprintf(rotated, sizeof(rotated), "%s.%u", d->fname, d->file_seq - d->rotate_keep);
+        unlink(rotated);
+    }
+
+    d->fp = sr_dump_open(d->fname, 0, d->snaplen);
+    d->file_bytes = sizeof(struct pcap_file_header);
+    d->file_opened = time(NULL);
+    d->rotations++;
+}
+
+static int
+sr_dump_rotation_due(struct sr_dumper* d, unsigned int pending)
+{
+    if ((d->fp == stdout) || (d->file_bytes <= sizeof(struct pcap_file_header)))
+    { return 0; }
+
+    if (d->rotate_bytes && (d->file_bytes + pending > d->rotate_bytes))
+    { return 1; }
+
+    if (d->rotate_secs && (difftime(time(NULL), d->file_opened) >= d->rotate_secs))
+    { return 1; }
+
+    return 0;
+}
+
+/*
+ * Writer side. Moves producers onto the other epoch and waits for the
+ * matches still counted in the old one, they are never longer than a
+ * bpf run.
+ */
+static void
+sr_dump_drain(struct sr_dumper* d)
+{
+    uint32_t old = d->filter_epoch & 1;
+
+    __sync_fetch_and_add(&(d->filter_epoch), 1);
+    while (d->matching[old])
+    { sched_yield(); }
+    __sync_synchronize();
+}
+
+/*
+ * Writer side. Frees the filters replaced so far. A producer still holding
+ * one took it before it was replaced and counted itself in first, in
+ * whichever epoch it read, possibly a stale one, so both get drained.
+ */
+static void
+sr_dump_reclaim(struct sr_dumper* d)
+{
+    struct sr_dump_filter* f;
+    struct sr_dump_filter* next;
+
+    if (!d->retired)
+    { return; }
+
+    pthread_mutex_lock(&(d->filter_lock));
+    f = d->retired;
+    d->retired = NULL;
+    pthread_mutex_unlock(&(d->filter_lock));
+
+    sr_dump_drain(d);
+    sr_dump_drain(d);
+
+    for (; f; f = next)
+    {
+        next = f->retired;
+        if (f->has_prog)
+        { pcap_freecode(&(f->prog)); }
+        free(f);
+    }
+}
+
+/*
+ * Writer thread: drains the ring into one buffer and writes it in a
+ * single call, then naps if there was nothing to do. On stop it keeps
+ * going until the ring is empty.
+ */
+static void*
+sr_dump_thread(void* arg)
+{
+    struct sr_dumper* d = (struct sr_dumper*)arg;
+    struct sr_dump_slot* slot;
+    unsigned char* batch = (unsigned char*)malloc(SR_DUMP_BATCH_SIZE);
+    unsigned int n;
+    uint32_t packets;
+
+    for (;;)
+    {
+        int running = d->running;
+
+        sr_dump_reclaim(d);
+
+        n = 0;
+        packets = 0;
+        while (n + sizeof(struct pcap_sf_pkthdr) + SR_PACKET_DUMP_SIZE <= SR_DUMP_BATCH_SIZE)
+        {
+            slot = &(d->slots[d->tail & (SR_DUMP_RING_SLOTS - 1)]);
+            if (slot->seq != d->tail + 1)
+            { break; }
+            __sync_synchronize();
+
+            memcpy(batch + n, &(slot->hdr), sizeof(struct pcap_sf_pkthdr));
+            n += sizeof(struct pcap_sf_pkthdr);
+            memcpy(batch + n, slot->data, slot->hdr.caplen);
+            n += slot->hdr.caplen;
+
+            /* done reading it, the slot goes back to the producers a lap on */
+            __sync_synchronize();
+            slot->seq = d->tail + SR_DUMP_RING_SLOTS;
+            d->tail++;
+            packets++;
+        }
+
+        if (sr_dump_rotation_due(d, n))
+        { sr_dump_rotate(d); }
+
+        if (n)
+        {
+            if (!d->fp || (fwrite(batch, n, 1, d->fp) != 1) || (fflush(d->fp) != 0))
+            { d->write_errors++; }
+            d->file_bytes += n;
+            d->written += packets;
+            d->written_bytes += n;
+            d->batches++;
+        }
+        else if (running)
+        { usleep(SR_DUMP_IDLE_USEC); }
+        else
+        { break; }
+    }
+
+    free(batch);
+    return NULL;
+}
+
+/*
+ * NOT THREAD SAFE, LOCK THE FILTER
+ * Publishes a new filter, the old one goes on the retired chain. With keep
+ * the new one gets a copy of keep's compiled program and expression, else
+ * expr is compiled.
+ * Returns: 0 on success, -1 if expr did not compile
+ */
+static int
+sr_dump_replace_filter(struct sr_dumper* d, const char* expr, const struct sr_dump_filter* keep,
+        uint32_t ifaces, uint32_t dirs, uint32_t sample, int random, char* errbuf)
+{
+    struct sr_dump_filter* f = (struct sr_dump_filter*)calloc(1, sizeof(struct sr_dump_filter));
+    struct sr_dump_filter* old;
+    pcap_t* p;
+
+    if (keep)
+    {
+        if (keep->has_prog)
+        {
+            /* pcap_freecode frees bf_insns, so it can be a malloc'd copy */
+            f->prog.bf_len = keep->prog.bf_len;
+            f->prog.bf_insns = (struct bpf_insn*)malloc(keep->prog.bf_len * sizeof(struct bpf_insn));
+            memcpy(f->prog.bf_insns, keep->prog.bf_insns, keep->prog.bf_len * sizeof(struct bpf_insn));
+            f->has_prog = 1;
+            memcpy(f->expr, keep->expr, SR_DUMP_FILTER_LEN);
+        }
+    }
+    else if (expr && expr[0])
+    {
+        if (strlen(expr) >= SR_DUMP_FILTER_LEN)
+        {
+            if (errbuf)
+            { snprintf(errbuf, PCAP_ERRBUF_SIZE, "longer than %d characters", SR_DUMP_FILTER_LEN - 1); }
+            free(f);
+            return -1;
+        }
+
+        p = pcap_open_dead(DLT_EN10MB, SR_PACKET_DUMP_SIZE);
+        if (!p || (pcap_compile(p, &(f->prog), (char*)expr, 1, 0xFFFFFFFF) != 0))
+        {
+            if (errbuf)
+            { snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", p ? pcap_geterr(p) : "can't open pcap"); }
+            if (p)
+            { pcap_close(p); }
+            free(f);
+            return -1;
+        }
+        pcap_close(p);
+
+        f->has_prog = 1;
+        strncpy(f->expr, expr, SR_DUMP_FILTER_LEN - 1);
+    }
+
+    f->ifaces = ifaces;
+    f->dirs = dirs;
+    f->sample = sample;
+    f->sample_random = random;
+
+    /* fully built before anyone can see it */
+    __sync_synchronize();
+    old = d->filter;
+    d->filter = f;
+
+    if (old)
+    {
+        old->retired = d->retired;
+        d->retired = old;
+    }
+
+    return 0;
+}
+
+int
+sr_dump_set_filter(struct sr_instance* sr, const char* expr, char* errbuf)
+{
+    struct sr_dumper* d = sr->dumper;
+    struct sr_dump_filter* f;
+    int rc;
+
+    if (!d)
+    { return -1; }
+
+    pthread_mutex_lock(&(d->filter_lock));
+    f = d->filter;
+    rc = sr_dump_replace_filter(d, expr, NULL, f->ifaces, f->dirs, f->sample, f->sample_random, errbuf);
+    pthread_mutex_unlock(&(d->filter_lock));
+
+    return rc;
+}
+
+void
+sr_dump_set_sampling(struct sr_instance* sr, uint32_t sample, int random)
+{
+    struct sr_dumper* d = sr->dumper;
+    struct sr_dump_filter* f;
+
+    if (!d)
+    { return; }
+
+    pthread_mutex_lock(&(d->filter_lock));
+    f = d->filter;
+    sr_dump_replace_filter(d, NULL, f, f->ifaces, f->dirs, sample, random, NULL);
+    pthread_mutex_unlock(&(d->filter_lock));
+}
+
+void
+sr_dump_set_selection(struct sr_instance* sr, uint32_t ifaces, uint32_t dirs)
+{
+    struct sr_dumper* d = sr->dumper;
+    struct sr_dump_filter* f;
+
+    if (!d)
+    { return; }
+
+    /* read under the lock, a concurrent change may free the filter */
+    pthread_mutex_lock(&(d->filter_lock));
+    f = d->filter;
+    sr_dump_replace_filter(d, NULL, f, (ifaces ? ifaces : f->ifaces), (dirs ? dirs : f->dirs),
+            f->sample, f->sample_random, NULL);
+    pthread_mutex_unlock(&(d->filter_lock));
+}
+
+/*
+ * Opens fname with a pcap header and starts the writer thread.
+ * Returns: 0 on success, -1 on failure
+ */
+int
+sr_dump_start(struct sr_instance* sr, const char* fname, int snaplen)
+{
+    struct sr_dumper* d;
+    uint32_t i;
+
+    assert(sr);
+    assert(fname);
+
+    d = (struct sr_dumper*)calloc(1, sizeof(struct sr_dumper));
+    d->slots = (struct sr_dump_slot*)malloc(SR_DUMP_RING_SLOTS * sizeof(struct sr_dump_slot));
+    for (i = 0; i < SR_DUMP_RING_SLOTS; ++i)
+    { d->slots[i].seq = i; }
+    d->snaplen = min(snaplen, SR_PACKET_DUMP_SIZE);
+    strncpy(d->fname, fname, sizeof(d->fname) - 1);
+
+    d->fp = sr_dump_open(d->fname, 0, d->snaplen);
+    if (!d->fp)
+    {
+        free(d->slots);
+        free(d);
+        return -1;
+    }
+    d->file_bytes = sizeof(struct pcap_file_header);
+    d->file_opened = time(NULL);
+    d->running = 1;
+
+    /* everything until told otherwise */
+    pthread_mutex_init(&(d->filter_lock), NULL);
+    sr_dump_replace_filter(d, NULL, NULL, SR_DUMP_ALL_IFACES, SR_DUMP_RX | SR_DUMP_TX, 1, 0, NULL);
+
+    if (pthread_create(&(d->thread), NULL, sr_dump_thread, (void*)d) != 0)
+    {
+        perror("sr_dump_start: pthread_create");
+        sr_dump_close(d->fp);
+        free(d->slots);
+        free(d);
+        return -1;
+    }
+
+    /* the writer thread owns the file and replaces it on rotation, so
+       logfile is left NULL rather than pointing at one that may be closed */
+    sr->logfile = NULL;
+    sr->dumper = d;
+    return 0;
+}
+
+/*
+ * Stops capture, waits for the writer to drain what was already captured
+ * and closes the file.
+ */
+void
+sr_dump_stop(struct sr_instance* sr)
+{
+    struct sr_dumper* d = sr->dumper;
+
+    if (!d)
+    { return; }
+
+    /* new packets stop here, ones already claimed still land in the ring */
+    sr->dumper = NULL;
+    d->running = 0;
+    pthread_join(d->thread, NULL);
+
+    if (d->fp)
+    { sr_dump_close(d->fp); }
+    sr->logfile = NULL;
+
+    /* the ring and filters are not freed, a producer that read the pointer
+       before we cleared it may still be using them */
+}
+
+void
+sr_dump_set_rotation(struct sr_instance* sr, uint64_t bytes, uint32_t secs, uint32_t keep)
+{
+    struct sr_dumper* d = sr->dumper;
+
+    if (!d)
+    { return; }
+
+    d->rotate_bytes = bytes;
+    d->rotate_secs = secs;
+    d->rotate_keep = keep;
 }
 
@@ -3,6 +3,9 @@
  * format as well as a set of operations for logging.
  */
 
+#ifndef SR_DUMPER_H
+#define SR_DUMPER_H
+
 
 #ifdef _LINUX_
 #include <stdint.h>
@@ -13,6 +16,8 @@
 #endif /* _DARWIN_ */
 
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <pcap.h>
 
 #define PCAP_VERSION_MAJOR 2
@@ -28,6 +33,15 @@
 
 #define SR_PACKET_DUMP_SIZE 1514
 
+#define SR_DUMP_RING_SLOTS 4096             /* power of two */
+#define SR_DUMP_BATCH_SIZE (256 * 1024)     /* bytes handed to each fwrite */
+#define SR_DUMP_IDLE_USEC 5000              /* writer nap when the ring is empty */
+
+#define SR_DUMP_RX 0x1
+#define SR_DUMP_TX 0x2
+#define SR_DUMP_ALL_IFACES 0xFFFFFFFF
+#define SR_DUMP_FILTER_LEN 256
+
 
 /*
  * This is a timeval as stored in disk in a dumpfile.
@@ -49,9 +63,99 @@ struct pcap_sf_pkthdr {
     uint32_t len;            /* length this packet (off wire) */
 };
 
+/*
+ * A packet waiting in the capture ring. seq says whose turn the slot is:
+ * producers may claim it when it equals their ticket, the writer may
+ * consume it when it equals its ticket + 1.
+ */
+struct sr_dump_slot {
+    volatile uint32_t seq;
+    struct pcap_sf_pkthdr hdr;
+    unsigned char data[SR_PACKET_DUMP_SIZE];
+};
+
+/*
+ * What gets captured: the interfaces and directions selected, then the bpf
+ * program, then 1 in sample of what is left. A filter is never changed once
+ * published, the cli builds a new one and swaps the pointer, so the datapath
+ * reads it without a lock. Replaced filters wait on the dumper's retired
+ * chain until the writer has seen every match that began before then end.
+ */
+struct sr_dump_filter {
+    struct bpf_program prog;
+    int has_prog;
+    char expr[SR_DUMP_FILTER_LEN];
+    uint32_t ifaces;                /* bit per interface number, see sr_dump_iface_bit */
+    uint32_t dirs;                  /* SR_DUMP_RX | SR_DUMP_TX */
+    uint32_t sample;                /* 0 or 1 keeps everything */
+    int sample_random;              /* else every sample'th packet */
+    volatile uint32_t sample_count;
+    struct sr_dump_filter* retired; /* next on the retired chain */
+};
+
+/*
+ * Asynchronous capture. The datapath copies each packet into the ring
+ * without taking a lock, a writer thread drains it into large writes and
+ * rotates the file. When the ring is full the packet is counted as dropped,
+ * capture never holds up forwarding.
+ */
+struct sr_dumper {
+    struct sr_dump_slot* slots;
+    volatile uint32_t head;         /* next ticket handed to a producer */
+    uint32_t tail;                  /* next ticket the writer consumes */
+    int snaplen;
+
+    struct sr_dump_filter* volatile filter;
+    pthread_mutex_t filter_lock;    /* serializes replacing it */
+    struct sr_dump_filter* retired; /* replaced filters, under filter_lock */
+    volatile uint32_t filter_epoch; /* producers count themselves in */
+    volatile uint32_t matching[2];  /* matching[epoch & 1] while they hold a filter */
+
+    /* owned by the writer thread */
+    pthread_t thread;
+    volatile int running;
+    FILE* fp;
+    char fname[256];
+    uint64_t file_bytes;
+    time_t file_opened;
+    uint32_t file_seq;              /* suffix of the last rotated file */
+
+    /* rotation, 0 turns each off, set from the cli */
+    volatile uint64_t rotate_bytes;
+    volatile uint32_t rotate_secs;
+    volatile uint32_t rotate_keep;  /* rotated files kept, 0 keeps all */
+
+    /* counters */
+    volatile uint64_t dropped;      /* ring full */
+    volatile uint64_t written;      /* packets */
+    volatile uint64_t written_bytes;
+    volatile uint64_t batches;
+    volatile uint64_t rotations;
+    volatile uint64_t write_errors;
+};
+
 /* Given sr instance, log packet to logfile */
 struct sr_instance; /* forward declare */
-void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len );
+void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len, const char* iface, int dir );
+
+/**
+ * Open the dump file and start the writer thread, or stop it after it has
+ * drained the ring.
+ */
+int sr_dump_start(struct sr_instance* sr, const char* fname, int snaplen);
+void sr_dump_stop(struct sr_instance* sr);
+void sr_dump_set_rotation(struct sr_instance* sr, uint64_t bytes, uint32_t secs, uint32_t keep);
+
+/**
+ * Narrow down what is captured. A NULL or empty expression captures
+ * everything, errbuf (PCAP_ERRBUF_SIZE) gets the reason a filter did
+ * not compile or was longer than SR_DUMP_FILTER_LEN - 1. A selection of
+ * 0 ifaces or dirs leaves that part as it was.
+ */
+int sr_dump_set_filter(struct sr_instance* sr, const char* expr, char* errbuf);
+void sr_dump_set_sampling(struct sr_instance* sr, uint32_t sample, int random);
+void sr_dump_set_selection(struct sr_instance* sr, uint32_t ifaces, uint32_t dirs);
+uint32_t sr_dump_iface_bit(const char* iface);
 
 /**
  * Open a dump file and initialize the file.
@@ -67,3 +171,5 @@ void sr_dump(FILE *fp, const struct pcap_pkthdr *h, const unsigned char *sp);
  * Close the file
  */
 void sr_dump_close(FILE *fp);
+
+#endif /* SR_DUMPER_H */
@@ -20,6 +20,7 @@
 #include "sr_base_internal.h"
 #include "or_data_types.h"
 #include "or_main.h"
+#include "or_utils.h"
 
 #ifdef _CPUMODE_
 #include "sr_cpu_extension_nf2.h"
@@ -87,6 +88,11 @@ void sr_integ_input(struct sr_instance* sr,
     /* -- INTEGRATION PACKET ENTRY POINT!-- */
 
     /* printf(" ** sr_integ_input(..) called \n"); */
+
+    /* whoever hands us packets is a forwarding thread, give it its own
+       per worker counters the first time */
+    worker_register();
+
     process_packet(sr, packet, len, interface);
 
 } /* -- sr_integ_input -- */
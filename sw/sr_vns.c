@@ -41,8 +41,7 @@ void sr_vns_init_log(struct sr_instance* sr, char* logfile)
     if (!logfile)
     { return; }
 
-    sr->logfile = sr_dump_open(logfile, 0, SR_PACKET_DUMP_SIZE);
-    if(!sr->logfile)
+    if(sr_dump_start(sr, logfile, SR_PACKET_DUMP_SIZE) != 0)
     {
         fprintf(stderr,"Error opening up dump file %s\n",
                 logfile);
@@ -59,8 +58,7 @@ void sr_close_instance(struct sr_instance* sr)
 {
     close(sr->sockfd);
 
-    if(sr->logfile)
-    { sr_dump_close(sr->logfile); }
+    sr_dump_stop(sr);
 
     sr->hw_init = 0;
 } /* -- sr_close_instance -- */
@@ -338,7 +336,8 @@ int sr_vns_read_from_server(struct sr_instance* sr /* borrowed */)
 
             /* -- log packet -- */
             sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
+                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header),
+                    sr_pkt->mInterfaceName, SR_DUMP_RX);
 
             /* -- pass to router, student's code should take over here -- */
             sr_integ_input(sr,
@@ -418,7 +417,7 @@ int sr_vns_send_packet(struct sr_instance* sr /* borrowed */,
             buf,len);
 
     /* -- log packet -- */
-    sr_log_packet(sr,buf,len);
+    sr_log_packet(sr,buf,len,iface,SR_DUMP_TX);
 
     if ( pthread_mutex_lock(&(sr->send_lock)) )
     { assert (0); }